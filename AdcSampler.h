@@ -0,0 +1,134 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Timer-driven ADC acquisition.
+ *
+ * A hardware ticker interrupt samples N_CH analog pins at a fixed rate and
+ * pushes each frame (one reading per channel) into a lock-free ring. When at
+ * least `block` frames are waiting, the onBlock callback is raised (once, from
+ * interrupt context) so that the consumer can drain the ring in blocks from
+ * thread context.
+ *
+ * The rate and block size can be changed while sampling (setRate()); the
+ * ticker is a low-power one, so that it does not keep the MCU out of deep
+ * sleep between samples.
+ *
+ * The mbed::AnalogIn API takes a mutex and cannot be used from an ISR, so the
+ * HAL analogin API is used directly. A DMA-driven producer (e.g. the nRF52
+ * SAADC with EasyDMA and PPI) would keep the same consumer side: read() and
+ * the onBlock notification.
+ */
+#ifndef _ADC_SAMPLER_H_
+#define _ADC_SAMPLER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include <mbed.h>
+#include <hal/analogin_api.h>
+
+#include "SpscRing.h"
+#include "Metrics.h"
+#include "EventTrace.h"
+
+namespace ldry { namespace signal {
+
+  template <uint8_t N_CH>
+  struct SampleFrame {
+    uint16_t ch[N_CH];
+#if MYOKBD_METRICS
+    uint32_t t_us;      // when it was sampled (see Metrics.h)
+#endif
+  };
+
+  template <uint8_t N_CH=1, uint16_t LOG_2SIZE=6>
+  class AdcSampler {
+    public:
+     typedef SampleFrame<N_CH> Frame;
+
+     AdcSampler(const PinName (&pins)[N_CH]) :
+      _block(1),
+      _period_us(0),
+      _overruns(0),
+      _notified(false) {
+       for(uint8_t c = 0; c < N_CH; c++) analogin_init(&_adc[c], pins[c]);
+     }
+
+     ~AdcSampler() {
+       stop();
+     }
+
+     /**
+      * Start sampling at rate_hz; onBlock is called from interrupt context
+      * whenever block frames are ready and the previous notification has
+      * been acknowledged by a read().
+      */
+     void start(uint32_t rate_hz, uint32_t block, mbed::Callback<void()> onBlock) {
+       _block = block ? block : 1;
+       _onBlock = onBlock;
+       _period_us = 1000000 / rate_hz;
+       _ticker.attach_us(mbed::callback(this, &AdcSampler::sample), _period_us);
+     }
+
+     void stop() {
+       _ticker.detach();
+     }
+
+     /**
+      * Restart sampling at a new rate and block size. Frames already in the
+      * ring were sampled at the previous rate: stop() and drain them first if
+      * the consumer needs to tell them apart.
+      */
+     void setRate(uint32_t rate_hz, uint32_t block) {
+       _ticker.detach();
+       _block = block ? block : 1;
+       _period_us = 1000000 / rate_hz;
+       _ticker.attach_us(mbed::callback(this, &AdcSampler::sample), _period_us);
+     }
+
+     /** Consumer side: pop up to max frames, returns the number read */
+     size_t read(Frame* out, size_t max) {
+       _notified.store(false, std::memory_order_relaxed);
+       return _ring.pop(out, max);
+     }
+
+     uint32_t available() const { return _ring.size(); }
+     uint32_t period_us() const { return _period_us; }
+     /* frames lost because the consumer did not keep up */
+     uint32_t overruns() const { return _overruns; }
+
+    private:
+     void sample() {
+       Frame f;
+       for(uint8_t c = 0; c < N_CH; c++) f.ch[c] = analogin_read_u16(&_adc[c]);
+       METRIC_STAMP(f);
+       TRACE_FRAME(f.ch, N_CH);
+       if(!_ring.push(f)) {
+         _overruns++;
+         METRIC_COUNT(ADC_OVERRUNS);
+       }
+       if(_ring.size() >= _block &&
+          !_notified.exchange(true, std::memory_order_relaxed) && _onBlock)
+         _onBlock();
+     }
+
+    private:
+      analogin_t _adc[N_CH];
+      mbed::LowPowerTicker _ticker;
+      ldry::util::SpscRing<Frame, 1u << LOG_2SIZE> _ring;
+      mbed::Callback<void()> _onBlock;
+      uint32_t _block;
+      uint32_t _period_us;
+      volatile uint32_t _overruns;
+      std::atomic<bool> _notified;
+  };
+
+} }
+
+#endif /* _ADC_SAMPLER_H_ */
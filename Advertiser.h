@@ -0,0 +1,216 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Tiered advertising, for quick reconnection to the bonded host.
+ *
+ * A host that slept or lost the link scans with a low duty cycle, so the odds
+ * of it hearing the peripheral depend on how often the peripheral
+ * advertises. Advertising goes through a table of tiers, from the most
+ * aggressive to the cheapest: each tier runs for its duration, and when the
+ * stack reports it ended without a connection (onAdvertisingEnd) the next
+ * one starts. The last tier normally runs until a host connects.
+ *
+ * Tiers that target the bonded peers (directed advertising, or advertising
+ * that only accepts connections from the whitelist) are skipped while there
+ * is no bond, and unless the controller resolves addresses: the bond table
+ * holds identity addresses, and most hosts connect from resolvable private
+ * ones, which only match them once resolved (see setAddressResolution). Time
+ * from a disconnection to the next connection is recorded in Stats.
+ */
+#ifndef _MYOKBD_ADVERTISER_H_
+#define _MYOKBD_ADVERTISER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mbed.h>
+
+#include <ble/BLE.h>
+#include <ble/Gap.h>
+
+namespace myokbd {
+
+  enum AdvertisingMode : uint8_t {
+    ADV_DIRECTED,   // high duty cycle directed to the bonded host (<= 1.28 s)
+    ADV_BONDED,     // undirected, connections from whitelisted (bonded) hosts only
+    ADV_OPEN,       // undirected, any host may connect and pair
+  };
+
+  struct AdvertisingTier {
+    AdvertisingMode mode;
+    uint16_t interval;      // units of 0.625 ms, ignored for ADV_DIRECTED
+    uint16_t duration;      // units of 10 ms, 0: until a host connects
+  };
+
+  /* directed burst, then 20 ms for 30 s, 152.5 ms for a minute, then 417.5 ms
+   * (long intervals close to a divisor of a 1.28 s host scan interval take
+   * minutes to line up with its scan window) */
+  const AdvertisingTier DefaultAdvertisingTiers[] = {
+    { ADV_DIRECTED, 32,   128 },
+    { ADV_BONDED,   32,   3000 },
+    { ADV_OPEN,     244,  6000 },
+    { ADV_OPEN,     668,  0 },
+  };
+
+  const size_t DefaultAdvertisingTiersSize =
+    sizeof(DefaultAdvertisingTiers) / sizeof(DefaultAdvertisingTiers[0]);
+
+  /* what Myokbd did before tiers: 200 ms, open, until connected */
+  const AdvertisingTier SlowAdvertisingTiers[] = {
+    { ADV_OPEN, 320, 0 },
+  };
+
+  const size_t SlowAdvertisingTiersSize =
+    sizeof(SlowAdvertisingTiers) / sizeof(SlowAdvertisingTiers[0]);
+
+  class Advertiser {
+    public:
+     static const uint8_t MAX_TIERS = 8;
+
+     struct Stats {
+       uint32_t reconnects;         // connections following a disconnection
+       uint32_t last_ms;            // disconnection to connection
+       uint32_t max_ms;
+       uint32_t total_ms;
+       uint32_t by_tier[MAX_TIERS]; // reconnects per tier advertising at the time
+     };
+
+     Advertiser(ble::Gap& gap, const AdvertisingTier* tiers, size_t n_tiers) :
+      _gap(gap),
+      _tiers(tiers),
+      _n_tiers(n_tiers < MAX_TIERS ? n_tiers : MAX_TIERS),
+      _tier(0),
+      _has_peer(false),
+      _n_bonded(0),
+      _resolving(false),
+      _active(false),
+      _reconnecting(false),
+      _down_ms(0) {
+       _stats = Stats();
+     }
+
+     /** Bonded hosts changed: they become the whitelist, and the first one
+      * the target of directed advertising */
+     void setBondedPeers(const ble::whitelist_t& bonded) {
+       _n_bonded = bonded.size;
+       _has_peer = bonded.size > 0;
+       if(_has_peer) {
+         const BLEProtocol::Address_t& a = bonded.addresses[0];
+         _peer = ble::address_t(a.address);
+         _peer_type = a.type == BLEProtocol::AddressType::PUBLIC ?
+                      ble::target_peer_address_type_t::PUBLIC :
+                      ble::target_peer_address_type_t::RANDOM;
+       }
+       _gap.setWhitelist(bonded);
+     }
+
+     /** Whether the controller resolves private addresses against the bonded
+      * peers' keys (privacy enabled with LL privacy); without it the bonded
+      * tiers would refuse hosts using resolvable private addresses */
+     void setAddressResolution(bool resolving) {
+       _resolving = resolving;
+     }
+
+     /** Start advertising from the first tier */
+     void start() {
+       startTier(0);
+     }
+
+     void stop() {
+       if(_active) _gap.stopAdvertising(ble::LEGACY_ADVERTISING_HANDLE);
+       _active = false;
+     }
+
+     void connected() {
+       _active = false;
+       if(!_reconnecting) return;
+       _reconnecting = false;
+       uint32_t ms = now() - _down_ms;
+       _stats.reconnects++;
+       _stats.last_ms = ms;
+       _stats.total_ms += ms;
+       if(ms > _stats.max_ms) _stats.max_ms = ms;
+       _stats.by_tier[_tier]++;
+     }
+
+     void disconnected() {
+       _reconnecting = true;
+       _down_ms = now();
+       start();
+     }
+
+     /** Called on the stack's onAdvertisingEnd: move on to the next tier */
+     void ended(const ble::AdvertisingEndEvent& event) {
+       if(event.isConnected() || !_active) return;
+       _active = false;
+       if(_tier + 1 < _n_tiers) startTier(_tier + 1);
+     }
+
+     uint8_t tier() const { return _tier; }
+     bool isAdvertising() const { return _active; }
+     const Stats& stats() const { return _stats; }
+
+    private:
+     bool usable(const AdvertisingTier& t) const {
+       switch(t.mode) {
+         case ADV_DIRECTED: return _resolving && _has_peer;
+         case ADV_BONDED: return _resolving && _n_bonded > 0;
+         default: return true;
+       }
+     }
+
+     void startTier(uint8_t i) {
+       while(i < _n_tiers && !usable(_tiers[i])) i++;
+       if(i >= _n_tiers) return;
+       _tier = i;
+       const AdvertisingTier& t = _tiers[i];
+
+       ble::AdvertisingParameters params(
+           t.mode == ADV_DIRECTED ? ble::advertising_type_t::CONNECTABLE_DIRECTED :
+                                    ble::advertising_type_t::CONNECTABLE_UNDIRECTED,
+           ble::adv_interval_t(t.interval), ble::adv_interval_t(t.interval));
+       if(t.mode == ADV_DIRECTED)
+         params.setPeer(_peer, _peer_type);
+       else if(t.mode == ADV_BONDED)
+         params.setFilter(ble::advertising_filter_policy_t::FILTER_SCAN_AND_CONNECTION_REQUESTS);
+
+       if(_active) _gap.stopAdvertising(ble::LEGACY_ADVERTISING_HANDLE);
+       ble_error_t error = _gap.setAdvertisingParameters(ble::LEGACY_ADVERTISING_HANDLE,
+                                                         params);
+       if(!error)
+         error = _gap.startAdvertising(ble::LEGACY_ADVERTISING_HANDLE,
+                                       t.duration ? ble::adv_duration_t(t.duration) :
+                                                    ble::adv_duration_t::forever());
+       _active = !error;
+       // a tier the stack refuses (e.g. directed advertising to an address it
+       // cannot use) is skipped rather than leaving the device silent
+       if(error && i + 1 < _n_tiers) startTier(i + 1);
+     }
+
+     static uint32_t now() {
+       return (uint32_t)rtos::Kernel::get_ms_count();
+     }
+
+    private:
+      ble::Gap& _gap;
+      const AdvertisingTier* _tiers;
+      uint8_t _n_tiers;
+      uint8_t _tier;
+      bool _has_peer;
+      ble::address_t _peer;
+      ble::target_peer_address_type_t _peer_type;
+      uint8_t _n_bonded;
+      bool _resolving;
+      bool _active;
+      bool _reconnecting;
+      uint32_t _down_ms;
+      Stats _stats;
+  };
+
+}
+
+#endif /* _MYOKBD_ADVERTISER_H_ */
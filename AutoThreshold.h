@@ -0,0 +1,152 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Online threshold calibration for the peak detectors.
+ *
+ * Collects samples while the arm rests and picks, per channel, the detection
+ * threshold expected to give a target rate of false triggers. The rest
+ * signal's baseline and noise are estimated robustly, as the median and the
+ * MAD (OrderStatistics, binned on the ADC's 12 bits), so a twitch during
+ * calibration does not inflate them.
+ *
+ * A false trigger needs DEBOUNCE consecutive samples over the threshold (see
+ * ZScoreDecision in PeakDecision.h). Taking one such run per
+ * trigger, the target rate gives a per-sample exceedance probability p, and
+ * the distance from the median exceeded with probability p is the larger of
+ *  - the gaussian estimate, z(p) * 1.4826 * MAD, and
+ *  - the empirical (1 - p) quantile of |x - median|, which is larger when the
+ *    rest signal has heavier tails than gaussian noise.
+ * The detectors compare against the window's mean and standard deviation, so
+ * that distance is returned in standard deviations of the collected samples,
+ * clamped to [MIN_THRESHOLD, MAX_THRESHOLD].
+ */
+#ifndef _AUTO_THRESHOLD_H_
+#define _AUTO_THRESHOLD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "OrderStatistics.h"
+
+namespace ldry { namespace signal {
+
+  template <uint8_t N_CH, uint8_t DEBOUNCE = 6>
+  class AutoThreshold {
+    public:
+     static constexpr float MIN_THRESHOLD = 2.0f;
+     static constexpr float MAX_THRESHOLD = 12.0f;
+     /* frames a calibration takes at most (the histograms count in 16 bits) */
+     static const uint32_t MAX_SAMPLES = 65535;
+
+     /**
+      * false_per_min: target false triggers per minute at rest; rate_hz: rate
+      * at which the detector sees samples; samples: rest frames to collect
+      */
+     AutoThreshold(float false_per_min, uint32_t rate_hz, uint32_t samples) :
+      _p(false_per_min * DEBOUNCE / (60.0f * rate_hz)),
+      _samples(samples < MAX_SAMPLES ? samples : MAX_SAMPLES),
+      _collecting(false),
+      _done(false) {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _threshold[c] = 0;
+         _median[c] = 0;
+         _sigma[c] = 0;
+       }
+     }
+
+     /** Start (or restart) collecting rest samples */
+     void start() {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _stats[c].clear();
+         _K[c] = 0;
+         _Ex[c] = 0;
+         _Ex2[c] = 0;
+       }
+       _collecting = _samples > 0;
+       _done = false;
+     }
+
+     bool collecting() const { return _collecting; }
+     bool done() const { return _done; }
+
+     /** Add a frame taken at rest; true when it completes the calibration */
+     bool add(const uint16_t* frame) {
+       if(!_collecting) return false;
+       for(uint8_t c = 0; c < N_CH; c++) {
+         if(_stats[c].size() == 0) _K[c] = frame[c];
+         int32_t v = (int32_t)frame[c] - _K[c];
+         _Ex[c] += v;
+         _Ex2[c] += (int64_t)v * v;
+         _stats[c].add(frame[c]);
+       }
+       if(_stats[0].size() < _samples) return false;
+       for(uint8_t c = 0; c < N_CH; c++) compute(c);
+       _collecting = false;
+       _done = true;
+       return true;
+     }
+
+     /* results, valid once done() */
+     float threshold(uint8_t ch) const { return _threshold[ch]; }
+     uint16_t median(uint8_t ch) const { return _median[ch]; }
+     float sigma(uint8_t ch) const { return _sigma[ch]; }   // 1.4826 * MAD
+
+     /** z such that P(|N(0,1)| > z) = p, for 0 < p < 1; bisection, as
+      * it only runs once per calibration */
+     static float twoSidedZ(float p) {
+       float lo = 0, hi = 10;
+       for(int i = 0; i < 32; i++) {
+         float z = (lo + hi) / 2;
+         if(erfcf(z * 0.70710678f) > p) lo = z; else hi = z;
+       }
+       return lo;
+     }
+
+    private:
+     void compute(uint8_t c) {
+       const Histogram& s = _stats[c];
+       uint32_t n = s.size();
+       uint16_t m = s.median();
+       float sigma = MAD_TO_SD * s.mad(m);
+       float d = twoSidedZ(_p) * sigma;
+       // samples allowed beyond d: p * n, at least none
+       uint32_t tail = (uint32_t)(_p * n);
+       float emp = (float)s.spread(m, n - tail);
+       if(emp > d) d = emp;
+
+       double var = ((double)_Ex2[c] - (double)_Ex[c] * _Ex[c] / n) / (n - 1);
+       float sd = (float)sqrt(var > 1.0 ? var : 1.0);
+       float t = d / sd;
+       if(t < MIN_THRESHOLD) t = MIN_THRESHOLD;
+       if(t > MAX_THRESHOLD) t = MAX_THRESHOLD;
+       _threshold[c] = t;
+       _median[c] = m;
+       _sigma[c] = sigma;
+     }
+
+    private:
+      static constexpr float MAD_TO_SD = 1.4826f;
+      typedef ldry::util::OrderStatistics<12, uint16_t> Histogram;
+
+      float _p;               // target per-sample exceedance probability
+      uint32_t _samples;
+      bool _collecting;
+      bool _done;
+      Histogram _stats[N_CH];
+      uint16_t _K[N_CH];
+      int32_t _Ex[N_CH];
+      int64_t _Ex2[N_CH];
+      float _threshold[N_CH];
+      uint16_t _median[N_CH];
+      float _sigma[N_CH];
+  };
+
+} }
+
+#endif /* _AUTO_THRESHOLD_H_ */
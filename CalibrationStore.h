@@ -0,0 +1,175 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * A single calibration record kept on a block device, surviving resets and
+ * interrupted writes.
+ *
+ * The device is split in two slots used in turn. A save erases the older
+ * slot, programs the data and only then the header (magic, sequence number,
+ * layout key, size and CRC32 of the data), so a slot whose write was cut
+ * short has no valid header and the previous record is still loaded. The key
+ * identifies the layout of the record (e.g. detector lag and channel count):
+ * a record saved by firmware with another layout is ignored.
+ */
+#ifndef _MYOKBD_CALIBRATION_STORE_H_
+#define _MYOKBD_CALIBRATION_STORE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "BlockDevice.h"
+
+namespace myokbd {
+
+  class CalibrationStore {
+    public:
+     static const uint32_t MAGIC = 0x4d594f43;   // "MYOC"
+
+     CalibrationStore(mbed::BlockDevice& bd) :
+      _bd(bd),
+      _slot_size(0),
+      _seq(0),
+      _current(-1),
+      _next(0),
+      _saves(0),
+      _ok(false) { }
+
+     /** Initialise the device and find the latest record; false if the
+      * device cannot hold two slots */
+     bool init() {
+       if(_bd.init() != mbed::BD_ERROR_OK) return false;
+       mbed::bd_size_t erase = _bd.get_erase_size();
+       _slot_size = _bd.size() / 2 / erase * erase;
+       _ok = _slot_size > HEADER_SIZE &&
+             HEADER_SIZE % _bd.get_program_size() == 0 &&
+             CHUNK % _bd.get_program_size() == 0 &&
+             CHUNK % _bd.get_read_size() == 0;
+       if(!_ok) return false;
+       Header h[2];
+       bool valid[2] = { readHeader(0, h[0]), readHeader(1, h[1]) };
+       int latest = -1;
+       for(int i = 0; i < 2; i++)
+         if(valid[i] && (latest < 0 || (int32_t)(h[i].seq - h[latest].seq) > 0))
+           latest = i;
+       _current = latest;
+       if(latest >= 0) {
+         _seq = h[latest].seq;
+         _next = 1 - latest;
+       }
+       return true;
+     }
+
+     /** Read the latest record into data; false if there is none with this
+      * key and size, or its CRC does not match */
+     bool load(uint32_t key, void* data, size_t size) {
+       if(!_ok || _current < 0) return false;
+       Header h;
+       if(!readHeader(_current, h) || h.key != key || h.size != size) return false;
+       uint8_t* out = (uint8_t*)data;
+       mbed::bd_addr_t base = slotAddr(_current) + HEADER_SIZE;
+       uint32_t crc = CRC_INIT;
+       for(size_t off = 0; off < size; off += CHUNK) {
+         size_t n = size - off < CHUNK ? size - off : CHUNK;
+         if(_bd.read(_chunk, base + off, CHUNK) != mbed::BD_ERROR_OK) return false;
+         memcpy(out + off, _chunk, n);
+         crc = crc32(crc, _chunk, n);
+       }
+       return ~crc == h.crc;
+     }
+
+     /** Write a new record to the slot not holding the latest one */
+     bool save(uint32_t key, const void* data, size_t size) {
+       if(!_ok || recordSize(size) > _slot_size) return false;
+       mbed::bd_addr_t base = slotAddr(_next);
+       if(_bd.erase(base, _slot_size) != mbed::BD_ERROR_OK) return false;
+
+       const uint8_t* in = (const uint8_t*)data;
+       uint32_t crc = CRC_INIT;
+       for(size_t off = 0; off < size; off += CHUNK) {
+         size_t n = size - off < CHUNK ? size - off : CHUNK;
+         memset(_chunk, 0xff, CHUNK);
+         memcpy(_chunk, in + off, n);
+         crc = crc32(crc, _chunk, n);
+         if(_bd.program(_chunk, base + HEADER_SIZE + off, CHUNK) != mbed::BD_ERROR_OK)
+           return false;
+       }
+
+       Header h;
+       h.magic = MAGIC;
+       h.seq = _seq + 1;
+       h.key = key;
+       h.size = (uint32_t)size;
+       h.crc = ~crc;
+       memset(h.pad, 0xff, sizeof(h.pad));
+       if(_bd.program(&h, base, HEADER_SIZE) != mbed::BD_ERROR_OK) return false;
+       _bd.sync();
+
+       _seq = h.seq;
+       _current = _next;
+       _next = 1 - _next;
+       _saves++;
+       return true;
+     }
+
+     bool hasRecord() const { return _ok && _current >= 0; }
+
+     /** Bytes a record of size bytes takes in a slot */
+     static constexpr size_t recordSize(size_t size) {
+       return HEADER_SIZE + (size + CHUNK - 1) / CHUNK * CHUNK;
+     }
+     uint32_t saves() const { return _saves; }
+
+    private:
+     struct Header {
+       uint32_t magic;
+       uint32_t seq;
+       uint32_t key;
+       uint32_t size;
+       uint32_t crc;
+       uint8_t pad[12];
+     };
+
+     static const size_t HEADER_SIZE = sizeof(Header);
+     static const size_t CHUNK = 64;
+     static const uint32_t CRC_INIT = 0xffffffffu;
+
+     bool readHeader(int slot, Header& h) {
+       if(_bd.read(&h, slotAddr(slot), HEADER_SIZE) != mbed::BD_ERROR_OK) return false;
+       return h.magic == MAGIC && recordSize(h.size) <= _slot_size;
+     }
+
+     mbed::bd_addr_t slotAddr(int slot) const {
+       return (mbed::bd_addr_t)slot * _slot_size;
+     }
+
+
+     /* CRC-32 (IEEE), bitwise: a record is checked once per boot */
+     static uint32_t crc32(uint32_t crc, const uint8_t* p, size_t n) {
+       for(size_t i = 0; i < n; i++) {
+         crc ^= p[i];
+         for(int b = 0; b < 8; b++)
+           crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+       }
+       return crc;
+     }
+
+    private:
+      mbed::BlockDevice& _bd;
+      mbed::bd_size_t _slot_size;
+      uint32_t _seq;
+      int _current;           // slot holding the latest record, -1: none
+      int _next;
+      uint32_t _saves;
+      bool _ok;
+      uint8_t _chunk[CHUNK];
+  };
+
+}
+
+#endif /* _MYOKBD_CALIBRATION_STORE_H_ */
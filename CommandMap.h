@@ -0,0 +1,65 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Mapping from (EMG channel, gesture) pairs to presentation remote commands.
+ */
+#ifndef _MYOKBD_COMMAND_MAP_H_
+#define _MYOKBD_COMMAND_MAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "config.h"
+#include "PresentationRemote.h"
+#include "GestureEngine.h"
+
+namespace myokbd {
+
+  typedef void (PresentationRemote::*RemoteCommand)();
+
+  struct CommandBinding {
+    uint8_t channel;
+    Gesture gesture;
+    RemoteCommand command;
+  };
+
+  const CommandBinding DefaultCommandMap[] = {
+#if EMG_CHANNELS == 1
+    { 0, Gesture::SHORT_SQUEEZE, &PresentationRemote::previousSlide },
+    { 0, Gesture::LONG_SQUEEZE,  &PresentationRemote::nextSlide },
+#else
+    // e.g. electrodes on the left (0) and right (1) forearm
+    { 0, Gesture::SHORT_SQUEEZE, &PresentationRemote::previousSlide },
+    { 1, Gesture::SHORT_SQUEEZE, &PresentationRemote::nextSlide },
+    { 0, Gesture::LONG_SQUEEZE,  &PresentationRemote::blank },
+    { 1, Gesture::LONG_SQUEEZE,  &PresentationRemote::nextForHidden },
+#endif
+  };
+
+  const size_t DefaultCommandMapSize =
+    sizeof(DefaultCommandMap) / sizeof(DefaultCommandMap[0]);
+
+  /*
+   * Single channel map that also reaches blank() and nextForHidden(). Binding
+   * double/triple squeezes makes single squeezes wait GESTURE_MULTI_GAP_MS
+   * after the release, to rule out a second squeeze.
+   */
+  const CommandBinding MultiSqueezeCommandMap[] = {
+    { 0, Gesture::SHORT_SQUEEZE,  &PresentationRemote::previousSlide },
+    { 0, Gesture::LONG_SQUEEZE,   &PresentationRemote::nextSlide },
+    { 0, Gesture::HOLD_REPEAT,    &PresentationRemote::nextSlide },
+    { 0, Gesture::DOUBLE_SQUEEZE, &PresentationRemote::blank },
+    { 0, Gesture::TRIPLE_SQUEEZE, &PresentationRemote::nextForHidden },
+  };
+
+  const size_t MultiSqueezeCommandMapSize =
+    sizeof(MultiSqueezeCommandMap) / sizeof(MultiSqueezeCommandMap[0]);
+
+}
+
+#endif /* _MYOKBD_COMMAND_MAP_H_ */
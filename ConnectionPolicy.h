@@ -0,0 +1,211 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Connection parameter policy: latency while the user is acting, power while
+ * they are not.
+ *
+ * The connection interval bounds how long a queued report waits for the
+ * radio, so while a gesture is in progress or reports are queued the policy
+ * asks the central for the shortest interval (CONN_FAST_INTERVAL, at most
+ * CONN_FAST_SLACK units longer) and no slave latency. Once nothing has
+ * happened for CONN_IDLE_AFTER_MS it asks for
+ * CONN_IDLE_INTERVAL with CONN_IDLE_LATENCY: the peripheral may then skip
+ * that many connection events when it has nothing to send, but still
+ * transmits at the next event as soon as it has.
+ *
+ * A parameter update only takes effect several connection events after it is
+ * requested, which is why the fast parameters are requested when a gesture
+ * starts rather than when its command is issued. One request is outstanding
+ * at a time; what the central granted (which need not be what was asked for)
+ * is kept in Stats.
+ */
+#ifndef _MYOKBD_CONNECTION_POLICY_H_
+#define _MYOKBD_CONNECTION_POLICY_H_
+
+#include <stdint.h>
+#include <mbed.h>
+
+#include "config.h"
+
+#include <ble/BLE.h>
+#include <ble/Gap.h>
+
+namespace myokbd {
+
+  class ConnectionPolicy {
+    public:
+     enum Mode : uint8_t { MODE_CENTRAL, MODE_FAST, MODE_IDLE };
+
+     struct Stats {
+       uint32_t requests;       // updates requested
+       uint32_t updates;        // updates completed
+       uint32_t failed;         // requests refused by the stack or the central
+       uint32_t not_as_asked;   // completed with an interval outside the request
+       uint16_t interval;       // parameters in use, in BLE units (1.25 ms,
+       uint16_t latency;        // connection events, 10 ms)
+       uint16_t timeout;
+       uint32_t connected_ms;
+       uint32_t fast_ms;        // time at an interval <= CONN_FAST_INTERVAL + CONN_FAST_SLACK
+     };
+
+     /** busy() is polled before relaxing the parameters: it should return
+      * true while there is work that wants a short interval (reports queued,
+      * a gesture in progress) */
+     ConnectionPolicy(ble::Gap& gap, events::EventQueue& queue,
+                      mbed::Callback<bool()> busy) :
+      _gap(gap),
+      _queue(queue),
+      _busy(busy),
+      _connected(false),
+      _pending(false),
+      _mode(MODE_CENTRAL),
+      _want(MODE_IDLE),
+      _requested(MODE_CENTRAL),
+      _handle(0),
+      _last_activity_ms(0),
+      _since_ms(0),
+      _idle_check_id(0) {
+       resetStats();
+     }
+
+     void connected(const ble::ConnectionCompleteEvent& event) {
+       resetStats();
+       _connected = true;
+       _pending = false;
+       _handle = event.getConnectionHandle();
+       _mode = MODE_CENTRAL;
+       _since_ms = now();
+       _stats.interval = event.getConnectionInterval().value();
+       _stats.latency = event.getConnectionLatency();
+       _stats.timeout = event.getSupervisionTimeout().value();
+       _last_activity_ms = now();
+       armIdleCheck(CONN_IDLE_AFTER_MS);
+     }
+
+     void disconnected() {
+       account();
+       _connected = false;
+       _pending = false;
+       if(_idle_check_id) _queue.cancel(_idle_check_id);
+       _idle_check_id = 0;
+     }
+
+     void updated(const ble::ConnectionParametersUpdateCompleteEvent& event) {
+       if(!_connected || event.getConnectionHandle() != _handle) return;
+       account();
+       _pending = false;
+       if(event.getStatus() == BLE_ERROR_NONE) {
+         _stats.updates++;
+         _stats.interval = event.getConnectionInterval().value();
+         _stats.latency = event.getSlaveLatency();
+         _stats.timeout = event.getSupervisionTimeout().value();
+         bool fast = _requested == MODE_FAST;
+         uint16_t lo = fast ? CONN_FAST_INTERVAL : CONN_IDLE_INTERVAL;
+         if(_stats.interval < lo || _stats.interval > lo + (fast ? CONN_FAST_SLACK : CONN_IDLE_SLACK))
+           _stats.not_as_asked++;
+       } else {
+         _stats.failed++;
+       }
+       // whatever was granted stands for the requested mode; asking again
+       // would only get the same answer
+       _mode = _requested;
+       apply();
+     }
+
+     /** Something that wants low latency is happening (a gesture started, a
+      * key was queued); keeps the fast parameters for CONN_IDLE_AFTER_MS */
+     void activity() {
+       _last_activity_ms = now();
+       _want = MODE_FAST;
+       apply();
+       armIdleCheck(CONN_IDLE_AFTER_MS);
+     }
+
+     Mode mode() const { return _mode; }
+
+     const Stats& stats() {
+       account();
+       return _stats;
+     }
+
+    private:
+     void apply() {
+       if(!_connected || _pending || _mode == _want) return;
+       bool fast = _want == MODE_FAST;
+       uint16_t lo = fast ? CONN_FAST_INTERVAL : CONN_IDLE_INTERVAL;
+       ble_error_t err = _gap.updateConnectionParameters(
+           _handle,
+           ble::conn_interval_t(lo),
+           ble::conn_interval_t(lo + (fast ? CONN_FAST_SLACK : CONN_IDLE_SLACK)),
+           (ble::slave_latency_t)(fast ? 0 : CONN_IDLE_LATENCY),
+           ble::supervision_timeout_t(CONN_SUPERVISION_TIMEOUT));
+       _requested = _want;
+       if(err == BLE_ERROR_NONE) {
+         _stats.requests++;
+         _pending = true;
+       } else {
+         _stats.failed++;
+         _mode = _want;
+       }
+     }
+
+     void armIdleCheck(uint32_t ms) {
+       if(_idle_check_id || !_connected) return;
+       _idle_check_id = _queue.call_in(ms, this, &ConnectionPolicy::idleCheck);
+     }
+
+     void idleCheck() {
+       _idle_check_id = 0;
+       if(!_connected) return;
+       if(_busy && _busy()) _last_activity_ms = now();
+       uint32_t quiet = now() - _last_activity_ms;
+       if(quiet < CONN_IDLE_AFTER_MS) {
+         armIdleCheck(CONN_IDLE_AFTER_MS - quiet);
+         return;
+       }
+       _want = MODE_IDLE;
+       apply();
+     }
+
+     /* account the time since the last change to the parameters in use */
+     void account() {
+       if(!_connected) return;
+       uint32_t t = now();
+       uint32_t dt = t - _since_ms;
+       _stats.connected_ms += dt;
+       if(_stats.interval <= CONN_FAST_INTERVAL + CONN_FAST_SLACK) _stats.fast_ms += dt;
+       _since_ms = t;
+     }
+
+     void resetStats() {
+       _stats = Stats();
+     }
+
+     static uint32_t now() {
+       return (uint32_t)rtos::Kernel::get_ms_count();
+     }
+
+    private:
+      ble::Gap& _gap;
+      events::EventQueue& _queue;
+      mbed::Callback<bool()> _busy;
+      bool _connected;
+      bool _pending;
+      Mode _mode;           // mode of the parameters in use
+      Mode _want;
+      Mode _requested;
+      ble::connection_handle_t _handle;
+      uint32_t _last_activity_ms;
+      uint32_t _since_ms;
+      int _idle_check_id;
+      Stats _stats;
+  };
+
+}
+
+#endif /* _MYOKBD_CONNECTION_POLICY_H_ */
@@ -0,0 +1,320 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Vendor GATT service streaming the raw ADC frames, for recording EMG on the
+ * central (e.g. to build replay traces or tune the detector).
+ *
+ * One notify-only characteristic; nothing is buffered or sent until a central
+ * enables its notifications. Each notification carries, little-endian:
+ *   seq      u16  incremented per notification: a gap means notifications
+ *                 were lost
+ *   frame    u16  index of the first frame, counting every frame offered
+ *                 while streaming: a gap means frames were dropped here,
+ *                 because the link could not keep up
+ *   n_ch     u8   samples per frame
+ *   hold     u8   frames are 1 / hold of the full sampling rate apart (see
+ *                 EMG_IDLE_DECIMATION)
+ * followed by consecutive frames (channel-interleaved) of 12-bit samples,
+ * packed two per 3 bytes: a[7:0], a[11:8] | b[3:0] << 4, b[11:4]; an odd last
+ * sample takes 2 bytes. Notifications fill the ATT MTU: 9 samples in the
+ * default MTU of 23, 158 in the largest (247) a 251 byte link layer payload
+ * carries unfragmented. A notification is cut short where the frame index
+ * jumps or the rate changes.
+ *
+ * On connection the service asks for a larger ATT MTU, for 251 byte link
+ * layer payloads (data length extension) and, if the controller supports
+ * it, for the 2M PHY: a full notification then goes out as one packet, in
+ * about a quarter of the airtime, which leaves more of each connection event
+ * to HID reports. mbed's Gap has no data length request, so that one goes
+ * through the Cordio DM API under it. What the central agreed to is kept
+ * (attMtu(), dataLength(), phy2m()); the number of notifications per
+ * connection event stays capped by max_in_flight (below).
+ *
+ * GattServer has a single event handler, shared by all services: the
+ * application's handler forwards the ATT MTU and subscription events to
+ * attMtuChanged(), updatesEnabled() and updatesDisabled(), as it forwards
+ * the Gap connection events to connect() and disconnect().
+ *
+ * Frames are staged in a ring (2^LOG_2SIZE frames) by push(), from the
+ * sampling queue, and notified from queue (the BLE one), which HID reports
+ * take precedence over: a notification is only written while hid_busy()
+ * returns false, and no more than max_in_flight of them wait in the stack at
+ * a time, so that a report written meanwhile is never queued behind more
+ * than that. That cap also bounds the stream to as many notifications per
+ * connection event (see host/bench_stream for the resulting rates).
+ */
+#ifndef _BT_EMG_STREAM_SERVICE_H_
+#define _BT_EMG_STREAM_SERVICE_H_
+
+#include "config.h"
+
+#if MYOKBD_STREAM
+
+#include <stdint.h>
+#include <atomic>
+#include <mbed.h>
+
+#include "SpscRing.h"
+#include "NotifyLedger.h"
+
+#include "ble/BLE.h"
+#include "ble/GattCharacteristic.h"
+#include "dm_api.h"
+
+namespace btsvc {
+
+  template <uint8_t N_CH = EMG_CHANNELS, uint16_t LOG_2SIZE = MYOKBD_STREAM_LOG2_RING>
+  class EmgStreamService {
+    public:
+     static const uint8_t HEADER_SIZE = 6;
+     static const uint16_t MAX_ATT_MTU = 247;
+     static const uint16_t MAX_PAYLOAD = MAX_ATT_MTU - 3;
+     // link layer payload carrying a MAX_ATT_MTU notification (with its
+     // L2CAP header) unfragmented, and its airtime at 1M in us
+     static const uint16_t MAX_LL_PAYLOAD = MAX_ATT_MTU + 4;
+     static const uint16_t MAX_LL_TIME_US = (MAX_LL_PAYLOAD + 14) * 8;
+
+     struct Stats {
+       uint32_t notifications;
+       uint32_t frames;           // frames sent
+       uint32_t dropped;          // frames the ring had no room for
+       uint32_t refused;          // writes the stack refused (retried)
+     };
+
+     EmgStreamService(BLEDevice &ble, events::EventQueue &queue,
+                      mbed::Callback<bool()> hid_busy,
+                      uint8_t max_in_flight = MYOKBD_STREAM_MAX_IN_FLIGHT) :
+       _ble(ble),
+       _queue(queue),
+       _hid_busy(hid_busy),
+       _max_in_flight(max_in_flight),
+       _ledger(NotifyLedger::of(ble)),
+       _stream_charc(UUID("6d796f6b-6264-4d65-8000-000000000011"),
+           _packet, 0, MAX_PAYLOAD,
+           GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY,
+           NULL, 0, true),
+       _pump_scheduled(false),
+       _connected(false),
+       _enabled(false),
+       _staged(false),
+       _phy_2m(false),
+       _att_mtu(23),
+       _data_length(27),
+       _seq(0),
+       _offered(0),
+       _frames(0),
+       _handle(0) {
+       memset(&_stats, 0, sizeof(_stats));
+       GattCharacteristic *cTable[] = { &_stream_charc };
+       GattService streamService(UUID("6d796f6b-6264-4d65-8000-000000000010"),
+                                 cTable, 1);
+       _ble.gattServer().addService(streamService);
+       _ble.gattServer().onDataSent(this, &EmgStreamService::onDataSent);
+     }
+
+     /** Offer a frame sampled at 1 / hold of the full rate; sampling queue */
+     void push(const uint16_t* ch, uint8_t hold) {
+       if(!streaming()) return;
+       Entry e;
+       e.frame = _offered++;
+       e.hold = hold;
+       for(uint8_t c = 0; c < N_CH; c++) e.ch[c] = ch[c];
+       if(!_ring.push(e)) {
+         _stats.dropped++;
+         return;
+       }
+       if(_ring.size() >= framesPerPacket()) schedulePump();
+     }
+
+     void connect(const ble::ConnectionCompleteEvent &event) {
+       _connected = true;
+       _handle = event.getConnectionHandle();
+       _att_mtu = 23;
+       _data_length = 27;
+       _phy_2m = false;
+       _ble.gattClient().negotiateAttMtu(_handle);
+       if(_ble.gap().isFeatureSupported(
+              ble::controller_supported_features_t::LE_DATA_PACKET_LENGTH_EXTENSION))
+         DmConnSetDataLen(DmConnIdByHandle(_handle), MAX_LL_PAYLOAD, MAX_LL_TIME_US);
+       if(_ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_2M_PHY)) {
+         ble::phy_set_t phys(false, true, false);
+         _ble.gap().setPhy(_handle, &phys, &phys, ble::coded_symbol_per_bit_t());
+       }
+     }
+
+     void disconnect() {
+       _connected = false;
+       _enabled = false;
+       _ledger.reset();
+       clear();
+     }
+
+     /* Gap events, forwarded by the Gap event handler */
+     void phyUpdated(ble_error_t status, ble::phy_t tx, ble::phy_t rx) {
+       if(status == BLE_ERROR_NONE) _phy_2m = tx.value() == ble::phy_t::LE_2M;
+     }
+     void dataLengthChanged(uint16_t tx_size, uint16_t rx_size) {
+       _data_length = tx_size;
+     }
+
+     /** A central is connected and subscribed */
+     bool streaming() const { return _connected && _enabled; }
+
+     /* link as negotiated: ATT MTU, PHY and link layer payload (bytes) */
+     uint16_t attMtu() const { return _att_mtu; }
+     bool phy2m() const { return _phy_2m; }
+     uint16_t dataLength() const { return _data_length; }
+
+     /** Frames per (full) notification at the current ATT MTU */
+     uint16_t framesPerPacket() const {
+       uint16_t payload = (_att_mtu < MAX_ATT_MTU ? _att_mtu : MAX_ATT_MTU) - 3;
+       return (payload - HEADER_SIZE) * 2 / 3 / N_CH;
+     }
+
+     const Stats& stats() const { return _stats; }
+
+     GattAttribute::Handle_t getValueHandle() const {
+       return _stream_charc.getValueHandle();
+     }
+
+     /* GattServer events, forwarded by the GattServer event handler */
+     void attMtuChanged(ble::connection_handle_t connectionHandle, uint16_t attMtuSize) {
+       if(connectionHandle == _handle) _att_mtu = attMtuSize;
+     }
+
+     void updatesEnabled(const GattUpdatesEnabledCallbackParams &params) {
+       if(params.charHandle != _stream_charc.getValueHandle()) return;
+       _enabled = true;
+     }
+
+     void updatesDisabled(const GattUpdatesDisabledCallbackParams &params) {
+       if(params.charHandle != _stream_charc.getValueHandle()) return;
+       _enabled = false;
+       clear();
+     }
+
+    private:
+     struct Entry {
+       uint16_t frame;
+       uint8_t hold;
+       uint16_t ch[N_CH];
+     };
+
+     void schedulePump() {
+       if(!_pump_scheduled.exchange(true))
+         _queue.call(this, &EmgStreamService::pump);
+     }
+
+     void onDataSent(unsigned count) {
+       if(streaming()) pump();
+     }
+
+     /* notify staged packets while HID is quiet and the stack holds fewer
+      * than _max_in_flight of ours; whatever stops it, a
+      * transmission (onDataSent) or the next full packet restarts it */
+     void pump() {
+       _pump_scheduled.store(false);
+       while(streaming()) {
+         if(!_staged && !assemble()) return;
+         if(_ledger.inFlight(NotifyLedger::STREAM) >= _max_in_flight) return;
+         if(_hid_busy && _hid_busy()) return;
+         ble_error_t ret = _ble.gattServer().write(_stream_charc.getValueHandle(),
+                                                   _packet, packetLength());
+         if(ret != BLE_ERROR_NONE) {
+           _stats.refused++;
+           return;
+         }
+         _ledger.written(NotifyLedger::STREAM);
+         _stats.notifications++;
+         _stats.frames += _frames;
+         _seq++;
+         _frames = 0;
+         _staged = false;
+       }
+     }
+
+     /* move frames from the ring into the packet; true once it is complete:
+      * full, or followed by a frame it cannot hold */
+     bool assemble() {
+       uint16_t max = framesPerPacket();
+       Entry e;
+       while(_frames < max && _ring.peek(e)) {
+         if(_frames && (e.frame != (uint16_t)(_first_frame + _frames) || e.hold != _hold))
+           return _staged = true;
+         _ring.drop();
+         if(!_frames) {
+           _first_frame = e.frame;
+           _hold = e.hold;
+           _packet[0] = (uint8_t)_seq;
+           _packet[1] = (uint8_t)(_seq >> 8);
+           _packet[2] = (uint8_t)e.frame;
+           _packet[3] = (uint8_t)(e.frame >> 8);
+           _packet[4] = N_CH;
+           _packet[5] = e.hold;
+         }
+         for(uint8_t c = 0; c < N_CH; c++) pack(_frames * N_CH + c, e.ch[c] >> 4);
+         _frames++;
+       }
+       return _staged = _frames == max;
+     }
+
+     /* store 12-bit sample number i of the packet */
+     void pack(uint16_t i, uint16_t x) {
+       uint8_t* p = _packet + HEADER_SIZE + i / 2 * 3;
+       if(i % 2 == 0) {
+         p[0] = (uint8_t)x;
+         p[1] = (uint8_t)(x >> 8);
+       } else {
+         p[1] |= (uint8_t)(x << 4);
+         p[2] = (uint8_t)(x >> 4);
+       }
+     }
+
+     uint16_t packetLength() const {
+       uint16_t n = _frames * N_CH;
+       return HEADER_SIZE + n / 2 * 3 + (n % 2 ? 2 : 0);
+     }
+
+     /* drop staged frames; the frame index keeps counting */
+     void clear() {
+       Entry e;
+       while(_ring.pop(e)) { }
+       _frames = 0;
+       _staged = false;
+     }
+
+    private:
+      BLEDevice &_ble;
+      events::EventQueue &_queue;
+      mbed::Callback<bool()> _hid_busy;
+      uint8_t _max_in_flight;
+      NotifyLedger &_ledger;
+      uint8_t _packet[MAX_PAYLOAD];
+      GattCharacteristic _stream_charc;
+      ldry::util::SpscRing<Entry, (1u << LOG_2SIZE)> _ring;
+      std::atomic<bool> _pump_scheduled;
+      bool _connected;
+      bool _enabled;
+      bool _staged;           // _packet is complete, waiting for the stack
+      bool _phy_2m;
+      uint16_t _att_mtu;
+      uint16_t _data_length;
+      uint16_t _seq;
+      uint16_t _offered;      // frame index of the next frame offered
+      uint16_t _first_frame;  // of the packet being assembled
+      uint16_t _frames;       // in the packet being assembled
+      uint8_t _hold;
+      ble::connection_handle_t _handle;
+      Stats _stats;
+  };
+
+}
+
+#endif /* MYOKBD_STREAM */
+
+#endif /* _BT_EMG_STREAM_SERVICE_H_ */
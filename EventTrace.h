@@ -0,0 +1,180 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Binary event trace: a flight recorder for reconstructing single gestures.
+ *
+ * Fixed-size (8 byte) records, timestamped with micros(), go into a RAM ring
+ * that keeps the latest 2^MYOKBD_TRACE_LOG2_RECORDS of them:
+ *  - SAMPLE: a raw ADC reading (every MYOKBD_TRACE_SAMPLE_DIV-th frame, one
+ *    record per channel), from the sampling interrupt;
+ *  - FLIP: a channel's detector state changed (value 1: PEAK);
+ *  - GESTURE: the gesture engine's decision (value: Gesture);
+ *  - ENQUEUE / DROPPED: keys queued for the host (value: HID usage), or
+ *    refused with ENOMEM;
+ *  - WRITE: the outcome of a report write (value: ble_error_t);
+ *  - SENT: the stack reports notifications transmitted (value: count);
+ *  - CONNECT (value: interval, 1.25 ms units) / DISCONNECT (value: reason);
+ *  - RATE: detector samples per ADC sample changed (value: the new hold).
+ *
+ * Writers reserve a slot with one atomic increment and fill it, so records
+ * can come from interrupts and from the application thread alike. The ring
+ * is drained from the application thread: whatever thread-side writer
+ * reserved a slot has finished with it (there is only one such thread), and
+ * records an interrupt overwrote while they were being copied are dropped.
+ *
+ * dump() writes the ring as frames: a 12 byte header ("MKTR", version,
+ * record size, record count, sequence number of the first record) and the
+ * records, all little-endian. host/trace_decode turns a dump into a timeline
+ * and per-stage latencies. The sketch dumps the trace on serial when it
+ * receives 'T'.
+ *
+ * With MYOKBD_TRACE 0 (config.h) the probe macros expand to nothing.
+ */
+#ifndef _MYOKBD_EVENT_TRACE_H_
+#define _MYOKBD_EVENT_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "config.h"
+
+namespace myokbd {
+
+  enum class TraceEvent : uint8_t {
+    SAMPLE,
+    FLIP,
+    GESTURE,
+    ENQUEUE,
+    DROPPED,
+    WRITE,
+    SENT,
+    CONNECT,
+    DISCONNECT,
+    RATE,
+    N_EVENTS
+  };
+
+  struct TraceRecord {
+    uint32_t t_us;
+    uint8_t event;      // TraceEvent
+    uint8_t ch;         // channel, for SAMPLE, FLIP and GESTURE
+    uint16_t value;
+  };
+
+  struct TraceFrameHeader {
+    char magic[4];      // "MKTR"
+    uint8_t version;
+    uint8_t record_size;
+    uint16_t count;
+    uint32_t first_seq;
+  };
+
+  const uint8_t TRACE_VERSION = 1;
+  const uint16_t TRACE_FRAME_RECORDS = 32;
+
+  template <uint16_t LOG_2SIZE>
+  class EventTrace {
+    static_assert(LOG_2SIZE >= 4 && LOG_2SIZE <= 15, "trace size out of range");
+    public:
+     static const uint32_t SIZE = 1u << LOG_2SIZE;
+
+     /* any context */
+     void record(TraceEvent e, uint8_t ch, uint16_t value) {
+       uint32_t seq = _head.fetch_add(1, std::memory_order_relaxed);
+       TraceRecord& r = _buf[seq & MASK];
+       r.t_us = micros();
+       r.event = (uint8_t)e;
+       r.ch = ch;
+       r.value = value;
+     }
+
+     /* sampling interrupt only: every div-th frame of N_CH readings */
+     void frame(const uint16_t* ch, uint8_t n_ch, uint8_t div) {
+       if(++_frames < div) return;
+       _frames = 0;
+       for(uint8_t c = 0; c < n_ch; c++) record(TraceEvent::SAMPLE, c, ch[c]);
+     }
+
+     /**
+      * Copy up to max records from sequence number cursor on into out;
+      * returns the number copied and advances cursor past them. Records
+      * overwritten before they could be read are skipped (cursor jumps).
+      * Application thread only.
+      */
+     size_t read(uint32_t& cursor, TraceRecord* out, size_t max) {
+       uint32_t head = _head.load(std::memory_order_acquire);
+       if(head - cursor > SIZE) cursor = head - SIZE;
+       size_t n = head - cursor < max ? head - cursor : max;
+       for(size_t i = 0; i < n; i++) out[i] = _buf[(cursor + i) & MASK];
+       // an interrupt may have lapped the oldest of them meanwhile
+       uint32_t lapped = _head.load(std::memory_order_acquire) - SIZE;
+       size_t skip = 0;
+       while(skip < n && (int32_t)(cursor + skip - lapped) < 0) skip++;
+       for(size_t i = skip; i < n; i++) out[i - skip] = out[i];
+       cursor += n;
+       return n - skip;
+     }
+
+     /** Sequence number of the next record */
+     uint32_t head() const { return _head.load(std::memory_order_acquire); }
+
+     /**
+      * Write the ring's records to out (anything with write(const uint8_t*,
+      * size_t), such as Serial) as frames; returns the number of records.
+      */
+     template <typename SINK>
+     size_t dump(SINK& out) {
+       uint32_t h = head();
+       uint32_t cursor = h > SIZE ? h - SIZE : 0;
+       size_t total = 0;
+       TraceRecord recs[TRACE_FRAME_RECORDS];
+       for(;;) {
+         size_t n = read(cursor, recs, TRACE_FRAME_RECORDS);
+         if(!n) break;
+         TraceFrameHeader fh = { { 'M', 'K', 'T', 'R' }, TRACE_VERSION,
+                                 (uint8_t)sizeof(TraceRecord), (uint16_t)n,
+                                 cursor - (uint32_t)n };
+         out.write((const uint8_t*)&fh, sizeof(fh));
+         out.write((const uint8_t*)recs, n * sizeof(TraceRecord));
+         total += n;
+       }
+       return total;
+     }
+
+    private:
+      static const uint32_t MASK = SIZE - 1;
+
+      std::atomic<uint32_t> _head;
+      uint8_t _frames;
+      TraceRecord _buf[SIZE];
+  };
+
+#if MYOKBD_TRACE
+  typedef EventTrace<MYOKBD_TRACE_LOG2_RECORDS> SketchTrace;
+
+  /** The sketch's trace; zero-initialised, so usable from the first interrupt */
+  inline SketchTrace& eventTrace() {
+    static SketchTrace t;
+    return t;
+  }
+#endif
+
+}
+
+#if MYOKBD_TRACE
+#define TRACE_EVENT(event, ch, value) \
+  (::myokbd::eventTrace().record(::myokbd::TraceEvent::event, (ch), (value)))
+#define TRACE_FRAME(ch, n_ch) \
+  (::myokbd::eventTrace().frame((ch), (n_ch), MYOKBD_TRACE_SAMPLE_DIV))
+#else
+#define TRACE_EVENT(event, ch, value) ((void)0)
+#define TRACE_FRAME(ch, n_ch)         ((void)0)
+#endif
+
+#endif /* _MYOKBD_EVENT_TRACE_H_ */
@@ -0,0 +1,118 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Bufferless peak detection: PeakDetection with the lag window replaced by
+ * an exponentially weighted mean and variance, in O(1) memory (a few words
+ * instead of 2^LOG_2LAG samples).
+ *
+ * The weight of a new sample is alpha = 2^-(LOG_2LAG - 1) = 2 / LAG, which
+ * gives the samples the same mean age as a window of LAG samples (the usual
+ * moving average / EWMA equivalence, alpha = 2 / (N + 1)). Until LAG samples
+ * have been seen the weight is 1/n instead, so the estimates start as plain
+ * averages; MORE_DATA_NEEDED is returned for those samples, as while
+ * PeakDetection fills its window.
+ *
+ * Decisions and influence follow PeakDetection: a sample more than threshold
+ * standard deviations from the mean is a peak. PeakDetection then keeps the
+ * evicted sample in its window, mixed with the peak by influence; here the
+ * peak enters with its weight scaled by influence, so with the default 0 the
+ * estimates hold still through a contraction. The stable signal flips after
+ * DEBOUNCE consecutive disagreeing samples. The statistics are single
+ * precision floats (hardware on the M4F); there is no window to drift from,
+ * so accumulated rounding is bounded by the weights.
+ *
+ * A windowed detector forgets a contraction-sized excursion LAG samples
+ * later; here it decays geometrically, so decisions near the threshold
+ * differ (see host/bench_ewma).
+ */
+#ifndef _EWMA_PEAKDETECTION_H_
+#define _EWMA_PEAKDETECTION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "PeakDetection.h"
+
+namespace ldry { namespace signal {
+
+  template <uint16_t LOG_2LAG=7, uint8_t DEBOUNCE = 6>
+  class EwmaPeakDetection {
+    static_assert(LOG_2LAG >= 1 && LOG_2LAG <= 15, "lag must be in [2, 2^15]");
+    static_assert(DEBOUNCE >= 1, "DEBOUNCE must be at least 1");
+    static const uint16_t LAG = 1u << LOG_2LAG;
+    public:
+     EwmaPeakDetection(float threshold=3, float infl=0) :
+      _influence(infl),
+      _mean(0),
+      _var(0),
+      _n(0),
+      _unstable_count(0),
+      _stable_peak(false) {
+       setThreshold(threshold);
+     }
+
+     PeakSignal addDataGetPeak(uint16_t data) {
+       float x = data;
+       if(_n < LAG) {
+         // warm-up: running averages of the first LAG samples
+         _n++;
+         update(x, 1.0f / _n);
+         return PeakSignal::MORE_DATA_NEEDED;
+       }
+
+       float d = x - _mean;
+       bool peak = d * d > _thr2 * _var;
+       if(!peak) update(x, ALPHA);
+       else if(_influence > 0) update(x, _influence * ALPHA);
+
+       bool same = (peak == _stable_peak);
+       _unstable_count = same ? 0 : _unstable_count + 1;
+       if(_unstable_count >= DEBOUNCE) {
+         _stable_peak = !_stable_peak;
+         _unstable_count = 0;
+       }
+       return _stable_peak ? PeakSignal::PEAK : PeakSignal::NO_PEAK;
+     }
+
+     /** Same contract as PeakDetection::addBlock */
+     void addBlock(const uint16_t* samples, size_t n, PeakSignal* out) {
+       for(size_t i = 0; i < n; i++) out[i] = addDataGetPeak(samples[i]);
+     }
+
+     void setThreshold(float newthreshold) {
+       _thr2 = newthreshold * newthreshold;
+     }
+
+     /* current estimates */
+     float mean() const { return _mean; }
+     float variance() const { return _var; }
+
+    private:
+     /* West's incremental weighted mean and (population) variance */
+     void update(float x, float w) {
+       float diff = x - _mean;
+       float incr = w * diff;
+       _mean += incr;
+       _var = (1 - w) * (_var + diff * incr);
+     }
+
+    private:
+      static constexpr float ALPHA = 2.0f / LAG;
+
+      float _influence;
+      float _thr2;            // threshold^2
+      float _mean;
+      float _var;
+      uint16_t _n;            // samples seen, up to LAG
+      uint8_t _unstable_count;
+      bool _stable_peak;
+  };
+
+} }
+
+#endif /*_EWMA_PEAKDETECTION_H_*/
@@ -0,0 +1,335 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Compile-time composed EMG filter front end.
+ *
+ * A Pipeline of stages runs over one channel's samples in integer arithmetic:
+ *
+ *   Pipeline<Notch<50, 2000>, BiquadBandpass<20, 450, 2000>, Rectify,
+ *            RmsEnvelope<6>, CicDecimator<2> > front_end;
+ *   int32_t x = sample;
+ *   if(front_end.step(x)) use(x);
+ *
+ * Filter frequencies and the sample rate are template parameters: the biquad
+ * coefficients are designed (RBJ cookbook) by constexpr functions and stored
+ * as Q28 constants, so nothing is computed at run time. Stages are plain
+ * members called through inline step()s, which the compiler fuses into a
+ * single loop body; there are no virtual calls or function pointers.
+ *
+ * Stage interface:
+ *   static const uint32_t DECIMATION   input samples per output sample
+ *   bool step(int32_t& x)              filter x in place; false when the
+ *                                      stage produced no output (decimation)
+ *   int32_t prime(int32_t x)           settle on a constant input x, as if
+ *                                      it had been seen forever; returns the
+ *                                      output for it
+ *
+ * Samples are int32_t with up to 17 significant bits (read_u16 values, or
+ * their signed difference from a baseline).
+ */
+#ifndef _FILTERS_H_
+#define _FILTERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+namespace ldry { namespace signal {
+
+  namespace constmath {
+    constexpr double PI = 3.14159265358979323846;
+
+    /* Taylor series, accurate to ~1e-13 over [-pi, pi] */
+    constexpr double sin(double x) {
+      double term = x, sum = x;
+      for(int n = 1; n < 14; n++) {
+        term *= -x * x / ((2 * n) * (2 * n + 1));
+        sum += term;
+      }
+      return sum;
+    }
+
+    constexpr double cos(double x) {
+      double term = 1, sum = 1;
+      for(int n = 1; n < 14; n++) {
+        term *= -x * x / ((2 * n - 1) * (2 * n));
+        sum += term;
+      }
+      return sum;
+    }
+  }
+
+  /** Biquad coefficients normalised to a0 = 1 */
+  struct BiquadCoeffs {
+    double b0, b1, b2, a1, a2;
+  };
+
+  namespace design {
+    constexpr BiquadCoeffs normalise(double b0, double b1, double b2,
+                                     double a0, double a1, double a2) {
+      return BiquadCoeffs{ b0 / a0, b1 / a0, b2 / a0, a1 / a0, a2 / a0 };
+    }
+
+    constexpr double omega(double f, double fs) { return 2 * constmath::PI * f / fs; }
+
+    constexpr BiquadCoeffs notch(double f0, double fs, double q) {
+      return normalise(1, -2 * constmath::cos(omega(f0, fs)), 1,
+                       1 + constmath::sin(omega(f0, fs)) / (2 * q),
+                       -2 * constmath::cos(omega(f0, fs)),
+                       1 - constmath::sin(omega(f0, fs)) / (2 * q));
+    }
+
+    constexpr BiquadCoeffs lowpass(double fc, double fs, double q) {
+      return normalise((1 - constmath::cos(omega(fc, fs))) / 2,
+                       1 - constmath::cos(omega(fc, fs)),
+                       (1 - constmath::cos(omega(fc, fs))) / 2,
+                       1 + constmath::sin(omega(fc, fs)) / (2 * q),
+                       -2 * constmath::cos(omega(fc, fs)),
+                       1 - constmath::sin(omega(fc, fs)) / (2 * q));
+    }
+
+    constexpr BiquadCoeffs highpass(double fc, double fs, double q) {
+      return normalise((1 + constmath::cos(omega(fc, fs))) / 2,
+                       -(1 + constmath::cos(omega(fc, fs))),
+                       (1 + constmath::cos(omega(fc, fs))) / 2,
+                       1 + constmath::sin(omega(fc, fs)) / (2 * q),
+                       -2 * constmath::cos(omega(fc, fs)),
+                       1 - constmath::sin(omega(fc, fs)) / (2 * q));
+    }
+
+    constexpr double BUTTERWORTH_Q = 0.70710678118654752;
+  }
+
+  /* Designs: a coeffs() function usable in constant expressions. Q is given
+   * in tenths */
+  template <uint32_t F0, uint32_t RATE_HZ, uint32_t Q_X10 = 100>
+  struct NotchDesign {
+    static_assert(F0 > 0 && 2 * F0 < RATE_HZ, "notch frequency must be below Nyquist");
+    static constexpr BiquadCoeffs coeffs() {
+      return design::notch(F0, RATE_HZ, Q_X10 / 10.0);
+    }
+  };
+
+  template <uint32_t FC, uint32_t RATE_HZ>
+  struct LowpassDesign {
+    static_assert(FC > 0 && 2 * FC < RATE_HZ, "cutoff must be below Nyquist");
+    static constexpr BiquadCoeffs coeffs() {
+      return design::lowpass(FC, RATE_HZ, design::BUTTERWORTH_Q);
+    }
+  };
+
+  template <uint32_t FC, uint32_t RATE_HZ>
+  struct HighpassDesign {
+    static_assert(FC > 0 && 2 * FC < RATE_HZ, "cutoff must be below Nyquist");
+    static constexpr BiquadCoeffs coeffs() {
+      return design::highpass(FC, RATE_HZ, design::BUTTERWORTH_Q);
+    }
+  };
+
+  /**
+   * Fixed-point biquad, direct form I: Q28 coefficients, 64 bit accumulator
+   * (one SMLAL per tap on the M4F), rounded back to the input scale
+   */
+  template <typename DESIGN>
+  class Biquad {
+    public:
+     static const uint32_t DECIMATION = 1;
+     static const int COEFF_BITS = 28;
+
+     static constexpr int32_t fixed(double c) {
+       return (int32_t)(c * (1 << COEFF_BITS) + (c < 0 ? -0.5 : 0.5));
+     }
+
+     static constexpr int32_t COEF_B0 = fixed(DESIGN::coeffs().b0);
+     static constexpr int32_t COEF_B1 = fixed(DESIGN::coeffs().b1);
+     static constexpr int32_t COEF_B2 = fixed(DESIGN::coeffs().b2);
+     static constexpr int32_t COEF_A1 = fixed(DESIGN::coeffs().a1);
+     static constexpr int32_t COEF_A2 = fixed(DESIGN::coeffs().a2);
+
+     Biquad() : _x1(0), _x2(0), _y1(0), _y2(0) { }
+
+     bool step(int32_t& x) {
+       int64_t acc = (int64_t)COEF_B0 * x + (int64_t)COEF_B1 * _x1 +
+                     (int64_t)COEF_B2 * _x2 - (int64_t)COEF_A1 * _y1 -
+                     (int64_t)COEF_A2 * _y2;
+       int32_t y = (int32_t)((acc + (1 << (COEFF_BITS - 1))) >> COEFF_BITS);
+       _x2 = _x1;
+       _x1 = x;
+       _y2 = _y1;
+       _y1 = y;
+       x = y;
+       return true;
+     }
+
+     int32_t prime(int32_t x) {
+       // DC gain of the quantised filter
+       int64_t num = (int64_t)COEF_B0 + COEF_B1 + COEF_B2;
+       int64_t den = (int64_t)(1 << COEFF_BITS) + COEF_A1 + COEF_A2;
+       int32_t y = (int32_t)(num * x / den);
+       _x1 = _x2 = x;
+       _y1 = _y2 = y;
+       return y;
+     }
+
+    private:
+      int32_t _x1, _x2, _y1, _y2;
+  };
+
+  template <uint32_t F0, uint32_t RATE_HZ, uint32_t Q_X10 = 100>
+  using Notch = Biquad<NotchDesign<F0, RATE_HZ, Q_X10> >;
+
+  template <uint32_t FC, uint32_t RATE_HZ>
+  using Lowpass = Biquad<LowpassDesign<FC, RATE_HZ> >;
+
+  template <uint32_t FC, uint32_t RATE_HZ>
+  using Highpass = Biquad<HighpassDesign<FC, RATE_HZ> >;
+
+  /** Full-wave rectifier */
+  class Rectify {
+    public:
+     static const uint32_t DECIMATION = 1;
+
+     bool step(int32_t& x) {
+       if(x < 0) x = -x;
+       return true;
+     }
+
+     int32_t prime(int32_t x) { return x < 0 ? -x : x; }
+  };
+
+  /** Moving RMS over the last 2^LOG_2N samples (|x| saturated to 16 bits) */
+  template <uint8_t LOG_2N>
+  class RmsEnvelope {
+    static_assert(LOG_2N <= 12, "RmsEnvelope window too long");
+    public:
+     static const uint32_t DECIMATION = 1;
+     static const uint32_t N = 1u << LOG_2N;
+
+     RmsEnvelope() { prime(0); }
+
+     bool step(int32_t& x) {
+       uint32_t sq = square(x);
+       _sum += sq;
+       _sum -= _sq[_pos];
+       _sq[_pos] = sq;
+       _pos = (_pos + 1) & (N - 1);
+       // hardware VSQRT on the M4F
+       x = (int32_t)(sqrtf((float)(_sum >> LOG_2N)) + 0.5f);
+       return true;
+     }
+
+     int32_t prime(int32_t x) {
+       uint32_t sq = square(x);
+       for(uint32_t i = 0; i < N; i++) _sq[i] = sq;
+       _sum = (uint64_t)sq << LOG_2N;
+       _pos = 0;
+       return (int32_t)(sqrtf((float)sq) + 0.5f);
+     }
+
+    private:
+     static uint32_t square(int32_t x) {
+       uint32_t a = x < 0 ? -x : x;
+       if(a > 0xffff) a = 0xffff;
+       return a * a;
+     }
+
+    private:
+      uint32_t _sq[N];
+      uint64_t _sum;
+      uint32_t _pos;
+  };
+
+  /**
+   * Cascaded integrator-comb decimator by 2^LOG_2R, ORDER stages, unit
+   * differential delay; the gain R^ORDER is divided out. Integrators wrap
+   * around (unsigned arithmetic), which the combs undo as long as the output
+   * fits: 17 input bits + ORDER * LOG_2R <= 32.
+   */
+  template <uint8_t LOG_2R, uint8_t ORDER = 3>
+  class CicDecimator {
+    static_assert(ORDER >= 1 && LOG_2R >= 1 && ORDER * LOG_2R <= 15,
+                  "CIC gain does not fit 32 bits");
+    public:
+     static const uint32_t DECIMATION = 1u << LOG_2R;
+
+     CicDecimator() { clear(); }
+
+     bool step(int32_t& x) {
+       uint32_t v = (uint32_t)x;
+       for(uint8_t i = 0; i < ORDER; i++) {
+         _integ[i] += v;
+         v = _integ[i];
+       }
+       if(++_phase < DECIMATION) return false;
+       _phase = 0;
+       for(uint8_t i = 0; i < ORDER; i++) {
+         uint32_t d = v - _comb[i];
+         _comb[i] = v;
+         v = d;
+       }
+       x = (int32_t)v >> (ORDER * LOG_2R);
+       return true;
+     }
+
+     int32_t prime(int32_t x) {
+       // the impulse response spans ORDER * (R - 1) + 1 inputs
+       clear();
+       for(uint32_t i = 0; i < (ORDER + 1u) * DECIMATION; i++) {
+         int32_t v = x;
+         step(v);
+       }
+       return x;
+     }
+
+    private:
+     void clear() {
+       for(uint8_t i = 0; i < ORDER; i++) _integ[i] = _comb[i] = 0;
+       _phase = 0;
+     }
+
+    private:
+      uint32_t _integ[ORDER];
+      uint32_t _comb[ORDER];
+      uint32_t _phase;
+  };
+
+  /** Stages run in order; a Pipeline is itself a stage */
+  template <typename... STAGES>
+  class Pipeline;
+
+  template <>
+  class Pipeline<> {
+    public:
+     static const uint32_t DECIMATION = 1;
+     bool step(int32_t&) { return true; }
+     int32_t prime(int32_t x) { return x; }
+  };
+
+  template <typename HEAD, typename... TAIL>
+  class Pipeline<HEAD, TAIL...> {
+    public:
+     static const uint32_t DECIMATION = HEAD::DECIMATION * Pipeline<TAIL...>::DECIMATION;
+
+     bool step(int32_t& x) { return _head.step(x) && _tail.step(x); }
+     int32_t prime(int32_t x) { return _tail.prime(_head.prime(x)); }
+
+     HEAD& head() { return _head; }
+     Pipeline<TAIL...>& tail() { return _tail; }
+
+    private:
+      HEAD _head;
+      Pipeline<TAIL...> _tail;
+  };
+
+  /* band-pass as a 2nd order Butterworth high-pass then low-pass */
+  template <uint32_t LO, uint32_t HI, uint32_t RATE_HZ>
+  using BiquadBandpass = Pipeline<Highpass<LO, RATE_HZ>, Lowpass<HI, RATE_HZ> >;
+
+} }
+
+#endif /* _FILTERS_H_ */
@@ -0,0 +1,177 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Table-driven gesture recognition on debounced EMG peak signals.
+ *
+ * Every channel runs the same state machine, described by a constexpr
+ * transition table indexed by (state, input). Inputs are contraction edges
+ * (PRESS, RELEASE, or BLIP for a release too short to count as a squeeze) and
+ * TIMEOUT, raised when the channel has stayed in a state for the duration
+ * that state waits for (long hold, gap between squeezes, repeat interval).
+ *
+ *   IDLE      --PRESS-->    PRESS1
+ *   PRESS1    --RELEASE-->  GAP1      --BLIP-->  IDLE  --TIMEOUT-->  HELD [LONG]
+ *   GAP1      --PRESS-->    PRESS2    --TIMEOUT-->  IDLE [SHORT]
+ *   PRESS2    --RELEASE-->  GAP2      --BLIP-->  GAP1  --TIMEOUT-->  HELD [LONG]
+ *   GAP2      --PRESS-->    PRESS3    --TIMEOUT-->  IDLE [DOUBLE]
+ *   PRESS3    --RELEASE-->  IDLE [TRIPLE]  --BLIP--> GAP2  --TIMEOUT--> HELD [LONG]
+ *   HELD      --RELEASE/BLIP-->  IDLE  --TIMEOUT-->  REPEATING [REPEAT]
+ *   REPEATING --RELEASE/BLIP-->  IDLE  --TIMEOUT-->  REPEATING [REPEAT]
+ *
+ * With a zero gap (no double/triple squeeze bound on a channel) GAP1 times
+ * out on the release itself, so single squeezes are not delayed.
+ */
+#ifndef _MYOKBD_GESTURE_ENGINE_H_
+#define _MYOKBD_GESTURE_ENGINE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace myokbd {
+
+  /** Gestures recognised on a single EMG channel */
+  enum class Gesture : uint8_t {
+    SHORT_SQUEEZE,    // held between min_tap_ms and long_ms
+    DOUBLE_SQUEEZE,
+    TRIPLE_SQUEEZE,
+    LONG_SQUEEZE,     // held for long_ms, sent while still held
+    HOLD_REPEAT,      // keeps firing while a long squeeze is held
+    NONE
+  };
+
+  const size_t N_GESTURES = (size_t)Gesture::NONE;
+
+  struct GestureTiming {
+    uint16_t min_tap_ms;          // shorter contractions are ignored
+    uint16_t long_ms;             // hold time of a long squeeze
+    uint16_t multi_gap_ms;        // max pause within a double/triple squeeze
+    uint16_t repeat_delay_ms;     // long squeeze to first repeat
+    uint16_t repeat_interval_ms;
+  };
+
+  namespace gesture {
+
+    enum State : uint8_t {
+      IDLE, PRESS1, GAP1, PRESS2, GAP2, PRESS3, HELD, REPEATING, N_STATES,
+      STAY = N_STATES     // table entries for inputs a state does not expect
+    };
+
+    enum Input : uint8_t { PRESS, RELEASE, BLIP, TIMEOUT, N_INPUTS };
+
+    enum Wait : uint8_t { NO_WAIT, WAIT_LONG, WAIT_GAP, WAIT_REPEAT_DELAY, WAIT_REPEAT };
+
+    struct Transition {
+      State next;
+      Gesture emit;
+    };
+
+    constexpr Transition to(State next, Gesture emit = Gesture::NONE) {
+      return Transition{ next, emit };
+    }
+
+    constexpr Transition transitions[N_STATES][N_INPUTS] = {
+      // PRESS        RELEASE                            BLIP          TIMEOUT
+      { to(PRESS1),   to(STAY),                          to(STAY),     to(STAY) },                           // IDLE
+      { to(STAY),     to(GAP1),                          to(IDLE),     to(HELD, Gesture::LONG_SQUEEZE) },    // PRESS1
+      { to(PRESS2),   to(STAY),                          to(STAY),     to(IDLE, Gesture::SHORT_SQUEEZE) },   // GAP1
+      { to(STAY),     to(GAP2),                          to(GAP1),     to(HELD, Gesture::LONG_SQUEEZE) },    // PRESS2
+      { to(PRESS3),   to(STAY),                          to(STAY),     to(IDLE, Gesture::DOUBLE_SQUEEZE) },  // GAP2
+      { to(STAY),     to(IDLE, Gesture::TRIPLE_SQUEEZE), to(GAP2),     to(HELD, Gesture::LONG_SQUEEZE) },    // PRESS3
+      { to(STAY),     to(IDLE),                          to(IDLE),     to(REPEATING, Gesture::HOLD_REPEAT) },// HELD
+      { to(STAY),     to(IDLE),                          to(IDLE),     to(REPEATING, Gesture::HOLD_REPEAT) },// REPEATING
+    };
+
+    constexpr Wait waits[N_STATES] = {
+      NO_WAIT, WAIT_LONG, WAIT_GAP, WAIT_LONG, WAIT_GAP, WAIT_LONG,
+      WAIT_REPEAT_DELAY, WAIT_REPEAT
+    };
+
+  }
+
+  template <uint8_t N_CH>
+  class GestureEngine {
+    public:
+     GestureEngine(const GestureTiming& timing) : _timing(timing) {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _state[c] = gesture::IDLE;
+         _contracted[c] = false;
+         _entered[c] = 0;
+         _press_start[c] = 0;
+         _gap_ms[c] = timing.multi_gap_ms;
+       }
+     }
+
+     /** Override the double/triple squeeze gap of one channel (0 disables) */
+     void setMultiGap(uint8_t ch, uint16_t gap_ms) {
+       _gap_ms[ch] = gap_ms;
+     }
+
+     /**
+      * Feed the debounced signal of channel ch (true while contracted) at
+      * time now_ms; returns the gesture completed by this sample, if any.
+      */
+     Gesture step(uint8_t ch, bool contracted, int now_ms) {
+       using namespace gesture;
+
+       if(contracted != _contracted[ch]) {
+         Input in;
+         _contracted[ch] = contracted;
+         if(contracted) {
+           in = PRESS;
+           _press_start[ch] = now_ms;
+         } else {
+           in = (now_ms - _press_start[ch] >= _timing.min_tap_ms) ? RELEASE : BLIP;
+         }
+         Gesture g = apply(ch, in, now_ms);
+         if(g != Gesture::NONE) return g;
+       }
+
+       Wait w = waits[_state[ch]];
+       if(w != NO_WAIT && now_ms - _entered[ch] >= waitMs(ch, w))
+         return apply(ch, TIMEOUT, now_ms);
+       return Gesture::NONE;
+     }
+
+     /** true when no channel is contracted or in the middle of a gesture */
+     bool idle() const {
+       for(uint8_t c = 0; c < N_CH; c++)
+         if(_state[c] != gesture::IDLE || _contracted[c]) return false;
+       return true;
+     }
+
+    private:
+     Gesture apply(uint8_t ch, gesture::Input in, int now_ms) {
+       const gesture::Transition& t = gesture::transitions[_state[ch]][in];
+       if(t.next == gesture::STAY) return Gesture::NONE;
+       _state[ch] = t.next;
+       _entered[ch] = now_ms;
+       return t.emit;
+     }
+
+     int waitMs(uint8_t ch, gesture::Wait w) const {
+       switch(w) {
+         case gesture::WAIT_LONG: return _timing.long_ms;
+         case gesture::WAIT_GAP: return _gap_ms[ch];
+         case gesture::WAIT_REPEAT_DELAY: return _timing.repeat_delay_ms;
+         case gesture::WAIT_REPEAT: return _timing.repeat_interval_ms;
+         default: return 0;
+       }
+     }
+
+    private:
+      GestureTiming _timing;
+      gesture::State _state[N_CH];
+      bool _contracted[N_CH];
+      int _entered[N_CH];
+      int _press_start[N_CH];
+      uint16_t _gap_ms[N_CH];
+  };
+
+}
+
+#endif /* _MYOKBD_GESTURE_ENGINE_H_ */
@@ -0,0 +1,77 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Keyboard events as queued for sending: a HID usage, the modifier byte to
+ * report with it and flags. Characters are translated into events once, when
+ * they are queued, through the compile-time keymap (UK or US layout, see
+ * US_KEYBOARD in Keyboard_types.h); keys and combinations outside the keymap
+ * are built directly from usages.
+ */
+#ifndef _BT_HID_EVENT_H_
+#define _BT_HID_EVENT_H_
+
+#include <stdint.h>
+
+#include "Keyboard_types.h"
+
+namespace btsvc {
+
+  enum HidEventFlags : uint8_t {
+    HID_EVENT_CHORD = 1,    // pressed together with the event that follows
+  };
+
+  struct HidEvent {
+    uint8_t usage;          // 0: modifier only
+    uint8_t modifier;
+    uint8_t flags;
+  };
+
+  /* modifier bits of the input report beyond those in Keyboard_types.h */
+  enum : uint8_t {
+    KEY_GUI = 8,
+    KEY_RIGHT_CTRL = 16,
+    KEY_RIGHT_SHIFT = 32,
+    KEY_RIGHT_ALT = 64,
+    KEY_RIGHT_GUI = 128,
+  };
+
+  constexpr HidEvent hidKey(uint8_t usage, uint8_t modifier = 0) {
+    return HidEvent{ usage, modifier, 0 };
+  }
+
+  /** Event typing character c; usage 0 and no modifier if it has no key */
+  constexpr HidEvent hidChar(uint8_t c) {
+    return c < KEYMAP_SIZE ? hidKey(keymap[c].usage, keymap[c].modifier)
+                           : hidKey(0);
+  }
+
+  constexpr HidEvent withModifier(HidEvent e, uint8_t modifier) {
+    return HidEvent{ e.usage, (uint8_t)(e.modifier | modifier), e.flags };
+  }
+
+  constexpr bool isNoKey(HidEvent e) {
+    return e.usage == 0 && e.modifier == 0;
+  }
+
+  /* keys the character keymap does not reach */
+  namespace hidkeys {
+    constexpr HidEvent ESCAPE = hidKey(0x29);
+    constexpr HidEvent PAUSE = hidKey(0x48);
+    constexpr HidEvent DELETE = hidKey(0x4c);
+    constexpr HidEvent END = hidKey(0x4d);
+    constexpr HidEvent APPLICATION = hidKey(0x65);
+    constexpr HidEvent F13 = hidKey(0x68);
+    constexpr HidEvent F14 = hidKey(0x69);
+    constexpr HidEvent F15 = hidKey(0x6a);
+    constexpr HidEvent SHIFT_F5 = withModifier(hidChar(KEY_F5), KEY_SHIFT);
+    constexpr HidEvent CTRL_P = withModifier(hidChar('p'), KEY_CTRL);
+  }
+
+}
+
+#endif /* _BT_HID_EVENT_H_ */
@@ -14,81 +14,67 @@
 #define _KEYBUFFER_H_
 
 #include <stdint.h>
-#include <mbed.h>
-#include <CircularBuffer.h>
+#include <stddef.h>
+
+#include "HidEvent.h"
+#include "SpscRing.h"
 
 namespace btutil {
 
 /**
  * @class KeyBuffer
- * Ported with some code refactoring from mbed example project
+ * Originally ported from the mbed example project
+ *
+ * Buffer used to store key events (already translated to HID usages) to send.
+ * Keys are queued by one producer (the thread typing them) and sent by one
+ * consumer (the report pump), so the buffer is a wait-free single-producer/
+ * single-consumer ring: neither side takes a lock or masks interrupts.
  *
- * Buffer used to store keys to send.
- * A circular buffer with the added capability of putting the last char back in,
- * when we're unable to send it (ie. when BLE stack is busy)
+ * When the consumer cannot send an event (ie. when the BLE stack is busy, or
+ * the event does not fit the report being built) it simply does not drop it:
+ * events are looked at with peek() and only removed with drop() once taken.
  */
 template<uint32_t BUFFER_SIZE>
-class KeyBuffer: public mbed::CircularBuffer<uint8_t, BUFFER_SIZE> {
+class KeyBuffer {
 public:
-    KeyBuffer() :
-        _data_is_pending (false),
-        _keyUp_is_pending (false){}
-
-    /** Mark a character as pending. When a freshly popped character cannot be
-     * sent, because the underlying stack is busy, we set it as pending, and it
-     * will get popped in priority by @ref getPending once reports can be sent
-     * again.
-     *
-     * @param data  The character to send in priority. The second keyUp report
-     * is implied.
-     */
-    void setPending(uint8_t data) {
-      MBED_ASSERT(_data_is_pending == false);
+    /* ---- producer side ---- */
+
+    bool push(const btsvc::HidEvent &data) {
+      return _ring.push(data);
+    }
 
-      _data_is_pending = true;
-      _pending_data = data;
-      _keyUp_is_pending = true;
+    /** Queue n events atomically: all of them are visible to the consumer
+     * at once, or none is queued if there is not enough room.
+     */
+    bool push(const btsvc::HidEvent *data, size_t n) {
+      return _ring.push(data, n);
     }
 
-    /** Get pending char. Either from the high priority buffer (set with
-     * setPending), or from the circular buffer.
+    bool full() const { return _ring.full(); }
+
+    /* ---- consumer side ---- */
+
+    /** Get the oldest event without removing it.
      *
-     * @param   data Filled with the pending data, when present
+     * @param   data Filled with the event, when present
      * @return  true if data was filled
      */
-    bool getPending(uint8_t &data){
-      if(_data_is_pending) {
-        data = _pending_data;
-        _data_is_pending = false;
-        return true;
-      }
-
-      return mbed::CircularBuffer<uint8_t, BUFFER_SIZE>::pop(data);
+    bool peek(btsvc::HidEvent &data) const {
+      return _ring.peek(data);
     }
 
-    bool isSomethingPending(void){
-      return _data_is_pending ||
-             _keyUp_is_pending ||
-             !mbed::CircularBuffer<uint8_t, BUFFER_SIZE>::empty();
-    }
+    /** Remove the event returned by the last successful peek */
+    void drop() { _ring.drop(); }
 
-    /** Signal that a keyUp report is pending. This means that a character has
-     * successfully been sent, but the subsequent keyUp report failed. This
-     * report is of highest priority than the next character.
-     */
-    void setKeyUpPending(void){ _keyUp_is_pending = true; }
+    bool isSomethingPending() const { return !_ring.empty(); }
 
-    /** Signal that no high-priority report is pending anymore, we can go back
-     * to the normal queue.
-     */
-    void clearKeyUpPending(void){ _keyUp_is_pending = false; }
+    /* ---- either side ---- */
 
-    bool isKeyUpPending(void) { return _keyUp_is_pending; }
+    uint32_t size() const { return _ring.size(); }
+    static uint32_t capacity() { return BUFFER_SIZE; }
 
 protected:
-    bool _data_is_pending;
-    uint8_t _pending_data;
-    bool _keyUp_is_pending;
+    ldry::util::SpscRing<btsvc::HidEvent, BUFFER_SIZE> _ring;
 };
 
 }
@@ -21,9 +21,12 @@
 #define BLE_UUID_DESCRIPTOR_REPORT_REFERENCE 0x2908
 
 #include "KeyBuffer.h"
+#include "NotifyLedger.h"
+#include "HidEvent.h"
 #include "USB_HID.h"
 
 #include <stdint.h>
+#include <atomic>
 #include <mbed.h>
 
 #include "ble/BLE.h"
@@ -35,8 +38,16 @@ namespace btsvc {
   class KeyboardService : public mbed::Stream {
     public:
       const static uint16_t UUID = GattService::UUID_HUMAN_INTERFACE_DEVICE_SERVICE;
+      const static uint8_t KEY_SLOTS = 6;     // key array of the input report
+      const static uint8_t MAX_BUSY_RETRIES = 20;   // back-offs before giving up
 
-      KeyboardService(BLEDevice &ble, uint8_t reportTickerDelay=80);
+      /**
+       * Reports are sent from ble_queue, the event queue processing BLE
+       * events: keys are pumped out as soon as the stack has a free
+       * notification buffer (see pump()).
+       */
+      KeyboardService(BLEDevice &ble, events::EventQueue &ble_queue,
+                      uint8_t busyBackoffMs=10);
 
       /* GattAttribute::Handle_t getValueHandle() const
        * {
@@ -48,18 +59,32 @@ namespace btsvc {
       GattAttribute** getOutputReportDescriptors();
       GattAttribute** getFeatureReportDescriptors();
 
-      void startReportTicker();
-      void stopReportTicker();
+      bool reportsPending();
+      bool keysDown();
+      void schedulePump();
+      void scheduleBackoff();
+      void cancelBackoff();
       void onDataSent(unsigned count);
+      ble_error_t sendNextReport();
       ble_error_t send(const Report_t report);
-      ble_error_t sendAllKeysUp();
-      ble_error_t sendKeyDown(uint8_t key, uint8_t modifier);
+      void stageReport();
+      static bool isHeld(const uint8_t* keys, uint8_t usage);
 
     public:
       void connect(const ble::ConnectionCompleteEvent &event);
       void disconnect(const ble::DisconnectionCompleteEvent &event);
       bool isConnected();
-      void sendCallback();
+      /** nothing queued, staged, held down or waiting in the stack */
+      bool isIdle();
+      /** writes the stack refused (each retried later) */
+      unsigned long failedReports() const;
+      void pump();
+
+      /** Queue a key press (released by the next report); ENOMEM if full */
+      int press(HidEvent e);
+      /** Queue up to KEY_SLOTS keys pressed together, modifiers combined */
+      int pressChord(const HidEvent* keys, uint8_t n);
+
       // Stream implementation
       virtual int _putc(int c);
       virtual int _getc();
@@ -96,9 +121,15 @@ namespace btsvc {
       uint8_t _hid_protocol_mode;
       ReadOnlyGattCharacteristic<uint8_t> _protocol_mode_charc;
 
-      mbed::Ticker _report_ticker;
-      uint32_t _report_ticker_delay;
-      bool _report_ticker_active;
+      events::EventQueue &_ble_queue;
+      std::atomic<bool> _pump_scheduled;
+      NotifyLedger &_ledger;      // reports in flight
+      uint8_t _busy_backoff_ms;
+      uint8_t _busy_retries;
+      int _backoff_id;
+      bool _report_staged;
+      uint8_t _sent_modifier;
+      uint8_t _sent_keys[KEY_SLOTS];    // usages held by the last report sent
 
       btutil::KeyBuffer<KEYBUFFER_SIZE> _keybuf;
 
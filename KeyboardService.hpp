@@ -12,7 +12,10 @@
 
 #include "KeyBuffer.h"
 #include "USB_HID.h"
+#include "Metrics.h"
+#include "EventTrace.h"
 #include <type_traits>
+#include <string.h>
 
 #include <ble/Gap.h>
 
@@ -22,12 +25,11 @@ using namespace btutil;
 // KeyboardService constructor
 template<uint32_t BUFFER_SIZE>
 KeyboardService<BUFFER_SIZE>::KeyboardService(BLEDevice &ble,
-                                              uint8_t reportTickerDelay) :
+                                              events::EventQueue &ble_queue,
+                                              uint8_t busyBackoffMs) :
   _ble(ble),
   _connected(false),
   _failed_reports(0),
-  _report_ticker_active(false),
-  _report_ticker_delay(reportTickerDelay),
 
   // define report containing pressed key data
   _input_report(KbdConfig::InputReportData),
@@ -93,8 +95,19 @@ KeyboardService<BUFFER_SIZE>::KeyboardService(BLEDevice &ble,
       GattCharacteristic::UUID_PROTOCOL_MODE_CHAR,
       &_hid_protocol_mode,
       GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE
-  )
+  ),
+
+  _ble_queue(ble_queue),
+  _pump_scheduled(false),
+  _ledger(NotifyLedger::of(ble)),
+  _busy_backoff_ms(busyBackoffMs),
+  _busy_retries(0),
+  _backoff_id(0),
+  _report_staged(false),
+  _sent_modifier(0)
 {
+        memset(_sent_keys, 0, sizeof(_sent_keys));
+
         static bool serviceAdded = false;
         if(serviceAdded) {
           return;
@@ -165,87 +178,123 @@ GattAttribute** KeyboardService<BUFFER_SIZE>::getFeatureReportDescriptors() {
   return descs;
 }
 
+/**
+ * Report pump
+ *
+ * Every successful write takes one of the stack's notification buffers until
+ * onDataSent reports it transmitted; the ledger counts those (other services
+ * may be notifying on the same link). Reports are written back to back until
+ * the key buffer is empty or the stack returns BLE_STACK_BUSY:
+ * - busy with reports in flight: out of buffers, the next onDataSent
+ *   restarts the pump, no timer needed
+ * - busy with nothing in flight: the stack is busy for some other reason,
+ *   retry after a short back-off (giving up after 20 attempts; the next key
+ *   queued, onDataSent or connection restarts the pump with a fresh count)
+ * Nothing runs while there is nothing to send.
+ */
 template<uint32_t BUFFER_SIZE>
-void KeyboardService<BUFFER_SIZE>::startReportTicker() {
-  if(_report_ticker_active)
+void KeyboardService<BUFFER_SIZE>::pump() {
+  _pump_scheduled.store(false);
+  // run from the back-off timer or ahead of it: either way it is not needed
+  cancelBackoff();
+
+  while(_connected && reportsPending()) {
+    ble_error_t ret = sendNextReport();
+    if(ret == BLE_ERROR_NONE) {
+      _busy_retries = 0;
+      continue;
+    }
+    _failed_reports++;
+    METRIC_COUNT(FAILED_REPORTS);
+    if(ret == BLE_STACK_BUSY && _ledger.inFlight(NotifyLedger::HID) == 0)
+      scheduleBackoff();
     return;
-  _report_ticker.attach_us(this, &KeyboardService::sendCallback, _report_ticker_delay * 1000);
-  _report_ticker_active = true;
+  }
 }
 
+/* keys still to send, or keys held that still need a keyUp */
 template<uint32_t BUFFER_SIZE>
-void KeyboardService<BUFFER_SIZE>::stopReportTicker() {
-  _report_ticker.detach();
-  _report_ticker_active = false;
+bool KeyboardService<BUFFER_SIZE>::reportsPending() {
+  return _report_staged || _keybuf.isSomethingPending() || keysDown();
 }
 
+/* the last report sent holds keys or modifiers down */
 template<uint32_t BUFFER_SIZE>
-void KeyboardService<BUFFER_SIZE>::onDataSent(unsigned count) {
-  if(!_report_ticker_active && _keybuf.isSomethingPending())
-    startReportTicker();
+bool KeyboardService<BUFFER_SIZE>::keysDown() {
+  return _sent_modifier != 0 || _sent_keys[0] != 0;
 }
 
-/**
- * Sends raw report; Should only be called from sendCallback
- */
+/* any context: run the pump on the BLE event queue */
 template<uint32_t BUFFER_SIZE>
-ble_error_t KeyboardService<BUFFER_SIZE>::send(const Report_t report) {
-  static unsigned int consecutiveFailures = 0;
-  ble_error_t ret = _ble.gattServer().write(_input_report_charc.getValueHandle(),
-                                            report,
-                                            _input_report_len);
+void KeyboardService<BUFFER_SIZE>::schedulePump() {
+  if(!_pump_scheduled.exchange(true))
+    _ble_queue.call(this, &KeyboardService::pump);
+}
 
-  /*
-   * Wait until a buffer is available (onDataSent)
-   * TODO. This won't work, because BUSY error is not only returned when we're
-   * short of notification buffers, but in other cases as well (e.g. when
-   * disconnected). We need to find a reliable way of knowing when we actually
-   * need to wait for onDataSent to be called.
-   * if (ret == BLE_STACK_BUSY)
-   *   stopReportTicker();
-   */
-  if (ret == BLE_STACK_BUSY)
-      consecutiveFailures++;
-  else
-      consecutiveFailures = 0;
-
-  if (consecutiveFailures > 20) {
-      /*
-       * We're not transmitting anything anymore. Might as well avoid
-       * overloading the system in case it can magically fix itself. Ticker
-       * will start again on next _putc call, or on next connection.
-       */
-      stopReportTicker();
-      consecutiveFailures = 0;
+template<uint32_t BUFFER_SIZE>
+void KeyboardService<BUFFER_SIZE>::scheduleBackoff() {
+  if(_backoff_id || _busy_retries > MAX_BUSY_RETRIES)
+    return;
+  if(_busy_retries == MAX_BUSY_RETRIES) {
+    // counted once; the next key (or a report sent) starts a new sequence
+    _busy_retries++;
+    METRIC_COUNT(BUSY_GIVE_UPS);
+    return;
   }
-
-  return ret;
+  _busy_retries++;
+  METRIC_COUNT(BUSY_RETRIES);
+  _backoff_id = _ble_queue.call_in(_busy_backoff_ms, this, &KeyboardService::pump);
 }
 
+/* the pending back-off, if any; the retry count is left as it is */
 template<uint32_t BUFFER_SIZE>
-ble_error_t KeyboardService<BUFFER_SIZE>::sendAllKeysUp() {
-  return send(KbdConfig::EmptyInputReportData);
+void KeyboardService<BUFFER_SIZE>::cancelBackoff() {
+  if(_backoff_id)
+    _ble_queue.cancel(_backoff_id);
+  _backoff_id = 0;
 }
 
 template<uint32_t BUFFER_SIZE>
-ble_error_t KeyboardService<BUFFER_SIZE>::sendKeyDown(uint8_t key, uint8_t modifier) {
-  _input_report[0] = modifier;
-  _input_report[2] = keymap[key].usage;
+void KeyboardService<BUFFER_SIZE>::onDataSent(unsigned count) {
+  TRACE_EVENT(SENT, 0, (uint16_t)count);
+  if(reportsPending()) {
+    _busy_retries = 0;
+    pump();
+  }
+}
 
-  return send(_input_report);
+/**
+ * Sends raw report; Should only be called from the pump
+ */
+template<uint32_t BUFFER_SIZE>
+ble_error_t KeyboardService<BUFFER_SIZE>::send(const Report_t report) {
+  ble_error_t ret = _ble.gattServer().write(_input_report_charc.getValueHandle(),
+                                            report,
+                                            _input_report_len);
+  if(ret == BLE_ERROR_NONE) {
+    _ledger.written(NotifyLedger::HID);
+    METRIC_WRITE();
+  }
+  TRACE_EVENT(WRITE, 0, (uint16_t)ret);
+  return ret;
 }
 
 template<uint32_t BUFFER_SIZE>
 void KeyboardService<BUFFER_SIZE>::connect(const ble::ConnectionCompleteEvent &event) {
   this->_connected = true;
-  if(!_report_ticker_active && _keybuf.isSomethingPending())
-    startReportTicker();
+  _ledger.reset();
+  cancelBackoff();
+  _busy_retries = 0;
+  if(reportsPending())
+    pump();
 }
 
 template<uint32_t BUFFER_SIZE>
 void KeyboardService<BUFFER_SIZE>::disconnect(const ble::DisconnectionCompleteEvent &event) {
-  stopReportTicker();
+  cancelBackoff();
+  _busy_retries = 0;
   this->_connected = false;
+  _ledger.reset();
 }
 
 template<uint32_t BUFFER_SIZE>
@@ -253,83 +302,143 @@ bool KeyboardService<BUFFER_SIZE>::isConnected() {
   return _connected;
 }
 
+template<uint32_t BUFFER_SIZE>
+unsigned long KeyboardService<BUFFER_SIZE>::failedReports() const {
+  return _failed_reports;
+}
+
+template<uint32_t BUFFER_SIZE>
+bool KeyboardService<BUFFER_SIZE>::isIdle() {
+  return !reportsPending() && _ledger.inFlight(NotifyLedger::HID) == 0;
+}
+
 /**
-  * Pop a key from the internal FIFO, and attempt to send it over BLE
+  * Pack key events from the internal FIFO into the input report (6-key
+  * rollover)
   *
-  * keyUp reports should theoretically be sent after every keyDown, but we optimize the
-  * throughput by only sending one when strictly necessary:
-  * - when we need to repeat the same key
-  * - when there is no more key to report
-  *
-  * In case of error, put the key event back in the buffer, and retry on next tick.
+  * Up to 6 consecutive keys sharing the same modifier go into one report; the
+  * host presses the usages of a report in array order, so ordering is kept.
+  * A key cannot be pressed again while it is still held, so packing stops at
+  * a usage already in this report or held from the previous one; when the
+  * very first key is still held, the staged report is a keyUp (empty) one.
+  * A chord (events flagged HID_EVENT_CHORD, up to the first unflagged one)
+  * gets a report of its own, pressed from a state with no keys held.
   */
 template<uint32_t BUFFER_SIZE>
-void KeyboardService<BUFFER_SIZE>::sendCallback(void) {
-    ble_error_t ret;
-    uint8_t c;
-    static uint8_t previousKey = 0;
-
-    if (_keybuf.isSomethingPending() && !_keybuf.isKeyUpPending()) {
-        bool hasData = _keybuf.getPending(c);
-
-        /*
-          * If something is pending and is not a keyUp, getPending *must* return something. The
-          * following is only a sanity check.
-          */
-        MBED_ASSERT(hasData);
-
-        if (!hasData)
-            return;
-
-        if (previousKey == c) {
-            /*
-              * When the same key needs to be sent twice, we need to interleave a keyUp report,
-              * or else the OS won't be able to differentiate them.
-              * Push the key back into the buffer, and continue to keyUpCode.
-              */
-            _keybuf.setPending(c);
+void KeyboardService<BUFFER_SIZE>::stageReport(void) {
+    HidEvent e;
+    uint8_t n = 0;
+    uint8_t taken = 0;
+    bool chord = false;
+
+    memset(_input_report, 0, _input_report_len);
+    while (n < KEY_SLOTS && _keybuf.peek(e)) {
+        bool chorded = e.flags & HID_EVENT_CHORD;
+        bool fits;
+        if (taken == 0) {
+            chord = chorded;
+            fits = !isHeld(_sent_keys, e.usage) && !(chord && keysDown());
+            _input_report[0] = e.modifier;
+        } else if (chord) {
+            fits = true;
+            _input_report[0] |= e.modifier;
         } else {
-            ret = sendKeyDown(c, keymap[c].modifier);
-            if (ret) {
-                _keybuf.setPending(c);
-                _failed_reports++;
-            } else {
-                previousKey = c;
-            }
-
-            return;
+            fits = !chorded && e.modifier == _input_report[0] &&
+                   !isHeld(_sent_keys, e.usage) &&
+                   !isHeld(_input_report + 2, e.usage);
+        }
+        if (!fits) {
+            if (taken == 0)
+                _input_report[0] = 0;
+            break;
         }
+        _keybuf.drop();
+        if (e.usage)
+            _input_report[2 + n++] = e.usage;
+        taken++;
+        if (chord && !chorded)
+            break;
     }
+    _report_staged = true;
+}
 
-    ret = sendAllKeysUp();
-    if (ret) {
-        _keybuf.setKeyUpPending();
-        _failed_reports++;
-    } else {
-        _keybuf.clearKeyUpPending();
-        previousKey = 0;
-
-        /* Idle when there is nothing more to send */
-        if (!_keybuf.isSomethingPending())
-            stopReportTicker();
+template<uint32_t BUFFER_SIZE>
+bool KeyboardService<BUFFER_SIZE>::isHeld(const uint8_t* keys, uint8_t usage) {
+    if (!usage)
+        return false;
+    for (uint8_t i = 0; i < KEY_SLOTS; i++)
+        if (keys[i] == usage)
+            return true;
+    return false;
+}
+
+/**
+  * Send the staged report, staging the next one first if needed. In case of
+  * error the report stays staged, and the pump retries it once the stack
+  * can take it. Returns the result of the write.
+  */
+template<uint32_t BUFFER_SIZE>
+ble_error_t KeyboardService<BUFFER_SIZE>::sendNextReport(void) {
+    if (!_report_staged)
+        stageReport();
+
+    ble_error_t ret = send(_input_report);
+    if (ret == BLE_ERROR_NONE) {
+        _report_staged = false;
+        _sent_modifier = _input_report[0];
+        memcpy(_sent_keys, _input_report + 2, KEY_SLOTS);
     }
+    return ret;
 }
 
-// Stream implementation
 template<uint32_t BUFFER_SIZE>
-int KeyboardService<BUFFER_SIZE>::_putc(int c){
-  if (_keybuf.full()) {
+int KeyboardService<BUFFER_SIZE>::press(HidEvent e){
+  if (isNoKey(e))
+    return 0;
+  e.flags &= ~HID_EVENT_CHORD;
+  if (!_keybuf.push(e)) {
+    METRIC_COUNT(KEYS_DROPPED);
+    TRACE_EVENT(DROPPED, 0, e.usage);
     return ENOMEM;
   }
 
-  _keybuf.push((unsigned char)c);
+  METRIC_ENQUEUE();
+  TRACE_EVENT(ENQUEUE, 0, e.usage);
+  _busy_retries = 0;    // a new key gets a full set of back-offs
+  schedulePump();
+  return 0;
+}
 
-  if(!_report_ticker_active)
-    startReportTicker();
+template<uint32_t BUFFER_SIZE>
+int KeyboardService<BUFFER_SIZE>::pressChord(const HidEvent* keys, uint8_t n){
+  if (n == 0 || n > KEY_SLOTS)
+    return EINVAL;
+
+  HidEvent chord[KEY_SLOTS];
+  for (uint8_t i = 0; i < n; i++) {
+    chord[i] = keys[i];
+    chord[i].flags = (i + 1 < n) ? HID_EVENT_CHORD : 0;
+  }
+  // queued as a whole, so that the pump never sees half a chord
+  if (!_keybuf.push(chord, n)) {
+    METRIC_COUNT(KEYS_DROPPED);
+    TRACE_EVENT(DROPPED, 0, chord[0].usage);
+    return ENOMEM;
+  }
 
+  METRIC_ENQUEUE();
+  TRACE_EVENT(ENQUEUE, 0, chord[0].usage);
+  _busy_retries = 0;
+  schedulePump();
   return 0;
 }
 
+// Stream implementation
+template<uint32_t BUFFER_SIZE>
+int KeyboardService<BUFFER_SIZE>::_putc(int c){
+  return press(hidChar((uint8_t)c));
+}
+
 template<uint32_t BUFFER_SIZE>
 int KeyboardService<BUFFER_SIZE>::_getc(){
   return 0;
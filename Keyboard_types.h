@@ -79,7 +79,7 @@ typedef struct {
 #ifdef US_KEYBOARD
 /* US keyboard (as HID standard) */
 #define KEYMAP_SIZE (152)
-const KEYMAP keymap[KEYMAP_SIZE] = {
+constexpr KEYMAP keymap[KEYMAP_SIZE] = {
     {0, 0},             /* NUL */
     {0, 0},             /* SOH */
     {0, 0},             /* STX */
@@ -240,7 +240,7 @@ const KEYMAP keymap[KEYMAP_SIZE] = {
 #else
 /* UK keyboard */
 #define KEYMAP_SIZE (152)
-const KEYMAP keymap[KEYMAP_SIZE] = {
+constexpr KEYMAP keymap[KEYMAP_SIZE] = {
     {0, 0},             /* NUL */
     {0, 0},             /* SOH */
     {0, 0},             /* STX */
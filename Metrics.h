@@ -0,0 +1,180 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Latency probes, from muscle onset to the report leaving for the host.
+ *
+ * Four points of the path are timestamped (micros()):
+ *  - ADC sample: the sampling interrupt stamps each frame it pushes;
+ *  - detector flip: a channel's PEAK / NO_PEAK state changes;
+ *  - enqueue: KeyboardService queues a command's keys (_putc, press());
+ *  - write: gattServer().write() takes the next input report.
+ * A flip remembers the time of the sample it was decided on; the next
+ * command enqueued is attributed to the latest flip, and the next report
+ * written to that command (later commands enqueued before it are not timed).
+ * This gives four fixed-bucket histograms: sample to flip (detection,
+ * including the block and queueing delays), flip to enqueue (the gesture
+ * decision), enqueue to write (the report pump) and sample to write.
+ *
+ * Counters: BLE_STACK_BUSY back-offs, reports the stack refused, keys dropped
+ * because the key buffer was full (ENOMEM), back-off sequences given up
+ * (the stack stayed busy through every retry) and ADC frames lost to ring
+ * overruns.
+ *
+ * The totals are read through the vendor characteristic of MetricsService.h.
+ * With MYOKBD_METRICS 0 (config.h) the probe macros expand to nothing and no
+ * state is kept.
+ */
+#ifndef _MYOKBD_METRICS_H_
+#define _MYOKBD_METRICS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#if MYOKBD_METRICS
+
+namespace myokbd {
+
+  /* bucket 0 counts latencies under BASE_US, bucket b < N_BUCKETS - 1 those
+   * in [BASE_US << (b - 1), BASE_US << b), the last one everything above */
+  struct LatencyHistogram {
+    static const uint8_t N_BUCKETS = 12;
+    static const uint32_t BASE_US = 250;
+
+    uint16_t count[N_BUCKETS];    // saturating
+    uint32_t max_us;
+
+    void add(uint32_t us) {
+      uint32_t q = us / BASE_US;
+      uint8_t b = q ? 32 - __builtin_clz(q) : 0;
+      if(b >= N_BUCKETS) b = N_BUCKETS - 1;
+      if(count[b] != 0xffff) count[b]++;
+      if(us > max_us) max_us = us;
+    }
+  };
+
+  class Metrics {
+    public:
+     enum Latency : uint8_t {
+       SAMPLE_TO_FLIP,
+       FLIP_TO_ENQUEUE,
+       ENQUEUE_TO_WRITE,
+       SAMPLE_TO_WRITE,
+       N_LATENCIES
+     };
+
+     enum Counter : uint8_t {
+       BUSY_RETRIES,      // back-offs after BLE_STACK_BUSY
+       FAILED_REPORTS,    // writes the stack refused
+       KEYS_DROPPED,      // press() / _putc() returning ENOMEM
+       BUSY_GIVE_UPS,     // BLE_STACK_BUSY through all back-offs, retries stopped
+       ADC_OVERRUNS,      // frames lost, the sensor loop did not keep up
+       N_COUNTERS
+     };
+
+     /* layout of the value read from the metrics characteristic: all fields
+      * little-endian, histograms in Latency order */
+     struct Snapshot {
+       uint8_t version;
+       uint8_t n_buckets;
+       uint16_t base_us;
+       uint32_t uptime_ms;
+       uint32_t counters[N_COUNTERS];
+       LatencyHistogram latency[N_LATENCIES];
+     } __attribute__((packed));
+     static const uint8_t VERSION = 2;
+
+     void reset() {
+       memset(_latency, 0, sizeof(_latency));
+       for(uint8_t i = 0; i < N_COUNTERS; i++) _counters[i] = 0;
+       _flip_us = 0;
+       _flip_sample_us = 0;
+       _enqueue_us = 0;
+       _cmd_sample_us = 0;
+       _flipped = false;
+       _pending = false;
+     }
+
+     /* any context, ADC_OVERRUNS included (each counter has one writer) */
+     void count(Counter c) { _counters[c]++; }
+
+     /** A channel changed state, decided on the sample taken at sample_us */
+     void flip(uint32_t sample_us) {
+       uint32_t now = micros();
+       _latency[SAMPLE_TO_FLIP].add(now - sample_us);
+       _flip_us = now;
+       _flip_sample_us = sample_us;
+       _flipped = true;
+     }
+
+     void enqueued() {
+       if(_pending || !_flipped) return;
+       uint32_t now = micros();
+       _latency[FLIP_TO_ENQUEUE].add(now - _flip_us);
+       _enqueue_us = now;
+       _cmd_sample_us = _flip_sample_us;
+       _pending = true;
+     }
+
+     void written() {
+       if(!_pending) return;
+       uint32_t now = micros();
+       _latency[ENQUEUE_TO_WRITE].add(now - _enqueue_us);
+       _latency[SAMPLE_TO_WRITE].add(now - _cmd_sample_us);
+       _pending = false;
+     }
+
+     uint32_t counter(Counter c) const { return _counters[c]; }
+     const LatencyHistogram& latency(Latency l) const { return _latency[l]; }
+
+     void snapshot(Snapshot& s) const {
+       s.version = VERSION;
+       s.n_buckets = LatencyHistogram::N_BUCKETS;
+       s.base_us = LatencyHistogram::BASE_US;
+       s.uptime_ms = millis();
+       for(uint8_t i = 0; i < N_COUNTERS; i++) s.counters[i] = _counters[i];
+       memcpy(s.latency, _latency, sizeof(_latency));
+     }
+
+    private:
+      LatencyHistogram _latency[N_LATENCIES];
+      volatile uint32_t _counters[N_COUNTERS];
+      uint32_t _flip_us;
+      uint32_t _flip_sample_us;
+      uint32_t _enqueue_us;
+      uint32_t _cmd_sample_us;
+      bool _flipped;
+      bool _pending;    // a command enqueued, its report not written yet
+  };
+
+  /** The probes' totals; zero-initialised, so usable from the first interrupt */
+  inline Metrics& metrics() {
+    static Metrics m;
+    return m;
+  }
+
+}
+
+#define METRIC_STAMP(frame)   ((frame).t_us = micros())
+#define METRIC_FLIP(t_us)     (::myokbd::metrics().flip(t_us))
+#define METRIC_ENQUEUE()      (::myokbd::metrics().enqueued())
+#define METRIC_WRITE()        (::myokbd::metrics().written())
+#define METRIC_COUNT(counter) (::myokbd::metrics().count(::myokbd::Metrics::counter))
+
+#else
+
+#define METRIC_STAMP(frame)   ((void)0)
+#define METRIC_FLIP(t_us)     ((void)0)
+#define METRIC_ENQUEUE()      ((void)0)
+#define METRIC_WRITE()        ((void)0)
+#define METRIC_COUNT(counter) ((void)0)
+
+#endif /* MYOKBD_METRICS */
+
+#endif /* _MYOKBD_METRICS_H_ */
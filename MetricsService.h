@@ -0,0 +1,64 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Vendor GATT service exposing the latency probes and counters of Metrics.h.
+ *
+ * One read-only characteristic holds a Metrics::Snapshot (packed,
+ * little-endian, about 140 bytes: centrals fetch it with a long read). The
+ * value is only updated by update(), so reads return the totals as of the
+ * last refresh; it is not notified, as it would not fit a default MTU.
+ */
+#ifndef _BT_METRICS_SERVICE_H_
+#define _BT_METRICS_SERVICE_H_
+
+#include "Metrics.h"
+
+#if MYOKBD_METRICS
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ble/BLE.h"
+#include "ble/GattCharacteristic.h"
+
+namespace btsvc {
+
+  class MetricsService {
+    public:
+      MetricsService(BLEDevice &ble) :
+        _ble(ble),
+        _metrics_charc(UUID("6d796f6b-6264-4d65-8000-000000000002"),
+            (uint8_t *)&_value, sizeof(_value), sizeof(_value),
+            GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ,
+            NULL, 0, false) {
+        memset(&_value, 0, sizeof(_value));
+        GattCharacteristic *cTable[] = { &_metrics_charc };
+        GattService metricsService(UUID("6d796f6b-6264-4d65-8000-000000000001"),
+                                   cTable, 1);
+        _ble.gattServer().addService(metricsService);
+        update();
+      }
+
+      /** Copy the current totals into the characteristic's value */
+      void update() {
+        myokbd::metrics().snapshot(_value);
+        _ble.gattServer().write(_metrics_charc.getValueHandle(),
+                                (const uint8_t *)&_value, sizeof(_value), true);
+      }
+
+    private:
+      BLEDevice &_ble;
+      myokbd::Metrics::Snapshot _value;
+      GattCharacteristic _metrics_charc;
+  };
+
+}
+
+#endif /* MYOKBD_METRICS */
+
+#endif /* _BT_METRICS_SERVICE_H_ */
@@ -0,0 +1,306 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Peak detection over several EMG channels sampled together.
+ *
+ * Per channel this is PeakDetection<LOG_2LAG, ExactStats, DEBOUNCE> (same
+ * decisions with the default ZScoreDecision; see PeakDecision.h for the
+ * other decision policies), but the state of all channels is kept as a
+ * struct of arrays: one array per
+ * statistic, indexed by channel, and a lag buffer laid out frame by frame.
+ * A sample frame (one reading per channel) is then processed in a single
+ * pass where every step is a loop over channels on contiguous memory, which
+ * the compiler can vectorise across channels.
+ *
+ * The window (and thresholds) can be saved to a Snapshot and restored after
+ * a reset, so that detection resumes without first refilling the window.
+ */
+#ifndef _MULTI_PEAKDETECTION_H_
+#define _MULTI_PEAKDETECTION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "PeakDetection.h"
+#include "PeakDecision.h"
+
+namespace ldry { namespace signal {
+
+  template <uint8_t N_CH, uint16_t LOG_2LAG=7,
+            template <uint8_t, uint16_t, uint8_t> class Decision = ZScoreDecision,
+            uint8_t DEBOUNCE = 6>
+  class MultiPeakDetection {
+    static_assert(N_CH >= 1, "at least one channel is needed");
+    static_assert(LOG_2LAG >= 1 && LOG_2LAG <= 15, "lag must be in [2, 2^15]");
+    static const uint16_t LAG = 1u << LOG_2LAG;
+    public:
+     /** Detector state worth keeping across resets: the lag window, in ring
+      * order from slot, and the calibrated thresholds (the wake threshold is
+      * configuration, and is left as set) */
+     struct Snapshot {
+       uint32_t thr2_q8[N_CH];
+       uint16_t slot;
+       uint16_t window[LAG][N_CH];
+     };
+
+     /* frames checked against a restored window before it is trusted */
+     static const uint16_t WARM_CHECK = LAG / 16 > 8 ? LAG / 16 : 8;
+
+     MultiPeakDetection(float threshold=3, float infl=0, float wake=2) :
+      _influence(infl) {
+       reset();
+       setThreshold(threshold);
+       setWakeThreshold(wake);
+     }
+
+     /** Forget the window; the next LAG frames refill it */
+     void reset() {
+       _n = 0;
+       _bufFilled = false;
+       _restored = false;
+       _warm_left = 0;
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _K[c] = 0;
+         _Ex[c] = 0;
+         _Ex2[c] = 0;
+         _warm_peaks[c] = 0;
+         _outlier[c] = 0;
+       }
+       _decision.reset();
+     }
+
+     /** Copy the current window and thresholds; false until the window is
+      * filled (or while a restored one is still being checked) */
+     bool save(Snapshot& snap) const {
+       if(!_bufFilled || _warm_left) return false;
+       for(uint8_t c = 0; c < N_CH; c++) snap.thr2_q8[c] = _thr2_q8[c];
+       snap.slot = _n & (LAG - 1);
+       for(uint16_t i = 0; i < LAG; i++)
+         for(uint8_t c = 0; c < N_CH; c++)
+           snap.window[i][c] = _lagData_cBuf[i][c];
+       return true;
+     }
+
+     /**
+      * Warm start: detection continues from a saved window. New frames
+      * replace the saved ones as usual, so after LAG frames nothing of the
+      * snapshot is left.
+      *
+      * A window saved before the electrodes moved no longer describes the
+      * signal, and with no influence a shifted baseline would never be
+      * absorbed. The first WARM_CHECK frames are therefore only checked
+      * (MORE_DATA_NEEDED is returned for them): if more than half of them are
+      * peaks on a channel, the snapshot is dropped and the window refilled
+      * from scratch, as on a cold start.
+      */
+     void restore(const Snapshot& snap) {
+       reset();
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _thr2_q8[c] = snap.thr2_q8[c];
+         _decision.setThreshold(c, _thr2_q8[c]);
+         _K[c] = snap.window[0][c];
+       }
+       for(uint16_t i = 0; i < LAG; i++)
+         for(uint8_t c = 0; c < N_CH; c++) {
+           uint16_t x = snap.window[i][c];
+           int32_t v = (int32_t)x - _K[c];
+           _lagData_cBuf[i][c] = x;
+           _Ex[c] += v;
+           _Ex2[c] += (int64_t)v * v;
+         }
+       _n = snap.slot & (LAG - 1);
+       _bufFilled = true;
+       _restored = true;
+       _warm_left = WARM_CHECK;
+     }
+
+     /**
+      * Process one frame (N_CH samples, one per channel); out receives the
+      * N_CH stable signals.
+      */
+     void addFrame(const uint16_t* frame, PeakSignal* out) {
+       const uint16_t mask = LAG - 1;
+       uint16_t slot = _n & mask;
+
+       if(!_bufFilled) {
+         fill(frame);
+         for(uint8_t c = 0; c < N_CH; c++) out[c] = PeakSignal::MORE_DATA_NEEDED;
+         return;
+       }
+
+       uint8_t* peak = _outlier;
+       for(uint8_t c = 0; c < N_CH; c++) {
+         int64_t d = ((int64_t)((int32_t)frame[c] - _K[c]) << LOG_2LAG) - _Ex[c];
+         uint64_t S = (uint64_t)((_Ex2[c] << LOG_2LAG) - (int64_t)_Ex[c] * _Ex[c]);
+         peak[c] = _decision.classify(c, d, S, _thr2_q8[c]);
+       }
+       slide(frame, slot);
+
+       if(_warm_left) {
+         if(!checkWarm(peak)) {
+           addFrame(frame, out);
+           return;
+         }
+         for(uint8_t c = 0; c < N_CH; c++) out[c] = PeakSignal::MORE_DATA_NEEDED;
+         _n++;
+         return;
+       }
+
+       for(uint8_t c = 0; c < N_CH; c++)
+         out[c] = _decision.active(c, peak[c]) ? PeakSignal::PEAK : PeakSignal::NO_PEAK;
+       _n++;
+     }
+
+     /**
+      * Repeat frame, the one last passed to addFrame, in the window (the held
+      * copies of a decimated stream, see PresentationController). Only the
+      * window moves on, with the verdicts frame had when it was classified:
+      * the decision policy, its debounce and the warm check see every sample
+      * once, so a copy can neither confirm a state change nor count as
+      * another peak.
+      */
+     void holdFrame(const uint16_t* frame) {
+       if(!_bufFilled) fill(frame);
+       else {
+         slide(frame, _n & (LAG - 1));
+         _n++;
+       }
+     }
+
+     /** Process n_frames interleaved frames; out is interleaved likewise */
+     void addBlock(const uint16_t* frames, size_t n_frames, PeakSignal* out) {
+       for(size_t i = 0; i < n_frames; i++)
+         addFrame(frames + i * N_CH, out + i * N_CH);
+     }
+
+     void setThreshold(float newthreshold) {
+       for(uint8_t c = 0; c < N_CH; c++) setThreshold(c, newthreshold);
+     }
+
+     void setThreshold(uint8_t ch, float newthreshold) {
+       float t2 = newthreshold * newthreshold * 256.0f + 0.5f;
+       _thr2_q8[ch] = t2 >= 65535.0f ? 65535u : (uint32_t)t2;
+       _decision.setThreshold(ch, _thr2_q8[ch]);
+     }
+
+     /** Threshold in use, as represented (threshold^2 in Q8) */
+     float threshold(uint8_t ch) const {
+       return sqrtf(_thr2_q8[ch] / 256.0f);
+     }
+
+     /**
+      * true if any sample of frame lies more than the wake threshold (in
+      * standard deviations) away from its channel's window mean; always
+      * false while the window is being filled. Does not change any state.
+      */
+     bool deviates(const uint16_t* frame) const {
+       if(!_bufFilled) return false;
+       uint8_t any = 0;
+       for(uint8_t c = 0; c < N_CH; c++) {
+         int64_t d = ((int64_t)((int32_t)frame[c] - _K[c]) << LOG_2LAG) - _Ex[c];
+         uint64_t S = (uint64_t)((_Ex2[c] << LOG_2LAG) - (int64_t)_Ex[c] * _Ex[c]);
+         any |= detail::mulGreater(detail::square(d), (uint32_t)(LAG - 1) << 8,
+                                   S, _wake2_q8 << LOG_2LAG);
+       }
+       return any;
+     }
+
+     void setWakeThreshold(float wake) {
+       float t2 = wake * wake * 256.0f + 0.5f;
+       _wake2_q8 = t2 >= 65535.0f ? 65535u : (uint32_t)t2;
+     }
+
+     bool ready() const { return _bufFilled; }
+
+     /** true while a restored window is still being checked */
+     bool warming() const { return _warm_left != 0; }
+
+     /** true if the window started from a snapshot (not refilled since) */
+     bool restored() const { return _restored; }
+
+     static uint8_t channels() { return N_CH; }
+
+     /* samples a state change takes to confirm (see PeakDecision.h) */
+     static constexpr uint8_t debounce() { return DEBOUNCE; }
+
+     /* true if the decision policy only works on raw EMG, not an envelope */
+     static constexpr bool needsRawInput() {
+       return Decision<N_CH, LOG_2LAG, DEBOUNCE>::needsRawInput();
+     }
+
+    private:
+     /* add frame to a window still being filled */
+     void fill(const uint16_t* frame) {
+       uint16_t slot = _n & (LAG - 1);
+       for(uint8_t c = 0; c < N_CH; c++) {
+         if(_n == 0) _K[c] = frame[c];
+         int32_t v = (int32_t)frame[c] - _K[c];
+         _lagData_cBuf[slot][c] = frame[c];
+         _Ex[c] += v;
+         _Ex2[c] += (int64_t)v * v;
+         _outlier[c] = 0;
+       }
+       _n++;
+       if(_n == LAG) _bufFilled = true;
+     }
+
+     /* replace the oldest frame of a full window (at slot) with frame; the
+      * outliers of _outlier enter it weighted by the influence */
+     void slide(const uint16_t* frame, uint16_t slot) {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         uint16_t data = frame[c];
+         uint16_t rmVal = _lagData_cBuf[slot][c];
+         uint16_t inflVal = _influence * data + (1 - _influence) * rmVal;
+         uint16_t newVal = _outlier[c] ? inflVal : data;
+         _lagData_cBuf[slot][c] = newVal;
+
+         int32_t vr = (int32_t)rmVal - _K[c];
+         int32_t vn = (int32_t)newVal - _K[c];
+         _Ex[c] += vn - vr;
+         _Ex2[c] += (int64_t)vn * vn - (int64_t)vr * vr;
+       }
+     }
+
+     /* count the restored window's verdicts; false (after reverting to a
+      * cold start) once a channel disagrees with it too often */
+     bool checkWarm(const uint8_t* peak) {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _warm_peaks[c] += peak[c];
+         if(_warm_peaks[c] > WARM_CHECK / 2) {
+           reset();
+           return false;
+         }
+       }
+       _warm_left--;
+       return true;
+     }
+
+    private:
+      float _influence;
+      uint32_t _wake2_q8;
+      uint16_t _n;
+      bool _bufFilled;
+      bool _restored;
+      uint16_t _warm_left;
+
+      // per-channel state, struct of arrays
+      uint16_t _K[N_CH];
+      int32_t _Ex[N_CH];
+      int64_t _Ex2[N_CH];
+      uint32_t _thr2_q8[N_CH];
+      uint16_t _warm_peaks[N_CH];
+      uint8_t _outlier[N_CH];   // verdicts of the latest frame classified
+      Decision<N_CH, LOG_2LAG, DEBOUNCE> _decision;
+
+      uint16_t _lagData_cBuf[1 << LOG_2LAG][N_CH];
+  };
+
+} }
+
+#endif /*_MULTI_PEAKDETECTION_H_*/
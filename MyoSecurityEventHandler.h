@@ -5,14 +5,66 @@
  * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
  * root of the project for details.
  * ---------
+ *
+ * Keeps track of bonded hosts: the bond table is read back (as a whitelist)
+ * once the stack is up and after every new pairing, and handed to
+ * onBondedPeers. A host that reconnects with a bond only re-encrypts the
+ * link; pairings() counts the times a host had to pair.
  */
 #ifndef _MYO_SECURITY_EVENT_HANDLER_H_
 #define _MYO_SECURITY_EVENT_HANDLER_H_
 
+#include <stdint.h>
+#include <mbed.h>
 #include <ble/SecurityManager.h>
 
 namespace myokbd {
   class MyoSecurityEventHandler : public ble::SecurityManager::EventHandler {
+    public:
+     static const uint8_t MAX_BONDS = 4;
+
+     MyoSecurityEventHandler(ble::SecurityManager& sm,
+                             mbed::Callback<void(const ble::whitelist_t&)> onBondedPeers) :
+      _sm(sm),
+      _on_bonded(onBondedPeers),
+      _pairings(0),
+      _encryptions(0) {
+       _whitelist.addresses = _addresses;
+       _whitelist.size = 0;
+       _whitelist.capacity = MAX_BONDS;
+     }
+
+     /** Read the bond table; the result arrives in whitelistFromBondTable */
+     ble_error_t refresh() {
+       return _sm.generateWhitelistFromBondTable(&_whitelist);
+     }
+
+     void pairingResult(ble::connection_handle_t connectionHandle,
+                        ble::SecurityManager::SecurityCompletionStatus_t result) override {
+       if(result != ble::SecurityManager::SEC_STATUS_SUCCESS) return;
+       _pairings++;
+       refresh();
+     }
+
+     void linkEncryptionResult(ble::connection_handle_t connectionHandle,
+                               ble::link_encryption_t result) override {
+       if(result.value() != ble::link_encryption_t::NOT_ENCRYPTED) _encryptions++;
+     }
+
+     void whitelistFromBondTable(ble::whitelist_t* whitelist) override {
+       if(_on_bonded) _on_bonded(*whitelist);
+     }
+
+     uint32_t pairings() const { return _pairings; }
+     uint32_t encryptions() const { return _encryptions; }
+
+    private:
+      ble::SecurityManager& _sm;
+      mbed::Callback<void(const ble::whitelist_t&)> _on_bonded;
+      BLEProtocol::Address_t _addresses[MAX_BONDS];
+      ble::whitelist_t _whitelist;
+      uint32_t _pairings;
+      uint32_t _encryptions;
   };
 }
 
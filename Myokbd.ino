@@ -26,6 +26,8 @@
 #include "config.h"
 #include "PresentationRemote.h"
 #include "PresentationController.h"
+#include "Storage.h"
+#include "EventTrace.h"
 
 #include <mbed.h>
 #include <ble/BLE.h>
@@ -34,17 +36,31 @@
 using namespace mbed;
 using namespace myokbd;
 
+static Scheduler scheduler;
 
 void setup() {
-  //Serial.begin(115200);
+#if MYOKBD_TRACE
+  Serial.begin(115200);
+#endif
   BLEDevice &ble = BLEDevice::Instance();
 
-  PresentationRemote pr(ble);
+  static PresentationRemote pr(ble, scheduler);
   pr.start();
-  PresentationController(&pr, analogPinToPinName(A0));
+  static const PinName emg_pins[EMG_CHANNELS] = EMG_PINS;
+  // the detector resumes from the calibration saved before the last reset
+  static PresentationController<> pc(&pr, emg_pins, scheduler, GESTURE_LONG_MS,
+                                     GESTURE_MIN_TAP_MS, EMG_SAMPLE_RATE_HZ, DefaultCommandMap,
+                                     DefaultCommandMapSize,
+                                     storage::calibration());
 }
 
 void loop() {
-// execution path never reaches here; control passed to mbed event loop in
-// PresentationRemote
+  // sensor, report and BLE work all run from here; sleeps until the next
+  // deadline when none is due
+  scheduler.runOnce();
+#if MYOKBD_TRACE
+  // 'T' on serial dumps the event trace (decode with host/trace_decode)
+  if(Serial.available() > 0 && Serial.read() == 'T')
+    eventTrace().dump(Serial);
+#endif
 }
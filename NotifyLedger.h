@@ -0,0 +1,84 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Which service wrote the notifications in flight on the link.
+ *
+ * The stack reports transmitted notifications (onDataSent) as a bare count,
+ * for all characteristics at once, so a service counting its writes down by
+ * that count would take another service's transmissions for its own. The
+ * stack sends notifications in the order they were written: the ledger keeps
+ * the writer of each one in flight in a FIFO and retires them from its head
+ * as onDataSent reports them. It registers for onDataSent when first used,
+ * which the services do from their constructors, before registering their
+ * own onDataSent: by the time those run, the counts are up to date.
+ */
+#ifndef _BT_NOTIFY_LEDGER_H_
+#define _BT_NOTIFY_LEDGER_H_
+
+#include <stdint.h>
+
+#include "ble/BLE.h"
+
+namespace btsvc {
+
+  class NotifyLedger {
+    public:
+      enum Owner : uint8_t { HID, STREAM, N_OWNERS };
+
+      /** The ledger of ble's connection */
+      static NotifyLedger& of(BLEDevice &ble) {
+        static NotifyLedger ledger(ble);
+        return ledger;
+      }
+
+      /** A notification of o was written successfully */
+      void written(Owner o) {
+        // more than the stack can hold: the oldest must have gone out
+        if(_size == CAPACITY) retire(1);
+        _fifo[(_head + _size) & MASK] = o;
+        _size++;
+        _count[o]++;
+      }
+
+      unsigned inFlight(Owner o) const { return _count[o]; }
+      unsigned inFlight() const { return _size; }
+
+      /** Forget all notifications in flight (the link went down) */
+      void reset() {
+        _head = _size = 0;
+        for(uint8_t o = 0; o < N_OWNERS; o++) _count[o] = 0;
+      }
+
+    private:
+      static const uint8_t CAPACITY = 32;
+      static const uint8_t MASK = CAPACITY - 1;
+
+      NotifyLedger(BLEDevice &ble) {
+        reset();
+        ble.gattServer().onDataSent(this, &NotifyLedger::onDataSent);
+      }
+
+      void onDataSent(unsigned count) { retire(count); }
+
+      void retire(unsigned n) {
+        for(; n > 0 && _size > 0; n--) {
+          _count[_fifo[_head]]--;
+          _head = (_head + 1) & MASK;
+          _size--;
+        }
+      }
+
+      uint8_t _fifo[CAPACITY];
+      uint8_t _head;
+      uint8_t _size;
+      uint8_t _count[N_OWNERS];
+  };
+
+}
+
+#endif /* _BT_NOTIFY_LEDGER_H_ */
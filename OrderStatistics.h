@@ -0,0 +1,119 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Streaming order statistics (median, MAD, quantiles) over 16 bit samples.
+ *
+ * Samples are counted in a histogram of 2^VALUE_BITS bins (the top
+ * VALUE_BITS bits of the sample) stored as a Fenwick (binary indexed) tree,
+ * so adding or removing a sample and finding the k-th smallest one are
+ * O(VALUE_BITS) rather than a sort of the window. Results are bin centres:
+ * the resolution is 2^(16 - VALUE_BITS) counts. The default of 12 bits is
+ * what the nRF52 ADC resolves (read_u16 scales its 12 bit conversions to 16
+ * bits): a coarser histogram rounds the noise of a resting arm, a few LSB,
+ * to 0 or one bin.
+ *
+ * Count holds the bin counts (and Fenwick partial sums): a uint16_t halves
+ * the histogram's RAM when at most 65535 samples are counted at once.
+ *
+ * The MAD (median of |x - median|) is found by bisecting on the distance d:
+ * the number of samples within [median - d, median + d] is two prefix
+ * counts, so it costs O(VALUE_BITS^2).
+ */
+#ifndef _ORDER_STATISTICS_H_
+#define _ORDER_STATISTICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ldry { namespace util {
+
+  template <uint8_t VALUE_BITS = 12, typename Count = uint32_t>
+  class OrderStatistics {
+    static_assert(VALUE_BITS >= 4 && VALUE_BITS <= 16, "VALUE_BITS must be in [4, 16]");
+    public:
+     static const uint32_t BINS = 1u << VALUE_BITS;
+     static const uint8_t SHIFT = 16 - VALUE_BITS;
+
+     OrderStatistics() { clear(); }
+
+     void clear() {
+       for(uint32_t i = 0; i <= BINS; i++) _tree[i] = 0;
+       _n = 0;
+     }
+
+     void add(uint16_t x) { update(x >> SHIFT, 1); _n++; }
+     void remove(uint16_t x) { update(x >> SHIFT, -1); _n--; }
+
+     uint32_t size() const { return _n; }
+
+     /** k-th smallest sample (0-based, k < size()), as its bin centre */
+     uint16_t select(uint32_t k) const {
+       // descend the tree: the largest prefix of bins holding <= k samples
+       uint32_t pos = 0;
+       for(uint32_t step = BINS; step; step >>= 1) {
+         uint32_t next = pos + step;
+         if(next <= BINS && _tree[next] <= k) {
+           pos = next;
+           k -= _tree[next];
+         }
+       }
+       return centre(pos);
+     }
+
+     uint16_t median() const { return select(_n / 2); }
+
+     /** Smallest distance d from m with at least k samples in [m - d, m + d] */
+     uint16_t spread(uint16_t m, uint32_t k) const {
+       if(k > _n) k = _n;
+       int32_t mb = m >> SHIFT;
+       int32_t lo = 0, hi = BINS;        // distance in bins
+       while(lo < hi) {
+         int32_t d = (lo + hi) / 2;
+         if(countRange(mb - d, mb + d) >= k) hi = d;
+         else lo = d + 1;
+       }
+       uint32_t v = (uint32_t)lo << SHIFT;
+       return v > 0xffff ? 0xffff : (uint16_t)v;
+     }
+
+     /** Median absolute deviation from m */
+     uint16_t mad(uint16_t m) const { return spread(m, (_n + 1) / 2); }
+
+     /** Number of samples in bins [lo, hi] (clamped to the histogram) */
+     uint32_t countRange(int32_t lo, int32_t hi) const {
+       if(lo < 0) lo = 0;
+       if(hi >= (int32_t)BINS) hi = BINS - 1;
+       if(lo > hi) return 0;
+       return prefix(hi + 1) - prefix(lo);
+     }
+
+    private:
+     void update(uint32_t bin, int32_t delta) {
+       for(uint32_t i = bin + 1; i <= BINS; i += i & (0 - i))
+         _tree[i] = (Count)(_tree[i] + delta);
+     }
+
+     /* samples in bins [0, bins) */
+     uint32_t prefix(uint32_t bins) const {
+       uint32_t s = 0;
+       for(uint32_t i = bins; i; i -= i & (0 - i)) s += _tree[i];
+       return s;
+     }
+
+     static uint16_t centre(uint32_t bin) {
+       return (uint16_t)((bin << SHIFT) + ((1u << SHIFT) >> 1));
+     }
+
+    private:
+      Count _tree[BINS + 1];      // 1-based Fenwick tree of bin counts
+      uint32_t _n;
+  };
+
+} }
+
+#endif /* _ORDER_STATISTICS_H_ */
@@ -0,0 +1,227 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Decision policies for MultiPeakDetection: how a sample's deviation from
+ * the lag window turns into the contraction (PEAK) / rest state.
+ *
+ * Every policy is given, per channel and sample, the deviation from the
+ * window mean and the window variance in the exact integer form the window
+ * keeps them, and the channel's threshold (in standard deviations). It says
+ * whether the sample is an outlier, kept out of the window (with no
+ * influence), and then what the debounced state is. DEBOUNCE is a template
+ * parameter, so the counters compile to constants.
+ *
+ *  - ZScoreDecision: |z| > threshold, flipping the state after DEBOUNCE
+ *    consecutive samples disagreeing with it (the original rule, with
+ *    DEBOUNCE = 6). Each transition takes at least DEBOUNCE samples.
+ *  - TkeoDecision: onset after DEBOUNCE consecutive samples whose
+ *    Teager-Kaiser energy psi = z[n-1]^2 - z[n-2] * z[n] exceeds
+ *    threshold^2, offset after DEBOUNCE samples with |z| under threshold / 2.
+ *    psi weighs amplitude by frequency, which suits raw EMG bursts; on an
+ *    envelope it only responds while the level rises steeply, and rarely
+ *    for DEBOUNCE samples in a row, so it misses most contractions. It is
+ *    meant for raw EMG only (needsRawInput(); PresentationController refuses
+ *    it for an envelope sensor, see EMG_INPUT_ENVELOPE).
+ *  - CusumDecision: one-sided CUSUM, g = max(0, g + z - threshold / 2), with
+ *    onset once g > DEBOUNCE * threshold / 2 (DEBOUNCE samples just over the
+ *    threshold, or fewer, larger ones: a strong contraction is seen after
+ *    one sample), and hysteresis for the offset: DEBOUNCE samples under
+ *    threshold / 2.
+ *
+ * Policy interface (template <N_CH, LOG_2LAG, DEBOUNCE>):
+ *   void reset()                                 forget the decision state
+ *   void setThreshold(uint8_t c, uint32_t thr2_q8)
+ *   uint8_t classify(uint8_t c, int64_t d, uint64_t S, uint32_t thr2_q8)
+ *       d = LAG * (x - mean), S = LAG^2 * population variance of the window;
+ *       returns 1 if x is an outlier
+ *   uint8_t active(uint8_t c, uint8_t outlier)   the state after this sample
+ *   static constexpr bool needsRawInput()        true if the policy does not
+ *       work on an EMG envelope
+ */
+#ifndef _PEAKDECISION_H_
+#define _PEAKDECISION_H_
+
+#include <stdint.h>
+#include <math.h>
+
+#include "PeakStats.h"
+
+namespace ldry { namespace signal {
+
+  namespace detail {
+    /** z score of a sample from the window's exact sums (see above) */
+    template <uint16_t LOG_2LAG>
+    inline float zScore(int64_t d, uint64_t S) {
+      const float lag = (float)(1u << LOG_2LAG);
+      float s = (float)S;
+      if(s < 1.0f) s = 1.0f;
+      return (float)d * sqrtf((lag - 1.0f) / (lag * s));
+    }
+
+    /* per-channel state flipping after DEBOUNCE disagreeing samples */
+    template <uint8_t N_CH, uint8_t DEBOUNCE>
+    class Debounce {
+      static_assert(DEBOUNCE >= 1, "DEBOUNCE must be at least 1");
+      public:
+       void reset() {
+         for(uint8_t c = 0; c < N_CH; c++) {
+           _stable[c] = 0;
+           _unstable[c] = 0;
+         }
+       }
+
+       uint8_t step(uint8_t c, uint8_t raw) {
+         uint32_t same = (raw == _stable[c]);
+         uint32_t unstable = (_unstable[c] + 1) & -(!same);
+         uint32_t flip = unstable >= DEBOUNCE;
+         _stable[c] ^= flip;
+         _unstable[c] = unstable & -(!flip);
+         return _stable[c];
+       }
+
+      private:
+        uint32_t _unstable[N_CH];
+        uint8_t _stable[N_CH];
+    };
+  }
+
+  template <uint8_t N_CH, uint16_t LOG_2LAG, uint8_t DEBOUNCE>
+  class ZScoreDecision {
+    public:
+     static constexpr bool needsRawInput() { return false; }
+
+     void reset() { _debounce.reset(); }
+     void setThreshold(uint8_t, uint32_t) { }
+
+     uint8_t classify(uint8_t, int64_t d, uint64_t S, uint32_t thr2_q8) {
+       return detail::mulGreater(detail::square(d), ((1u << LOG_2LAG) - 1) << 8,
+                                 S, thr2_q8 << LOG_2LAG);
+     }
+
+     uint8_t active(uint8_t c, uint8_t outlier) { return _debounce.step(c, outlier); }
+
+    private:
+      detail::Debounce<N_CH, DEBOUNCE> _debounce;
+  };
+
+  template <uint8_t N_CH, uint16_t LOG_2LAG, uint8_t DEBOUNCE>
+  class TkeoDecision {
+    static_assert(DEBOUNCE >= 1, "DEBOUNCE must be at least 1");
+    public:
+     static constexpr bool needsRawInput() { return true; }
+
+     void reset() {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _z1[c] = 0;
+         _z2[c] = 0;
+         _z[c] = 0;
+         _psi[c] = 0;
+         _count[c] = 0;
+         _active[c] = 0;
+       }
+     }
+
+     void setThreshold(uint8_t c, uint32_t thr2_q8) {
+       _thr2[c] = thr2_q8 / 256.0f;
+       _off[c] = sqrtf(_thr2[c]) / 2;
+     }
+
+     uint8_t classify(uint8_t c, int64_t d, uint64_t S, uint32_t) {
+       float z = detail::zScore<LOG_2LAG>(d, S);
+       _psi[c] = _z1[c] * _z1[c] - _z2[c] * z;
+       _z2[c] = _z1[c];
+       _z1[c] = z;
+       _z[c] = z;
+       return z * z > _thr2[c];
+     }
+
+     uint8_t active(uint8_t c, uint8_t) {
+       if(!_active[c]) {
+         _count[c] = _psi[c] > _thr2[c] ? _count[c] + 1 : 0;
+         if(_count[c] >= DEBOUNCE) {
+           _active[c] = 1;
+           _count[c] = 0;
+         }
+       } else {
+         _count[c] = fabsf(_z[c]) < _off[c] ? _count[c] + 1 : 0;
+         if(_count[c] >= DEBOUNCE) {
+           _active[c] = 0;
+           _count[c] = 0;
+         }
+       }
+       return _active[c];
+     }
+
+    private:
+      float _thr2[N_CH];
+      float _off[N_CH];       // offset level: half the threshold
+      float _z1[N_CH];
+      float _z2[N_CH];
+      float _z[N_CH];
+      float _psi[N_CH];
+      uint8_t _count[N_CH];
+      uint8_t _active[N_CH];
+  };
+
+  template <uint8_t N_CH, uint16_t LOG_2LAG, uint8_t DEBOUNCE>
+  class CusumDecision {
+    static_assert(DEBOUNCE >= 1, "DEBOUNCE must be at least 1");
+    public:
+     static constexpr bool needsRawInput() { return false; }
+
+     void reset() {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         _g[c] = 0;
+         _z[c] = 0;
+         _below[c] = 0;
+         _active[c] = 0;
+       }
+     }
+
+     void setThreshold(uint8_t c, uint32_t thr2_q8) {
+       _thr2[c] = thr2_q8 / 256.0f;
+       _k[c] = sqrtf(_thr2[c]) / 2;
+     }
+
+     uint8_t classify(uint8_t c, int64_t d, uint64_t S, uint32_t) {
+       float z = detail::zScore<LOG_2LAG>(d, S);
+       float g = _g[c] + z - _k[c];
+       _g[c] = g > 0 ? g : 0;
+       _z[c] = z;
+       return z * z > _thr2[c];
+     }
+
+     uint8_t active(uint8_t c, uint8_t) {
+       if(!_active[c]) {
+         if(_g[c] > DEBOUNCE * _k[c]) {
+           _active[c] = 1;
+           _below[c] = 0;
+         }
+       } else if(_z[c] < _k[c]) {
+         if(++_below[c] >= DEBOUNCE) {
+           _active[c] = 0;
+           _g[c] = 0;
+         }
+       } else {
+         _below[c] = 0;
+       }
+       return _active[c];
+     }
+
+    private:
+      float _thr2[N_CH];
+      float _k[N_CH];         // drift: half the threshold
+      float _g[N_CH];
+      float _z[N_CH];
+      uint8_t _below[N_CH];
+      uint8_t _active[N_CH];
+  };
+
+} }
+
+#endif /*_PEAKDECISION_H_*/
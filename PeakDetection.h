@@ -18,8 +18,11 @@
 #define _PEAKDETECTION_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include <LowPowerTimer.h>
 
+#include "PeakStats.h"
+
 namespace ldry { namespace signal {
   enum class PeakSignal {
     MORE_DATA_NEEDED,
@@ -30,39 +33,46 @@ namespace ldry { namespace signal {
     FLIP_MASK=11    // 1011_(2)
   };
 
-  template <uint16_t LOG_2LAG=7>
+  /**
+   * Stats selects the numeric engine, see PeakStats.h. DoubleStats matches
+   * the original floating point implementation; ExactStats takes the same
+   * decisions without double math or a per-sample sqrt.
+   *
+   * The stable signal flips after DEBOUNCE consecutive samples disagreeing
+   * with it.
+   */
+  template <uint16_t LOG_2LAG=7,
+            template <uint16_t> class Stats = DoubleStats,
+            uint8_t DEBOUNCE = 6>
   class PeakDetection {
+    static_assert(LOG_2LAG <= 15, "lag index is kept in an uint16_t");
+    static_assert(DEBOUNCE >= 1, "DEBOUNCE must be at least 1");
     public:
      PeakDetection(float threshold=3, float infl=0):
       _lag(1<<LOG_2LAG),
-      _threshold(threshold),
       _influence(infl),
-      _n(0), _K(0),
-      _Ex(0.0), _Ex2(0.0),
-      _avgFilter(0.0),
+      _stats(threshold),
+      _n(0),
+      _lagData_cBuf {},
       _stable_sig(PeakSignal::NO_PEAK),
       _stable_count(1000),
       _unstable_count(0),
-      _bufFilled(false),
-      _lagData_cBuf {},
-      _stdFilter(0.0) {
+      _bufFilled(false) {
      }
 
      PeakSignal addDataGetPeak(uint16_t data){
        uint16_t rmVal = 0;
-       PeakSignal ret;
 
        // incremental computation of avg and variance
-       if(_n == 0 && !_bufFilled) _K = data;
+       if(_n == 0 && !_bufFilled) _stats.start(data);
        if(_bufFilled){ // save oldest value from the avg/std dev calculations
-         rmVal = _lagData_cBuf[_n % _lag];
+         rmVal = _lagData_cBuf[_n & (_lag - 1)];
        } else { // buffer not filled yet so we are just adding values
 
-        _lagData_cBuf[_n % _lag] = data;
+        _lagData_cBuf[_n & (_lag - 1)] = data;
 
         // add new value to the avg/std dev calculations
-        _Ex += data - _K;
-        _Ex2 += (data - _K) * (data - _K);
+        _stats.add(data);
 
         _n++;
        }
@@ -70,16 +80,11 @@ namespace ldry { namespace signal {
        if(_n < _lag && !_bufFilled) return PeakSignal::MORE_DATA_NEEDED;
        if(_n == _lag && !_bufFilled) { // we now compute statistics for a window of size _lag
          _bufFilled = true;
-         _avgFilter = _K + _Ex / _lag;
-         _stdFilter = sqrt( (_Ex2 - (_Ex * _Ex) / _lag) / (_lag - 1) );
-         /* Serial.print("avg:");
-          * Serial.println(_avgFilter);
-          * Serial.print("thr:");
-          * Serial.println(_threshold * _stdFilter); */
+         _stats.update();
          return PeakSignal::MORE_DATA_NEEDED;
        }
        else {
-         if( abs(data - _avgFilter) > _threshold * _stdFilter) { // PEAK
+         if(_stats.exceeds(data)) { // PEAK
            if(((int)_stable_sig & (int)PeakSignal::PEAK) != 0) {
              _stable_count++;  // was previously a peak, maintained
              _unstable_count = 0;
@@ -91,8 +96,8 @@ namespace ldry { namespace signal {
             * } else {
             *   ret = PeakSignal::NEG_PEAK;
             * } */
-           _lagData_cBuf[_n % _lag] =
-             _influence * data + (1 - _influence) * _lagData_cBuf[(_n) % _lag];
+           _lagData_cBuf[_n & (_lag - 1)] =
+             _influence * data + (1 - _influence) * _lagData_cBuf[_n & (_lag - 1)];
          }
          else { // NO_PEAK
            if(_stable_sig == PeakSignal::NO_PEAK) {
@@ -101,50 +106,88 @@ namespace ldry { namespace signal {
            } else {
              _unstable_count++;// stable is PEAK but we got a NO_PEAK
            }
-           ret = PeakSignal::NO_PEAK;
-           _lagData_cBuf[_n % _lag] = data;
+           _lagData_cBuf[_n & (_lag - 1)] = data;
          }
 
          // update statistics
-         _Ex -= rmVal - _K;
-         _Ex2 -= (rmVal - _K) * (rmVal - _K);
-         _Ex += _lagData_cBuf[_n % _lag]  - _K;
-         _Ex2 += (_lagData_cBuf[_n % _lag] - _K) * (_lagData_cBuf[_n % _lag] - _K);
-         _avgFilter = _K + _Ex / _lag;
-         _stdFilter = sqrt( (_Ex2 - (_Ex * _Ex) / _lag) / (_lag - 1) );
-         /* Serial.println("sig:");
-          * Serial.println(data-_avgFilter);
-          * Serial.println("thr:");
-          * Serial.println(_threshold * _stdFilter);  */
+         _stats.remove(rmVal);
+         _stats.add(_lagData_cBuf[_n & (_lag - 1)]);
+         _stats.update();
          _n++;
-         if(_unstable_count > 5){ // flip stable/unstable
+         if(_unstable_count >= DEBOUNCE){ // flip stable/unstable
            if(_stable_sig==PeakSignal::NO_PEAK) _stable_sig=PeakSignal::PEAK;
            else _stable_sig = PeakSignal::NO_PEAK;
            _stable_count = _unstable_count;
            _unstable_count = 0;
-           //Serial.println("flip!");
          }
          return _stable_sig;
        }
      }
 
+     /**
+      * Process a block of samples at once; out[i] receives the signal that
+      * addDataGetPeak(samples[i]) would have returned.
+      *
+      * Samples that complete the initial window are handled one at a time.
+      * After that, the steady-state loop indexes the lag buffer with a
+      * power-of-two mask and takes every decision with selects rather than
+      * branches, so one wakeup can process a whole ADC burst.
+      */
+     void addBlock(const uint16_t* samples, size_t n, PeakSignal* out){
+       size_t i = 0;
+       for(; i < n && !_bufFilled; i++) out[i] = addDataGetPeak(samples[i]);
+
+       const uint16_t mask = _lag - 1;
+       uint16_t idx = _n;
+       uint32_t stableCount = _stable_count;
+       uint32_t unstableCount = _unstable_count;
+       bool stableIsPeak = (_stable_sig != PeakSignal::NO_PEAK);
+       for(; i < n; i++) {
+         uint16_t data = samples[i];
+         uint16_t slot = idx & mask;
+         uint16_t rmVal = _lagData_cBuf[slot];
+         bool peak = _stats.exceeds(data);
+
+         uint16_t inflVal = _influence * data + (1 - _influence) * rmVal;
+         uint16_t newVal = peak ? inflVal : data;
+         _lagData_cBuf[slot] = newVal;
+
+         bool same = (peak == stableIsPeak);
+         stableCount += same;
+         unstableCount = (unstableCount + 1) & -(uint32_t)!same;
+
+         _stats.remove(rmVal);
+         _stats.add(newVal);
+         _stats.update();
+         idx++;
+
+         bool flip = unstableCount >= DEBOUNCE;
+         stableIsPeak ^= flip;
+         stableCount = flip ? unstableCount : stableCount;
+         unstableCount &= -(uint32_t)!flip;
+         out[i] = stableIsPeak ? PeakSignal::PEAK : PeakSignal::NO_PEAK;
+       }
+
+       _n = idx;
+       _stable_count = stableCount;
+       _unstable_count = unstableCount;
+       _stable_sig = stableIsPeak ? PeakSignal::PEAK : PeakSignal::NO_PEAK;
+     }
+
      void setThreshold(float newthreshold){
-       _threshold = newthreshold;
+       _stats.setThreshold(newthreshold);
      }
 
     private:
       uint16_t _lag;          // lag of moving window (in number of samples)
-      float _threshold;       // number of standard deviations from the moving
-                              // mean above which we classify a new datapoint as
-                              // a "peak"
       float _influence;       // number in interval [0, 1] controlling the
                               // influence of detected peaks on means/std dev
                               // 0 means that future peaks are determined based
                               // on a threshold not influenced by past signals
-      double _avgFilter;
-      double _stdFilter;
+      Stats<LOG_2LAG> _stats; // window sums; the threshold is the number of
+                              // standard deviations from the moving mean above
+                              // which we classify a new datapoint as a "peak"
       uint16_t _n;
-      uint16_t _K;
       uint16_t _lagData_cBuf[1<<LOG_2LAG];
       /* mbed::LowPowerTimer *_timer; */
       PeakSignal _stable_sig;
@@ -152,7 +195,6 @@ namespace ldry { namespace signal {
       uint32_t _unstable_count;
       /* bool _extTimer; */
       bool _bufFilled;
-      double _Ex, _Ex2;
   };
 } }
 
@@ -0,0 +1,204 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Numeric policies for PeakDetection.
+ *
+ * A policy keeps the running (shifted) sums over the lag window and decides
+ * whether a new sample lies more than threshold standard deviations away from
+ * the window mean. All policies take samples relative to the shift value K
+ * (the first sample seen), which keeps the sums small.
+ *
+ *  - DoubleStats: the original algorithm; double accumulators and one sqrt
+ *    per sample. Slow on the Cortex-M4F (software double math), kept as the
+ *    reference implementation.
+ *  - ExactStats: int32/int64 accumulators; the decision is taken by comparing
+ *    the squared deviation against threshold^2 * variance using exact integer
+ *    arithmetic, so there is no sqrt and no drift. The threshold is held as
+ *    threshold^2 in Q8 fixed point, so thresholds whose square is a multiple
+ *    of 1/256 (3, 2.5, 1.75, ...) are represented exactly; threshold < 16.
+ *  - FloatStats: the same exact accumulators, with the comparison done in
+ *    single precision (hardware float on the M4F) for arbitrary thresholds.
+ *
+ * Policy interface (LOG_2LAG <= 15):
+ *   void start(uint16_t K)       set shift value, clear sums
+ *   void add(uint16_t x)         add sample to the window sums
+ *   void remove(uint16_t x)      remove sample from the window sums
+ *   void update()                window changed, refresh cached values
+ *   bool exceeds(uint16_t x)     |x - mean| > threshold * std dev
+ *   void setThreshold(float t)
+ */
+#ifndef _PEAKSTATS_H_
+#define _PEAKSTATS_H_
+
+#include <stdint.h>
+#include <math.h>
+
+namespace ldry { namespace signal {
+
+  template <uint16_t LOG_2LAG>
+  class DoubleStats {
+    public:
+     DoubleStats(float threshold) :
+      _threshold(threshold), _K(0), _Ex(0.0), _Ex2(0.0),
+      _avgFilter(0.0), _stdFilter(0.0) { }
+
+     void start(uint16_t K) { _K = K; _Ex = 0.0; _Ex2 = 0.0; }
+
+     void add(uint16_t x) {
+       double v = (int32_t)x - _K;
+       _Ex += v;
+       _Ex2 += v * v;
+     }
+
+     void remove(uint16_t x) {
+       double v = (int32_t)x - _K;
+       _Ex -= v;
+       _Ex2 -= v * v;
+     }
+
+     void update() {
+       const uint32_t lag = 1u << LOG_2LAG;
+       _avgFilter = _K + _Ex / lag;
+       _stdFilter = sqrt( (_Ex2 - (_Ex * _Ex) / lag) / (lag - 1) );
+     }
+
+     bool exceeds(uint16_t x) const {
+       return fabs(x - _avgFilter) > _threshold * _stdFilter;
+     }
+
+     void setThreshold(float threshold) { _threshold = threshold; }
+
+    private:
+      float _threshold;
+      uint16_t _K;
+      double _Ex, _Ex2;
+      double _avgFilter;
+      double _stdFilter;
+  };
+
+  namespace detail {
+    /** Exact a * b > c * e for 64x32 bit unsigned products (96 bit results).
+     * Each side costs two 32x32->64 multiplies (UMULL on the M4); the
+     * comparison is branch-free.
+     */
+    inline bool mulGreater(uint64_t a, uint32_t b, uint64_t c, uint32_t e) {
+      uint64_t lo_ab = (a & 0xffffffffu) * b;
+      uint64_t hi_ab = (a >> 32) * b + (lo_ab >> 32);
+      uint64_t lo_ce = (c & 0xffffffffu) * e;
+      uint64_t hi_ce = (c >> 32) * e + (lo_ce >> 32);
+      return (hi_ab > hi_ce) |
+             ((hi_ab == hi_ce) & ((uint32_t)lo_ab > (uint32_t)lo_ce));
+    }
+
+    /** d^2 for a deviation d = lag * (x - mean), as the unsigned product of
+     * |d| (at most 2^(16 + LOG_2LAG)), so no lag the detectors allow can
+     * overflow a signed multiply */
+    inline uint64_t square(int64_t d) {
+      uint64_t a = (uint64_t)(d < 0 ? -d : d);
+      return a * a;
+    }
+  }
+
+  template <uint16_t LOG_2LAG>
+  class ExactStats {
+    static_assert(LOG_2LAG >= 1 && LOG_2LAG <= 15, "lag must be in [2, 2^15]");
+    public:
+     ExactStats(float threshold) : _K(0), _Ex(0), _Ex2(0) {
+       setThreshold(threshold);
+     }
+
+     void start(uint16_t K) { _K = K; _Ex = 0; _Ex2 = 0; }
+
+     void add(uint16_t x) {
+       int32_t v = (int32_t)x - _K;
+       _Ex += v;
+       _Ex2 += (int64_t)v * v;
+     }
+
+     void remove(uint16_t x) {
+       int32_t v = (int32_t)x - _K;
+       _Ex -= v;
+       _Ex2 -= (int64_t)v * v;
+     }
+
+     void update() { }
+
+     /* With d = lag * (x - mean) and S = lag * Ex2 - Ex^2 = lag (lag-1) var:
+      *   (x - mean)^2 > thr^2 var  <=>  d^2 (lag-1) 256 > thr2_q8 lag S
+      */
+     bool exceeds(uint16_t x) const {
+       int64_t d = ((int64_t)((int32_t)x - _K) << LOG_2LAG) - _Ex;
+       uint64_t d2 = detail::square(d);
+       uint64_t S = (uint64_t)((_Ex2 << LOG_2LAG) - (int64_t)_Ex * _Ex);
+       return detail::mulGreater(d2, ((1u << LOG_2LAG) - 1) << 8,
+                                 S, _thr2_q8 << LOG_2LAG);
+     }
+
+     void setThreshold(float threshold) {
+       float t2 = threshold * threshold * 256.0f + 0.5f;
+       _thr2_q8 = t2 >= 65535.0f ? 65535u : (uint32_t)t2;
+     }
+
+    private:
+      uint32_t _thr2_q8;
+      uint16_t _K;
+      int32_t _Ex;
+      int64_t _Ex2;
+  };
+
+  template <uint16_t LOG_2LAG>
+  class FloatStats {
+    static_assert(LOG_2LAG >= 1 && LOG_2LAG <= 15, "lag must be in [2, 2^15]");
+    public:
+     FloatStats(float threshold) :
+      _thr2(threshold * threshold), _K(0), _Ex(0), _Ex2(0),
+      _mean(0.0f), _thr2_var(0.0f) { }
+
+     void start(uint16_t K) { _K = K; _Ex = 0; _Ex2 = 0; }
+
+     void add(uint16_t x) {
+       int32_t v = (int32_t)x - _K;
+       _Ex += v;
+       _Ex2 += (int64_t)v * v;
+     }
+
+     void remove(uint16_t x) {
+       int32_t v = (int32_t)x - _K;
+       _Ex -= v;
+       _Ex2 -= (int64_t)v * v;
+     }
+
+     void update() {
+       const float lag = (float)(1u << LOG_2LAG);
+       int64_t S = (_Ex2 << LOG_2LAG) - (int64_t)_Ex * _Ex;
+       _mean = _Ex / lag;
+       _thr2_var = _thr2 * ((float)S / (lag * (lag - 1.0f)));
+     }
+
+     bool exceeds(uint16_t x) const {
+       float dv = (float)((int32_t)x - _K) - _mean;
+       return dv * dv > _thr2_var;
+     }
+
+     void setThreshold(float threshold) {
+       _thr2 = threshold * threshold;
+       update();
+     }
+
+    private:
+      float _thr2;
+      uint16_t _K;
+      int32_t _Ex;
+      int64_t _Ex2;
+      float _mean;
+      float _thr2_var;
+  };
+
+} }
+
+#endif /*_PEAKSTATS_H_*/
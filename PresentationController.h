@@ -2,91 +2,457 @@
 #define _PRESENTATION_CONTROLLER_H_
 
 #include <mbed.h>
-#include "LowPowerTimer.h"
 
+#include "config.h"
+#include "Scheduler.h"
 #include "PresentationRemote.h"
-#include "PeakDetection.h"
+#include "Filters.h"
+#include "MultiPeakDetection.h"
+#include "AutoThreshold.h"
+#include "AdcSampler.h"
+#include "GestureEngine.h"
+#include "CommandMap.h"
+#include "CalibrationStore.h"
+#include "Metrics.h"
+#include "EventTrace.h"
 
 namespace myokbd {
+  /*
+   * Filters run on each channel before detection. The sensor (a MyoWare
+   * board) already outputs the rectified, smoothed EMG envelope, so only the
+   * mains hum is left to remove; a sensor giving the raw EMG would use e.g.
+   *   Pipeline<Notch<..>, BiquadBandpass<20, 450, ..>, Rectify, RmsEnvelope<..> >
+   * at a rate of 1 kHz or more.
+   */
+  typedef ldry::signal::Pipeline<
+            ldry::signal::Notch<EMG_MAINS_HZ, EMG_SAMPLE_RATE_HZ> > EmgFrontEnd;
+
+  template <uint8_t N_CH>
+  using EmgDetector = ldry::signal::MultiPeakDetection<N_CH, EMG_LOG2_LAG, EMG_DECISION,
+                                                       EMG_DEBOUNCE>;
+
+  /*
+   * Turns contractions on N_CH EMG channels into presentation commands. Each
+   * channel is debounced and run through the gesture engine independently;
+   * the (channel, gesture) pair then indexes a dispatch table built from the
+   * command map.
+   *
+   * Block processing runs from the scheduler's sampling queue; the
+   * constructor returns once sampling is started.
+   *
+   * While the arm is at rest the ADC is sampled at a fraction of the full rate
+   * (see EMG_IDLE_DECIMATION). The detector and gesture engine still see a
+   * full-rate stream: every idle sample is preceded by hold-1 copies of the
+   * previous one (zero-order hold), so the window spans the same time and
+   * sample time keeps its meaning across rate changes. The copies only move
+   * the window on (see MultiPeakDetection::holdFrame): contraction decisions
+   * and their debounce count ADC samples, so a single noisy idle sample
+   * cannot flip a channel on its own.
+   *
+   * With a CalibrationStore, the detector window is saved once the arm rests
+   * (at most every MYOKBD_CALIB_SAVE_INTERVAL_MS) and restored at the next
+   * start, so detection is usable from the first sample instead of after a
+   * settling delay and a full window.
+   *
+   * Otherwise the detection threshold is calibrated online from the first
+   * EMG_AUTO_THRESHOLD_SAMPLES samples taken at rest (see AutoThreshold.h),
+   * and saved with the window.
+   *
+   * Samples go through FRONT_END (see Filters.h) before the detector, which
+   * also sees the held copies, so the filters run at the full rate they were
+   * designed for. The detector stream keeps the sampling rate: FRONT_END
+   * cannot decimate.
+   *
+   * DETECTOR is the detection engine: a MultiPeakDetection with one of the
+   * decision policies of PeakDecision.h, or a class with the same interface
+   * (addFrame, holdFrame, deviates, thresholds, Snapshot save/restore and
+   * needsRawInput).
+   */
+  template <uint8_t N_CH = EMG_CHANNELS, typename FRONT_END = EmgFrontEnd,
+            typename DETECTOR = EmgDetector<N_CH> >
   class PresentationController {
+    static_assert(FRONT_END::DECIMATION == 1, "the front end cannot decimate");
+    static_assert(!EMG_INPUT_ENVELOPE || !DETECTOR::needsRawInput(),
+                  "the decision policy needs raw EMG, the sensor gives an envelope");
+    static_assert(EMG_WAKE_THRESHOLD <= EMG_THRESHOLD,
+                  "idle samples must wake the sampler before they can start a contraction");
+    typedef typename ldry::signal::AdcSampler<N_CH, EMG_LOG2_RING>::Frame Frame;
     public:
      PresentationController(PresentationRemote* pr,
-                            PinName data_src_pin,
-                            uint8_t evt_squeue_size = 20,
-                            uint16_t next_cmd_time = 550,
-                            uint16_t prev_min_cmd_time = 125) :
+                            const PinName (&data_src_pins)[N_CH],
+                            Scheduler& sched,
+                            uint16_t next_cmd_time = GESTURE_LONG_MS,
+                            uint16_t prev_min_cmd_time = GESTURE_MIN_TAP_MS,
+                            uint32_t sample_rate_hz = EMG_SAMPLE_RATE_HZ,
+                            const CommandBinding* commands = DefaultCommandMap,
+                            size_t n_commands = DefaultCommandMapSize,
+                            CalibrationStore* calibration = NULL) :
        _presenter(pr),
-       _sensor_queue(evt_squeue_size * EVENTS_EVENT_SIZE),
-       _dproc(),
-       _data_src(data_src_pin),
-       _sensor_data(0),
-       _threshold(32667),
-       _next_cmd_time(next_cmd_time),
-       _prev_min_cmd_time(prev_min_cmd_time),
-       _last_signal_time(0),
-       _last_nosignal_time(0)
+       _sensor_queue(sched.queue(PRIO_SAMPLING)),
+       _housekeeping_queue(sched.queue(PRIO_BLE)),
+       _calibration(calibration),
+       _dproc(EMG_THRESHOLD, EMG_INFLUENCE, EMG_WAKE_THRESHOLD),
+       _auto_threshold(EMG_FALSE_TRIGGERS_PER_MIN, sample_rate_hz,
+                       EMG_AUTO_THRESHOLD_SAMPLES),
+       _sampler(data_src_pins),
+       _gestures(gestureTiming(next_cmd_time, prev_min_cmd_time)),
+       _sample_rate_hz(sample_rate_hz),
+       _sample_count(0),
+       _hold(1),
+       _idle_hold(EMG_IDLE_DECIMATION > 1 && sample_rate_hz % EMG_IDLE_DECIMATION == 0 ?
+                  EMG_IDLE_DECIMATION : 1),
+       _quiet_samples(0),
+       _idle_samples(0),
+       _rate_changes(0),
+       _gesture_active(false),
+       _primed(false),
+       _warm(false),
+       _ready(false),
+       _saving(false),
+       _save_attempted(false),
+       _start_ms(0),
+       _ready_ms(0),
+       _last_save_ms(0),
+       _calibrated_ms(0),
+       _rest_slot(0),
+       _rest_pending(0)
     {
+      for(uint8_t c = 0; c < N_CH; c++)
+        for(size_t g = 0; g < N_GESTURES; g++)
+          _dispatch[c][g] = nullptr;
+#if MYOKBD_METRICS || MYOKBD_TRACE
+      for(uint8_t c = 0; c < N_CH; c++) _contracted[c] = false;
+#endif
+      for(size_t i = 0; i < n_commands; i++)
+        if(commands[i].channel < N_CH)
+          _dispatch[commands[i].channel][(size_t)commands[i].gesture] = commands[i].command;
+      // single squeezes only wait for a possible second one where it matters
+      for(uint8_t c = 0; c < N_CH; c++)
+        if(!_dispatch[c][(size_t)Gesture::DOUBLE_SQUEEZE] &&
+           !_dispatch[c][(size_t)Gesture::TRIPLE_SQUEEZE])
+          _gestures.setMultiGap(c, 0);
       setupDataProcessing();
-      _sensor_queue.call_every(25, this, &PresentationController::sensorLoop);
-      _sensor_queue.dispatch_forever();
+      _sampler.start(_sample_rate_hz, EMG_BLOCK_SIZE,
+                     mbed::callback(this, &PresentationController::onSamplesReady));
     }
 
     ~PresentationController() {
-      _timer.stop();
+      _sampler.stop();
+    }
+
+    /* samples seen by the detector, how many of them were held idle-rate
+     * samples, and the number of rate changes */
+    uint32_t samples() const { return _sample_count; }
+    uint32_t idleSamples() const { return _idle_samples; }
+    uint32_t rateChanges() const { return _rate_changes; }
+
+    /* time from construction to the first sample the detector could
+     * classify (0 until then), and whether that came from a restored window */
+    uint32_t startupMs() const { return _ready ? _ready_ms : 0; }
+    bool warmStarted() const { return _warm; }
+
+    /** Calibrate the threshold again from the next samples taken at rest */
+    void recalibrate() { _auto_threshold.start(); }
+
+    /* the calibration, and the time (ms from construction) it completed */
+    const ldry::signal::AutoThreshold<N_CH, DETECTOR::debounce()>& autoThreshold() const {
+      return _auto_threshold;
+    }
+    uint32_t calibratedMs() const { return _calibrated_ms; }
+
+    /** Key of the calibration record: the layout of the saved snapshot and
+     * what produced the window (the front end, and the detector with its
+     * decision policy); a change in any of them invalidates saved ones */
+    static uint32_t calibrationKey() {
+      uint32_t layout = 3u << 24 | (uint32_t)N_CH << 16 | EMG_LOG2_LAG << 8 |
+                        (uint32_t)(sizeof(Snapshot) & 0xff);
+      return typeHash<DETECTOR>(typeHash<FRONT_END>(layout));
     }
 
     private:
+     static GestureTiming gestureTiming(uint16_t next_cmd_time,
+                                        uint16_t prev_min_cmd_time) {
+       GestureTiming t;
+       t.min_tap_ms = prev_min_cmd_time;
+       t.long_ms = next_cmd_time;
+       t.multi_gap_ms = GESTURE_MULTI_GAP_MS;
+       t.repeat_delay_ms = GESTURE_REPEAT_DELAY_MS;
+       t.repeat_interval_ms = 1000 / GESTURE_REPEAT_RATE_HZ;
+       return t;
+     }
+
      void setupDataProcessing() {
-       _timer.start();
-       delay(1000);
+       _start_ms = nowMs();
+       _warm = _calibration &&
+               _calibration->load(calibrationKey(), &_snapshot, sizeof(_snapshot));
+       if(_warm) {
+         _dproc.restore(_snapshot);
+         limitWakeThreshold();
+         // the restored window counts as this period's save
+         _save_attempted = true;
+         _last_save_ms = _start_ms;
+       } else {
+         _auto_threshold.start();
+         delay(1000);   // let the sensor output settle before filling the window
+       }
+     }
+
+     /* FNV-1a of this function's signature, continuing from h: GCC and Clang
+      * spell out T in it, template arguments included */
+     template <typename T>
+     static uint32_t typeHash(uint32_t h) {
+       for(const char* p = __PRETTY_FUNCTION__; *p; p++)
+         h = (h ^ (uint8_t)*p) * 16777619u;
+       return h;
+     }
+
+     /* save the window while the arm rests; the write itself (a flash erase
+      * and program) runs later from the housekeeping queue */
+     void saveCalibration() {
+       if(!_calibration || _saving) return;
+       uint32_t now = nowMs();
+       if(_save_attempted && now - _last_save_ms < MYOKBD_CALIB_SAVE_INTERVAL_MS) return;
+       if(!_dproc.save(_snapshot)) return;
+       _saving = true;
+       _save_attempted = true;
+       _last_save_ms = now;
+       _housekeeping_queue.call(this, &PresentationController::writeCalibration);
+     }
+
+     void writeCalibration() {
+       _calibration->save(calibrationKey(), &_snapshot, sizeof(_snapshot));
+       _saving = false;
+     }
+
+     static uint32_t nowMs() {
+       return (uint32_t)rtos::Kernel::get_ms_count();
+     }
+
+     // interrupt context: defer block processing to the sensor queue
+     void onSamplesReady(void) {
+       _sensor_queue.call(this, &PresentationController::sensorLoop);
      }
 
      void sensorLoop(void) {
-       using namespace ldry::signal;
+       size_t n;
+       bool wake = false;
+       while((n = _sampler.read(_sensor_data, EMG_BLOCK_SIZE)) > 0)
+         wake |= process(n);
+
+       if(_hold > 1 && wake)
+         setHold(1);
+       else if(_hold < _idle_hold && resting())
+         setHold(_idle_hold);
+       if(resting()) saveCalibration();
+     }
+
+     /* no contraction for EMG_IDLE_AFTER_MS and no gesture in progress */
+     bool resting() const {
+       return _gestures.idle() &&
+              _quiet_samples >= (uint64_t)EMG_IDLE_AFTER_MS * _sample_rate_hz / 1000;
+     }
 
-       _sensor_data = _data_src.read_u16();
-       PeakSignal sig = _dproc.addDataGetPeak(_sensor_data);
-       if(sig == PeakSignal::MORE_DATA_NEEDED){
+     /* feed a rest frame (a filtered ADC sample, not a held copy) to the threshold
+      * calibration, REST_DELAY frames late: the first samples of a contraction
+      * pass for rest until the detector confirms it, and are dropped then
+      * (see process). Once complete, the thresholds apply from the next frame
+      * and are saved with the window at the next rest */
+     void calibrate(const uint16_t* frame) {
+       uint16_t* slot = _rest_delay[_rest_slot];
+       _rest_slot = (_rest_slot + 1) % REST_DELAY;
+       uint16_t oldest[N_CH];
+       for(uint8_t c = 0; c < N_CH; c++) {
+         oldest[c] = slot[c];
+         slot[c] = frame[c];
+       }
+       if(_rest_pending < REST_DELAY) {
+         _rest_pending++;
          return;
        }
-       if(sig == PeakSignal::PEAK) {
-         if(_last_signal == PeakSignal::NO_PEAK){
-            _last_signal_time = _timer.read_ms();
+       if(!_auto_threshold.add(oldest)) return;
+       for(uint8_t c = 0; c < N_CH; c++)
+         _dproc.setThreshold(c, _auto_threshold.threshold(c));
+       limitWakeThreshold();
+       _calibrated_ms = nowMs() - _start_ms;
+       _save_attempted = false;
+     }
+
+     /* EMG_WAKE_THRESHOLD, or the lowest detection threshold if that is below
+      * it (calibration goes down to AutoThreshold::MIN_THRESHOLD): a sample
+      * that can start a contraction has to wake the sampler */
+     void limitWakeThreshold() {
+       float wake = EMG_WAKE_THRESHOLD;
+       for(uint8_t c = 0; c < N_CH; c++)
+         if(_dproc.threshold(c) < wake) wake = _dproc.threshold(c);
+       _dproc.setWakeThreshold(wake);
+     }
+
+     /* the restored window did not match the signal and is being refilled
+      * (see MultiPeakDetection::restore): the thresholds saved with it go
+      * too, and are calibrated again as on a cold start */
+     void dropRestored() {
+       _warm = false;
+       _dproc.setThreshold(EMG_THRESHOLD);
+       limitWakeThreshold();
+       _auto_threshold.start();
+     }
+
+     /* feed n frames from _sensor_data; true if any of them deviates (checked
+      * after the front end, as the window holds filtered samples) */
+     bool process(size_t n) {
+       bool wake = false;
+       for(size_t i = 0; i < n; i++) {
+         const uint16_t* frame = _sensor_data[i].ch;
+         if(_hold > 1) {
+           for(uint8_t k = 1; k < _hold; k++) {
+             filter(_held.ch);
+             feed(_held, true);
+           }
+           _idle_samples += _hold;
+         }
+         filter(frame);
+         if(_hold > 1) wake |= _dproc.deviates(_filtered);
+         feed(_sensor_data[i], false);
+         _held = _sensor_data[i];
+#if MYOKBD_STREAM
+         _presenter->streamFrame(frame, _hold);
+#endif
+         if(_auto_threshold.collecting()) {
+           if(resting()) calibrate(_filtered);
+           else _rest_pending = 0;
          }
-         _last_signal = PeakSignal::POS_PEAK;
        }
-       if(sig == PeakSignal::NO_PEAK) {
-         _last_nosignal_time = _timer.read_ms();
-         if (_last_signal_time == 0) {
-           _last_signal_time = _last_nosignal_time;
+       return wake;
+     }
+
+     /* detect on frame, already run through filter(); held copies keep the
+      * previous frame's signals (no new decision), but advance the sample
+      * time so that gesture timeouts fire on time */
+     void feed(const Frame& frame, bool held) {
+       using namespace ldry::signal;
+
+       if(held) _dproc.holdFrame(_filtered);
+       else _dproc.addFrame(_filtered, _sensor_sig);
+       if(_warm && !_dproc.restored()) dropRestored();
+       _sample_count++;
+       _quiet_samples++;
+       int now_ms = sampleTime();
+       for(uint8_t c = 0; c < N_CH; c++) {
+         if(_sensor_sig[c] == PeakSignal::MORE_DATA_NEEDED) {
+           _ready = false;
+           _quiet_samples = 0;
+           continue;
+         }
+         if(!_ready) {
+           _ready = true;
+           _ready_ms = nowMs() - _start_ms;
          }
-         int delta = _last_nosignal_time - _last_signal_time;
-         //Serial.println(delta);
-         if ( delta >= _next_cmd_time)
-           _presenter->nextSlide();
-         else if( delta >= _prev_min_cmd_time)
-           _presenter->previousSlide();
-         _last_signal_time = 0;
-         _last_signal=PeakSignal::NO_PEAK;
+         bool contracted = _sensor_sig[c] == PeakSignal::PEAK;
+         if(contracted) _quiet_samples = 0;
+#if MYOKBD_METRICS || MYOKBD_TRACE
+         if(contracted != _contracted[c]) {
+           _contracted[c] = contracted;
+           METRIC_FLIP(frame.t_us);
+           TRACE_EVENT(FLIP, c, contracted);
+         }
+#endif
+         Gesture g = _gestures.step(c, contracted, now_ms);
+         if(g != Gesture::NONE) issue(c, g);
        }
+       bool active = !_gestures.idle();
+       if(active != _gesture_active) {
+         _gesture_active = active;
+         _presenter->gestureActive(active);
+       }
+     }
+
+     /* run frame through the front end into _filtered; the filters start
+      * settled on the first frame, so they do not ring while the window fills
+      * (or a restored window is checked) */
+     void filter(const uint16_t* frame) {
+       for(uint8_t c = 0; c < N_CH; c++) {
+         int32_t x = frame[c];
+         if(_primed) _front_end[c].step(x);
+         else x = _front_end[c].prime(x);
+         _filtered[c] = (uint16_t)(x < 0 ? 0 : x > 0xffff ? 0xffff : x);
+       }
+       _primed = true;
+     }
+
+     /* switch to sampling at _sample_rate_hz / hold */
+     void setHold(uint8_t hold) {
+       // frames already sampled at the current rate are processed at it
+       _sampler.stop();
+       size_t n;
+       while((n = _sampler.read(_sensor_data, EMG_BLOCK_SIZE)) > 0) process(n);
+       _hold = hold;
+       TRACE_EVENT(RATE, 0, hold);
+       _quiet_samples = 0;
+       _rate_changes++;
+       // idle samples are processed one by one, to react within one sample
+       _sampler.setRate(_sample_rate_hz / hold, hold > 1 ? 1 : EMG_BLOCK_SIZE);
+     }
+
+     /* time of the latest sample, derived from the sampling rate */
+     int sampleTime() const {
+       return (int)((uint64_t)_sample_count * 1000 / _sample_rate_hz);
+     }
+
+     void issue(uint8_t ch, Gesture g) {
+       TRACE_EVENT(GESTURE, ch, (uint16_t)g);
+       RemoteCommand cmd = _dispatch[ch][(size_t)g];
+       if(cmd) (_presenter->*cmd)();
      }
 
     private:
-      events::EventQueue _sensor_queue;
-      ldry::signal::PeakDetection<> _dproc;
-      ldry::signal::PeakSignal _last_signal;
-      mbed::AnalogIn _data_src;
-      uint16_t _sensor_data;
-      uint16_t _threshold;
-      uint16_t _window_ms;
+      typedef typename DETECTOR::Snapshot Snapshot;
+      // a save erases one of the two halves of the calibration area
+      static_assert(CalibrationStore::recordSize(sizeof(Snapshot)) <= MYOKBD_CALIB_SIZE / 2,
+                    "the detector snapshot does not fit a calibration slot: "
+                    "raise MYOKBD_CALIB_SIZE or lower EMG_LOG2_LAG");
+      // frames a contraction takes to confirm, and so to hold back from the
+      // threshold calibration
+      static const uint8_t REST_DELAY = DETECTOR::debounce();
+
       PresentationRemote* _presenter;
-      mbed::LowPowerTimer _timer;
-      int _cmd_time;
-      int _last_signal_time;
-      int _last_nosignal_time;
-      int _next_cmd_time;
-      int _prev_min_cmd_time;
-      bool _cmd_is_active;
+      events::EventQueue& _sensor_queue;
+      events::EventQueue& _housekeeping_queue;
+      CalibrationStore* _calibration;
+      Snapshot _snapshot;     // loaded at start, then staging for saves
+      DETECTOR _dproc;
+      ldry::signal::AutoThreshold<N_CH, DETECTOR::debounce()> _auto_threshold;
+      ldry::signal::AdcSampler<N_CH, EMG_LOG2_RING> _sampler;
+      GestureEngine<N_CH> _gestures;
+      RemoteCommand _dispatch[N_CH][N_GESTURES];
+      Frame _sensor_data[EMG_BLOCK_SIZE];
+      Frame _held;
+      FRONT_END _front_end[N_CH];
+      uint16_t _filtered[N_CH];
+      ldry::signal::PeakSignal _sensor_sig[N_CH];
+#if MYOKBD_METRICS || MYOKBD_TRACE
+      bool _contracted[N_CH];   // detector state, for the flip probes
+#endif
+      uint32_t _sample_rate_hz;
+      uint32_t _sample_count;
+      uint8_t _hold;          // detector samples per ADC sample: 1 at full rate
+      uint8_t _idle_hold;
+      uint32_t _quiet_samples;
+      uint32_t _idle_samples;
+      uint32_t _rate_changes;
+      bool _gesture_active;
+      bool _primed;
+      bool _warm;
+      bool _ready;
+      bool _saving;
+      bool _save_attempted;
+      uint32_t _start_ms;
+      uint32_t _ready_ms;
+      uint32_t _last_save_ms;
+      uint32_t _calibrated_ms;
+      // rest frames on their way to the calibration (see calibrate)
+      uint16_t _rest_delay[REST_DELAY][N_CH];
+      uint8_t _rest_slot;
+      uint8_t _rest_pending;
   };
 
 }
@@ -3,4 +3,4 @@
 
 using namespace myokbd;
 
-events::EventQueue PresentationRemote::_event_queue(20 * EVENTS_EVENT_SIZE);
+events::EventQueue *PresentationRemote::_event_queue = NULL;
@@ -21,7 +21,15 @@
 #include <stdint.h>
 
 #include "config.h"
+#include "Scheduler.h"
+#include "ConnectionPolicy.h"
+#include "Advertiser.h"
+#include "MyoSecurityEventHandler.h"
+#include "Storage.h"
 #include "KeyboardService.h"
+#include "MetricsService.h"
+#include "EmgStreamService.h"
+#include "EventTrace.h"
 #include "Keyboard_types.h"
 
 #include <ble/BLE.h>
@@ -32,28 +40,54 @@
 
 namespace myokbd {
 
-  class PresentationRemote : public ble::Gap::EventHandler {
+  class PresentationRemote : public ble::Gap::EventHandler,
+                             public GattServer::EventHandler {
   public:
-    PresentationRemote(BLEDevice &ble,
-                       const char dev_name[] = MYOKBD_BT_DEVICE_NAME ) :
+    PresentationRemote(BLEDevice &ble, Scheduler &sched,
+                       const char dev_name[] = MYOKBD_BT_DEVICE_NAME,
+                       const AdvertisingTier* adv_tiers = DefaultAdvertisingTiers,
+                       size_t n_adv_tiers = DefaultAdvertisingTiersSize) :
       _ble(ble),
+      _sched(sched),
       _dev_name(dev_name),
-      _uuid_list { btsvc::KeyboardService<KBD_BUF_SIZE>::UUID,
-                   GattService::UUID_DEVICE_INFORMATION_SERVICE,
-                   GattService::UUID_BATTERY_SERVICE
-                   },
       _connected_led(LED_PWR, 0),
       _err_led(LED1, 0),
       _init_done(false),
+      _gesture_active(false),
+      _adv_waiting_bonds(false),
+      _conn_policy(ble.gap(), sched.queue(PRIO_BLE),
+                   mbed::callback(this, &PresentationRemote::isBusy)),
+      _advertiser(ble.gap(), adv_tiers, n_adv_tiers),
+      _sec_handler(ble.securityManager(),
+                   mbed::callback(this, &PresentationRemote::onBondedPeers)),
       _bt_kbd_svc(NULL),
       _bt_devinfo_svc(NULL),
       _bt_batt_svc(NULL),
-      _adv_data_builder(_adv_buffer) { }
+#if MYOKBD_METRICS
+      _bt_metrics_svc(NULL),
+      _metrics_refresh_id(0),
+#endif
+#if MYOKBD_STREAM
+      _bt_stream_svc(NULL),
+#endif
+      _uuid_list { btsvc::KeyboardService<KBD_BUF_SIZE>::UUID,
+                   GattService::UUID_DEVICE_INFORMATION_SERVICE,
+                   GattService::UUID_BATTERY_SERVICE
+                   },
+      _adv_data_builder(_adv_buffer) {
+      _event_queue = &sched.queue(PRIO_BLE);
+    }
 
     ~PresentationRemote() {
       delete _bt_kbd_svc;
       delete _bt_batt_svc;
       delete _bt_devinfo_svc;
+#if MYOKBD_METRICS
+      delete _bt_metrics_svc;
+#endif
+#if MYOKBD_STREAM
+      delete _bt_stream_svc;
+#endif
     }
 
     void start() {
@@ -61,44 +95,141 @@ namespace myokbd {
       bool enableMITMProtection = false;
       _ble.onEventsToProcess(PresentationRemote::scheduleBleEvents);
       _ble.gap().setEventHandler(this);
+      _ble.gattServer().setEventHandler(this);
 
-      _ble.init(this, &PresentationRemote::onInitComplete);
-      _ble.securityManager().init(enableBonding, enableMITMProtection, SecurityManager::IO_CAPS_NONE);
+      /* bonds go to flash when there is a filesystem for them, so a bonded
+       * host reconnects after a reset without pairing again */
+      bool persistent = storage::mount();
 
-      //TODO(lc525): remove once MyoSecurityEventHandler is implemented
+      _ble.init(this, &PresentationRemote::onInitComplete);
+      _ble.securityManager().init(enableBonding, enableMITMProtection,
+                                  SecurityManager::IO_CAPS_NONE, NULL, true,
+                                  persistent ? MYOKBD_BOND_DB_PATH : NULL);
+      _ble.securityManager().preserveBondingStateOnReset(persistent);
+      _ble.securityManager().setSecurityManagerEventHandler(&_sec_handler);
       _ble.securityManager().setPairingRequestAuthorisation(false);
 
-      //_event_queue.call_every(1000, this, &PresentationRemote::onTick);
+      //_event_queue->call_every(1000, this, &PresentationRemote::onTick);
 
-      /* start event loop for processing ble-related events */
-      _bt_ev_thread.start(
-          mbed::callback(&_event_queue, &events::EventQueue::dispatch_forever)
-      );
+      /* ble-related events are processed when the scheduler runs the
+       * PRIO_BLE queue; nothing else to start here */
     }
 
     void nextSlide() {
+      _conn_policy.activity();
       _bt_kbd_svc->_putc(RIGHT_ARROW);
     }
 
     void previousSlide() {
+      _conn_policy.activity();
       _bt_kbd_svc->_putc(LEFT_ARROW);
     }
 
     void blank() {
+      _conn_policy.activity();
       _bt_kbd_svc->printf("B");
     }
 
     void unblank() {
+      _conn_policy.activity();
       _bt_kbd_svc->printf("W");
     }
 
     void nextForHidden() {
+      _conn_policy.activity();
       _bt_kbd_svc->printf("H");
     }
 
+    /** A gesture started (true) or ended (false): a command may follow, so
+     * ask for a short connection interval now */
+    void gestureActive(bool active) {
+      _gesture_active = active;
+      if(active) _conn_policy.activity();
+      refreshMetrics();
+    }
+
+    /** An ADC frame, sampled at 1 / hold of the full rate, for the raw stream */
+    void streamFrame(const uint16_t* ch, uint8_t hold) {
+#if MYOKBD_STREAM
+      if(_bt_stream_svc) _bt_stream_svc->push(ch, hold);
+#endif
+    }
+
+    const ConnectionPolicy::Stats& connectionStats() {
+      return _conn_policy.stats();
+    }
+
+    const Advertiser::Stats& advertisingStats() const {
+      return _advertiser.stats();
+    }
+
+    /** Number of times a host paired (rather than re-encrypted a bond) */
+    uint32_t pairings() const {
+      return _sec_handler.pairings();
+    }
+
   private:
+    /* update the metrics characteristic MYOKBD_METRICS_REFRESH_MS from now,
+     * once whatever report a gesture causes has been written; nothing is
+     * scheduled while the sensor is idle */
+    void refreshMetrics() {
+#if MYOKBD_METRICS
+      if(_metrics_refresh_id || !_bt_metrics_svc) return;
+      _metrics_refresh_id = _sched.queue(PRIO_BLE).call_in(
+          MYOKBD_METRICS_REFRESH_MS, this, &PresentationRemote::onMetricsRefresh);
+#endif
+    }
+
+#if MYOKBD_METRICS
+    void onMetricsRefresh() {
+      _metrics_refresh_id = 0;
+      _bt_metrics_svc->update();
+    }
+#endif
+
+    /* a central recording the raw stream keeps the short interval too */
+    bool isBusy() {
+      return _gesture_active || hidBusy() || streaming();
+    }
+
+    bool hidBusy() {
+      return _bt_kbd_svc && !_bt_kbd_svc->isIdle();
+    }
+
+    bool streaming() {
+#if MYOKBD_STREAM
+      return _bt_stream_svc && _bt_stream_svc->streaming();
+#else
+      return false;
+#endif
+    }
+
+    void onBondedPeers(const ble::whitelist_t& bonded) {
+      _advertiser.setBondedPeers(bonded);
+      if(_adv_waiting_bonds) {
+        _adv_waiting_bonds = false;
+        _advertiser.start();
+      }
+    }
+
     static void scheduleBleEvents(BLE::OnEventsToProcessCallbackContext *context) {
-      _event_queue.call(mbed::Callback<void()>(&context->ble, &BLE::processEvents));
+      _event_queue->call(mbed::Callback<void()>(&context->ble, &BLE::processEvents));
+    }
+
+    /* privacy puts the bonded peers' keys in the controller's resolving list,
+     * so that a bonded host connecting from a resolvable private address
+     * matches the whitelist; true if the controller resolves addresses */
+    bool enablePrivacy() {
+      ble::Gap& gap = _ble.gap();
+      if(!gap.isFeatureSupported(ble::controller_supported_features_t::LL_PRIVACY))
+        return false;
+      ble::peripheral_privacy_configuration_t conf;
+      conf.use_non_resolvable_random_address = false;
+      // a host that is not bonded pairs, as without privacy
+      conf.resolution_strategy =
+        ble::peripheral_privacy_configuration_t::PERFORM_PAIRING_PROCEDURE;
+      return gap.setPeripheralPrivacyConfiguration(&conf) == BLE_ERROR_NONE &&
+             gap.enablePrivacy(true) == BLE_ERROR_NONE;
     }
 
     void onInitComplete(BLEDevice::InitializationCompleteCallbackContext *params) {
@@ -114,25 +245,89 @@ namespace myokbd {
                                                      FW_REV,
                                                      SW_REV);
       _bt_batt_svc = new BatteryService(_ble);
-      _bt_kbd_svc = new btsvc::KeyboardService<KBD_BUF_SIZE>(_ble);
-
-      startAdvertising();
+      _bt_kbd_svc = new btsvc::KeyboardService<KBD_BUF_SIZE>(_ble,
+                                                          _sched.queue(PRIO_INPUT));
+#if MYOKBD_METRICS
+      _bt_metrics_svc = new btsvc::MetricsService(_ble);
+#endif
+#if MYOKBD_STREAM
+      _bt_stream_svc = new btsvc::EmgStreamService<>(_ble, _sched.queue(PRIO_BLE),
+          mbed::callback(this, &PresentationRemote::hidBusy));
+#endif
+
+      setAdvertisingPayload();
+      _advertiser.setAddressResolution(enablePrivacy());
+      // advertising starts once the bond table has been read (onBondedPeers),
+      // so that a bonded host gets directed advertising straight away
+      _adv_waiting_bonds = true;
+      if(_sec_handler.refresh() != BLE_ERROR_NONE) {
+        _adv_waiting_bonds = false;
+        _advertiser.start();
+      }
       _init_done = true;
     }
 
     void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override {
       if(_init_done && event.getStatus() == BLE_ERROR_NONE) {
+        TRACE_EVENT(CONNECT, 0, event.getConnectionInterval().value());
         _bt_kbd_svc->connect(event);
+#if MYOKBD_STREAM
+        _bt_stream_svc->connect(event);
+#endif
+        _conn_policy.connected(event);
+        _advertiser.connected();
+        refreshMetrics();
       }
     }
 
     void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override {
+      TRACE_EVENT(DISCONNECT, 0, event.getReason());
+      _conn_policy.disconnected();
       if(_bt_kbd_svc->isConnected()) {
         _bt_kbd_svc->disconnect(event);
       }
-      _ble.gap().startAdvertising(ble::LEGACY_ADVERTISING_HANDLE);
+#if MYOKBD_STREAM
+      if(_bt_stream_svc) _bt_stream_svc->disconnect();
+#endif
+      _advertiser.disconnected();
+    }
+
+    void onAdvertisingEnd(const ble::AdvertisingEndEvent &event) override {
+      _advertiser.ended(event);
+    }
+
+    void onConnectionParametersUpdateComplete(
+        const ble::ConnectionParametersUpdateCompleteEvent &event) override {
+      _conn_policy.updated(event);
+    }
+
+#if MYOKBD_STREAM
+    void onPhyUpdateComplete(ble_error_t status, ble::connection_handle_t connectionHandle,
+                             ble::phy_t txPhy, ble::phy_t rxPhy) override {
+      if(_bt_stream_svc) _bt_stream_svc->phyUpdated(status, txPhy, rxPhy);
+    }
+
+    void onDataLengthChange(ble::connection_handle_t connectionHandle,
+                            uint16_t txSize, uint16_t rxSize) override {
+      if(_bt_stream_svc) _bt_stream_svc->dataLengthChanged(txSize, rxSize);
+    }
+
+    /* GattServer has one event handler for all services: the events go to
+     * the services that need them */
+    void onAttMtuChange(ble::connection_handle_t connectionHandle,
+                        uint16_t attMtuSize) override {
+      if(_bt_stream_svc) _bt_stream_svc->attMtuChanged(connectionHandle, attMtuSize);
+    }
+
+    void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams &params) override {
+      if(_bt_stream_svc) _bt_stream_svc->updatesEnabled(params);
     }
 
+    void onUpdatesDisabled(const GattUpdatesDisabledCallbackParams &params) override {
+      if(_bt_stream_svc) _bt_stream_svc->updatesDisabled(params);
+    }
+#endif
+
     void onTick(void) {
       /* if(!_bt_kbd_svc->isConnected()) */
         _connected_led = !_connected_led;
@@ -145,12 +340,7 @@ namespace myokbd {
                                     SecurityManager::SecurityCompletionStatus_t status) {
     }
 
-    void startAdvertising() {
-      ble::AdvertisingParameters adv_param(
-          ble::advertising_type_t::CONNECTABLE_UNDIRECTED,
-          ble::adv_interval_t(ble::millisecond_t(200))
-      );
-
+    void setAdvertisingPayload() {
       _adv_data_builder.setFlags();
       _adv_data_builder.setLocalServiceList(
           mbed::make_Span(_uuid_list, 3)
@@ -158,45 +348,38 @@ namespace myokbd {
       _adv_data_builder.setName(_dev_name);
       _adv_data_builder.setAppearance(ble::adv_data_appearance_t::KEYBOARD);
 
-      ble_error_t error = _ble.gap().setAdvertisingParameters(
-          ble::LEGACY_ADVERTISING_HANDLE,
-          adv_param
-      );
-
-      if(error) {
-        return;
-      }
-
-      error = _ble.gap().setAdvertisingPayload(
+      _ble.gap().setAdvertisingPayload(
           ble::LEGACY_ADVERTISING_HANDLE,
           _adv_data_builder.getAdvertisingData()
       );
-
-      if(error) {
-        return;
-      }
-
-      error = _ble.gap().startAdvertising(ble::LEGACY_ADVERTISING_HANDLE);
-
-      if(error) {
-        return;
-      }
     }
 
   private:
     BLEDevice &_ble;
-    static events::EventQueue _event_queue;
-    rtos::Thread _bt_ev_thread;
+    Scheduler &_sched;
+    static events::EventQueue *_event_queue;
 
     const char* _dev_name;
 
     mbed::DigitalOut _connected_led;
     mbed::DigitalOut _err_led;
     bool _init_done;
+    bool _gesture_active;
+    bool _adv_waiting_bonds;
+    ConnectionPolicy _conn_policy;
+    Advertiser _advertiser;
+    MyoSecurityEventHandler _sec_handler;
 
     btsvc::KeyboardService<KBD_BUF_SIZE> *_bt_kbd_svc;
     DeviceInformationService *_bt_devinfo_svc;
     BatteryService *_bt_batt_svc;
+#if MYOKBD_METRICS
+    btsvc::MetricsService *_bt_metrics_svc;
+    int _metrics_refresh_id;
+#endif
+#if MYOKBD_STREAM
+    btsvc::EmgStreamService<> *_bt_stream_svc;
+#endif
     UUID _uuid_list[3];
 
     uint8_t _adv_buffer[ble::LEGACY_ADVERTISING_MAX_SIZE];
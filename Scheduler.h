@@ -0,0 +1,138 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Single-threaded cooperative scheduler with priority classes.
+ *
+ * All application work (sensor processing, gesture/HID reports and BLE stack
+ * events) runs from one thread, through one EventQueue per priority class.
+ * The queues are not dispatched by threads of their own: each is put in
+ * background mode, so that it reports the time to its next event whenever
+ * that changes (from interrupt context too). runOnce() dispatches the
+ * highest-priority class that has work due and otherwise sleeps on an
+ * EventFlags until the earliest deadline, which lets a tickless RTOS idle
+ * (and deep sleep, when nothing holds a deep sleep lock) between samples.
+ *
+ * Dispatch is non-preemptive: once a class is dispatched its due events run
+ * to completion, so the worst-case wait of a sampling event is the longest
+ * run of a lower class' due events, plus the wakeup time.
+ */
+#ifndef _MYOKBD_SCHEDULER_H_
+#define _MYOKBD_SCHEDULER_H_
+
+#include <stdint.h>
+#include <mbed.h>
+
+namespace myokbd {
+
+  enum Priority : uint8_t {
+    PRIO_SAMPLING,    // draining the ADC ring, detection and gestures
+    PRIO_INPUT,       // HID report pump
+    PRIO_BLE,         // BLE stack events and housekeeping
+    N_PRIO
+  };
+
+  class Scheduler {
+    static_assert(N_PRIO == 3, "one queue member per priority class");
+    public:
+     Scheduler(unsigned queue_size = 20 * EVENTS_EVENT_SIZE) :
+      _sampling_queue(queue_size),
+      _input_queue(queue_size),
+      _ble_queue(queue_size),
+      _stop(false),
+      _sleeps(0) {
+       _queues[PRIO_SAMPLING] = &_sampling_queue;
+       _queues[PRIO_INPUT] = &_input_queue;
+       _queues[PRIO_BLE] = &_ble_queue;
+       for(uint8_t p = 0; p < N_PRIO; p++) {
+         _slots[p].sched = this;
+         _slots[p].prio = p;
+         _pending[p] = false;
+         _due_ms[p] = 0;
+         _dispatches[p] = 0;
+         _queues[p]->background(mbed::callback(&_slots[p], &Slot::update));
+       }
+     }
+
+     events::EventQueue& queue(Priority p) { return *_queues[p]; }
+
+     /** Dispatch one priority class that has work due, or sleep until one does */
+     void runOnce() {
+       uint32_t now = (uint32_t)rtos::Kernel::get_ms_count();
+       uint32_t wait = osWaitForever;
+
+       core_util_critical_section_enter();
+       int8_t ready = -1;
+       for(uint8_t p = 0; p < N_PRIO; p++) {
+         if(!_pending[p]) continue;
+         int32_t left = (int32_t)(_due_ms[p] - now);
+         if(left <= 0) {
+           ready = p;
+           break;
+         }
+         if((uint32_t)left < wait) wait = left;
+       }
+       core_util_critical_section_exit();
+
+       if(ready >= 0) {
+         _dispatches[ready]++;
+         _queues[ready]->dispatch(0);
+         return;
+       }
+       _sleeps++;
+       _wake.wait_any(WAKE, wait);
+     }
+
+     void run() {
+       while(!_stop) runOnce();
+     }
+
+     void stop() {
+       _stop = true;
+       _wake.set(WAKE);
+     }
+
+     /* number of times the scheduler went to sleep / dispatched class p */
+     uint32_t sleeps() const { return _sleeps; }
+     uint32_t dispatches(Priority p) const { return _dispatches[p]; }
+
+    private:
+     // background update: ms until the next event of the queue, -1 if none
+     void update(uint8_t p, int ms) {
+       core_util_critical_section_enter();
+       _pending[p] = ms >= 0;
+       _due_ms[p] = (uint32_t)rtos::Kernel::get_ms_count() + (ms > 0 ? ms : 0);
+       core_util_critical_section_exit();
+       _wake.set(WAKE);
+     }
+
+     struct Slot {
+       Scheduler* sched;
+       uint8_t prio;
+       void update(int ms) { sched->update(prio, ms); }
+     };
+
+    private:
+      static const uint32_t WAKE = 1;
+
+      // EventQueue is not copyable: one member per class, indexed by _queues
+      events::EventQueue _sampling_queue;
+      events::EventQueue _input_queue;
+      events::EventQueue _ble_queue;
+      events::EventQueue* _queues[N_PRIO];
+      Slot _slots[N_PRIO];
+      rtos::EventFlags _wake;
+      volatile bool _pending[N_PRIO];
+      volatile uint32_t _due_ms[N_PRIO];
+      uint32_t _dispatches[N_PRIO];
+      volatile bool _stop;
+      uint32_t _sleeps;
+  };
+
+}
+
+#endif /* _MYOKBD_SCHEDULER_H_ */
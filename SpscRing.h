@@ -0,0 +1,105 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Wait-free single-producer/single-consumer ring buffer.
+ *
+ * The producer only writes _head and the consumer only writes _tail, so
+ * neither side needs a lock or to mask interrupts: it is safe to push from
+ * an ISR while a thread pops, or the other way around. Indexes run freely
+ * and are masked on access, hence SIZE must be a power of two.
+ */
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+namespace ldry { namespace util {
+
+  template <typename T, uint32_t SIZE>
+  class SpscRing {
+    static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0,
+                  "SpscRing size must be a power of two");
+    public:
+     SpscRing() : _head(0), _tail(0) { }
+
+     /* ---- producer side ---- */
+
+     bool push(const T& value) {
+       uint32_t h = _head.load(std::memory_order_relaxed);
+       if(h - _tail.load(std::memory_order_acquire) == SIZE) return false;
+       _buf[h & MASK] = value;
+       _head.store(h + 1, std::memory_order_release);
+       return true;
+     }
+
+     /** Push all n values or none; the consumer sees them all at once */
+     bool push(const T* values, size_t n) {
+       uint32_t h = _head.load(std::memory_order_relaxed);
+       if(SIZE - (h - _tail.load(std::memory_order_acquire)) < n) return false;
+       for(size_t i = 0; i < n; i++) _buf[(h + i) & MASK] = values[i];
+       _head.store(h + (uint32_t)n, std::memory_order_release);
+       return true;
+     }
+
+     /* ---- consumer side ---- */
+
+     /** Look at the oldest element without removing it */
+     bool peek(T& value) const {
+       uint32_t t = _tail.load(std::memory_order_relaxed);
+       if(_head.load(std::memory_order_acquire) == t) return false;
+       value = _buf[t & MASK];
+       return true;
+     }
+
+     /** Remove the oldest element; only valid after a successful peek() */
+     void drop() {
+       _tail.store(_tail.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+     }
+
+     bool pop(T& value) {
+       uint32_t t = _tail.load(std::memory_order_relaxed);
+       if(_head.load(std::memory_order_acquire) == t) return false;
+       value = _buf[t & MASK];
+       _tail.store(t + 1, std::memory_order_release);
+       return true;
+     }
+
+     /** Pop up to max elements into out; returns the number popped */
+     size_t pop(T* out, size_t max) {
+       uint32_t t = _tail.load(std::memory_order_relaxed);
+       uint32_t avail = _head.load(std::memory_order_acquire) - t;
+       size_t n = avail < max ? avail : max;
+       for(size_t i = 0; i < n; i++) out[i] = _buf[(t + i) & MASK];
+       _tail.store(t + (uint32_t)n, std::memory_order_release);
+       return n;
+     }
+
+     /* ---- either side ---- */
+
+     uint32_t size() const {
+       return _head.load(std::memory_order_acquire) -
+              _tail.load(std::memory_order_acquire);
+     }
+     bool empty() const { return size() == 0; }
+     bool full() const { return size() == SIZE; }
+     static uint32_t capacity() { return SIZE; }
+
+    private:
+      static const uint32_t MASK = SIZE - 1;
+
+      std::atomic<uint32_t> _head;   // written by the producer only
+      std::atomic<uint32_t> _tail;   // written by the consumer only
+      T _buf[SIZE];
+  };
+
+} }
+
+#endif /* _SPSC_RING_H_ */
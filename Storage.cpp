@@ -0,0 +1,34 @@
+#include "Storage.h"
+
+#include <mbed.h>
+#include "FlashIAPBlockDevice.h"
+#include "LittleFileSystem.h"
+
+namespace myokbd { namespace storage {
+
+  static FlashIAPBlockDevice flash_bd(MYOKBD_STORAGE_ADDR, MYOKBD_STORAGE_SIZE);
+  static mbed::LittleFileSystem fs(MYOKBD_FS_NAME);
+  static bool mounted = false;
+
+  static FlashIAPBlockDevice calib_bd(MYOKBD_CALIB_ADDR, MYOKBD_CALIB_SIZE);
+  static CalibrationStore calib_store(calib_bd);
+  static int calib_state = -1;     // -1: not initialised, 0: unusable, 1: ok
+
+  bool mount() {
+    if(mounted) return true;
+    int err = fs.mount(&flash_bd);
+    if(err) err = fs.reformat(&flash_bd);
+    mounted = (err == 0);
+    return mounted;
+  }
+
+  bool isMounted() {
+    return mounted;
+  }
+
+  CalibrationStore* calibration() {
+    if(calib_state < 0) calib_state = calib_store.init() ? 1 : 0;
+    return calib_state ? &calib_store : NULL;
+  }
+
+} }
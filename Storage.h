@@ -0,0 +1,44 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Persistent storage on the internal flash.
+ *
+ * The top MYOKBD_STORAGE_SIZE bytes of flash (past the sketch) hold a little
+ * filesystem mounted at "/" MYOKBD_FS_NAME; the BLE security database (bonds)
+ * lives there, so that a bonded host reconnects without pairing again after a
+ * reset.
+ *
+ * The detector calibration is kept apart from the filesystem, in its own
+ * MYOKBD_CALIB_SIZE bytes at MYOKBD_CALIB_ADDR (see CalibrationStore.h).
+ */
+#ifndef _MYOKBD_STORAGE_H_
+#define _MYOKBD_STORAGE_H_
+
+#include "config.h"
+#include "CalibrationStore.h"
+
+#define MYOKBD_BOND_DB_PATH "/" MYOKBD_FS_NAME "/bt_sec_db"
+
+namespace myokbd { namespace storage {
+
+  /**
+   * Mount the filesystem, formatting it if it does not mount (first use);
+   * returns false when the flash region cannot be used, in which case bonds
+   * are only kept in RAM.
+   */
+  bool mount();
+
+  bool isMounted();
+
+  /** The calibration store, initialised on first use; NULL if its flash
+   * region cannot be used */
+  CalibrationStore* calibration();
+
+} }
+
+#endif /* _MYOKBD_STORAGE_H_ */
@@ -20,7 +20,121 @@
 #define SW_REV "v0.0.1"
 
 #define SERIAL_DEBUG 1
+
+// Latency probes and counters (see Metrics.h), read through a vendor GATT
+// characteristic (MetricsService.h). Its value is refreshed at most every
+// MYOKBD_METRICS_REFRESH_MS, after commands; 0 compiles the probes out
+#define MYOKBD_METRICS 1
+#define MYOKBD_METRICS_REFRESH_MS 1000
+
+// Event trace (see EventTrace.h): the latest 2^MYOKBD_TRACE_LOG2_RECORDS
+// events (8 bytes each), with every MYOKBD_TRACE_SAMPLE_DIV-th ADC frame
+// among them; dumped on serial on request. 0 compiles the probes out
+#define MYOKBD_TRACE 1
+#define MYOKBD_TRACE_LOG2_RECORDS 10
+#define MYOKBD_TRACE_SAMPLE_DIV 4
+
+// Raw EMG streaming (see EmgStreamService.h): ADC frames, 12 bits a sample,
+// notified on a vendor characteristic while a central subscribes to it. Up to
+// 2^MYOKBD_STREAM_LOG2_RING frames wait for the link; at most
+// MYOKBD_STREAM_MAX_IN_FLIGHT notifications wait in the stack, ahead of any
+// HID report written meanwhile. 0 compiles it out
+#define MYOKBD_STREAM 1
+#define MYOKBD_STREAM_LOG2_RING 9
+#define MYOKBD_STREAM_MAX_IN_FLIGHT 2
+
+// Persistent storage (see Storage.h): the last 64 kB of the 1 MB nRF52840
+// flash, kept clear of the sketch
+#define MYOKBD_FS_NAME "fs"
+#define MYOKBD_STORAGE_ADDR 0xF0000
+#define MYOKBD_STORAGE_SIZE 0x10000
+
+// Detector calibration (see CalibrationStore.h): two flash pages just below
+// the filesystem. The window is saved when the arm first rests after the
+// detector is ready, then at most every MYOKBD_CALIB_SAVE_INTERVAL_MS. Each
+// page holds one snapshot (about 2 * EMG_CHANNELS << EMG_LOG2_LAG bytes)
+#define MYOKBD_CALIB_ADDR 0xEE000
+#define MYOKBD_CALIB_SIZE 0x2000
+#define MYOKBD_CALIB_SAVE_INTERVAL_MS 600000
 #define KBD_BUF_SIZE 128
 #define LED_PWR P1_9
 
+// Connection parameters requested from the central (see ConnectionPolicy.h).
+// Intervals are in units of 1.25 ms and are requested as [x, x + SLACK]: the
+// fast window stays narrow so that the central cannot grant an interval
+// several times longer than asked for; the idle one leaves it room to pick.
+// The supervision timeout is in units of 10 ms and must exceed
+// 2 * (1 + CONN_IDLE_LATENCY) * the idle interval.
+#define CONN_FAST_INTERVAL 6
+#define CONN_IDLE_INTERVAL 24
+#define CONN_IDLE_LATENCY 20
+#define CONN_FAST_SLACK 2
+#define CONN_IDLE_SLACK 12
+#define CONN_SUPERVISION_TIMEOUT 400
+#define CONN_IDLE_AFTER_MS 2000
+
+// EMG acquisition: the ADC is sampled from a timer interrupt and the detector
+// drains the samples in blocks of EMG_BLOCK_SIZE (EMG_BLOCK_SIZE / rate of
+// added latency). The lag window of the detector is 2^EMG_LOG2_LAG samples.
+// EMG_PINS lists one analog pin per channel; with several channels, gestures
+// on each channel map to commands through CommandMap.h
+#define EMG_CHANNELS 1
+#define EMG_PINS { analogPinToPinName(A0) }
+#define EMG_SAMPLE_RATE_HZ 500
+#define EMG_BLOCK_SIZE 4
+#define EMG_LOG2_LAG 10
+#define EMG_LOG2_RING 6
+
+// Onset detection (see PeakDecision.h and host/bench_onset): the decision
+// policy, and the number of samples a contraction onset or end takes to
+// confirm. CUSUM sees strong contractions after a sample or two, but on
+// the recorded traces it flips about twice as often as the z score (its sum
+// restarts after an offset and re-triggers) for no gain in gesture latency,
+// so the z score stays the default
+#define EMG_DECISION ldry::signal::ZScoreDecision
+#define EMG_DEBOUNCE 6
+
+// The sensor's output: 1 for the rectified and smoothed EMG envelope (as the
+// MyoWare board gives), 0 for raw EMG. TkeoDecision needs raw EMG
+#define EMG_INPUT_ENVELOPE 1
+
+// Filter front end (see Filters.h and EmgFrontEnd in PresentationController.h),
+// designed for EMG_SAMPLE_RATE_HZ: a notch at the local mains frequency (60 in
+// the Americas) removes the hum picked up by the electrode leads
+#define EMG_MAINS_HZ 50
+
+// Adaptive sampling: after EMG_IDLE_AFTER_MS without a detected contraction
+// (and with no gesture in progress), the ADC is sampled at
+// EMG_SAMPLE_RATE_HZ / EMG_IDLE_DECIMATION. The first sample deviating more
+// than EMG_WAKE_THRESHOLD standard deviations from the detector's window mean
+// brings it back to the full rate. An EMG_IDLE_DECIMATION of 1 disables this.
+// EMG_WAKE_THRESHOLD must not exceed EMG_THRESHOLD: a sample that can start a
+// contraction has to wake the sampler, so that the onset is confirmed over
+// full-rate samples. A calibrated threshold below it lowers it to match.
+#define EMG_IDLE_DECIMATION 10
+#define EMG_IDLE_AFTER_MS 1000
+#define EMG_WAKE_THRESHOLD 3.0f
+
+// Threshold auto-calibration (see AutoThreshold.h): unless a saved
+// calibration was restored, the first EMG_AUTO_THRESHOLD_SAMPLES samples
+// taken at rest set each channel's detection threshold for
+// EMG_FALSE_TRIGGERS_PER_MIN false triggers per minute. 0 samples disables
+// it (the threshold stays at EMG_THRESHOLD). EMG_INFLUENCE is the weight a
+// sample classified as a contraction has in the detector window
+#define EMG_THRESHOLD 3.0f
+#define EMG_INFLUENCE 0.0f
+#define EMG_AUTO_THRESHOLD_SAMPLES 1024
+#define EMG_FALSE_TRIGGERS_PER_MIN 0.1f
+
+// Gesture engine: shortest contraction that counts as a squeeze, hold time of
+// a long squeeze, longest pause between the squeezes of a double/triple
+// squeeze (only waited for on channels that bind such gestures), and the
+// auto-repeat timing of a held long squeeze. host/tune searches the detector
+// and gesture parameters over recorded traces.
+#define GESTURE_MIN_TAP_MS 125
+#define GESTURE_LONG_MS 550
+#define GESTURE_MULTI_GAP_MS 300
+#define GESTURE_REPEAT_DELAY_MS 700
+#define GESTURE_REPEAT_RATE_HZ 4
+
 #endif
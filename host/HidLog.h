@@ -0,0 +1,67 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Decoding of the HID input reports captured by the host BLE stand-in into
+ * the key presses a connected computer would observe.
+ */
+#ifndef _MYOKBD_HOST_HID_LOG_H_
+#define _MYOKBD_HOST_HID_LOG_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <ble/BLE.h>
+
+namespace myokbd { namespace host {
+
+  const uint8_t USAGE_RIGHT_ARROW = 0x4f;
+  const uint8_t USAGE_LEFT_ARROW = 0x50;
+
+  struct KeyPress {
+    uint64_t t_us;
+    uint8_t usage;
+    uint8_t modifier;
+  };
+
+  /** A key is pressed when its usage appears in a report but was absent from
+   * the previous one; usages within a report are pressed in array order.
+   */
+  inline std::vector<KeyPress> keyPresses(const std::vector<mbed_host::Notification>& log,
+                                          GattAttribute::Handle_t input_report) {
+    std::vector<KeyPress> presses;
+    uint8_t prev[6] = { 0 };
+    for(size_t i = 0; i < log.size(); i++) {
+      const mbed_host::Notification& n = log[i];
+      if(n.handle != input_report || n.data.size() < 8) continue;
+      for(int k = 2; k < 8; k++) {
+        uint8_t u = n.data[k];
+        if(!u) continue;
+        bool held = false;
+        for(int j = 0; j < 6; j++) held |= (prev[j] == u);
+        if(!held) {
+          KeyPress p = { n.t_us, u, n.data[0] };
+          presses.push_back(p);
+        }
+      }
+      for(int k = 0; k < 6; k++) prev[k] = n.data[k + 2];
+    }
+    return presses;
+  }
+
+  /** The input report is the only notifying characteristic written with
+   * 8-byte keyboard reports; use the handle of the first one seen.
+   */
+  inline GattAttribute::Handle_t inputReportHandle(const std::vector<mbed_host::Notification>& log) {
+    for(size_t i = 0; i < log.size(); i++)
+      if(log[i].data.size() == 8) return log[i].handle;
+    return 0;
+  }
+
+} }
+
+#endif /* _MYOKBD_HOST_HID_LOG_H_ */
@@ -0,0 +1,176 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Recorded ADC traces for host-side replay.
+ *
+ * Text format, one sample per line:
+ *
+ *   # rate_hz=40
+ *   <read_u16 value>[,<label>]
+ *
+ * Lines starting with '#' are comments, except for "key=value" headers.
+ * The optional label is the ground truth for that sample: 0 while the muscle
+ * is relaxed, otherwise the Label of the gesture being performed.
+ *
+ * loadTrace() also reads the binary files of TraceFile.h (by their magic),
+ * taking one of their channels.
+ */
+#ifndef _MYOKBD_HOST_TRACE_H_
+#define _MYOKBD_HOST_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <mbed.h>
+
+#include "TraceFile.h"
+
+namespace myokbd { namespace host {
+
+  enum Label {
+    LABEL_REST = 0,
+    LABEL_PREV = 1,   // short squeeze
+    LABEL_NEXT = 2,   // long squeeze
+  };
+
+  struct Trace {
+    Trace() : rate_hz(40) { }
+
+    uint32_t rate_hz;
+    std::vector<uint16_t> samples;
+    std::vector<uint8_t> labels;
+
+    bool labelled() const { return !labels.empty(); }
+    size_t size() const { return samples.size(); }
+  };
+
+  /** A labelled contraction, as sample indexes [onset, offset) */
+  struct Segment {
+    size_t onset;
+    size_t offset;
+    uint8_t label;
+  };
+
+  inline bool loadTraceFile(const char* path, Trace& t, uint8_t channel) {
+    TraceFileReader r;
+    if(!r.open(path) || channel >= r.channels()) return false;
+    size_t base = t.samples.size();
+    t.rate_hz = r.rateHz();
+    t.samples.resize(base + r.frames());
+    if(r.labelled()) t.labels.resize(base + r.frames());
+    for(uint32_t k = 0; k < r.chunks(); k++) {
+      size_t at = base + r.chunkFirstFrame(k);
+      if(!r.decode(k, channel, &t.samples[at]) ||
+         (r.labelled() && !r.decodeLabels(k, &t.labels[at])))
+        return false;
+    }
+    return true;
+  }
+
+  inline bool loadTrace(const char* path, Trace& t, uint8_t channel = 0) {
+    FILE* f = fopen(path, "r");
+    if(!f) return false;
+    char magic[4];
+    if(fread(magic, 1, 4, f) == 4 && !memcmp(magic, "MKTF", 4)) {
+      fclose(f);
+      return loadTraceFile(path, t, channel);
+    }
+    rewind(f);
+
+    char line[128];
+    bool has_labels = false;
+    while(fgets(line, sizeof(line), f)) {
+      if(line[0] == '#') {
+        const char* p = strstr(line, "rate_hz=");
+        if(p) t.rate_hz = (uint32_t)atoi(p + 8);
+        continue;
+      }
+      char* end;
+      long v = strtol(line, &end, 10);
+      if(end == line) continue;
+      uint8_t label = 0;
+      if(*end == ',') {
+        label = (uint8_t)atoi(end + 1);
+        has_labels = true;
+      }
+      t.samples.push_back((uint16_t)v);
+      t.labels.push_back(label);
+    }
+    fclose(f);
+    if(!has_labels) t.labels.clear();
+    return true;
+  }
+
+  inline std::vector<Segment> segments(const Trace& t) {
+    std::vector<Segment> segs;
+    if(!t.labelled()) return segs;
+    for(size_t i = 0; i < t.labels.size(); i++) {
+      if(t.labels[i] == LABEL_REST) continue;
+      if(segs.empty() || segs.back().offset != i ||
+         segs.back().label != t.labels[i]) {
+        Segment s = { i, i + 1, t.labels[i] };
+        segs.push_back(s);
+      } else {
+        segs.back().offset = i + 1;
+      }
+    }
+    return segs;
+  }
+
+  /** Feeds a trace to an AnalogIn as a signal in time: a read returns the
+   * sample recorded at the current virtual time (the first read gets sample 0
+   * and samples are period_us apart), so sampling below the trace rate skips
+   * samples rather than slowing the signal down. After the trace is exhausted
+   * the last sample is held and the simulation is asked to stop once drain_ms
+   * have passed, so that queued HID reports still get delivered.
+   */
+  class ReplaySource : public mbed_host::AnalogSource {
+    public:
+      ReplaySource(const Trace& t, uint32_t rate_hz, uint32_t drain_ms = 1000) :
+        _trace(t), _period_us(1000000 / rate_hz), _start_us(0), _pos(0),
+        _reads(0), _drain_ms(drain_ms), _stop_id(0) { }
+
+      uint16_t read_u16() override {
+        mbed_host::Sim& s = mbed_host::sim();
+        if(_reads++ == 0) _start_us = s.now_us();
+        size_t i = (size_t)((s.now_us() - _start_us + _period_us / 2) / _period_us);
+        if(i < _trace.size()) {
+          _pos = i + 1;
+          return _trace.samples[i];
+        }
+        _pos = _trace.size();
+        if(!_stop_id) {
+          _stop_id = s.schedule(NULL, s.now_us() + (uint64_t)_drain_ms * 1000, 0,
+                                []() { mbed_host::sim().requestStop(); });
+        }
+        return _trace.size() ? _trace.samples.back() : 0;
+      }
+
+      /* trace samples whose time has been reached */
+      size_t consumed() const { return _pos; }
+      /* ADC conversions, ie. read_u16() calls */
+      uint64_t reads() const { return _reads; }
+      /* virtual time (us) of sample i */
+      uint64_t readTime(size_t i) const { return _start_us + (uint64_t)i * _period_us; }
+
+    private:
+      const Trace& _trace;
+      uint64_t _period_us;
+      uint64_t _start_us;
+      size_t _pos;
+      uint64_t _reads;
+      uint32_t _drain_ms;
+      int _stop_id;
+  };
+
+} }
+
+#endif /* _MYOKBD_HOST_TRACE_H_ */
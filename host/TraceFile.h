@@ -0,0 +1,453 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Binary trace files, for recordings too long to keep as text (hours of
+ * multi-channel EMG at 1 kHz).
+ *
+ * Layout, all little-endian:
+ *  - TraceFileHeader: sample rate, channels, ADC resolution, whether there
+ *    are labels, frames per chunk, and where the chunk index is;
+ *  - chunks of up to chunk_frames frames, each independently decodable: a
+ *    TraceChunkHeader, the offset of every channel's data in the payload,
+ *    then, per channel, the samples as zigzag-varint deltas (the first one
+ *    from 0), and the labels as (run length varint, label) pairs;
+ *  - the index: (first frame, file offset) of every chunk, for seeking.
+ *
+ * Samples are given and returned in read_u16 scale; adc_bits < 16 stores
+ * only the top adc_bits of each (lossy unless the low bits are redundant)
+ * and reads them back with the low bits replicated from the top ones, as
+ * mbed scales conversions. A 16-bit trace is stored exactly.
+ *
+ * TraceWriter appends frames and writes a chunk whenever one is full; the
+ * header is completed on close(). TraceFileReader maps the file and decodes
+ * from the mapping straight into the caller's buffers: a Cursor yields one
+ * channel's samples in blocks of any size, as PeakDetection::addBlock()
+ * takes them.
+ */
+#ifndef _MYOKBD_HOST_TRACE_FILE_H_
+#define _MYOKBD_HOST_TRACE_FILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+namespace myokbd { namespace host {
+
+  struct TraceFileHeader {
+    char magic[4];            // "MKTF"
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t rate_hz;
+    uint8_t n_ch;
+    uint8_t adc_bits;
+    uint8_t flags;            // TRACE_FILE_LABELLED
+    uint8_t reserved;
+    uint32_t chunk_frames;
+    uint32_t n_chunks;
+    uint64_t n_frames;
+    uint64_t index_offset;
+  };
+
+  struct TraceChunkHeader {
+    char magic[4];            // "MKTC"
+    uint32_t n_frames;
+    uint64_t first_frame;
+    uint32_t size;            // payload bytes, after the channel offsets
+    uint32_t labels;          // offset of the labels in the payload
+  };
+
+  struct TraceIndexEntry {
+    uint64_t first_frame;
+    uint64_t offset;
+  };
+
+  const uint16_t TRACE_FILE_VERSION = 1;
+  const uint8_t TRACE_FILE_LABELLED = 0x01;
+  const uint8_t TRACE_FILE_MAX_CH = 16;
+
+  namespace varint {
+
+    inline uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+    inline int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+    inline void put(std::vector<uint8_t>& out, uint32_t v) {
+      while(v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+      }
+      out.push_back((uint8_t)v);
+    }
+
+    /* NULL if the value runs past end (or is longer than 5 bytes) */
+    inline const uint8_t* get(const uint8_t* p, const uint8_t* end, uint32_t& v) {
+      if(end - p >= 5) {
+        // no bounds to check within the value; most deltas take 1 or 2 bytes
+        uint32_t b = *p++;
+        v = b & 0x7f;
+        if(!(b & 0x80)) return p;
+        b = *p++;
+        v |= (b & 0x7f) << 7;
+        if(!(b & 0x80)) return p;
+        b = *p++;
+        v |= (b & 0x7f) << 14;
+        if(!(b & 0x80)) return p;
+        b = *p++;
+        v |= (b & 0x7f) << 21;
+        if(!(b & 0x80)) return p;
+        b = *p++;
+        v |= b << 28;
+        return b & 0xf0 ? NULL : p;
+      }
+      v = 0;
+      for(unsigned shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) return p;
+      }
+      return NULL;
+    }
+
+  }
+
+  /** Streaming writer; at most chunk_frames frames are held in memory */
+  class TraceWriter {
+    public:
+      TraceWriter() : _f(NULL) { }
+      ~TraceWriter() { close(); }
+
+      bool open(const char* path, uint32_t rate_hz, uint8_t n_ch, bool labelled,
+                uint8_t adc_bits = 16, uint32_t chunk_frames = 4096) {
+        if(_f || !n_ch || n_ch > TRACE_FILE_MAX_CH || !adc_bits || adc_bits > 16 ||
+           !chunk_frames)
+          return false;
+        _f = fopen(path, "wb");
+        if(!_f) return false;
+        memset(&_h, 0, sizeof(_h));
+        memcpy(_h.magic, "MKTF", 4);
+        _h.version = TRACE_FILE_VERSION;
+        _h.header_size = sizeof(_h);
+        _h.rate_hz = rate_hz;
+        _h.n_ch = n_ch;
+        _h.adc_bits = adc_bits;
+        _h.flags = labelled ? TRACE_FILE_LABELLED : 0;
+        _h.chunk_frames = chunk_frames;
+        _offset = sizeof(_h);
+        _index.clear();
+        _samples.clear();
+        _labels.clear();
+        _ok = fwrite(&_h, sizeof(_h), 1, _f) == 1;
+        return _ok;
+      }
+
+      /** Append one frame of n_ch samples; label is ignored if unlabelled */
+      bool add(const uint16_t* frame, uint8_t label = 0) {
+        if(!_f) return false;
+        _samples.insert(_samples.end(), frame, frame + _h.n_ch);
+        if(_h.flags & TRACE_FILE_LABELLED) _labels.push_back(label);
+        if(_samples.size() == (size_t)_h.chunk_frames * _h.n_ch) flush();
+        return _ok;
+      }
+
+      /** Write what is left, the index and the final header */
+      bool close() {
+        if(!_f) return false;
+        flush();
+        _h.n_chunks = (uint32_t)_index.size();
+        _h.index_offset = _offset;
+        if(!_index.empty() &&
+           fwrite(&_index[0], sizeof(TraceIndexEntry), _index.size(), _f) != _index.size())
+          _ok = false;
+        _offset += sizeof(TraceIndexEntry) * _index.size();
+        if(fseek(_f, 0, SEEK_SET) || fwrite(&_h, sizeof(_h), 1, _f) != 1) _ok = false;
+        if(fclose(_f)) _ok = false;
+        _f = NULL;
+        return _ok;
+      }
+
+      uint64_t frames() const { return _h.n_frames + _samples.size() / _h.n_ch; }
+      /* bytes written so far */
+      uint64_t bytes() const { return _offset; }
+
+    private:
+      void flush() {
+        uint32_t n = (uint32_t)(_samples.size() / _h.n_ch);
+        if(!n) return;
+        uint8_t shift = 16 - _h.adc_bits;
+        std::vector<uint8_t>& p = _payload;
+        p.clear();
+        uint32_t ch_offset[TRACE_FILE_MAX_CH];
+        for(uint8_t c = 0; c < _h.n_ch; c++) {
+          ch_offset[c] = (uint32_t)p.size();
+          int32_t prev = 0;
+          for(uint32_t i = 0; i < n; i++) {
+            int32_t x = _samples[(size_t)i * _h.n_ch + c] >> shift;
+            varint::put(p, varint::zigzag(x - prev));
+            prev = x;
+          }
+        }
+        uint32_t labels = (uint32_t)p.size();
+        for(uint32_t i = 0; i < _labels.size();) {
+          uint32_t run = 1;
+          while(i + run < _labels.size() && _labels[i + run] == _labels[i]) run++;
+          varint::put(p, run);
+          p.push_back(_labels[i]);
+          i += run;
+        }
+
+        TraceChunkHeader ch;
+        memcpy(ch.magic, "MKTC", 4);
+        ch.n_frames = n;
+        ch.first_frame = _h.n_frames;
+        ch.size = (uint32_t)p.size();
+        ch.labels = labels;
+        TraceIndexEntry e = { _h.n_frames, _offset };
+        _index.push_back(e);
+        if(fwrite(&ch, sizeof(ch), 1, _f) != 1 ||
+           fwrite(ch_offset, sizeof(uint32_t), _h.n_ch, _f) != _h.n_ch ||
+           (!p.empty() && fwrite(&p[0], 1, p.size(), _f) != p.size()))
+          _ok = false;
+        _offset += sizeof(ch) + sizeof(uint32_t) * _h.n_ch + p.size();
+        _h.n_frames += n;
+        _samples.clear();
+        _labels.clear();
+      }
+
+      FILE* _f;
+      bool _ok;
+      TraceFileHeader _h;
+      uint64_t _offset;
+      std::vector<TraceIndexEntry> _index;
+      std::vector<uint16_t> _samples;     // the chunk being filled, interleaved
+      std::vector<uint8_t> _labels;
+      std::vector<uint8_t> _payload;
+  };
+
+  /** Read-only view of a trace file, mapped in memory */
+  class TraceFileReader {
+    public:
+      TraceFileReader() : _base(NULL), _size(0), _h(NULL), _index(NULL) { }
+      ~TraceFileReader() { close(); }
+
+      /** Map path and check its header, index and chunk headers */
+      bool open(const char* path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) || (size_t)st.st_size < sizeof(TraceFileHeader)) {
+          ::close(fd);
+          return false;
+        }
+        void* m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(m == MAP_FAILED) return false;
+        _base = (const uint8_t*)m;
+        _size = (size_t)st.st_size;
+        madvise(m, _size, MADV_SEQUENTIAL);
+        if(!validate()) {
+          close();
+          return false;
+        }
+        return true;
+      }
+
+      void close() {
+        if(_base) munmap((void*)_base, _size);
+        _base = NULL;
+        _size = 0;
+        _h = NULL;
+        _index = NULL;
+      }
+
+      uint32_t rateHz() const { return _h->rate_hz; }
+      uint8_t channels() const { return _h->n_ch; }
+      uint8_t adcBits() const { return _h->adc_bits; }
+      bool labelled() const { return _h->flags & TRACE_FILE_LABELLED; }
+      uint64_t frames() const { return _h->n_frames; }
+      uint32_t chunks() const { return _h->n_chunks; }
+      size_t fileSize() const { return _size; }
+
+      uint64_t chunkFirstFrame(uint32_t k) const { return _index[k].first_frame; }
+      uint32_t chunkFrames(uint32_t k) const { return chunk(k)->n_frames; }
+
+      /** The chunk holding frame (frame < frames()) */
+      uint32_t chunkOf(uint64_t frame) const {
+        uint32_t lo = 0, hi = _h->n_chunks;
+        while(hi - lo > 1) {
+          uint32_t mid = (lo + hi) / 2;
+          if(_index[mid].first_frame <= frame) lo = mid;
+          else hi = mid;
+        }
+        return lo;
+      }
+
+      /** Decode channel ch of chunk k into out (chunkFrames(k) samples) */
+      bool decode(uint32_t k, uint8_t ch, uint16_t* out) const {
+        const uint8_t* p;
+        const uint8_t* end;
+        channelData(k, ch, p, end);
+        uint32_t n = chunk(k)->n_frames;
+        uint8_t bits = _h->adc_bits;
+        int32_t x = 0;
+        for(uint32_t i = 0; i < n; i++) {
+          uint32_t v;
+          if(!(p = varint::get(p, end, v))) return false;
+          x += varint::unzigzag(v);
+          out[i] = scale(x, bits);
+        }
+        return true;
+      }
+
+      /** Decode the labels of chunk k into out (chunkFrames(k) of them) */
+      bool decodeLabels(uint32_t k, uint8_t* out) const {
+        const TraceChunkHeader* c = chunk(k);
+        if(!labelled()) {
+          memset(out, 0, c->n_frames);
+          return true;
+        }
+        const uint8_t* p = payload(k) + c->labels;
+        const uint8_t* end = payload(k) + c->size;
+        for(uint32_t i = 0; i < c->n_frames;) {
+          uint32_t run;
+          if(!(p = varint::get(p, end, run)) || p >= end || run > c->n_frames - i)
+            return false;
+          memset(out + i, *p++, run);
+          i += run;
+        }
+        return true;
+      }
+
+      /** A stored value back in read_u16 scale */
+      static uint16_t scale(int32_t v, uint8_t bits) {
+        if(bits == 16) return (uint16_t)v;
+        uint16_t x = (uint16_t)((uint32_t)v << (16 - bits));
+        return (uint16_t)(x | x >> bits);
+      }
+
+      /**
+       * Sequential reader of one channel, decoding from the mapping into the
+       * caller's buffer, across chunks.
+       */
+      class Cursor {
+        public:
+          Cursor(const TraceFileReader& r, uint8_t ch, uint64_t from = 0) :
+            _r(r), _ch(ch), _bits(r.adcBits()), _chunk(0), _left(0), _p(NULL),
+            _end(NULL), _x(0) {
+            if(from >= r.frames()) {
+              _chunk = r.chunks();
+              return;
+            }
+            _chunk = r.chunkOf(from);
+            load();
+            uint16_t skip[256];
+            for(uint64_t n = from - r.chunkFirstFrame(_chunk); n > 0;) {
+              size_t k = read(skip, n < 256 ? (size_t)n : 256);
+              if(!k) break;
+              n -= k;
+            }
+          }
+
+          /** Up to max samples into out; 0 at the end (or on a corrupt chunk) */
+          size_t read(uint16_t* out, size_t max) {
+            size_t n = 0;
+            while(n < max) {
+              if(!_left) {
+                if(_chunk >= _r.chunks() || ++_chunk >= _r.chunks()) break;
+                load();
+                continue;
+              }
+              uint32_t v;
+              if(!(_p = varint::get(_p, _end, v))) {
+                _left = 0;
+                _chunk = _r.chunks();
+                break;
+              }
+              _x += varint::unzigzag(v);
+              out[n++] = scale(_x, _bits);
+              _left--;
+            }
+            return n;
+          }
+
+        private:
+          void load() {
+            _r.channelData(_chunk, _ch, _p, _end);
+            _left = _r.chunkFrames(_chunk);
+            _x = 0;
+          }
+
+          const TraceFileReader& _r;
+          uint8_t _ch;
+          uint8_t _bits;
+          uint32_t _chunk;
+          uint32_t _left;     // samples of the chunk still to decode
+          const uint8_t* _p;
+          const uint8_t* _end;
+          int32_t _x;
+      };
+
+    private:
+      bool validate() {
+        _h = (const TraceFileHeader*)_base;
+        if(memcmp(_h->magic, "MKTF", 4) || _h->version != TRACE_FILE_VERSION ||
+           _h->header_size != sizeof(TraceFileHeader) || !_h->n_ch ||
+           _h->n_ch > TRACE_FILE_MAX_CH || !_h->adc_bits || _h->adc_bits > 16)
+          return false;
+        if(_h->index_offset > _size ||
+           (_size - _h->index_offset) / sizeof(TraceIndexEntry) < _h->n_chunks)
+          return false;
+        _index = (const TraceIndexEntry*)(_base + _h->index_offset);
+        uint64_t frames = 0;
+        for(uint32_t k = 0; k < _h->n_chunks; k++) {
+          uint64_t off = _index[k].offset;
+          size_t hdr = sizeof(TraceChunkHeader) + sizeof(uint32_t) * _h->n_ch;
+          if(off + hdr > _h->index_offset) return false;
+          const TraceChunkHeader* c = chunk(k);
+          if(memcmp(c->magic, "MKTC", 4) || c->first_frame != frames ||
+             _index[k].first_frame != frames || !c->n_frames ||
+             off + hdr + c->size > _h->index_offset || c->labels > c->size)
+            return false;
+          const uint32_t* ch_offset = (const uint32_t*)(c + 1);
+          for(uint8_t ch = 0; ch < _h->n_ch; ch++)
+            if(ch_offset[ch] > c->labels) return false;
+          frames += c->n_frames;
+        }
+        return frames == _h->n_frames;
+      }
+
+      const TraceChunkHeader* chunk(uint32_t k) const {
+        return (const TraceChunkHeader*)(_base + _index[k].offset);
+      }
+
+      const uint8_t* payload(uint32_t k) const {
+        return (const uint8_t*)chunk(k) + sizeof(TraceChunkHeader) +
+               sizeof(uint32_t) * _h->n_ch;
+      }
+
+      /* bytes of channel ch in chunk k */
+      void channelData(uint32_t k, uint8_t ch, const uint8_t*& p, const uint8_t*& end) const {
+        const TraceChunkHeader* c = chunk(k);
+        const uint32_t* ch_offset = (const uint32_t*)(c + 1);
+        p = payload(k) + ch_offset[ch];
+        end = payload(k) + (ch + 1 < _h->n_ch ? ch_offset[ch + 1] : c->labels);
+      }
+
+      const uint8_t* _base;
+      size_t _size;
+      const TraceFileHeader* _h;
+      const TraceIndexEntry* _index;
+  };
+
+} }
+
+#endif /* _MYOKBD_HOST_TRACE_FILE_H_ */
@@ -0,0 +1,129 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Work-stealing thread pool for the host tools, for batches of independent
+ * tasks of uneven cost (e.g. one configuration over one trace).
+ *
+ * run(n, f) calls f(i) once for every i in [0, n). The indexes are dealt in
+ * contiguous ranges, one per worker, into per-worker deques; a worker takes
+ * from the back of its own and, once it is empty, steals from the front of
+ * the others', so neighbouring tasks stay on one worker until the load needs
+ * rebalancing. Tasks are expected to take well over a microsecond: each
+ * deque is guarded by its own mutex, which is only ever contended by a
+ * steal.
+ */
+#ifndef _MYOKBD_HOST_WORK_STEALING_POOL_H_
+#define _MYOKBD_HOST_WORK_STEALING_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace myokbd { namespace host {
+
+  class WorkStealingPool {
+    public:
+      struct WorkerStats {
+        size_t tasks;       // tasks run
+        size_t stolen;      // of which taken from another worker
+      };
+
+      /** threads = 0 uses one per hardware thread */
+      explicit WorkStealingPool(unsigned threads = 0) :
+        _threads(threads ? threads : hardwareThreads()) { }
+
+      static unsigned hardwareThreads() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+      }
+
+      unsigned threads() const { return _threads; }
+
+      /** Run f(i) for i in [0, n) on all workers; returns once all are done */
+      template <typename F>
+      void run(size_t n, F f) {
+        std::vector<Worker> workers(_threads);
+        for(unsigned w = 0; w < _threads; w++) {
+          size_t lo = n * w / _threads, hi = n * (w + 1) / _threads;
+          for(size_t i = lo; i < hi; i++) workers[w].tasks.push_back(i);
+        }
+        std::atomic<size_t> left(n);
+        std::vector<std::thread> pool;
+        for(unsigned w = 1; w < _threads; w++)
+          pool.emplace_back([&, w]() { work(workers, w, left, f); });
+        work(workers, 0, left, f);
+        for(size_t i = 0; i < pool.size(); i++) pool[i].join();
+        _stats.resize(_threads);
+        for(unsigned w = 0; w < _threads; w++) _stats[w] = workers[w].stats;
+      }
+
+      /* per worker, for the latest run() */
+      const std::vector<WorkerStats>& stats() const { return _stats; }
+
+    private:
+      struct Worker {
+        Worker() { stats.tasks = stats.stolen = 0; }
+        std::mutex lock;
+        std::deque<size_t> tasks;
+        WorkerStats stats;
+        char pad[64];       // keeps the stats off the next worker's lock line
+      };
+
+      template <typename F>
+      void work(std::vector<Worker>& workers, unsigned self, std::atomic<size_t>& left,
+                F& f) {
+        Worker& me = workers[self];
+        while(left.load(std::memory_order_acquire)) {
+          size_t i;
+          bool stolen = false;
+          if(!pop(me, i)) {
+            if(!steal(workers, self, i)) {
+              std::this_thread::yield();
+              continue;
+            }
+            stolen = true;
+          }
+          f(i);
+          me.stats.tasks++;
+          me.stats.stolen += stolen;
+          left.fetch_sub(1, std::memory_order_acq_rel);
+        }
+      }
+
+      static bool pop(Worker& w, size_t& i) {
+        std::lock_guard<std::mutex> g(w.lock);
+        if(w.tasks.empty()) return false;
+        i = w.tasks.back();
+        w.tasks.pop_back();
+        return true;
+      }
+
+      /* from the front of the next worker with tasks, round from self */
+      bool steal(std::vector<Worker>& workers, unsigned self, size_t& i) {
+        for(unsigned k = 1; k < _threads; k++) {
+          Worker& v = workers[(self + k) % _threads];
+          std::lock_guard<std::mutex> g(v.lock);
+          if(v.tasks.empty()) continue;
+          i = v.tasks.front();
+          v.tasks.pop_front();
+          return true;
+        }
+        return false;
+      }
+
+      unsigned _threads;
+      std::vector<WorkerStats> _stats;
+  };
+
+} }
+
+#endif /* _MYOKBD_HOST_WORK_STEALING_POOL_H_ */
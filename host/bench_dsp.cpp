@@ -0,0 +1,269 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Filter front end benchmark (Filters.h).
+ *
+ * Times each stage of a Pipeline on its own (fed the previous stage's
+ * output) and the fused pipeline, in cycles (the x86 time stamp counter) and
+ * ns per input sample. For labelled signals, reports how well the output
+ * separates contractions from rest: (mean in contractions - mean at rest) /
+ * standard deviation at rest.
+ *
+ * Without trace arguments, a raw EMG signal is generated at 2 kHz (-s
+ * seconds, -S seed): a mid-scale offset, noise bursts for contractions,
+ * mains hum of amplitude -m and slow motion artifacts. It is run through a
+ * raw EMG front end (notch, 20-450 Hz band-pass, rectifier, RMS envelope,
+ * CIC decimation to 500 Hz), and through offset removal and the envelope
+ * alone for comparison.
+ *
+ * Traces (envelope traces, as read by replay) are run through the sketch's
+ * EmgFrontEnd, which is designed for EMG_SAMPLE_RATE_HZ.
+ *
+ * usage: bench_dsp [-s seconds] [-S seed] [-m mains] [trace.txt ...]
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "config.h"
+#include "Filters.h"
+#include "PresentationController.h"
+
+#include "Trace.h"
+
+using namespace ldry::signal;
+using namespace myokbd::host;
+
+namespace {
+
+  const uint32_t RawRate = 2000;
+
+  typedef Pipeline<Notch<EMG_MAINS_HZ, RawRate>, BiquadBandpass<20, 450, RawRate>,
+                   Rectify, RmsEnvelope<6>, CicDecimator<2> > RawFrontEnd;
+  const char* RawFrontEndNames[] = {
+    "notch", "band-pass 20-450", "rectify", "RMS envelope (64)", "CIC decimate 4"
+  };
+
+  typedef Pipeline<Highpass<1, RawRate>, Rectify, RmsEnvelope<6>,
+                   CicDecimator<2> > OffsetOnly;
+  const char* OffsetOnlyNames[] = {
+    "high-pass 1 Hz", "rectify", "RMS envelope (64)", "CIC decimate 4"
+  };
+
+  const char* EmgFrontEndNames[] = { "notch" };
+
+  uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  struct Timing {
+    double cycles;    // per input sample
+    double ns;
+  };
+
+  /* run a fresh STAGE over in (best of 5) into out */
+  template <typename STAGE>
+  Timing run(const std::vector<int32_t>& in, std::vector<int32_t>& out) {
+    Timing best = { 1e30, 1e30 };
+    out.resize(in.size());
+    size_t n = 0;
+    for(int rep = 0; rep < 5; rep++) {
+      STAGE s;
+      if(!in.empty()) s.prime(in[0]);
+      n = 0;
+      auto t0 = std::chrono::steady_clock::now();
+      uint64_t c0 = cycles();
+      for(size_t i = 0; i < in.size(); i++) {
+        int32_t x = in[i];
+        if(s.step(x)) out[n++] = x;
+      }
+      uint64_t c = cycles() - c0;
+      double ns = std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - t0).count();
+      if(ns < best.ns) best.ns = ns;
+      if(c < best.cycles) best.cycles = (double)c;
+    }
+    out.resize(n);
+    if(!in.empty()) {
+      best.cycles /= in.size();
+      best.ns /= in.size();
+    }
+    return best;
+  }
+
+  /* time each stage of a Pipeline on the previous one's output */
+  template <typename... S>
+  struct Stages;
+
+  template <>
+  struct Stages<> {
+    static void time(const std::vector<int32_t>&, std::vector<Timing>&) { }
+  };
+
+  template <typename HEAD, typename... TAIL>
+  struct Stages<HEAD, TAIL...> {
+    static void time(const std::vector<int32_t>& in, std::vector<Timing>& out) {
+      std::vector<int32_t> next;
+      out.push_back(run<HEAD>(in, next));
+      Stages<TAIL...>::time(next, out);
+    }
+  };
+
+  template <typename P>
+  struct StagesOf;
+
+  template <typename... S>
+  struct StagesOf<Pipeline<S...> > {
+    typedef Stages<S...> type;
+  };
+
+  /* (mean in contractions - mean at rest) / rest std dev, skipping the first
+   * second; labels[i * decimation] is the label of output sample i */
+  double separation(const std::vector<int32_t>& out, const std::vector<uint8_t>& labels,
+                    size_t decimation, size_t skip) {
+    double sum[2] = { 0, 0 }, sum2 = 0;
+    size_t n[2] = { 0, 0 };
+    for(size_t i = skip; i < out.size() && i * decimation < labels.size(); i++) {
+      int k = labels[i * decimation] != LABEL_REST;
+      sum[k] += out[i];
+      n[k]++;
+      if(!k) sum2 += (double)out[i] * out[i];
+    }
+    if(!n[0] || !n[1]) return 0;
+    double rest = sum[0] / n[0];
+    double sd = sqrt(sum2 / n[0] - rest * rest);
+    return sd > 0 ? (sum[1] / n[1] - rest) / sd : 0;
+  }
+
+  template <typename P>
+  void bench(const char* what, const char* const* names, const std::vector<int32_t>& in,
+             const std::vector<uint8_t>& labels, uint32_t rate_hz) {
+    std::vector<Timing> stages;
+    StagesOf<P>::type::time(in, stages);
+    std::vector<int32_t> out;
+    Timing fused = run<P>(in, out);
+
+    printf("%s (%zu samples @ %u Hz in, %u Hz out):\n", what, in.size(), rate_hz,
+           rate_hz / P::DECIMATION);
+    double sum_c = 0, sum_ns = 0;
+    for(size_t s = 0; s < stages.size(); s++) {
+      printf("  %-20s %7.2f cycles/sample %6.2f ns/sample\n", names[s],
+             stages[s].cycles, stages[s].ns);
+      sum_c += stages[s].cycles;
+      sum_ns += stages[s].ns;
+    }
+    if(stages.size() > 1)
+      printf("  %-20s %7.2f cycles/sample %6.2f ns/sample\n", "stages, summed", sum_c, sum_ns);
+    printf("  %-20s %7.2f cycles/sample %6.2f ns/sample\n", "fused pipeline",
+           fused.cycles, fused.ns);
+    if(!labels.empty())
+      printf("  separation: %.2f rest standard deviations\n",
+             separation(out, labels, P::DECIMATION, rate_hz / P::DECIMATION));
+  }
+
+  /* raw EMG: what the electrodes see before an envelope detector */
+  void rawEmg(double seconds, unsigned seed, double mains,
+              std::vector<int32_t>& s, std::vector<uint8_t>& labels) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    size_t n = (size_t)(seconds * RawRate);
+    double dt = 1.0 / RawRate;
+    s.resize(n);
+    labels.resize(n);
+    double next_onset = 2.0, end = -1, amp = 0;
+    double next_motion = 3.0, motion_end = -1, motion_amp = 0, motion_hz = 0;
+    for(size_t i = 0; i < n; i++) {
+      double t = i * dt;
+      if(end < 0 && t >= next_onset) {
+        end = t + 0.2 + 0.8 * uni(rng);
+        amp = 1500 + 3000 * uni(rng);
+      }
+      if(end >= 0 && t >= end) {
+        end = -1;
+        next_onset = t + 1.0 + 2.0 * uni(rng);
+      }
+      if(motion_end < 0 && t >= next_motion) {
+        motion_end = t + 0.3 + 0.5 * uni(rng);
+        motion_amp = 2000 + 4000 * uni(rng);
+        motion_hz = 1 + 3 * uni(rng);
+      }
+      double motion = 0;
+      if(motion_end >= 0) {
+        motion = motion_amp * sin(2 * M_PI * motion_hz * (motion_end - t));
+        if(t >= motion_end) {
+          motion_end = -1;
+          next_motion = t + 2.0 + 4.0 * uni(rng);
+        }
+      }
+      double v = 32768 + 150 * gauss(rng) + (end >= 0 ? amp * gauss(rng) : 0) +
+                 mains * sin(2 * M_PI * 50 * t) + motion;
+      s[i] = (int32_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+      labels[i] = end >= 0 ? LABEL_PREV : LABEL_REST;
+    }
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-s seconds] [-S seed] [-m mains] [trace.txt ...]\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  double seconds = 120;
+  unsigned seed = 1;
+  double mains = 2000;
+  int opt;
+  while((opt = getopt(argc, argv, "s:S:m:")) != -1) {
+    switch(opt) {
+      case 's': seconds = atof(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 'm': mains = atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if(optind >= argc) {
+    std::vector<int32_t> s;
+    std::vector<uint8_t> labels;
+    rawEmg(seconds, seed, mains, s, labels);
+    printf("raw EMG: %.0f s, mains hum %.0f, motion artifacts\n", seconds, mains);
+    bench<RawFrontEnd>("raw EMG front end", RawFrontEndNames, s, labels, RawRate);
+    bench<OffsetOnly>("offset removal and envelope only", OffsetOnlyNames, s, labels,
+                      RawRate);
+    return 0;
+  }
+
+  for(int i = optind; i < argc; i++) {
+    Trace t;
+    if(!loadTrace(argv[i], t)) {
+      fprintf(stderr, "cannot read trace %s\n", argv[i]);
+      return 1;
+    }
+    if(t.rate_hz != EMG_SAMPLE_RATE_HZ)
+      printf("note: %s is sampled at %u Hz, EmgFrontEnd is designed for %u Hz\n",
+             argv[i], t.rate_hz, EMG_SAMPLE_RATE_HZ);
+    std::vector<int32_t> s(t.samples.begin(), t.samples.end());
+    bench<myokbd::EmgFrontEnd>(argv[i], EmgFrontEndNames, s, t.labels, t.rate_hz);
+    bench<Pipeline<> >("unfiltered", NULL, s, t.labels, t.rate_hz);
+  }
+  return 0;
+}
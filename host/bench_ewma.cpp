@@ -0,0 +1,203 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Bufferless (EWMA) against windowed peak detection.
+ *
+ * For lags of 2^7 and 2^10 samples, reports the RAM taken by one detector
+ * instance, cycles (x86 time stamp counter) and ns per sample, and how far
+ * EwmaPeakDetection agrees with the windowed PeakDetection<LOG_2LAG,
+ * ExactStats>: the share of samples with the same decision, the PEAK runs
+ * each reports and, for labelled traces, the contractions each detects and
+ * the mean onset difference. Without trace arguments a random-walk signal
+ * with bursts is generated (-n samples, -S seed), as in bench_peak.
+ *
+ * usage: bench_ewma [-n samples] [-S seed] [-t threshold] [trace.txt ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "PeakDetection.h"
+#include "MultiPeakDetection.h"
+#include "EwmaPeakDetection.h"
+#include "Trace.h"
+
+using namespace ldry::signal;
+using namespace myokbd::host;
+
+namespace {
+
+  uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  struct Run {
+    std::vector<PeakSignal> out;
+    double cycles;    // per sample
+    double ns;
+  };
+
+  template <typename DETECTOR>
+  Run run(const std::vector<uint16_t>& samples, float threshold) {
+    Run r;
+    r.out.resize(samples.size());
+    r.cycles = r.ns = 1e30;
+    for(int rep = 0; rep < 5; rep++) {
+      DETECTOR det(threshold);
+      auto t0 = std::chrono::steady_clock::now();
+      uint64_t c0 = cycles();
+      for(size_t i = 0; i < samples.size(); i++) r.out[i] = det.addDataGetPeak(samples[i]);
+      double c = (double)(cycles() - c0);
+      double ns = std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - t0).count();
+      if(c < r.cycles) r.cycles = c;
+      if(ns < r.ns) r.ns = ns;
+    }
+    if(!samples.empty()) {
+      r.cycles /= samples.size();
+      r.ns /= samples.size();
+    }
+    return r;
+  }
+
+  /* PEAK runs, as [start, end) sample indexes */
+  std::vector<std::pair<size_t, size_t> > peakRuns(const std::vector<PeakSignal>& s) {
+    std::vector<std::pair<size_t, size_t> > runs;
+    for(size_t i = 0; i < s.size(); i++) {
+      if(s[i] != PeakSignal::PEAK) continue;
+      if(runs.empty() || runs.back().second != i) runs.push_back(std::make_pair(i, i + 1));
+      else runs.back().second = i + 1;
+    }
+    return runs;
+  }
+
+  /* first PEAK sample within [from, to), or to */
+  size_t firstPeak(const std::vector<PeakSignal>& s, size_t from, size_t to) {
+    while(from < to && s[from] != PeakSignal::PEAK) from++;
+    return from;
+  }
+
+  template <uint16_t LOG_2LAG>
+  void bench(const std::string& name, const Trace& t, float threshold) {
+    typedef PeakDetection<LOG_2LAG, ExactStats> Windowed;
+    typedef EwmaPeakDetection<LOG_2LAG> Ewma;
+    const size_t lag = 1u << LOG_2LAG;
+
+    printf("%s, lag %zu: RAM per instance: PeakDetection %zu B (DoubleStats), "
+           "%zu B (ExactStats); MultiPeakDetection<1> %zu B; EwmaPeakDetection %zu B\n",
+           name.c_str(), lag, sizeof(PeakDetection<LOG_2LAG, DoubleStats>), sizeof(Windowed),
+           sizeof(MultiPeakDetection<1, LOG_2LAG>), sizeof(Ewma));
+
+    Run w = run<Windowed>(t.samples, threshold);
+    Run e = run<Ewma>(t.samples, threshold);
+    printf("  windowed %6.2f cycles/sample %6.2f ns/sample; EWMA %6.2f cycles/sample "
+           "%6.2f ns/sample\n", w.cycles, w.ns, e.cycles, e.ns);
+
+    size_t same = 0, n = 0;
+    for(size_t i = lag; i < t.size(); i++, n++) same += w.out[i] == e.out[i];
+    std::vector<std::pair<size_t, size_t> > wr = peakRuns(w.out), er = peakRuns(e.out);
+    size_t w_only = 0, e_only = 0;
+    for(size_t i = 0; i < wr.size(); i++)
+      if(firstPeak(e.out, wr[i].first, wr[i].second) == wr[i].second) w_only++;
+    for(size_t i = 0; i < er.size(); i++)
+      if(firstPeak(w.out, er[i].first, er[i].second) == er[i].second) e_only++;
+    printf("  agreement: %.2f%% of samples; PEAK runs: %zu windowed (%zu not seen by EWMA), "
+           "%zu EWMA (%zu not seen windowed)\n", n ? 100.0 * same / n : 0.0,
+           wr.size(), w_only, er.size(), e_only);
+
+    if(!t.labelled()) return;
+    std::vector<Segment> segs = segments(t);
+    unsigned contractions = 0, w_det = 0, e_det = 0, both = 0;
+    double diff_ms = 0;
+    for(size_t s = 0; s < segs.size(); s++) {
+      if(segs[s].onset < lag) continue;
+      contractions++;
+      size_t wi = firstPeak(w.out, segs[s].onset, segs[s].offset);
+      size_t ei = firstPeak(e.out, segs[s].onset, segs[s].offset);
+      w_det += wi < segs[s].offset;
+      e_det += ei < segs[s].offset;
+      if(wi < segs[s].offset && ei < segs[s].offset) {
+        both++;
+        diff_ms += ((double)ei - (double)wi) * 1000.0 / t.rate_hz;
+      }
+    }
+    printf("  contractions: %u, detected %u windowed, %u EWMA; EWMA onset %+.2f ms "
+           "from windowed on average\n", contractions, w_det, e_det,
+           both ? diff_ms / both : 0.0);
+  }
+
+  void benchAll(const std::string& name, const Trace& t, float threshold) {
+    bench<7>(name, t, threshold);
+    bench<10>(name, t, threshold);
+  }
+
+  std::vector<uint16_t> randomWalk(size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    std::vector<uint16_t> s(n);
+    double level = 8000, burst = 0;
+    for(size_t i = 0; i < n; i++) {
+      level += 20 * gauss(rng);
+      if(level < 2000) level = 2000;
+      if(level > 40000) level = 40000;
+      if(burst <= 0 && uni(rng) < 0.01) burst = 10000 + 15000 * uni(rng);
+      double v = level + burst + 250 * gauss(rng);
+      burst *= 0.97;
+      if(burst < 100) burst = 0;
+      s[i] = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+    }
+    return s;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  size_t n = 4 * 3600 * 40;   // four hours at 40 Hz
+  unsigned seed = 1;
+  float threshold = 3;
+  int opt;
+  while((opt = getopt(argc, argv, "n:S:t:")) != -1) {
+    switch(opt) {
+      case 'n': n = (size_t)atol(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 't': threshold = (float)atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n samples] [-S seed] [-t threshold] [trace.txt ...]\n",
+                argv[0]);
+        return 2;
+    }
+  }
+
+  if(optind >= argc) {
+    Trace t;
+    t.samples = randomWalk(n, seed);
+    benchAll("random walk", t, threshold);
+    return 0;
+  }
+  for(int i = optind; i < argc; i++) {
+    Trace t;
+    if(!loadTrace(argv[i], t)) {
+      fprintf(stderr, "cannot read trace %s\n", argv[i]);
+      return 1;
+    }
+    benchAll(argv[i], t, threshold);
+  }
+  return 0;
+}
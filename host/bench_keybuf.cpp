@@ -0,0 +1,227 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * KeyBuffer benchmark and stress test.
+ *
+ * Compares the SPSC KeyBuffer with the previous design, an
+ * mbed::CircularBuffer guarded by critical sections plus a one-event
+ * push-back slot. Host critical sections are a global mutex, standing in for
+ * interrupt masking on the device. Both are timed with push/pop from a single
+ * thread and with a producer and a consumer thread.
+ *
+ * With -s, producer and consumer threads run for the given number of
+ * seconds on the SPSC KeyBuffer instead. The producer queues sequence-
+ * numbered events, singly and in atomic batches. The consumer peeks, and at
+ * random declines events as the report pump does. Every event must arrive
+ * exactly once and in order, and every batch must appear whole.
+ *
+ * usage: bench_keybuf [-n events] [-s seconds] [-S seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include <mbed.h>
+#include "KeyBuffer.h"
+
+using namespace btsvc;
+
+namespace {
+
+  const uint32_t SIZE = 128;
+
+  /* the KeyBuffer this replaced, on HidEvent */
+  class LegacyKeyBuffer : public mbed::CircularBuffer<HidEvent, SIZE> {
+    public:
+      LegacyKeyBuffer() : _data_is_pending(false) { }
+
+      void setPending(const HidEvent& data) {
+        _data_is_pending = true;
+        _pending_data = data;
+      }
+
+      bool getPending(HidEvent& data) {
+        if(_data_is_pending) {
+          data = _pending_data;
+          _data_is_pending = false;
+          return true;
+        }
+        return pop(data);
+      }
+
+    private:
+      bool _data_is_pending;
+      HidEvent _pending_data;
+  };
+
+  typedef btutil::KeyBuffer<SIZE> SpscKeyBuffer;
+
+  HidEvent encode(uint32_t seq) {
+    return HidEvent{ (uint8_t)seq, (uint8_t)(seq >> 8), (uint8_t)(seq >> 16) };
+  }
+
+  uint32_t decode(const HidEvent& e) {
+    return e.usage | ((uint32_t)e.modifier << 8) | ((uint32_t)e.flags << 16);
+  }
+
+  const uint32_t SEQ_MASK = 0xffffff;
+
+  /* adapters giving both buffers the same producer/consumer interface */
+  bool produce(SpscKeyBuffer& b, const HidEvent& e) { return b.push(e); }
+  bool produce(LegacyKeyBuffer& b, const HidEvent& e) {
+    if(b.full()) return false;
+    b.push(e);
+    return true;
+  }
+  bool consume(SpscKeyBuffer& b, HidEvent& e) {
+    if(!b.peek(e)) return false;
+    b.drop();
+    return true;
+  }
+  bool consume(LegacyKeyBuffer& b, HidEvent& e) { return b.getPending(e); }
+
+  typedef std::chrono::steady_clock Clock;
+
+  volatile uint32_t sink;
+
+  template <typename Buffer>
+  double singleThreadNs(size_t n) {
+    Buffer b;
+    HidEvent e;
+    uint32_t sum = 0;
+    Clock::time_point t0 = Clock::now();
+    for(size_t i = 0; i < n; i += 16) {
+      for(uint32_t k = 0; k < 16; k++) produce(b, encode((uint32_t)i + k));
+      for(uint32_t k = 0; k < 16; k++) if(consume(b, e)) sum += e.usage;
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+    sink = sum;
+    return ns / n;
+  }
+
+  template <typename Buffer>
+  double twoThreadNs(size_t n, size_t& errors) {
+    Buffer b;
+    std::atomic<bool> go(false);
+    Clock::time_point t0;
+    std::thread producer([&]() {
+      while(!go.load()) { }
+      for(uint32_t i = 0; i < n; i++)
+        while(!produce(b, encode(i & SEQ_MASK))) std::this_thread::yield();
+    });
+    errors = 0;
+    t0 = Clock::now();
+    go.store(true);
+    HidEvent e;
+    for(uint32_t i = 0; i < n; i++) {
+      while(!consume(b, e)) std::this_thread::yield();
+      errors += decode(e) != (i & SEQ_MASK);
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+    producer.join();
+    return ns / n;
+  }
+
+  int stress(double seconds, unsigned seed) {
+    SpscKeyBuffer b;
+    std::atomic<bool> stop(false);
+    std::atomic<uint32_t> produced(0);
+    std::atomic<bool> finished(false);
+
+    std::thread producer([&]() {
+      std::mt19937 rng(seed);
+      uint32_t seq = 0;
+      HidEvent batch[6];
+      while(!stop.load(std::memory_order_relaxed)) {
+        uint32_t n = rng() % 4 == 0 ? 1 + rng() % 6 : 1;
+        for(uint32_t k = 0; k < n; k++) {
+          batch[k] = encode((seq + k) & SEQ_MASK);
+          // the high flag bit marks every batch member but the last
+          batch[k].flags = (uint8_t)((((seq + k) >> 16) & 0x7f) | (k + 1 < n ? 0x80 : 0));
+        }
+        bool ok = n == 1 ? b.push(batch[0]) : b.push(batch, n);
+        if(ok) seq += n;
+        else std::this_thread::yield();
+      }
+      produced.store(seq & SEQ_MASK);
+      finished.store(true);
+    });
+
+    std::mt19937 rng(seed + 1);
+    uint32_t expect = 0, declined = 0, batches = 0;
+    size_t errors = 0;
+    bool in_batch = false;
+    Clock::time_point end = Clock::now() +
+      std::chrono::microseconds((int64_t)(seconds * 1e6));
+    HidEvent e;
+    for(;;) {
+      bool done = stop.load();
+      if(!done && Clock::now() >= end) stop.store(done = true);
+      if(!b.peek(e)) {
+        if(finished.load() && expect == produced.load()) break;
+        if(in_batch) errors++;    // the rest of a batch must already be there
+        in_batch = false;
+        std::this_thread::yield();
+        continue;
+      }
+      HidEvent again;
+      if(rng() % 8 == 0) {
+        // declined, as a key that does not fit the report being built
+        declined++;
+        if(!b.peek(again) || decode(again) != decode(e)) errors++;
+        continue;
+      }
+      b.drop();
+      uint32_t seq = (e.usage | ((uint32_t)e.modifier << 8) |
+                      ((uint32_t)(e.flags & 0x7f) << 16)) & 0x7fffff;
+      errors += seq != (expect & 0x7fffff);
+      expect = (expect + 1) & SEQ_MASK;
+      bool more = e.flags & 0x80;
+      if(more && !in_batch) batches++;
+      in_batch = more;
+    }
+    producer.join();
+    printf("stress: %u events (%u batches), %u declined peeks, %zu errors\n",
+           expect, batches, declined, errors);
+    return errors ? 1 : 0;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  size_t n = 4000000;
+  double seconds = 0;
+  unsigned seed = 1;
+  int opt;
+  while((opt = getopt(argc, argv, "n:s:S:")) != -1) {
+    switch(opt) {
+      case 'n': n = (size_t)atol(optarg); break;
+      case 's': seconds = atof(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n events] [-s seconds] [-S seed]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if(seconds > 0) return stress(seconds, seed);
+
+  size_t err_legacy, err_spsc;
+  printf("%zu events, %u-event buffers\n", n, SIZE);
+  printf("  single thread:  CircularBuffer %7.2f ns/event, SPSC %7.2f ns/event\n",
+         singleThreadNs<LegacyKeyBuffer>(n), singleThreadNs<SpscKeyBuffer>(n));
+  double legacy = twoThreadNs<LegacyKeyBuffer>(n, err_legacy);
+  double spsc = twoThreadNs<SpscKeyBuffer>(n, err_spsc);
+  printf("  two threads:    CircularBuffer %7.2f ns/event, SPSC %7.2f ns/event"
+         "  (%zu / %zu out of order)\n", legacy, spsc, err_legacy, err_spsc);
+  return 0;
+}
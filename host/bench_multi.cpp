@@ -0,0 +1,138 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Multi-channel peak detection benchmark.
+ *
+ * For 1, 2, 4 and 8 channels, runs MultiPeakDetection over interleaved
+ * frames and, as the reference, one PeakDetection<LOG_2LAG, ExactStats> per
+ * channel over the same data. Reports ns/frame for both and the number of
+ * decisions that differ. Each channel is an independent random walk with
+ * bursts (-n frames, -S seed).
+ *
+ * usage: bench_multi [-n frames] [-S seed] [-t threshold] [-b block]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "PeakDetection.h"
+#include "MultiPeakDetection.h"
+
+using namespace ldry::signal;
+
+namespace {
+
+  const uint16_t LOG_2LAG = 7;
+
+  typedef std::chrono::steady_clock Clock;
+
+  double elapsedNs(Clock::time_point t0) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+  }
+
+  /* n_frames x n_ch interleaved samples, independent walks per channel */
+  std::vector<uint16_t> randomWalks(size_t n_frames, uint8_t n_ch, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    std::vector<uint16_t> s(n_frames * n_ch);
+    for(uint8_t c = 0; c < n_ch; c++) {
+      double level = 8000, burst = 0;
+      for(size_t i = 0; i < n_frames; i++) {
+        level += 20 * gauss(rng);
+        if(level < 2000) level = 2000;
+        if(level > 40000) level = 40000;
+        if(burst <= 0 && uni(rng) < 0.01) burst = 10000 + 15000 * uni(rng);
+        double v = level + burst + 250 * gauss(rng);
+        burst *= 0.97;
+        if(burst < 100) burst = 0;
+        s[i * n_ch + c] = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+      }
+    }
+    return s;
+  }
+
+  template <uint8_t N_CH>
+  void bench(size_t n_frames, unsigned seed, float threshold, size_t block) {
+    std::vector<uint16_t> frames = randomWalks(n_frames, N_CH, seed);
+    std::vector<PeakSignal> ref(frames.size()), out(frames.size());
+    std::vector<uint16_t> chan(n_frames);
+    std::vector<PeakSignal> chan_out(n_frames);
+
+    // reference: one detector per channel, each over its own sample stream
+    double ref_ns = 1e30;
+    for(int rep = 0; rep < 5; rep++) {
+      double ns = 0;
+      for(uint8_t c = 0; c < N_CH; c++) {
+        for(size_t i = 0; i < n_frames; i++) chan[i] = frames[i * N_CH + c];
+        PeakDetection<LOG_2LAG, ExactStats> pd(threshold);
+        Clock::time_point t0 = Clock::now();
+        for(size_t i = 0; i < n_frames; i += block) {
+          size_t n = std::min(block, n_frames - i);
+          pd.addBlock(&chan[i], n, &chan_out[i]);
+        }
+        ns += elapsedNs(t0);
+        for(size_t i = 0; i < n_frames; i++) ref[i * N_CH + c] = chan_out[i];
+      }
+      ref_ns = std::min(ref_ns, ns);
+    }
+
+    double multi_ns = 1e30;
+    for(int rep = 0; rep < 5; rep++) {
+      MultiPeakDetection<N_CH, LOG_2LAG> mpd(threshold);
+      Clock::time_point t0 = Clock::now();
+      for(size_t i = 0; i < n_frames; i += block) {
+        size_t n = std::min(block, n_frames - i);
+        mpd.addBlock(&frames[i * N_CH], n, &out[i * N_CH]);
+      }
+      multi_ns = std::min(multi_ns, elapsedNs(t0));
+    }
+
+    size_t diff = 0, peaks = 0;
+    for(size_t i = 0; i < frames.size(); i++) {
+      diff += ref[i] != out[i];
+      peaks += ref[i] == PeakSignal::PEAK;
+    }
+    printf("  %u ch: separate %8.2f ns/frame, struct of arrays %8.2f ns/frame"
+           "  %5.2fx  (%zu PEAK decisions, %zu mismatches)\n",
+           N_CH, ref_ns / n_frames, multi_ns / n_frames, ref_ns / multi_ns,
+           peaks, diff);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  size_t n = 3600 * 500;      // one hour at 500 Hz
+  unsigned seed = 1;
+  float threshold = 3;
+  size_t block = 32;
+  int opt;
+  while((opt = getopt(argc, argv, "n:S:t:b:")) != -1) {
+    switch(opt) {
+      case 'n': n = (size_t)atol(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 't': threshold = (float)atof(optarg); break;
+      case 'b': block = (size_t)atol(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames] [-S seed] [-t threshold] [-b block]\n", argv[0]);
+        return 2;
+    }
+  }
+  if(block == 0) block = 1;
+
+  printf("%zu frames, threshold %.2f, blocks of %zu frames\n", n, threshold, block);
+  bench<1>(n, seed, threshold, block);
+  bench<2>(n, seed, threshold, block);
+  bench<4>(n, seed, threshold, block);
+  bench<8>(n, seed, threshold, block);
+  return 0;
+}
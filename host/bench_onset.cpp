@@ -0,0 +1,165 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Onset detector comparison (PeakDecision.h).
+ *
+ * Runs each decision policy, at several debounce lengths, over the same
+ * corpus of labelled traces, filtered by the sketch's EmgFrontEnd. Per
+ * engine, reports:
+ *  - onset latency: from the labelled onset to the first PEAK sample of the
+ *    contraction (median, 95th percentile and max, in ms);
+ *  - missed contractions: no PEAK before the contraction ends;
+ *  - false triggers: PEAK onsets outside any contraction (or its 100 ms
+ *    decay), per minute of rest;
+ *  - ns per sample.
+ * The first LAG samples of each trace fill the window and are not scored.
+ * TKEO is only run on raw EMG (EMG_INPUT_ENVELOPE 0): on an envelope it
+ * misses nearly every contraction.
+ *
+ * usage: bench_onset [-t threshold] trace.txt ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "config.h"
+#include "PresentationController.h"
+
+#include "Trace.h"
+
+using namespace ldry::signal;
+using namespace myokbd::host;
+
+namespace {
+
+  const uint32_t DecayMs = 100;
+
+  struct Score {
+    std::vector<double> latency_ms;
+    unsigned contractions = 0, missed = 0, false_triggers = 0;
+    double rest_s = 0, ns = 0;
+    size_t samples = 0;
+
+    void print(const char* name, uint8_t debounce) {
+      std::sort(latency_ms.begin(), latency_ms.end());
+      size_t n = latency_ms.size();
+      double med = n ? latency_ms[n / 2] : 0;
+      double p95 = n ? latency_ms[std::min(n - 1, n * 95 / 100)] : 0;
+      double max = n ? latency_ms.back() : 0;
+      printf("  %-6s debounce %u: onset median %5.1f ms, p95 %5.1f ms, max %5.1f ms; "
+             "%u/%u missed; %5.2f false/min; %5.1f ns/sample\n",
+             name, debounce, med, p95, max, missed, contractions,
+             rest_s > 0 ? false_triggers * 60.0 / rest_s : 0.0,
+             samples ? ns / samples : 0.0);
+    }
+  };
+
+  template <typename DETECTOR>
+  void run(const Trace& t, const std::vector<uint16_t>& x, float threshold, Score& s) {
+    DETECTOR det(threshold, 0, EMG_WAKE_THRESHOLD);
+    std::vector<uint8_t> peak(x.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < x.size(); i++) {
+      PeakSignal sig;
+      det.addFrame(&x[i], &sig);
+      peak[i] = sig == PeakSignal::PEAK;
+    }
+    s.ns += std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - t0).count();
+    s.samples += x.size();
+
+    const size_t lag = 1u << EMG_LOG2_LAG;
+    const size_t decay = (size_t)DecayMs * t.rate_hz / 1000;
+    std::vector<Segment> segs = segments(t);
+    std::vector<uint8_t> explained(x.size(), 0);
+    for(size_t k = 0; k < segs.size(); k++) {
+      size_t end = std::min(segs[k].offset + decay, x.size());
+      for(size_t i = segs[k].onset; i < end; i++) explained[i] = 1;
+      if(segs[k].onset < lag) continue;
+      s.contractions++;
+      size_t i = segs[k].onset;
+      while(i < segs[k].offset && !peak[i]) i++;
+      if(i == segs[k].offset) s.missed++;
+      else s.latency_ms.push_back((i - segs[k].onset) * 1000.0 / t.rate_hz);
+    }
+    for(size_t i = lag + 1; i < x.size(); i++) {
+      if(!explained[i]) s.rest_s += 1.0 / t.rate_hz;
+      if(peak[i] && !peak[i - 1] && !explained[i]) s.false_triggers++;
+    }
+  }
+
+  template <template <uint8_t, uint16_t, uint8_t> class DECISION, uint8_t DEBOUNCE>
+  void engine(const char* name, const std::vector<Trace>& corpus,
+              const std::vector<std::vector<uint16_t> >& filtered, float threshold) {
+    typedef MultiPeakDetection<1, EMG_LOG2_LAG, DECISION, DEBOUNCE> Detector;
+    Score s;
+    for(size_t i = 0; i < corpus.size(); i++)
+      run<Detector>(corpus[i], filtered[i], threshold, s);
+    s.print(name, DEBOUNCE);
+  }
+
+  template <template <uint8_t, uint16_t, uint8_t> class DECISION>
+  void engines(const char* name, const std::vector<Trace>& corpus,
+               const std::vector<std::vector<uint16_t> >& filtered, float threshold) {
+    engine<DECISION, 6>(name, corpus, filtered, threshold);
+    engine<DECISION, 3>(name, corpus, filtered, threshold);
+    engine<DECISION, 2>(name, corpus, filtered, threshold);
+    engine<DECISION, 1>(name, corpus, filtered, threshold);
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-t threshold] trace.txt ...\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  float threshold = EMG_THRESHOLD;
+  int opt;
+  while((opt = getopt(argc, argv, "t:")) != -1) {
+    switch(opt) {
+      case 't': threshold = (float)atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind >= argc) usage(argv[0]);
+
+  std::vector<Trace> corpus;
+  std::vector<std::vector<uint16_t> > filtered;
+  double seconds = 0;
+  for(int i = optind; i < argc; i++) {
+    Trace t;
+    if(!loadTrace(argv[i], t) || !t.labelled()) {
+      fprintf(stderr, "cannot read labelled trace %s\n", argv[i]);
+      return 1;
+    }
+    myokbd::EmgFrontEnd fe;
+    std::vector<uint16_t> x(t.size());
+    for(size_t k = 0; k < t.size(); k++) {
+      int32_t v = t.samples[k];
+      if(k) fe.step(v);
+      else v = fe.prime(v);
+      x[k] = (uint16_t)(v < 0 ? 0 : v > 0xffff ? 0xffff : v);
+    }
+    seconds += (double)t.size() / t.rate_hz;
+    corpus.push_back(t);
+    filtered.push_back(x);
+  }
+
+  printf("%zu trace(s), %.0f s; threshold %.2f, lag %u samples\n", corpus.size(), seconds,
+         threshold, 1u << EMG_LOG2_LAG);
+  engines<ZScoreDecision>("z", corpus, filtered, threshold);
+  if(!EMG_INPUT_ENVELOPE) engines<TkeoDecision>("TKEO", corpus, filtered, threshold);
+  else printf("TKEO: skipped, it needs raw EMG (EMG_INPUT_ENVELOPE)\n");
+  engines<CusumDecision>("CUSUM", corpus, filtered, threshold);
+  return 0;
+}
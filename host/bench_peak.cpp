@@ -0,0 +1,155 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * PeakDetection numeric engine benchmark.
+ *
+ * Runs every engine over the same traces, one sample at a time and through
+ * addBlock() in blocks of -b samples, and reports ns/sample and the number
+ * of MORE_DATA_NEEDED / PEAK / NO_PEAK decisions that differ from the
+ * per-sample DoubleStats reference. Without trace arguments a long
+ * random-walk signal with bursts is generated (-n samples, -S seed).
+ *
+ * usage: bench_peak [-n samples] [-S seed] [-t threshold] [-b block]
+ *                   [trace.txt ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "PeakDetection.h"
+#include "Trace.h"
+
+using namespace ldry::signal;
+using namespace myokbd::host;
+
+namespace {
+
+  const uint16_t LOG_2LAG = 7;
+
+  struct Run {
+    std::vector<PeakSignal> out;
+    double ns_per_sample;
+  };
+
+  template <template <uint16_t> class Stats>
+  Run run(const std::vector<uint16_t>& samples, float threshold, size_t block) {
+    Run r;
+    r.out.resize(samples.size());
+    double best = 1e30;
+    for(int rep = 0; rep < 5; rep++) {
+      PeakDetection<LOG_2LAG, Stats> pd(threshold);
+      auto t0 = std::chrono::steady_clock::now();
+      if(block == 0) {
+        for(size_t i = 0; i < samples.size(); i++)
+          r.out[i] = pd.addDataGetPeak(samples[i]);
+      } else {
+        for(size_t i = 0; i < samples.size(); i += block) {
+          size_t n = std::min(block, samples.size() - i);
+          pd.addBlock(&samples[i], n, &r.out[i]);
+        }
+      }
+      double ns = std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - t0).count();
+      if(ns < best) best = ns;
+    }
+    r.ns_per_sample = samples.empty() ? 0 : best / samples.size();
+    return r;
+  }
+
+  void compare(const char* name, const Run& ref, const Run& r) {
+    size_t diff[3] = { 0, 0, 0 };
+    for(size_t i = 0; i < ref.out.size(); i++) {
+      if(ref.out[i] == r.out[i]) continue;
+      if(ref.out[i] == PeakSignal::MORE_DATA_NEEDED) diff[0]++;
+      else if(ref.out[i] == PeakSignal::PEAK) diff[1]++;
+      else diff[2]++;
+    }
+    printf("  %-18s %8.2f ns/sample  %5.2fx  mismatches: MORE_DATA_NEEDED %zu, PEAK %zu, NO_PEAK %zu\n",
+           name, r.ns_per_sample, ref.ns_per_sample / r.ns_per_sample,
+           diff[0], diff[1], diff[2]);
+  }
+
+  template <template <uint16_t> class Stats>
+  void compareEngine(const char* name, const Run& ref,
+                     const std::vector<uint16_t>& samples, float threshold,
+                     size_t block) {
+    std::string n(name);
+    compare(n.c_str(), ref, run<Stats>(samples, threshold, 0));
+    compare((n + " block").c_str(), ref, run<Stats>(samples, threshold, block));
+  }
+
+  void bench(const std::string& name, const std::vector<uint16_t>& samples,
+             float threshold, size_t block) {
+    size_t peaks = 0;
+    Run ref = run<DoubleStats>(samples, threshold, 0);
+    for(size_t i = 0; i < ref.out.size(); i++) peaks += ref.out[i] == PeakSignal::PEAK;
+    printf("%s: %zu samples, %zu PEAK decisions (threshold %.2f)\n",
+           name.c_str(), samples.size(), peaks, threshold);
+    compareEngine<DoubleStats>("DoubleStats", ref, samples, threshold, block);
+    compareEngine<ExactStats>("ExactStats", ref, samples, threshold, block);
+    compareEngine<FloatStats>("FloatStats", ref, samples, threshold, block);
+  }
+
+  std::vector<uint16_t> randomWalk(size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    std::vector<uint16_t> s(n);
+    double level = 8000, burst = 0;
+    for(size_t i = 0; i < n; i++) {
+      level += 20 * gauss(rng);
+      if(level < 2000) level = 2000;
+      if(level > 40000) level = 40000;
+      if(burst <= 0 && uni(rng) < 0.01) burst = 10000 + 15000 * uni(rng);
+      double v = level + burst + 250 * gauss(rng);
+      burst *= 0.97;
+      if(burst < 100) burst = 0;
+      s[i] = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+    }
+    return s;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  size_t n = 4 * 3600 * 40;   // four hours at 40 Hz
+  unsigned seed = 1;
+  float threshold = 3;
+  size_t block = 32;
+  int opt;
+  while((opt = getopt(argc, argv, "n:S:t:b:")) != -1) {
+    switch(opt) {
+      case 'n': n = (size_t)atol(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 't': threshold = (float)atof(optarg); break;
+      case 'b': block = (size_t)atol(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n samples] [-S seed] [-t threshold] [-b block] [trace.txt ...]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if(optind >= argc) {
+    bench("random walk", randomWalk(n, seed), threshold, block);
+    return 0;
+  }
+  for(int i = optind; i < argc; i++) {
+    Trace t;
+    if(!loadTrace(argv[i], t)) {
+      fprintf(stderr, "cannot read trace %s\n", argv[i]);
+      return 1;
+    }
+    bench(argv[i], t.samples, threshold, block);
+  }
+  return 0;
+}
@@ -0,0 +1,333 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Raw EMG streaming (EmgStreamService) over the simulated BLE link.
+ *
+ * Offers frames to the stream service at a given rate (by default far more
+ * than any link carries, to find the ceiling) while a key is typed every
+ * 97 ms, for each connection interval and each link the central may agree
+ * to: ATT MTU 23 or 247, 1M or 2M PHY, with or without data length
+ * extension. The central decodes every notification; for each configuration
+ * it reports:
+ *  - the samples/s and notifications/s delivered, once the link has settled;
+ *  - gaps in the notification sequence numbers (lost notifications) and in
+ *    the frame index (frames dropped before the link), and samples that did
+ *    not decode to what was offered;
+ *  - the median and max latency from a key press to its report, with the
+ *    stream running and, for reference, without a subscriber.
+ * Each configuration runs in a process of its own.
+ *
+ * usage: bench_stream [-r samples_per_s] [-t seconds] [-f max_in_flight]
+ *                     [-b notify_buffers] [-p packets_per_event]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+
+#include "config.h"
+#include "KeyboardService.h"
+#include "EmgStreamService.h"
+
+using namespace myokbd;
+
+#if MYOKBD_STREAM
+
+namespace {
+
+  typedef btsvc::EmgStreamService<> Stream;
+
+  events::EventQueue ble_queue(64 * EVENTS_EVENT_SIZE);
+  events::EventQueue sampling_queue(64 * EVENTS_EVENT_SIZE);
+
+  void scheduleBleEvents(BLE::OnEventsToProcessCallbackContext* context) {
+    ble_queue.call(mbed::Callback<void()>(&context->ble, &BLE::processEvents));
+  }
+
+  struct Options {
+    uint32_t rate;            // samples/s offered
+    uint32_t seconds;
+    uint8_t max_in_flight;
+    unsigned notify_buffers;
+    unsigned packets_per_event;
+  };
+
+  struct Config {
+    uint32_t interval_us;
+    uint16_t mtu;
+    bool phy_2m;
+    bool dle;
+  };
+
+  struct Result {
+    double samples_s;
+    double notifications_s;
+    unsigned seq_gaps;
+    unsigned frame_gaps;
+    unsigned bad_samples;
+    unsigned keys;
+    double key_median_ms;
+    double key_max_ms;
+    uint16_t mtu;             // link as negotiated
+    bool phy_2m;
+    uint16_t data_length;
+  };
+
+  struct Peripheral : public ble::Gap::EventHandler, public GattServer::EventHandler {
+    Peripheral(BLEDevice& ble, uint8_t max_in_flight) :
+      _ble(ble), _max_in_flight(max_in_flight), kbd(NULL), stream(NULL) { }
+
+    void onInitComplete(BLEDevice::InitializationCompleteCallbackContext* params) {
+      kbd = new btsvc::KeyboardService<KBD_BUF_SIZE>(_ble, ble_queue);
+      stream = new Stream(_ble, ble_queue, mbed::callback(this, &Peripheral::hidBusy),
+                          _max_in_flight);
+    }
+
+    bool hidBusy() { return !kbd->isIdle(); }
+
+    void onConnectionComplete(const ble::ConnectionCompleteEvent& event) override {
+      kbd->connect(event);
+      stream->connect(event);
+    }
+
+    void onPhyUpdateComplete(ble_error_t status, ble::connection_handle_t connectionHandle,
+                             ble::phy_t txPhy, ble::phy_t rxPhy) override {
+      stream->phyUpdated(status, txPhy, rxPhy);
+    }
+
+    void onDataLengthChange(ble::connection_handle_t connectionHandle,
+                            uint16_t txSize, uint16_t rxSize) override {
+      stream->dataLengthChanged(txSize, rxSize);
+    }
+
+    void onAttMtuChange(ble::connection_handle_t connectionHandle,
+                        uint16_t attMtuSize) override {
+      stream->attMtuChanged(connectionHandle, attMtuSize);
+    }
+
+    void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams& params) override {
+      stream->updatesEnabled(params);
+    }
+
+    void onUpdatesDisabled(const GattUpdatesDisabledCallbackParams& params) override {
+      stream->updatesDisabled(params);
+    }
+
+    BLEDevice& _ble;
+    uint8_t _max_in_flight;
+    btsvc::KeyboardService<KBD_BUF_SIZE>* kbd;
+    Stream* stream;
+  };
+
+  /* the ADC reading offered as frame f (mod 2^16, as the frame index), channel c */
+  uint16_t sampleValue(uint16_t f, uint8_t c) {
+    return (uint16_t)((((f + 1) * 2654435761u + c * 40503u) >> 20) & 0xfff) << 4;
+  }
+
+  /* samples of a notification of len bytes */
+  unsigned samplesIn(size_t len) {
+    size_t b = len - Stream::HEADER_SIZE;
+    return (unsigned)(b / 3 * 2 + (b % 3 == 2 ? 1 : 0));
+  }
+
+  uint16_t unpack(const uint8_t* p, unsigned i) {
+    const uint8_t* s = p + Stream::HEADER_SIZE + i / 2 * 3;
+    if(i % 2 == 0) return (uint16_t)(s[0] | (s[1] & 0x0f) << 8);
+    return (uint16_t)(s[1] >> 4 | s[2] << 4);
+  }
+
+  double median(std::vector<double> v) {
+    if(v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+  }
+
+  Result run(const Config& cfg, const Options& opt, bool subscribe) {
+    mbed_host::Sim& sim = mbed_host::sim();
+    mbed_host::FakeLink& link = mbed_host::link();
+    link.conn_interval_us = cfg.interval_us;
+    link.central_att_mtu = cfg.mtu;
+    link.central_2m_phy = cfg.phy_2m;
+    link.central_data_length_extension = cfg.dle;
+    link.notify_buffers = opt.notify_buffers;
+    link.packets_per_event = opt.packets_per_event;
+
+    BLEDevice& ble = BLEDevice::Instance();
+    Peripheral p(ble, opt.max_in_flight);
+    ble.onEventsToProcess(scheduleBleEvents);
+    ble.gap().setEventHandler(&p);
+    ble.gattServer().setEventHandler(&p);
+    ble.init(&p, &Peripheral::onInitComplete);
+    link.connect(ble);
+    sim.advance(100000);
+    if(subscribe) link.subscribe(ble, p.stream->getValueHandle());
+
+    // sampling: a block of frames every ms
+    uint32_t frame = 0;
+    uint64_t offered = 0;
+    const uint8_t n_ch = EMG_CHANNELS;
+    sampling_queue.call_every(1, [&]() {
+      offered += opt.rate;
+      uint16_t ch[EMG_CHANNELS];
+      for(; offered >= 1000u * n_ch; offered -= 1000u * n_ch, frame++) {
+        for(uint8_t c = 0; c < n_ch; c++) ch[c] = sampleValue((uint16_t)frame, c);
+        p.stream->push(ch, 1);
+      }
+    });
+
+    // the link settles (MTU exchange, data length and PHY updates) before
+    // measuring
+    sim.advance(500000);
+    uint64_t t0 = sim.now_us();
+    std::vector<uint64_t> presses;
+    int typing = ble_queue.call_every(97, [&]() {
+      if(p.kbd->_putc('a') == 0) presses.push_back(sim.now_us());
+    });
+    sim.advance((uint64_t)opt.seconds * 1000000);
+    uint64_t t1 = sim.now_us();
+    // the last keys go out
+    ble_queue.cancel(typing);
+    sim.advance(200000);
+
+    Result r;
+    memset(&r, 0, sizeof(r));
+    r.mtu = p.stream->attMtu();
+    r.phy_2m = p.stream->phy2m();
+    r.data_length = p.stream->dataLength();
+    const std::vector<mbed_host::Notification>& log = link.log();
+    GattAttribute::Handle_t sh = p.stream->getValueHandle();
+    bool first = true;
+    uint16_t next_seq = 0, next_frame = 0;
+    unsigned samples = 0, notifications = 0;
+    std::vector<double> key_ms;
+    size_t k = 0;
+    for(size_t i = 0; i < log.size(); i++) {
+      const mbed_host::Notification& n = log[i];
+      if(n.handle != sh) {
+        // a report pressing a key
+        if(n.data.size() == 8 && n.data[2] && k < presses.size() && n.t_us >= presses[k])
+          key_ms.push_back((n.t_us - presses[k++]) / 1000.0);
+        continue;
+      }
+      const uint8_t* d = n.data.data();
+      uint16_t seq = (uint16_t)(d[0] | d[1] << 8);
+      uint16_t f = (uint16_t)(d[2] | d[3] << 8);
+      unsigned ns = samplesIn(n.data.size());
+      if(!first) {
+        if(seq != next_seq) r.seq_gaps++;
+        if(f != next_frame) r.frame_gaps++;
+      }
+      first = false;
+      next_seq = seq + 1;
+      next_frame = (uint16_t)(f + ns / d[4]);
+      for(unsigned s = 0; s < ns; s++)
+        if(unpack(d, s) != sampleValue((uint16_t)(f + s / d[4]), (uint8_t)(s % d[4])) >> 4)
+          r.bad_samples++;
+      if(n.t_us >= t0 && n.t_us < t1) {
+        samples += ns;
+        notifications++;
+      }
+    }
+    double s = (t1 - t0) / 1e6;
+    r.samples_s = samples / s;
+    r.notifications_s = notifications / s;
+    r.keys = (unsigned)key_ms.size();
+    r.key_median_ms = median(key_ms);
+    r.key_max_ms = key_ms.empty() ? 0 : *std::max_element(key_ms.begin(), key_ms.end());
+    return r;
+  }
+
+  /* run in a child process: the stack and the link are singletons */
+  bool runIsolated(const Config& cfg, const Options& opt, bool subscribe, Result& r) {
+    int fd[2];
+    if(pipe(fd)) return false;
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) return false;
+    if(pid == 0) {
+      close(fd[0]);
+      Result res = run(cfg, opt, subscribe);
+      ssize_t w = write(fd[1], &res, sizeof(res));
+      _exit(w == (ssize_t)sizeof(res) ? 0 : 1);
+    }
+    close(fd[1]);
+    ssize_t n = read(fd[0], &r, sizeof(r));
+    close(fd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return n == (ssize_t)sizeof(r) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-r samples_per_s] [-t seconds] [-f max_in_flight] "
+                    "[-b notify_buffers] [-p packets_per_event]\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  Options opt = { 200000, 5, MYOKBD_STREAM_MAX_IN_FLIGHT, 3, 3 };
+  int o;
+  while((o = getopt(argc, argv, "r:t:f:b:p:")) != -1) {
+    switch(o) {
+      case 'r': opt.rate = (uint32_t)atoi(optarg); break;
+      case 't': opt.seconds = (uint32_t)atoi(optarg); break;
+      case 'f': opt.max_in_flight = (uint8_t)atoi(optarg); break;
+      case 'b': opt.notify_buffers = (unsigned)atoi(optarg); break;
+      case 'p': opt.packets_per_event = (unsigned)atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(!opt.rate || !opt.seconds || !opt.max_in_flight) usage(argv[0]);
+
+  static const uint32_t intervals_us[] = { 7500, 15000, 30000 };
+  static const Config links[] = {
+    { 0, 23, false, false },
+    { 0, 247, false, false },
+    { 0, 247, false, true },
+    { 0, 247, true, true },
+  };
+
+  printf("%u samples/s offered (%u channel(s)), %u s, %u notification(s) in flight, "
+         "%u buffers, %u packets/event\n", opt.rate, EMG_CHANNELS, opt.seconds,
+         opt.max_in_flight, opt.notify_buffers, opt.packets_per_event);
+  printf("%8s %4s %3s %4s | %10s %8s %4s %6s %4s | %15s | %15s\n",
+         "interval", "mtu", "phy", "ll", "samples/s", "notif/s", "seq", "frames", "bad",
+         "key ms (stream)", "key ms (none)");
+  bool ok = true;
+  for(size_t i = 0; i < sizeof(intervals_us) / sizeof(intervals_us[0]); i++) {
+    for(size_t l = 0; l < sizeof(links) / sizeof(links[0]); l++) {
+      Config cfg = links[l];
+      cfg.interval_us = intervals_us[i];
+      Result on, off;
+      if(!runIsolated(cfg, opt, true, on) || !runIsolated(cfg, opt, false, off)) {
+        fprintf(stderr, "run failed\n");
+        return 1;
+      }
+      printf("%6.1fms %4u %3s %4u | %10.0f %8.1f %4u %6u %4u | %6.1f / %6.1f | %6.1f / %6.1f\n",
+             cfg.interval_us / 1000.0, on.mtu, on.phy_2m ? "2M" : "1M", on.data_length,
+             on.samples_s, on.notifications_s, on.seq_gaps, on.frame_gaps, on.bad_samples,
+             on.key_median_ms, on.key_max_ms, off.key_median_ms, off.key_max_ms);
+      ok &= on.seq_gaps == 0 && on.bad_samples == 0 && on.keys == off.keys;
+    }
+  }
+  return ok ? 0 : 1;
+}
+
+#else
+
+int main() {
+  fprintf(stderr, "built with MYOKBD_STREAM 0\n");
+  return 1;
+}
+
+#endif
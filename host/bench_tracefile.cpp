@@ -0,0 +1,355 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Binary trace file benchmark, against multi-channel CSV.
+ *
+ * Generates -s seconds of -c channels at -r Hz (independent random walks
+ * with bursts, -n noise, -S seed; labelled by the bursts of channel 0) and
+ * writes it to -d as CSV ("v0,...,vN,label" lines) and as trace files of
+ * 16 and 12 bits. Reports:
+ *  - file sizes and compression against the CSV and against raw u16;
+ *  - decode throughput, as GB/s of decoded samples (2 bytes each): parsing
+ *    the CSV, decoding every chunk of the mapped file, and streaming each
+ *    channel through a Cursor;
+ *  - ns/sample feeding PeakDetection::addBlock() in blocks of -b from a
+ *    Cursor, against the same from memory (at 16 bits the decisions must
+ *    agree);
+ *  - the cost of a seek (a Cursor at a random frame).
+ * Every decode is checked against the generated samples (exactly at 16 bits,
+ * to within the dropped bits at 12). Files are removed unless -k is given.
+ *
+ * usage: bench_tracefile [-c channels] [-r rate_hz] [-s seconds] [-n noise]
+ *                        [-S seed] [-b block] [-d dir] [-k]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "PeakDetection.h"
+#include "Trace.h"
+
+using namespace ldry::signal;
+using namespace myokbd::host;
+
+namespace {
+
+  const uint16_t LOG_2LAG = 7;
+
+  typedef std::chrono::steady_clock Clock;
+
+  double elapsedNs(Clock::time_point t0) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+  }
+
+  struct Data {
+    uint8_t n_ch;
+    size_t frames;
+    std::vector<uint16_t> samples;    // interleaved
+    std::vector<uint8_t> labels;
+  };
+
+  Data generate(size_t frames, uint8_t n_ch, double noise, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    Data d;
+    d.n_ch = n_ch;
+    d.frames = frames;
+    d.samples.resize(frames * n_ch);
+    d.labels.resize(frames);
+    for(uint8_t c = 0; c < n_ch; c++) {
+      double level = 8000, burst = 0;
+      for(size_t i = 0; i < frames; i++) {
+        level += 20 * gauss(rng);
+        if(level < 2000) level = 2000;
+        if(level > 40000) level = 40000;
+        if(burst <= 0 && uni(rng) < 0.001) burst = 10000 + 15000 * uni(rng);
+        double v = level + burst + noise * gauss(rng);
+        burst *= 0.997;
+        if(burst < 100) burst = 0;
+        d.samples[i * n_ch + c] = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+        if(c == 0) d.labels[i] = burst > 0 ? LABEL_NEXT : LABEL_REST;
+      }
+    }
+    return d;
+  }
+
+  bool writeCsv(const std::string& path, const Data& d) {
+    FILE* f = fopen(path.c_str(), "w");
+    if(!f) return false;
+    for(size_t i = 0; i < d.frames; i++) {
+      for(uint8_t c = 0; c < d.n_ch; c++) fprintf(f, "%u,", d.samples[i * d.n_ch + c]);
+      fprintf(f, "%u\n", d.labels[i]);
+    }
+    return fclose(f) == 0;
+  }
+
+  bool writeTraceFile(const std::string& path, const Data& d, uint32_t rate_hz,
+                      uint8_t adc_bits, double* ns) {
+    Clock::time_point t0 = Clock::now();
+    TraceWriter w;
+    if(!w.open(path.c_str(), rate_hz, d.n_ch, true, adc_bits)) return false;
+    for(size_t i = 0; i < d.frames; i++) w.add(&d.samples[i * d.n_ch], d.labels[i]);
+    bool ok = w.close();
+    *ns = elapsedNs(t0);
+    return ok;
+  }
+
+  size_t fileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) ? 0 : (size_t)st.st_size;
+  }
+
+  /* parse the mapped CSV into interleaved samples and labels */
+  bool parseCsv(const std::string& path, Data& out) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    size_t size = fileSize(path);
+    void* m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED) return false;
+    const char* p = (const char*)m;
+    const char* end = p + size;
+    out.samples.clear();
+    out.labels.clear();
+    while(p < end) {
+      for(uint8_t c = 0; c <= out.n_ch && p < end; c++) {
+        unsigned v = 0;
+        while(p < end && *p >= '0' && *p <= '9') v = v * 10 + (unsigned)(*p++ - '0');
+        if(c < out.n_ch) out.samples.push_back((uint16_t)v);
+        else out.labels.push_back((uint8_t)v);
+        p++;      // ',' or '\n'
+      }
+    }
+    munmap(m, size);
+    out.frames = out.labels.size();
+    return true;
+  }
+
+  /* largest difference between the channel-planar decode and the data */
+  unsigned maxError(const Data& d, const std::vector<std::vector<uint16_t> >& ch) {
+    unsigned err = 0;
+    for(uint8_t c = 0; c < d.n_ch; c++) {
+      if(ch[c].size() != d.frames) return 65536;
+      for(size_t i = 0; i < d.frames; i++) {
+        int e = (int)ch[c][i] - (int)d.samples[i * d.n_ch + c];
+        err = std::max(err, (unsigned)(e < 0 ? -e : e));
+      }
+    }
+    return err;
+  }
+
+  /* every chunk of every channel, into channel-planar vectors */
+  bool decodeAll(const TraceFileReader& r, std::vector<std::vector<uint16_t> >& ch,
+                 std::vector<uint8_t>& labels) {
+    ch.assign(r.channels(), std::vector<uint16_t>(r.frames()));
+    labels.resize(r.frames());
+    for(uint32_t k = 0; k < r.chunks(); k++) {
+      size_t at = r.chunkFirstFrame(k);
+      for(uint8_t c = 0; c < r.channels(); c++)
+        if(!r.decode(k, c, &ch[c][at])) return false;
+      if(!r.decodeLabels(k, &labels[at])) return false;
+    }
+    return true;
+  }
+
+  void streamAll(const TraceFileReader& r, std::vector<std::vector<uint16_t> >& ch,
+                 size_t block) {
+    ch.assign(r.channels(), std::vector<uint16_t>(r.frames()));
+    for(uint8_t c = 0; c < r.channels(); c++) {
+      TraceFileReader::Cursor cur(r, c);
+      size_t at = 0, n;
+      while(at < r.frames() && (n = cur.read(&ch[c][at], std::min(block, r.frames() - at))))
+        at += n;
+      ch[c].resize(at);
+    }
+  }
+
+  double gbps(size_t bytes, double ns) { return ns > 0 ? bytes / ns : 0; }
+
+  template <typename F>
+  double best(int reps, F f) {
+    double b = 1e30;
+    for(int i = 0; i < reps; i++) {
+      Clock::time_point t0 = Clock::now();
+      f();
+      b = std::min(b, elapsedNs(t0));
+    }
+    return b;
+  }
+
+  void benchFile(const char* name, const std::string& path, const Data& d,
+                 size_t csv_bytes, double write_ns, size_t block) {
+    TraceFileReader r;
+    if(!r.open(path.c_str())) {
+      printf("%s: cannot read %s\n", name, path.c_str());
+      return;
+    }
+    size_t n_samples = d.frames * d.n_ch;
+    size_t raw = n_samples * 2;
+    printf("%s: %zu bytes, %.3f bytes/sample, %.2fx smaller than CSV, %.2fx than raw u16"
+           " (%u chunks); written at %.3f GB/s\n",
+           name, r.fileSize(), (double)r.fileSize() / n_samples,
+           (double)csv_bytes / r.fileSize(), (double)raw / r.fileSize(), r.chunks(),
+           gbps(raw, write_ns));
+
+    std::vector<std::vector<uint16_t> > ch;
+    std::vector<uint8_t> labels;
+    bool ok = true;
+    double ns = best(3, [&]() { ok = decodeAll(r, ch, labels) && ok; });
+    unsigned err = maxError(d, ch);
+    bool labels_ok = labels == d.labels;
+    printf("  decode chunks    %7.3f GB/s  (%.3f GB/s of file)  max error %u%s%s\n",
+           gbps(raw, ns), gbps(r.fileSize(), ns), err, ok ? "" : ", CORRUPT",
+           labels_ok ? "" : ", LABELS DIFFER");
+    ns = best(3, [&]() { streamAll(r, ch, block); });
+    printf("  stream cursors   %7.3f GB/s  max error %u\n", gbps(raw, ns), maxError(d, ch));
+
+    /* PeakDetection fed from the file, per channel, against from memory */
+    std::vector<uint16_t> buf(block);
+    std::vector<PeakSignal> out(block), ref(block);
+    size_t peaks = 0, diff = 0;
+    ns = best(3, [&]() {
+      peaks = 0;
+      for(uint8_t c = 0; c < r.channels(); c++) {
+        PeakDetection<LOG_2LAG> pd;
+        TraceFileReader::Cursor cur(r, c);
+        size_t n;
+        while((n = cur.read(&buf[0], block))) {
+          pd.addBlock(&buf[0], n, &out[0]);
+          for(size_t i = 0; i < n; i++) peaks += out[i] == PeakSignal::PEAK;
+        }
+      }
+    });
+    for(uint8_t c = 0; c < r.channels(); c++) {
+      PeakDetection<LOG_2LAG> pd, pd_file;
+      TraceFileReader::Cursor cur(r, c);
+      for(size_t at = 0; at < d.frames; at += block) {
+        size_t n = std::min(block, d.frames - at);
+        for(size_t i = 0; i < n; i++) buf[i] = d.samples[(at + i) * d.n_ch + c];
+        pd.addBlock(&buf[0], n, &ref[0]);
+        cur.read(&buf[0], n);
+        pd_file.addBlock(&buf[0], n, &out[0]);
+        for(size_t i = 0; i < n; i++) diff += ref[i] != out[i];
+      }
+    }
+    double mem_ns = best(3, [&]() {
+      for(uint8_t c = 0; c < r.channels(); c++) {
+        PeakDetection<LOG_2LAG> pd;
+        for(size_t at = 0; at < d.frames; at += block) {
+          size_t n = std::min(block, d.frames - at);
+          for(size_t i = 0; i < n; i++) buf[i] = d.samples[(at + i) * d.n_ch + c];
+          pd.addBlock(&buf[0], n, &ref[0]);
+        }
+      }
+    });
+    printf("  PeakDetection    %7.2f ns/sample from the file, %.2f from memory;"
+           " %zu PEAK decisions, %zu differ\n",
+           ns / n_samples, mem_ns / n_samples, peaks, diff);
+
+    std::mt19937 rng(7);
+    const int seeks = 2000;
+    size_t wrong = 0;
+    ns = best(3, [&]() {
+      for(int i = 0; i < seeks; i++) {
+        uint64_t f = rng() % d.frames;
+        uint8_t c = (uint8_t)(rng() % d.n_ch);
+        TraceFileReader::Cursor cur(r, c, f);
+        uint16_t v;
+        if(!cur.read(&v, 1) || (r.adcBits() == 16 && v != d.samples[f * d.n_ch + c]))
+          wrong++;
+      }
+    });
+    printf("  seek             %7.2f us/seek%s\n", ns / seeks / 1000,
+           wrong ? ", WRONG SAMPLES" : "");
+  }
+
+}
+
+int main(int argc, char** argv) {
+  unsigned n_ch = 4;
+  uint32_t rate_hz = 1000;
+  double seconds = 3600;
+  double noise = 250;
+  unsigned seed = 1;
+  size_t block = 64;
+  std::string dir = "/tmp";
+  bool keep = false;
+  int opt;
+  while((opt = getopt(argc, argv, "c:r:s:n:S:b:d:k")) != -1) {
+    switch(opt) {
+      case 'c': n_ch = (unsigned)atoi(optarg); break;
+      case 'r': rate_hz = (uint32_t)atoi(optarg); break;
+      case 's': seconds = atof(optarg); break;
+      case 'n': noise = atof(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 'b': block = (size_t)atol(optarg); break;
+      case 'd': dir = optarg; break;
+      case 'k': keep = true; break;
+      default:
+        n_ch = 0;
+        break;
+    }
+  }
+  if(!n_ch || n_ch > TRACE_FILE_MAX_CH || !block || !rate_hz) {
+    fprintf(stderr, "usage: %s [-c channels] [-r rate_hz] [-s seconds] [-n noise]"
+                    " [-S seed] [-b block] [-d dir] [-k]\n", argv[0]);
+    return 2;
+  }
+
+  size_t frames = (size_t)(seconds * rate_hz);
+  Data d = generate(frames, (uint8_t)n_ch, noise, seed);
+  size_t n_samples = frames * n_ch;
+  printf("%zu frames x %u channels at %u Hz (%.1f h), noise %.0f\n",
+         frames, n_ch, rate_hz, seconds / 3600, noise);
+
+  std::string csv = dir + "/bench_tracefile.csv";
+  std::string f16 = dir + "/bench_tracefile.mktf";
+  std::string f12 = dir + "/bench_tracefile.12.mktf";
+  Clock::time_point t0 = Clock::now();
+  if(!writeCsv(csv, d)) {
+    fprintf(stderr, "cannot write %s\n", csv.c_str());
+    return 1;
+  }
+  double csv_write_ns = elapsedNs(t0);
+  size_t csv_bytes = fileSize(csv);
+  printf("CSV: %zu bytes, %.3f bytes/sample; written at %.3f GB/s\n", csv_bytes,
+         (double)csv_bytes / n_samples, gbps(n_samples * 2, csv_write_ns));
+
+  Data parsed;
+  parsed.n_ch = d.n_ch;
+  bool ok = true;
+  double ns = best(3, [&]() { ok = parseCsv(csv, parsed) && ok; });
+  bool same = ok && parsed.samples == d.samples && parsed.labels == d.labels;
+  printf("  parse            %7.3f GB/s  (%.3f GB/s of file)%s\n",
+         gbps(n_samples * 2, ns), gbps(csv_bytes, ns), same ? "" : ", MISMATCH");
+
+  double w16, w12;
+  if(!writeTraceFile(f16, d, rate_hz, 16, &w16) || !writeTraceFile(f12, d, rate_hz, 12, &w12)) {
+    fprintf(stderr, "cannot write trace files in %s\n", dir.c_str());
+    return 1;
+  }
+  benchFile("16 bit", f16, d, csv_bytes, w16, block);
+  benchFile("12 bit", f12, d, csv_bytes, w12, block);
+
+  if(!keep) {
+    unlink(csv.c_str());
+    unlink(f16.c_str());
+    unlink(f12.c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,180 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Reconnection benchmark.
+ *
+ * Runs PresentationRemote against the simulated central: the central pairs
+ * once, then for each cycle drops the link, stays away for a while and comes
+ * back scanning (scan_window_ms every scan_interval_ms, as a host scanning
+ * in the background does). Reports the time from the host scanning again to
+ * the connection, which advertising tier the peripheral was in when it
+ * reconnected, and how many times the host had to pair.
+ *
+ * The away time cycles through 0.5 s, 5 s, 45 s and 120 s so that every tier
+ * is exercised, unless -a fixes it. -l uses the single 200 ms advertising
+ * setting Myokbd had before tiered advertising, for comparison.
+ *
+ * The central connects from a resolvable private address; -p makes it use
+ * its identity address, -N takes LL privacy away from the peripheral's
+ * controller (the bonded tiers are then skipped).
+ *
+ * usage: reconnect [-l] [-p] [-N] [-n cycles] [-a away_ms] [-i scan_interval_ms]
+ *                  [-w scan_window_ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "PresentationRemote.h"
+
+using namespace myokbd;
+
+namespace {
+
+  const uint32_t AwayMs[] = { 500, 5000, 45000, 120000 };
+  const size_t NAway = sizeof(AwayMs) / sizeof(AwayMs[0]);
+  const uint32_t GiveUpMs = 600000;
+
+  struct Reconnects {
+    unsigned n = 0;
+    uint64_t sum = 0;
+    uint32_t min = UINT32_MAX, max = 0;
+
+    void add(uint32_t ms) {
+      n++;
+      sum += ms;
+      if(ms < min) min = ms;
+      if(ms > max) max = ms;
+    }
+
+    void print(const char* what) const {
+      if(n)
+        printf("%s: min %u ms, mean %.1f ms, max %u ms (%u)\n",
+               what, min, (double)sum / n, max, n);
+    }
+  };
+
+  uint32_t nowMs() {
+    return (uint32_t)rtos::Kernel::get_ms_count();
+  }
+
+  /* run the scheduler until done() or timeout_ms of virtual time passed */
+  template <typename F>
+  bool runUntil(Scheduler& sched, F done, uint32_t timeout_ms) {
+    uint32_t until = nowMs() + timeout_ms;
+    // wakes the scheduler at the deadline even when nothing else is due
+    int wake = sched.queue(PRIO_BLE).call_in(timeout_ms, []() { });
+    while(!done() && (int32_t)(until - nowMs()) > 0) sched.runOnce();
+    sched.queue(PRIO_BLE).cancel(wake);
+    return done();
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-l] [-p] [-N] [-n cycles] [-a away_ms] [-i scan_interval_ms] "
+                    "[-w scan_window_ms]\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  bool legacy = false;
+  bool identity = false;
+  bool no_ll_privacy = false;
+  unsigned cycles = 40;
+  uint32_t away_ms = 0;
+  double scan_interval_ms = 1280;
+  double scan_window_ms = 11.25;
+  int opt;
+  while((opt = getopt(argc, argv, "lpNn:a:i:w:")) != -1) {
+    switch(opt) {
+      case 'l': legacy = true; break;
+      case 'p': identity = true; break;
+      case 'N': no_ll_privacy = true; break;
+      case 'n': cycles = (unsigned)atoi(optarg); break;
+      case 'a': away_ms = (uint32_t)atoi(optarg); break;
+      case 'i': scan_interval_ms = atof(optarg); break;
+      case 'w': scan_window_ms = atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  mbed_host::FakeLink& link = mbed_host::link();
+  link.scan_interval_us = (uint64_t)(scan_interval_ms * 1000);
+  link.scan_window_us = (uint64_t)(scan_window_ms * 1000);
+  link.central_private = !identity;
+  link.ll_privacy = !no_ll_privacy;
+
+  Scheduler sched;
+  BLEDevice &ble = BLEDevice::Instance();
+  PresentationRemote pr(ble, sched, MYOKBD_BT_DEVICE_NAME,
+                        legacy ? SlowAdvertisingTiers : DefaultAdvertisingTiers,
+                        legacy ? SlowAdvertisingTiersSize : DefaultAdvertisingTiersSize);
+  pr.start();
+
+  auto connected = [&link]() { return link.connected(); };
+  auto disconnected = [&link]() { return !link.connected(); };
+
+  link.scan(ble);
+  if(!runUntil(sched, connected, GiveUpMs)) {
+    fprintf(stderr, "the central never connected\n");
+    return 1;
+  }
+  uint32_t first_ms = nowMs();
+
+  Reconnects all, by_away[NAway];
+  uint64_t adv_events = link.advertisingEvents();
+  uint32_t adv_start_ms = nowMs();
+  for(unsigned i = 0; i < cycles; i++) {
+    runUntil(sched, []() { return false; }, 1000);
+    link.disconnect(ble);
+    runUntil(sched, disconnected, 1000);
+
+    uint32_t away = away_ms ? away_ms : AwayMs[i % NAway];
+    runUntil(sched, []() { return false; }, away);
+
+    uint32_t back_ms = nowMs();
+    link.scan(ble);
+    if(!runUntil(sched, connected, GiveUpMs)) {
+      printf("cycle %u: no reconnection within %u s\n", i, GiveUpMs / 1000);
+      continue;
+    }
+    uint32_t ms = nowMs() - back_ms;
+    all.add(ms);
+    if(!away_ms) by_away[i % NAway].add(ms);
+  }
+  // let the last reconnection's events reach the sketch
+  runUntil(sched, []() { return false; }, 100);
+  uint32_t span_ms = nowMs() - adv_start_ms;
+  adv_events = link.advertisingEvents() - adv_events;
+
+  const Advertiser::Stats& st = pr.advertisingStats();
+  printf("advertising: %s, scan %.2f ms every %.0f ms\n",
+         legacy ? "200 ms open (legacy)" : "tiered", scan_window_ms, scan_interval_ms);
+  printf("central address: %s, peripheral controller %s LL privacy\n",
+         identity ? "identity" : "resolvable private", no_ll_privacy ? "without" : "with");
+  printf("first connection after %.3f s, %u pairing(s) in %u reconnection(s)\n",
+         first_ms / 1000.0, pr.pairings(), all.n);
+  all.print("reconnect (host scanning -> connected)");
+  for(size_t a = 0; a < NAway; a++) {
+    char what[32];
+    snprintf(what, sizeof(what), "  away %u s", AwayMs[a] / 1000);
+    if(AwayMs[a] < 1000) snprintf(what, sizeof(what), "  away %u ms", AwayMs[a]);
+    by_away[a].print(what);
+  }
+  if(st.reconnects)
+    printf("reconnect (disconnection -> connected): mean %.1f ms, max %u ms\n",
+           (double)st.total_ms / st.reconnects, st.max_ms);
+  printf("reconnected in tier:");
+  size_t n_tiers = legacy ? SlowAdvertisingTiersSize : DefaultAdvertisingTiersSize;
+  for(size_t t = 0; t < n_tiers; t++) printf(" %u", st.by_tier[t]);
+  printf("\nadvertising events: %llu (%.1f/s over %.1f s)\n",
+         (unsigned long long)adv_events, adv_events * 1000.0 / span_ms, span_ms / 1000.0);
+  return 0;
+}
@@ -0,0 +1,404 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Trace replay driver.
+ *
+ * Runs the unmodified sketch signal path (PresentationController ->
+ * PeakDetection -> PresentationRemote -> KeyboardService) against the host
+ * mbed stand-in, feeding a recorded ADC trace into the analog pin, and
+ * reports throughput, the slide commands received by the simulated central
+ * and, for labelled traces, onset-to-command latency.
+ *
+ * The trace is sampled at its recorded rate unless -r overrides it, in which
+ * case it is replayed faster or slower than real time.
+ *
+ * The central connects at conn_interval_ms (-c) and grants connection
+ * parameter updates down to min_interval_ms (-m, 7.5 ms by default).
+ *
+ * With MYOKBD_METRICS, also prints the sketch's own latency probes and
+ * counters (Metrics.h), as read from the metrics characteristic.
+ *
+ * -T writes the sketch's event trace (EventTrace.h), as dumped on serial,
+ * to a file for host/trace_decode.
+ *
+ * -e replaces the configured onset decision (EMG_DECISION) with z, tkeo or
+ * cusum (see PeakDecision.h); tkeo only with a raw EMG sensor
+ * (EMG_INPUT_ENVELOPE 0).
+ *
+ * -w stores a calibration before the sketch starts, as if saved before the
+ * electrodes moved: the first window of the trace offset by that many ADC
+ * counts, with a 2 SD threshold. The sketch should drop it once the signal
+ * disagrees, and calibrate the threshold again.
+ *
+ * usage: replay [-q] [-r rate_hz] [-d drain_ms] [-c conn_interval_ms]
+ *               [-m min_interval_ms] [-e engine] [-w offset] [-T trace.bin]
+ *               trace.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+#include "config.h"
+#include "PresentationRemote.h"
+#include "PresentationController.h"
+#include "EventTrace.h"
+
+#include "BlockDevice.h"
+
+#include "Trace.h"
+#include "HidLog.h"
+
+using namespace myokbd;
+using namespace myokbd::host;
+
+namespace {
+
+#if MYOKBD_METRICS
+  /* count, median (as the range of its bucket) and max of a probe histogram */
+  void printLatency(const char* name, const LatencyHistogram& h) {
+    uint32_t n = 0;
+    for(uint8_t b = 0; b < LatencyHistogram::N_BUCKETS; b++) n += h.count[b];
+    uint32_t seen = 0;
+    uint8_t med = 0;
+    for(; med < LatencyHistogram::N_BUCKETS; med++) {
+      seen += h.count[med];
+      if(2 * seen >= n) break;
+    }
+    if(!n) {
+      printf("  %-18s none\n", name);
+      return;
+    }
+    double lo = med ? (LatencyHistogram::BASE_US << (med - 1)) / 1000.0 : 0.0;
+    double hi = (LatencyHistogram::BASE_US << med) / 1000.0;
+    if(med == LatencyHistogram::N_BUCKETS - 1)
+      printf("  %-18s %5u, median over %.2f ms, max %.2f ms\n", name, n, lo, h.max_us / 1000.0);
+    else
+      printf("  %-18s %5u, median %.2f-%.2f ms, max %.2f ms\n", name, n, lo, hi,
+             h.max_us / 1000.0);
+  }
+
+  void printMetrics() {
+    Metrics::Snapshot m;
+    metrics().snapshot(m);
+    printf("probes (sketch metrics):\n");
+    printLatency("sample -> flip", m.latency[Metrics::SAMPLE_TO_FLIP]);
+    printLatency("flip -> enqueue", m.latency[Metrics::FLIP_TO_ENQUEUE]);
+    printLatency("enqueue -> write", m.latency[Metrics::ENQUEUE_TO_WRITE]);
+    printLatency("sample -> write", m.latency[Metrics::SAMPLE_TO_WRITE]);
+    printf("  counters: %u busy retries, %u failed reports, %u keys dropped, "
+           "%u busy give-ups, %u ADC overruns\n",
+           m.counters[Metrics::BUSY_RETRIES], m.counters[Metrics::FAILED_REPORTS],
+           m.counters[Metrics::KEYS_DROPPED], m.counters[Metrics::BUSY_GIVE_UPS],
+           m.counters[Metrics::ADC_OVERRUNS]);
+  }
+#endif
+
+  /* EventTrace::dump() sink */
+  struct FileSink {
+    FILE* f;
+    FileSink(const char* path) : f(fopen(path, "wb")) { }
+    ~FileSink() { if(f) fclose(f); }
+    size_t write(const uint8_t* buf, size_t n) { return fwrite(buf, 1, n, f); }
+  };
+
+  struct Command {
+    uint64_t t_us;
+    uint8_t label;      // command expressed as the Label that should cause it
+    uint8_t usage;
+  };
+
+  const char* labelName(uint8_t label) {
+    switch(label) {
+      case LABEL_PREV: return "PREV";
+      case LABEL_NEXT: return "NEXT";
+      default: return "KEY";
+    }
+  }
+
+  uint8_t usageToLabel(uint8_t usage) {
+    switch(usage) {
+      case USAGE_LEFT_ARROW: return LABEL_PREV;
+      case USAGE_RIGHT_ARROW: return LABEL_NEXT;
+      default: return 0xff;
+    }
+  }
+
+  struct Latency {
+    unsigned n = 0;
+    double sum = 0, min = 1e9, max = 0;
+
+    void add(double ms) {
+      n++;
+      sum += ms;
+      if(ms < min) min = ms;
+      if(ms > max) max = ms;
+    }
+
+    void print(const char* what) const {
+      if(n)
+        printf("%s: min %.1f ms, mean %.1f ms, max %.1f ms\n",
+               what, min, sum / n, max);
+    }
+  };
+
+  /* what the sketch reports once the trace has been consumed */
+  struct SketchStats {
+    uint32_t idle_samples, det_samples, rate_changes, startup_ms, calibrated_ms;
+    float threshold;
+    bool warm;
+  };
+
+  /* save a snapshot of the first window of t, offset by offset ADC counts,
+   * under the key the sketch loads (see -w) */
+  template <typename DETECTOR>
+  void storeMovedWindow(CalibrationStore& calib, const Trace& t, int offset) {
+    typename DETECTOR::Snapshot snap;
+    const size_t lag = sizeof(snap.window) / sizeof(snap.window[0]);
+    snap.thr2_q8[0] = 2 * 2 * 256;     // AutoThreshold::MIN_THRESHOLD, in q8
+    snap.slot = 0;
+    for(size_t i = 0; i < lag; i++) {
+      int v = (int)t.samples[i < t.size() ? i : t.size() - 1] + offset;
+      snap.window[i][0] = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+    }
+    calib.save(PresentationController<1, EmgFrontEnd, DETECTOR>::calibrationKey(),
+               &snap, sizeof(snap));
+  }
+
+  /* runs the sketch loop with the given detector until the trace has been
+   * consumed */
+  template <typename DETECTOR>
+  SketchStats runSketch(PresentationRemote& pr, Scheduler& sched, uint32_t rate_hz,
+                        CalibrationStore& calib, const Trace& t, const int* moved) {
+    if(moved) storeMovedWindow<DETECTOR>(calib, t, *moved);
+    const PinName pins[1] = { analogPinToPinName(A0) };
+    PresentationController<1, EmgFrontEnd, DETECTOR> pc(
+        &pr, pins, sched, GESTURE_LONG_MS, GESTURE_MIN_TAP_MS, rate_hz, DefaultCommandMap,
+        DefaultCommandMapSize, &calib);
+    while(!mbed_host::sim().stopRequested()) sched.runOnce();
+    SketchStats s;
+    s.idle_samples = pc.idleSamples();
+    s.det_samples = pc.samples();
+    s.rate_changes = pc.rateChanges();
+    s.startup_ms = pc.startupMs();
+    s.calibrated_ms = pc.calibratedMs();
+    s.threshold = pc.autoThreshold().done() ? pc.autoThreshold().threshold(0) : 0;
+    s.warm = pc.warmStarted();
+    return s;
+  }
+
+  template <template <uint8_t, uint16_t, uint8_t> class DECISION>
+  SketchStats runSketchWith(PresentationRemote& pr, Scheduler& sched, uint32_t rate_hz,
+                            CalibrationStore& calib, const Trace& t, const int* moved) {
+    typedef ldry::signal::MultiPeakDetection<1, EMG_LOG2_LAG, DECISION, EMG_DEBOUNCE> Detector;
+    return runSketch<Detector>(pr, sched, rate_hz, calib, t, moved);
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-q] [-r rate_hz] [-d drain_ms] [-c conn_interval_ms] "
+                    "[-m min_interval_ms] [-e z|tkeo|cusum] [-w offset] [-T trace.bin] "
+                    "trace.txt\n",
+            prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  bool quiet = false;
+  uint32_t drain_ms = 1000;
+  uint32_t conn_interval_ms = 30;
+  double min_interval_ms = 7.5;
+  uint32_t rate_hz = 0;
+  const char* engine = NULL;
+  const char* trace_out = NULL;
+  int moved_offset = 0;
+  const int* moved = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "qr:d:c:m:e:w:T:")) != -1) {
+    switch(opt) {
+      case 'q': quiet = true; break;
+      case 'r': rate_hz = (uint32_t)atoi(optarg); break;
+      case 'd': drain_ms = (uint32_t)atoi(optarg); break;
+      case 'c': conn_interval_ms = (uint32_t)atoi(optarg); break;
+      case 'm': min_interval_ms = atof(optarg); break;
+      case 'e': engine = optarg; break;
+      case 'w': moved_offset = atoi(optarg); moved = &moved_offset; break;
+      case 'T': trace_out = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind >= argc) usage(argv[0]);
+  if(engine && strcmp(engine, "z") && strcmp(engine, "tkeo") && strcmp(engine, "cusum"))
+    usage(argv[0]);
+  if(engine && !strcmp(engine, "tkeo") && EMG_INPUT_ENVELOPE) {
+    fprintf(stderr, "tkeo needs raw EMG; the sensor gives an envelope (EMG_INPUT_ENVELOPE)\n");
+    return 2;
+  }
+
+  Trace trace;
+  if(!loadTrace(argv[optind], trace)) {
+    fprintf(stderr, "cannot read trace %s\n", argv[optind]);
+    return 1;
+  }
+  if(!rate_hz) rate_hz = trace.rate_hz;
+
+  ReplaySource src(trace, rate_hz, drain_ms);
+  mbed_host::attachAnalog(analogPinToPinName(A0), &src);
+  mbed_host::link().conn_interval_us = conn_interval_ms * 1000;
+  mbed_host::link().central_min_interval_us = (uint64_t)(min_interval_ms * 1000);
+
+  Scheduler sched;
+  BLEDevice &ble = BLEDevice::Instance();
+  PresentationRemote pr(ble, sched);
+  pr.start();
+  mbed_host::link().connect(ble);
+
+  // calibration flash: two 4 kB pages, as on the target
+  mbed::HeapBlockDevice calib_bd(MYOKBD_CALIB_SIZE, 1, 4, 4096);
+  CalibrationStore calib(calib_bd);
+  calib.init();
+
+  auto wall_start = std::chrono::steady_clock::now();
+  SketchStats st;
+  if(!engine)
+    st = runSketch<EmgDetector<1> >(pr, sched, rate_hz, calib, trace, moved);
+  else if(!strcmp(engine, "z"))
+    st = runSketchWith<ldry::signal::ZScoreDecision>(pr, sched, rate_hz, calib, trace, moved);
+#if !EMG_INPUT_ENVELOPE
+  else if(!strcmp(engine, "tkeo"))
+    st = runSketchWith<ldry::signal::TkeoDecision>(pr, sched, rate_hz, calib, trace, moved);
+#endif
+  else
+    st = runSketchWith<ldry::signal::CusumDecision>(pr, sched, rate_hz, calib, trace, moved);
+  double wall_s = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - wall_start).count();
+
+  // commands as seen by the central
+  const std::vector<mbed_host::Notification>& log = mbed_host::link().log();
+  std::vector<KeyPress> presses = keyPresses(log, inputReportHandle(log));
+  std::vector<Command> cmds;
+  for(size_t i = 0; i < presses.size(); i++) {
+    Command c = { presses[i].t_us, usageToLabel(presses[i].usage), presses[i].usage };
+    cmds.push_back(c);
+  }
+
+  printf("trace: %s (%zu samples @ %u Hz%s), sampled at %u Hz\n", argv[optind],
+         trace.size(), trace.rate_hz, trace.labelled() ? ", labelled" : "",
+         rate_hz);
+  if(engine) printf("onset decision: %s\n", engine);
+  if(rate_hz != EMG_SAMPLE_RATE_HZ)
+    printf("note: the filter front end is designed for %u Hz\n", EMG_SAMPLE_RATE_HZ);
+  printf("samples: %zu replayed, %.3f s virtual, %.3f s wall, %.0f samples/s\n",
+         src.consumed(), mbed_host::sim().now_us() / 1e6, wall_s,
+         wall_s > 0 ? src.consumed() / wall_s : 0.0);
+
+  // match every labelled contraction with the first command issued between
+  // its onset and the onset of the next one
+  std::vector<Segment> segs = segments(trace);
+  std::vector<int> match(cmds.size(), -1);
+  size_t ci = 0;
+  for(size_t si = 0; si < segs.size(); si++) {
+    if(segs[si].onset >= src.consumed()) break;
+    uint64_t t0 = src.readTime(segs[si].onset);
+    uint64_t t1 = (si + 1 < segs.size() && segs[si + 1].onset < src.consumed()) ?
+                  src.readTime(segs[si + 1].onset) : UINT64_MAX;
+    while(ci < cmds.size() && cmds[ci].t_us < t0) ci++;
+    if(ci < cmds.size() && cmds[ci].t_us < t1) match[ci++] = (int)si;
+  }
+
+  unsigned correct = 0, wrong = 0, spurious = 0;
+  Latency all, per_label[LABEL_NEXT + 1];
+  if(!quiet) printf("commands:\n");
+  for(size_t i = 0; i < cmds.size(); i++) {
+    const Command& c = cmds[i];
+    if(!quiet) printf("  t=%9.3f s  %-4s", c.t_us / 1e6, labelName(c.label));
+    if(match[i] >= 0) {
+      const Segment& s = segs[match[i]];
+      double lat = (c.t_us - src.readTime(s.onset)) / 1000.0;
+      all.add(lat);
+      if(s.label <= LABEL_NEXT) per_label[s.label].add(lat);
+      if(s.label == c.label) correct++;
+      else wrong++;
+      if(!quiet) printf("  latency %7.1f ms  (labelled %s, held %.0f ms)", lat,
+                        labelName(s.label),
+                        (s.offset - s.onset) * 1000.0 / rate_hz);
+    } else {
+      spurious++;
+      if(!quiet && trace.labelled()) printf("  spurious");
+    }
+    if(!quiet) printf("\n");
+  }
+
+  printf("commands: %zu (%zu reports)\n", cmds.size(), log.size());
+  printf("events: %llu interrupt, %llu thread\n",
+         (unsigned long long)mbed_host::sim().isrEvents(),
+         (unsigned long long)mbed_host::sim().threadEvents());
+  printf("scheduler: %u sleeps, %u/%u/%u sampling/input/ble dispatches\n",
+         sched.sleeps(), sched.dispatches(PRIO_SAMPLING),
+         sched.dispatches(PRIO_INPUT), sched.dispatches(PRIO_BLE));
+  // energy proxies: every interrupt wakes the MCU, every scheduler sleep ends
+  // in a thread wakeup
+  double virt_s = mbed_host::sim().now_us() / 1e6;
+  printf("energy: %.1f interrupts/s, %.1f thread wakeups/s, %.1f ADC conversions/s\n",
+         mbed_host::sim().isrEvents() / virt_s, sched.sleeps() / virt_s,
+         src.reads() / virt_s);
+  const ConnectionPolicy::Stats& cs = pr.connectionStats();
+  printf("connection: %u updates requested, %u granted (%u not as asked), %u failed; "
+         "%.1f%% of the time at the fast interval\n", cs.requests, cs.updates,
+         cs.not_as_asked, cs.failed,
+         cs.connected_ms ? 100.0 * cs.fast_ms / cs.connected_ms : 0.0);
+  printf("  now %.2f ms interval, latency %u, timeout %u ms; %.1f radio events/s\n",
+         cs.interval * 1.25, cs.latency, cs.timeout * 10,
+         mbed_host::link().radioEvents() / virt_s);
+  printf("sampling: %.1f%% of samples at the idle rate, %u rate changes\n",
+         st.det_samples ? 100.0 * st.idle_samples / st.det_samples : 0.0,
+         st.rate_changes);
+  printf("startup: detector usable %u ms after start (%s); calibration saved %u "
+         "time(s), %llu page erases\n", st.startup_ms, st.warm ? "warm" : "cold",
+         calib.saves(), (unsigned long long)calib_bd.erasedBlocks());
+  if(moved)
+    printf("moved window (offset %d): %s\n", moved_offset,
+           st.warm ? "kept, threshold not calibrated again" :
+           st.calibrated_ms ? "dropped, threshold calibrated again" :
+                              "dropped, threshold not calibrated again");
+  if(st.calibrated_ms)
+    printf("threshold: auto-calibrated to %.2f standard deviations after %.1f s\n",
+           st.threshold, st.calibrated_ms / 1000.0);
+  else
+    printf("threshold: not calibrated (no rest long enough), %.2f\n", EMG_THRESHOLD);
+#if MYOKBD_METRICS
+  printMetrics();
+#endif
+  if(trace_out) {
+#if MYOKBD_TRACE
+    FileSink out(trace_out);
+    if(!out.f) {
+      fprintf(stderr, "cannot write %s\n", trace_out);
+      return 1;
+    }
+    printf("event trace: %zu records written to %s\n", eventTrace().dump(out), trace_out);
+#else
+    printf("event trace: disabled (MYOKBD_TRACE 0)\n");
+#endif
+  }
+  if(trace.labelled()) {
+    unsigned matched = correct + wrong;
+    size_t n_segs = 0;
+    for(size_t si = 0; si < segs.size(); si++)
+      if(segs[si].onset < src.consumed()) n_segs++;
+    printf("gestures: %zu labelled, %u correct, %u wrong command, %zu missed, %u spurious\n",
+           n_segs, correct, wrong, n_segs - matched, spurious);
+    all.print("latency (onset -> command)");
+    per_label[LABEL_PREV].print("  PREV gestures");
+    per_label[LABEL_NEXT].print("  NEXT gestures");
+  }
+  return 0;
+}
@@ -0,0 +1,4 @@
+/* Host stand-in for the Arduino core globals, see Arduino.h */
+#include "Arduino.h"
+
+HostSerial Serial;
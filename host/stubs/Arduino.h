@@ -0,0 +1,60 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Host stand-in for the Arduino core. The Arduino builder implicitly
+ * includes Arduino.h in every sketch file; the host Makefile mirrors this
+ * with -include.
+ */
+#ifndef _MBED_HOST_STUB_ARDUINO_H_
+#define _MBED_HOST_STUB_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <cmath>
+#include <cstdlib>
+
+#include "mbed.h"
+
+using std::abs;
+
+#define A0 200
+#define A1 201
+#define A2 202
+#define A3 203
+#define A4 204
+#define A5 205
+#define A6 206
+#define A7 207
+
+inline PinName analogPinToPinName(int pin) { return (PinName)pin; }
+
+/** Blocking delay: other contexts keep running on the virtual clock */
+inline void delay(unsigned long ms) {
+  mbed_host::sim().advance((uint64_t)ms * 1000);
+}
+
+inline unsigned long millis() { return mbed_host::sim().now_ms(); }
+inline unsigned long micros() { return (unsigned long)mbed_host::sim().now_us(); }
+
+/** Serial output is discarded on the host */
+class HostSerial {
+  public:
+    void begin(unsigned long baud) { }
+    template<typename T> size_t print(const T&) { return 0; }
+    template<typename T> size_t println(const T&) { return 0; }
+    size_t println() { return 0; }
+    size_t write(const uint8_t* buf, size_t n) { return n; }
+    int available() { return 0; }
+    int read() { return -1; }
+    operator bool() const { return true; }
+};
+
+extern HostSerial Serial;
+
+#endif /* _MBED_HOST_STUB_ARDUINO_H_ */
@@ -0,0 +1,113 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Host stand-in for mbed::BlockDevice, with a memory-backed HeapBlockDevice.
+ *
+ * Like flash, a block must be erased before it is programmed again:
+ * programming can only clear bits of erased (0xff) bytes, so a missing erase
+ * shows up as corrupted data rather than going unnoticed.
+ */
+#ifndef _MBED_HOST_STUB_BLOCKDEVICE_H_
+#define _MBED_HOST_STUB_BLOCKDEVICE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace mbed {
+
+  typedef uint64_t bd_addr_t;
+  typedef uint64_t bd_size_t;
+
+  enum {
+    BD_ERROR_OK = 0,
+    BD_ERROR_DEVICE_ERROR = -4001,
+  };
+
+  class BlockDevice {
+    public:
+      virtual ~BlockDevice() { }
+      virtual int init() = 0;
+      virtual int deinit() = 0;
+      virtual int read(void* buffer, bd_addr_t addr, bd_size_t size) = 0;
+      virtual int program(const void* buffer, bd_addr_t addr, bd_size_t size) = 0;
+      virtual int erase(bd_addr_t addr, bd_size_t size) { return BD_ERROR_OK; }
+      virtual int sync() { return BD_ERROR_OK; }
+      virtual bd_size_t get_read_size() const = 0;
+      virtual bd_size_t get_program_size() const = 0;
+      virtual bd_size_t get_erase_size() const { return get_program_size(); }
+      virtual int get_erase_value() const { return -1; }
+      virtual bd_size_t size() const = 0;
+      virtual const char* get_type() const = 0;
+
+      bool is_valid_read(bd_addr_t addr, bd_size_t size) const {
+        return addr % get_read_size() == 0 && size % get_read_size() == 0 &&
+               addr + size <= this->size();
+      }
+      bool is_valid_program(bd_addr_t addr, bd_size_t size) const {
+        return addr % get_program_size() == 0 && size % get_program_size() == 0 &&
+               addr + size <= this->size();
+      }
+      bool is_valid_erase(bd_addr_t addr, bd_size_t size) const {
+        return addr % get_erase_size() == 0 && size % get_erase_size() == 0 &&
+               addr + size <= this->size();
+      }
+  };
+
+  class HeapBlockDevice : public BlockDevice {
+    public:
+      HeapBlockDevice(bd_size_t size, bd_size_t read, bd_size_t program,
+                      bd_size_t erase) :
+        _size(size), _read(read), _program(program), _erase(erase),
+        _erases(0), _programmed(0) { }
+
+      int init() override {
+        if(_data.empty()) _data.assign((size_t)_size, 0xff);
+        return BD_ERROR_OK;
+      }
+      int deinit() override { return BD_ERROR_OK; }
+
+      int read(void* buffer, bd_addr_t addr, bd_size_t size) override {
+        if(_data.empty() || !is_valid_read(addr, size)) return BD_ERROR_DEVICE_ERROR;
+        memcpy(buffer, &_data[(size_t)addr], (size_t)size);
+        return BD_ERROR_OK;
+      }
+      int program(const void* buffer, bd_addr_t addr, bd_size_t size) override {
+        if(_data.empty() || !is_valid_program(addr, size)) return BD_ERROR_DEVICE_ERROR;
+        const uint8_t* b = static_cast<const uint8_t*>(buffer);
+        for(size_t i = 0; i < size; i++) _data[(size_t)addr + i] &= b[i];
+        _programmed += size;
+        return BD_ERROR_OK;
+      }
+      int erase(bd_addr_t addr, bd_size_t size) override {
+        if(_data.empty() || !is_valid_erase(addr, size)) return BD_ERROR_DEVICE_ERROR;
+        memset(&_data[(size_t)addr], 0xff, (size_t)size);
+        _erases += size / _erase;
+        return BD_ERROR_OK;
+      }
+
+      bd_size_t get_read_size() const override { return _read; }
+      bd_size_t get_program_size() const override { return _program; }
+      bd_size_t get_erase_size() const override { return _erase; }
+      int get_erase_value() const override { return 0xff; }
+      bd_size_t size() const override { return _size; }
+      const char* get_type() const override { return "HEAP"; }
+
+      /* ---- host side: wear accounting ---- */
+      uint64_t erasedBlocks() const { return _erases; }
+      uint64_t programmedBytes() const { return _programmed; }
+
+    private:
+      bd_size_t _size, _read, _program, _erase;
+      uint64_t _erases, _programmed;
+      std::vector<uint8_t> _data;
+  };
+
+} /** mbed namespace end **/
+
+#endif /* _MBED_HOST_STUB_BLOCKDEVICE_H_ */
@@ -0,0 +1,5 @@
+/* Host stand-in: see mbed.h */
+#ifndef _MBED_HOST_STUB_CIRCULARBUFFER_H_
+#define _MBED_HOST_STUB_CIRCULARBUFFER_H_
+#include "mbed.h"
+#endif
@@ -0,0 +1,14 @@
+/* Host stand-in: internal flash as a memory-backed block device (4 kB pages) */
+#ifndef _MBED_HOST_STUB_FLASHIAPBLOCKDEVICE_H_
+#define _MBED_HOST_STUB_FLASHIAPBLOCKDEVICE_H_
+
+#include "BlockDevice.h"
+
+class FlashIAPBlockDevice : public mbed::HeapBlockDevice {
+  public:
+    FlashIAPBlockDevice(uint32_t address, uint32_t size) :
+      mbed::HeapBlockDevice(size, 1, 4, 4096) { }
+    const char* get_type() const override { return "FLASHIAP"; }
+};
+
+#endif
@@ -0,0 +1,31 @@
+/* Host stand-in: mounting always succeeds, no files are kept */
+#ifndef _MBED_HOST_STUB_LITTLEFILESYSTEM_H_
+#define _MBED_HOST_STUB_LITTLEFILESYSTEM_H_
+
+#include "BlockDevice.h"
+
+namespace mbed {
+
+  class LittleFileSystem {
+    public:
+      LittleFileSystem(const char* name = NULL, BlockDevice* bd = NULL) :
+        _bd(NULL) {
+        if(bd) mount(bd);
+      }
+      int mount(BlockDevice* bd) {
+        _bd = bd;
+        return bd->init();
+      }
+      int unmount() {
+        _bd = NULL;
+        return 0;
+      }
+      int reformat(BlockDevice* bd) { return mount(bd); }
+
+    private:
+      BlockDevice* _bd;
+  };
+
+}
+
+#endif
@@ -0,0 +1,1341 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Host stand-in for the mbed BLE API (BLE, Gap, GattServer, SecurityManager).
+ *
+ * The stack is modelled at the level Myokbd cares about: events are delivered
+ * through onEventsToProcess/processEvents like on the device, notifications
+ * consume a bounded number of stack buffers and are only transmitted at
+ * connection events, and onDataSent reports the buffers released by each
+ * connection event. mbed_host::link() drives the simulated central and keeps
+ * a log of every notification that made it over the air; it also plays the
+ * advertising events, so that a scanning central can (re)connect, and the
+ * pairing/bonding the SecurityManager would do.
+ */
+#ifndef _MBED_HOST_STUB_BLE_H_
+#define _MBED_HOST_STUB_BLE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "../mbed.h"
+
+enum ble_error_t {
+  BLE_ERROR_NONE = 0,
+  BLE_ERROR_BUFFER_OVERFLOW = 1,
+  BLE_ERROR_NOT_IMPLEMENTED = 2,
+  BLE_ERROR_PARAM_OUT_OF_RANGE = 3,
+  BLE_ERROR_INVALID_PARAM = 4,
+  BLE_STACK_BUSY = 5,
+  BLE_ERROR_INVALID_STATE = 6,
+  BLE_ERROR_NO_MEM = 7,
+  BLE_ERROR_OPERATION_NOT_PERMITTED = 8,
+  BLE_ERROR_INITIALIZATION_INCOMPLETE = 9,
+  BLE_ERROR_ALREADY_INITIALIZED = 10,
+  BLE_ERROR_UNSPECIFIED = 11,
+  BLE_ERROR_INTERNAL_STACK_FAILURE = 12,
+};
+
+class UUID {
+  public:
+    typedef uint16_t ShortUUIDBytes_t;
+
+    UUID(ShortUUIDBytes_t uuid = 0) : _short(uuid), _long(NULL) { }
+    /** 128-bit UUID, "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" (kept as given) */
+    UUID(const char* str) : _short(0), _long(str) { }
+    ShortUUIDBytes_t getShortUUID() const { return _short;}
+    bool operator==(const UUID& o) const {
+      if(_long || o._long) return _long && o._long && strcmp(_long, o._long) == 0;
+      return _short == o._short;
+    }
+
+  private:
+    ShortUUIDBytes_t _short;
+    const char* _long;
+};
+
+class GattAttribute {
+  public:
+    typedef uint16_t Handle_t;
+
+    GattAttribute(const UUID& uuid, uint8_t* valuePtr = NULL,
+                  uint16_t len = 0, uint16_t maxLen = 0,
+                  bool hasVariableLen = true) :
+      _uuid(uuid), _value(valuePtr), _len(len), _max_len(maxLen), _handle(0) { }
+
+    Handle_t getHandle() const { return _handle; }
+    void setHandle(Handle_t h) { _handle = h; }
+    const UUID& getUUID() const { return _uuid; }
+    uint8_t* getValuePtr() { return _value; }
+    uint16_t getLength() const { return _len; }
+    uint16_t getMaxLength() const { return _max_len; }
+
+  private:
+    UUID _uuid;
+    uint8_t* _value;
+    uint16_t _len;
+    uint16_t _max_len;
+    Handle_t _handle;
+};
+
+class GattCharacteristic {
+  public:
+    enum {
+      UUID_HID_INFORMATION_CHAR    = 0x2A4A,
+      UUID_REPORT_MAP_CHAR         = 0x2A4B,
+      UUID_HID_CONTROL_POINT_CHAR  = 0x2A4C,
+      UUID_REPORT_CHAR             = 0x2A4D,
+      UUID_PROTOCOL_MODE_CHAR      = 0x2A4E,
+    };
+
+    enum Properties_t {
+      BLE_GATT_CHAR_PROPERTIES_NONE = 0x00,
+      BLE_GATT_CHAR_PROPERTIES_BROADCAST = 0x01,
+      BLE_GATT_CHAR_PROPERTIES_READ = 0x02,
+      BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE = 0x04,
+      BLE_GATT_CHAR_PROPERTIES_WRITE = 0x08,
+      BLE_GATT_CHAR_PROPERTIES_NOTIFY = 0x10,
+      BLE_GATT_CHAR_PROPERTIES_INDICATE = 0x20,
+    };
+
+    GattCharacteristic(const UUID& uuid, uint8_t* valuePtr = NULL,
+                       uint16_t len = 0, uint16_t maxLen = 0,
+                       uint8_t props = BLE_GATT_CHAR_PROPERTIES_NONE,
+                       GattAttribute* descriptors[] = NULL,
+                       unsigned numDescriptors = 0,
+                       bool hasVariableLen = true) :
+      _value_attr(uuid, valuePtr, len, maxLen, hasVariableLen),
+      _props(props) { }
+
+    GattAttribute& getValueAttribute() { return _value_attr; }
+    GattAttribute::Handle_t getValueHandle() const {
+      return _value_attr.getHandle();
+    }
+    uint8_t getProperties() const { return _props; }
+
+  private:
+    GattAttribute _value_attr;
+    uint8_t _props;
+};
+
+template<typename T>
+class ReadOnlyGattCharacteristic : public GattCharacteristic {
+  public:
+    ReadOnlyGattCharacteristic(const UUID& uuid, T* valuePtr,
+                               uint8_t additionalProperties = BLE_GATT_CHAR_PROPERTIES_NONE,
+                               GattAttribute* descriptors[] = NULL,
+                               unsigned numDescriptors = 0) :
+      GattCharacteristic(uuid, reinterpret_cast<uint8_t*>(valuePtr),
+                         sizeof(T), sizeof(T),
+                         BLE_GATT_CHAR_PROPERTIES_READ | additionalProperties,
+                         descriptors, numDescriptors, false) { }
+};
+
+class GattService {
+  public:
+    enum {
+      UUID_DEVICE_INFORMATION_SERVICE    = 0x180A,
+      UUID_BATTERY_SERVICE               = 0x180F,
+      UUID_HUMAN_INTERFACE_DEVICE_SERVICE = 0x1812,
+    };
+
+    GattService(const UUID& uuid, GattCharacteristic* characteristics[],
+                unsigned numCharacteristics) :
+      _uuid(uuid), _chars(characteristics), _n(numCharacteristics) { }
+
+    const UUID& getUUID() const { return _uuid; }
+    unsigned getCharacteristicCount() const { return _n; }
+    GattCharacteristic* getCharacteristic(unsigned i) { return _chars[i]; }
+
+  private:
+    UUID _uuid;
+    GattCharacteristic** _chars;
+    unsigned _n;
+};
+
+namespace BLEProtocol {
+  struct AddressType {
+    enum Type { PUBLIC = 0, RANDOM_STATIC, RANDOM_PRIVATE_RESOLVABLE,
+                RANDOM_PRIVATE_NON_RESOLVABLE };
+  };
+  typedef AddressType::Type AddressType_t;
+  typedef uint8_t AddressBytes_t[6];
+
+  struct Address_t {
+    AddressType_t type;
+    AddressBytes_t address;
+  };
+}
+
+namespace ble {
+
+  typedef uintptr_t connection_handle_t;
+  typedef uint8_t advertising_handle_t;
+
+  const advertising_handle_t LEGACY_ADVERTISING_HANDLE = 0x00;
+  const uint8_t LEGACY_ADVERTISING_MAX_SIZE = 0x1F;
+
+  struct millisecond_t {
+    explicit millisecond_t(uint32_t ms) : _ms(ms) { }
+    uint32_t value() const { return _ms; }
+    uint32_t _ms;
+  };
+
+  /** Interval in units of 0.625 ms */
+  struct adv_interval_t {
+    adv_interval_t(uint32_t v = 0x800) : _v(v) { }
+    adv_interval_t(millisecond_t ms) : _v(ms.value() * 8 / 5) { }
+    uint32_t value() const { return _v; }
+    uint32_t valueInMs() const { return _v * 5 / 8; }
+    uint32_t _v;
+  };
+
+  struct advertising_type_t {
+    enum type {
+      CONNECTABLE_UNDIRECTED = 0x00,
+      CONNECTABLE_DIRECTED,
+      SCANNABLE_UNDIRECTED,
+      NON_CONNECTABLE_UNDIRECTED,
+      CONNECTABLE_DIRECTED_LOW_DUTY,
+    };
+    advertising_type_t(type v) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct address_t {
+    address_t() { memset(_b, 0, sizeof(_b)); }
+    address_t(const uint8_t (&bytes)[6]) { memcpy(_b, bytes, sizeof(_b)); }
+    const uint8_t* data() const { return _b; }
+    bool operator==(const address_t& o) const { return !memcmp(_b, o._b, sizeof(_b)); }
+    bool operator!=(const address_t& o) const { return !(*this == o); }
+    uint8_t _b[6];
+  };
+
+  struct peer_address_type_t {
+    enum type { PUBLIC = 0, RANDOM, PUBLIC_IDENTITY, RANDOM_STATIC_IDENTITY, ANONYMOUS };
+    peer_address_type_t(type v = PUBLIC) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct target_peer_address_type_t {
+    enum type { PUBLIC = 0, RANDOM };
+    target_peer_address_type_t(type v = PUBLIC) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct advertising_filter_policy_t {
+    enum type { NO_FILTER = 0, FILTER_SCAN_REQUESTS, FILTER_CONNECTION_REQUEST,
+                FILTER_SCAN_AND_CONNECTION_REQUESTS };
+    advertising_filter_policy_t(type v = NO_FILTER) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct link_encryption_t {
+    enum type { NOT_ENCRYPTED, ENCRYPTION_IN_PROGRESS, ENCRYPTED,
+                ENCRYPTED_WITH_MITM, ENCRYPTED_WITH_SC_AND_MITM };
+    link_encryption_t(type v = NOT_ENCRYPTED) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct phy_t {
+    enum type { NONE = 0, LE_1M = 1, LE_2M = 2, LE_CODED = 3 };
+    phy_t(type v = NONE) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  class phy_set_t {
+    public:
+      enum { PHY_SET_1M = 0x01, PHY_SET_2M = 0x02, PHY_SET_CODED = 0x04 };
+      phy_set_t(bool phy_1m = false, bool phy_2m = false, bool phy_coded = false) :
+        _v((phy_1m ? PHY_SET_1M : 0) | (phy_2m ? PHY_SET_2M : 0) |
+           (phy_coded ? PHY_SET_CODED : 0)) { }
+      bool get_1m() const { return _v & PHY_SET_1M; }
+      bool get_2m() const { return _v & PHY_SET_2M; }
+      bool get_coded() const { return _v & PHY_SET_CODED; }
+    private:
+      uint8_t _v;
+  };
+
+  struct coded_symbol_per_bit_t {
+    enum type { UNDEFINED, S2, S8 };
+    coded_symbol_per_bit_t(type v = UNDEFINED) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct controller_supported_features_t {
+    enum type {
+      LE_ENCRYPTION = 0,
+      CONNECTION_PARAMETERS_REQUEST_PROCEDURE,
+      EXTENDED_REJECT_INDICATION,
+      SLAVE_INITIATED_FEATURES_EXCHANGE,
+      LE_PING,
+      LE_DATA_PACKET_LENGTH_EXTENSION,
+      LL_PRIVACY,
+      EXTENDED_SCANNER_FILTER_POLICIES,
+      LE_2M_PHY,
+    };
+    controller_supported_features_t(type v) : _v(v) { }
+    type value() const { return _v; }
+    type _v;
+  };
+
+  struct whitelist_t {
+    BLEProtocol::Address_t* addresses;
+    uint8_t size;
+    uint8_t capacity;
+  };
+
+  struct peripheral_privacy_configuration_t {
+    bool use_non_resolvable_random_address;
+    enum resolution_strategy_t {
+      DO_NOT_RESOLVE,
+      REJECT_NON_RESOLVED_ADDRESS,
+      PERFORM_PAIRING_PROCEDURE,
+      PERFORM_AUTHENTICATION_PROCEDURE
+    };
+    resolution_strategy_t resolution_strategy;
+  };
+
+  /** Duration counted in units of TB_US microseconds */
+  template<typename Rep, uint32_t TB_US>
+  struct Duration {
+    Duration() : _v(0) { }
+    explicit Duration(Rep v) : _v(v) { }
+    static Duration forever() { return Duration(0); }
+    Rep value() const { return _v; }
+    uint32_t valueInMs() const { return (uint32_t)((uint64_t)_v * TB_US / 1000); }
+    uint64_t valueInUs() const { return (uint64_t)_v * TB_US; }
+    bool operator==(const Duration& o) const { return _v == o._v; }
+    bool operator!=(const Duration& o) const { return _v != o._v; }
+    Rep _v;
+  };
+
+  typedef Duration<uint16_t, 1250> conn_interval_t;
+  typedef Duration<uint16_t, 10000> supervision_timeout_t;
+  typedef Duration<uint16_t, 625> conn_event_length_t;
+  typedef uint16_t slave_latency_t;
+  typedef Duration<uint16_t, 10000> adv_duration_t;   // 0: forever
+
+  struct adv_data_appearance_t {
+    enum type { UNKNOWN = 0, KEYBOARD = 961 };
+  };
+
+  class AdvertisingParameters {
+    public:
+      AdvertisingParameters(advertising_type_t advType = advertising_type_t::CONNECTABLE_UNDIRECTED,
+                            adv_interval_t minInterval = adv_interval_t(),
+                            adv_interval_t maxInterval = adv_interval_t(),
+                            bool useLegacyPDU = true) :
+        _type(advType), _min(minInterval), _max(maxInterval) { }
+      AdvertisingParameters& setType(advertising_type_t t) { _type = t; return *this; }
+      AdvertisingParameters& setPeer(const address_t& address,
+                                     target_peer_address_type_t type) {
+        _peer = address;
+        _peer_type = type;
+        return *this;
+      }
+      AdvertisingParameters& setFilter(advertising_filter_policy_t mode) {
+        _filter = mode;
+        return *this;
+      }
+      advertising_type_t getType() const { return _type; }
+      adv_interval_t getMinPrimaryInterval() const { return _min; }
+      adv_interval_t getMaxPrimaryInterval() const { return _max; }
+      const address_t& getPeerAddress() const { return _peer; }
+      target_peer_address_type_t getPeerAddressType() const { return _peer_type; }
+      advertising_filter_policy_t getFilter() const { return _filter; }
+    private:
+      advertising_type_t _type;
+      adv_interval_t _min;
+      adv_interval_t _max;
+      address_t _peer;
+      target_peer_address_type_t _peer_type;
+      advertising_filter_policy_t _filter;
+  };
+
+  class AdvertisingDataBuilder {
+    public:
+      AdvertisingDataBuilder(uint8_t* buffer, size_t size = LEGACY_ADVERTISING_MAX_SIZE) :
+        _buf(buffer), _size(0) { }
+      template<size_t N>
+      AdvertisingDataBuilder(uint8_t (&buffer)[N]) : _buf(buffer), _size(0) { }
+
+      ble_error_t setFlags(uint8_t flags = 0x06) { return BLE_ERROR_NONE; }
+      ble_error_t setLocalServiceList(mbed::Span<const UUID> data, bool complete = true) {
+        return BLE_ERROR_NONE;
+      }
+      ble_error_t setName(const char* name, bool complete = true) { return BLE_ERROR_NONE; }
+      ble_error_t setAppearance(adv_data_appearance_t::type appearance) {
+        return BLE_ERROR_NONE;
+      }
+      mbed::Span<const uint8_t> getAdvertisingData() const {
+        return mbed::Span<const uint8_t>(_buf, _size);
+      }
+    private:
+      uint8_t* _buf;
+      size_t _size;
+  };
+
+  class ConnectionCompleteEvent {
+    public:
+      ConnectionCompleteEvent(ble_error_t status, connection_handle_t handle,
+                              conn_interval_t interval = conn_interval_t(24),
+                              slave_latency_t latency = 0,
+                              supervision_timeout_t timeout = supervision_timeout_t(400),
+                              peer_address_type_t peer_type = peer_address_type_t(),
+                              const address_t& peer = address_t()) :
+        _status(status), _handle(handle), _interval(interval),
+        _latency(latency), _timeout(timeout), _peer_type(peer_type), _peer(peer) { }
+      ble_error_t getStatus() const { return _status; }
+      connection_handle_t getConnectionHandle() const { return _handle; }
+      const conn_interval_t& getConnectionInterval() const { return _interval; }
+      const slave_latency_t& getConnectionLatency() const { return _latency; }
+      const supervision_timeout_t& getSupervisionTimeout() const { return _timeout; }
+      const peer_address_type_t& getPeerAddressType() const { return _peer_type; }
+      const address_t& getPeerAddress() const { return _peer; }
+    private:
+      ble_error_t _status;
+      connection_handle_t _handle;
+      conn_interval_t _interval;
+      slave_latency_t _latency;
+      supervision_timeout_t _timeout;
+      peer_address_type_t _peer_type;
+      address_t _peer;
+  };
+
+  class AdvertisingEndEvent {
+    public:
+      AdvertisingEndEvent(advertising_handle_t adv, connection_handle_t conn,
+                          uint8_t completed, bool connected) :
+        _adv(adv), _conn(conn), _completed(completed), _connected(connected) { }
+      advertising_handle_t getAdvHandle() const { return _adv; }
+      connection_handle_t getConnection() const { return _conn; }
+      uint8_t getCompleted_events() const { return _completed; }
+      bool isConnected() const { return _connected; }
+    private:
+      advertising_handle_t _adv;
+      connection_handle_t _conn;
+      uint8_t _completed;
+      bool _connected;
+  };
+
+  class ConnectionParametersUpdateCompleteEvent {
+    public:
+      ConnectionParametersUpdateCompleteEvent(ble_error_t status,
+                                              connection_handle_t handle,
+                                              conn_interval_t interval,
+                                              slave_latency_t latency,
+                                              supervision_timeout_t timeout) :
+        _status(status), _handle(handle), _interval(interval),
+        _latency(latency), _timeout(timeout) { }
+      ble_error_t getStatus() const { return _status; }
+      connection_handle_t getConnectionHandle() const { return _handle; }
+      const conn_interval_t& getConnectionInterval() const { return _interval; }
+      const slave_latency_t& getSlaveLatency() const { return _latency; }
+      const supervision_timeout_t& getSupervisionTimeout() const { return _timeout; }
+    private:
+      ble_error_t _status;
+      connection_handle_t _handle;
+      conn_interval_t _interval;
+      slave_latency_t _latency;
+      supervision_timeout_t _timeout;
+  };
+
+  class DisconnectionCompleteEvent {
+    public:
+      DisconnectionCompleteEvent(connection_handle_t handle, uint8_t reason) :
+        _handle(handle), _reason(reason) { }
+      connection_handle_t getConnectionHandle() const { return _handle; }
+      uint8_t getReason() const { return _reason; }
+    private:
+      connection_handle_t _handle;
+      uint8_t _reason;
+  };
+
+  class Gap {
+    public:
+      typedef connection_handle_t Handle_t;
+      typedef whitelist_t Whitelist_t;
+
+      struct EventHandler {
+        virtual void onConnectionComplete(const ConnectionCompleteEvent& event) { }
+        virtual void onDisconnectionComplete(const DisconnectionCompleteEvent& event) { }
+        virtual void onConnectionParametersUpdateComplete(
+            const ConnectionParametersUpdateCompleteEvent& event) { }
+        virtual void onAdvertisingEnd(const AdvertisingEndEvent& event) { }
+        virtual void onPhyUpdateComplete(ble_error_t status,
+                                         connection_handle_t connectionHandle,
+                                         phy_t txPhy, phy_t rxPhy) { }
+        virtual void onDataLengthChange(connection_handle_t connectionHandle,
+                                        uint16_t txSize, uint16_t rxSize) { }
+        protected:
+          ~EventHandler() { }
+      };
+
+      static const uint8_t MAX_WHITELIST = 8;
+
+      Gap() : _handler(NULL), _advertising(false), _whitelist_size(0), _privacy(false) { }
+
+      void setEventHandler(EventHandler* handler) { _handler = handler; }
+      EventHandler* getEventHandler() { return _handler; }
+
+      ble_error_t setAdvertisingParameters(advertising_handle_t handle,
+                                           const AdvertisingParameters& params) {
+        _adv_params = params;
+        return BLE_ERROR_NONE;
+      }
+      ble_error_t setAdvertisingPayload(advertising_handle_t handle,
+                                        mbed::Span<const uint8_t> payload) {
+        return BLE_ERROR_NONE;
+      }
+      /** Advertising events are played by the simulated link, see FakeLink */
+      inline ble_error_t startAdvertising(advertising_handle_t handle,
+                                          adv_duration_t maxDuration = adv_duration_t::forever(),
+                                          uint8_t maxEvents = 0);
+      inline ble_error_t stopAdvertising(advertising_handle_t handle);
+      bool isAdvertisingActive(advertising_handle_t handle) const {
+        return _advertising;
+      }
+      void setAdvertisingActive(bool active) { _advertising = active; }
+
+      uint8_t getMaxWhitelistSize() const { return MAX_WHITELIST; }
+      ble_error_t setWhitelist(const Whitelist_t& whitelist) {
+        if(whitelist.size > MAX_WHITELIST) return BLE_ERROR_PARAM_OUT_OF_RANGE;
+        _whitelist_size = whitelist.size;
+        for(uint8_t i = 0; i < whitelist.size; i++)
+          _whitelist[i] = whitelist.addresses[i];
+        return BLE_ERROR_NONE;
+      }
+      bool inWhitelist(const address_t& a) const {
+        for(uint8_t i = 0; i < _whitelist_size; i++)
+          if(address_t(_whitelist[i].address) == a) return true;
+        return false;
+      }
+      /** Privacy: with it the bonded peers' keys go to the resolving list, and a
+       * controller with LL privacy matches their resolvable private addresses
+       * against the whitelist and directed advertising; see FakeLink */
+      ble_error_t setPeripheralPrivacyConfiguration(
+          const peripheral_privacy_configuration_t* configuration) {
+        _privacy_conf = *configuration;
+        return BLE_ERROR_NONE;
+      }
+      ble_error_t enablePrivacy(bool enable) {
+        _privacy = enable;
+        return BLE_ERROR_NONE;
+      }
+      bool privacyEnabled() const { return _privacy; }
+      const AdvertisingParameters& advertisingParameters() const {
+        return _adv_params;
+      }
+
+      /** Forwarded to the simulated central, see FakeLink */
+      inline ble_error_t updateConnectionParameters(
+          connection_handle_t connectionHandle,
+          conn_interval_t minConnectionInterval,
+          conn_interval_t maxConnectionInterval,
+          slave_latency_t slaveLatency,
+          supervision_timeout_t supervisionTimeout,
+          conn_event_length_t minConnectionEventLength = conn_event_length_t(0),
+          conn_event_length_t maxConnectionEventLength = conn_event_length_t(0));
+
+      /** Features of the local controller, see FakeLink */
+      inline bool isFeatureSupported(controller_supported_features_t feature);
+      inline ble_error_t setPhy(connection_handle_t connection, const phy_set_t* txPhys,
+                                const phy_set_t* rxPhys,
+                                coded_symbol_per_bit_t codedSymbol);
+
+    private:
+      EventHandler* _handler;
+      AdvertisingParameters _adv_params;
+      bool _advertising;
+      BLEProtocol::Address_t _whitelist[MAX_WHITELIST];
+      uint8_t _whitelist_size;
+      bool _privacy;
+      peripheral_privacy_configuration_t _privacy_conf;
+  };
+
+  class SecurityManager {
+    public:
+      enum SecurityIOCapabilities_t {
+        IO_CAPS_DISPLAY_ONLY = 0x00,
+        IO_CAPS_DISPLAY_YESNO = 0x01,
+        IO_CAPS_KEYBOARD_ONLY = 0x02,
+        IO_CAPS_NONE = 0x03,
+        IO_CAPS_KEYBOARD_DISPLAY = 0x04,
+      };
+      enum SecurityCompletionStatus_t {
+        SEC_STATUS_SUCCESS = 0x00,
+        SEC_STATUS_UNSPECIFIED = 0x88,
+      };
+      typedef uint8_t Passkey_t[6];
+
+      struct EventHandler {
+        virtual void pairingResult(connection_handle_t connectionHandle,
+                                   SecurityCompletionStatus_t result) { }
+        virtual void linkEncryptionResult(connection_handle_t connectionHandle,
+                                          link_encryption_t result) { }
+        virtual void whitelistFromBondTable(whitelist_t* whitelist) { }
+        virtual ~EventHandler() { }
+      };
+
+      /** Bonds are kept in memory for the life of the process; with a
+       * dbFilepath and preserveBondingStateOnReset() they would also survive
+       * a device reset. */
+      SecurityManager() : _bonding(false), _preserve(false), _db(NULL), _handler(NULL) { }
+
+      ble_error_t init(bool enableBonding = true, bool requireMITM = true,
+                       SecurityIOCapabilities_t iocaps = IO_CAPS_NONE,
+                       const Passkey_t passkey = NULL, bool signing = true,
+                       const char* dbFilepath = NULL) {
+        _bonding = enableBonding;
+        _db = dbFilepath;
+        return BLE_ERROR_NONE;
+      }
+      ble_error_t preserveBondingStateOnReset(bool enable) {
+        _preserve = enable;
+        return BLE_ERROR_NONE;
+      }
+      ble_error_t setPairingRequestAuthorisation(bool required = true) {
+        return BLE_ERROR_NONE;
+      }
+      void setSecurityManagerEventHandler(EventHandler* handler) { _handler = handler; }
+      EventHandler* getEventHandler() { return _handler; }
+
+      /** Fills whitelist with the bonded peers; the result is delivered to
+       * EventHandler::whitelistFromBondTable */
+      inline ble_error_t generateWhitelistFromBondTable(whitelist_t* whitelist) const;
+
+      /* ---- host side ---- */
+      bool bondingEnabled() const { return _bonding; }
+      const char* databasePath() const { return _preserve ? _db : NULL; }
+      bool isBonded(const address_t& peer) const {
+        for(size_t i = 0; i < _bonds.size(); i++)
+          if(address_t(_bonds[i].address) == peer) return true;
+        return false;
+      }
+      void addBond(const address_t& peer) {
+        BLEProtocol::Address_t a;
+        a.type = BLEProtocol::AddressType::PUBLIC;
+        memcpy(a.address, peer.data(), sizeof(a.address));
+        _bonds.push_back(a);
+      }
+
+    private:
+      bool _bonding;
+      bool _preserve;
+      const char* _db;
+      EventHandler* _handler;
+      std::vector<BLEProtocol::Address_t> _bonds;
+  };
+
+} /** ble namespace end **/
+
+using ble::SecurityManager;
+typedef ble::Gap Gap;
+
+class BLE;
+
+struct GattUpdatesChangedCallbackParams {
+  ble::connection_handle_t connHandle;
+  GattAttribute::Handle_t attHandle;    // the CCCD
+  GattAttribute::Handle_t charHandle;   // the characteristic value
+};
+typedef GattUpdatesChangedCallbackParams GattUpdatesEnabledCallbackParams;
+typedef GattUpdatesChangedCallbackParams GattUpdatesDisabledCallbackParams;
+
+class GattServer {
+  public:
+    typedef mbed::Callback<void(unsigned)> DataSentCallback_t;
+
+    struct EventHandler {
+      virtual void onAttMtuChange(ble::connection_handle_t connectionHandle,
+                                  uint16_t attMtuSize) { }
+      virtual void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams& params) { }
+      virtual void onUpdatesDisabled(const GattUpdatesDisabledCallbackParams& params) { }
+      protected:
+        ~EventHandler() { }
+    };
+
+    GattServer(BLE& ble) : _ble(ble), _next_handle(1), _handler(NULL) { }
+
+    void setEventHandler(EventHandler* handler) { _handler = handler; }
+    EventHandler* getEventHandler() { return _handler; }
+
+    ble_error_t addService(GattService& service) {
+      for(unsigned i = 0; i < service.getCharacteristicCount(); i++) {
+        GattCharacteristic* c = service.getCharacteristic(i);
+        if(c) c->getValueAttribute().setHandle(_next_handle++);
+      }
+      return BLE_ERROR_NONE;
+    }
+
+    template<typename T, typename U>
+    void onDataSent(U* obj, void (T::*m)(unsigned)) {
+      _data_sent.push_back(DataSentCallback_t(obj, m));
+    }
+    void onDataSent(DataSentCallback_t cb) { _data_sent.push_back(cb); }
+
+    inline ble_error_t write(GattAttribute::Handle_t handle, const uint8_t* value,
+                             uint16_t size, bool localOnly = false);
+
+    void dataSent(unsigned count) {
+      for(size_t i = 0; i < _data_sent.size(); i++) _data_sent[i](count);
+    }
+
+  private:
+    BLE& _ble;
+    GattAttribute::Handle_t _next_handle;
+    EventHandler* _handler;
+    std::vector<DataSentCallback_t> _data_sent;
+};
+
+class GattClient {
+  public:
+    /** Forwarded to the simulated central, see FakeLink */
+    inline ble_error_t negotiateAttMtu(ble::connection_handle_t connection);
+};
+
+class BLE {
+  public:
+    typedef unsigned InstanceID_t;
+
+    struct InitializationCompleteCallbackContext {
+      BLE& ble;
+      ble_error_t error;
+    };
+    struct OnEventsToProcessCallbackContext {
+      BLE& ble;
+    };
+    typedef mbed::Callback<void(OnEventsToProcessCallbackContext*)> OnEventsToProcessCallback_t;
+
+    static BLE& Instance(InstanceID_t id = 0) {
+      static BLE instance;
+      return instance;
+    }
+
+    void onEventsToProcess(const OnEventsToProcessCallback_t& cb) {
+      _events_cb = cb;
+    }
+
+    template<typename T, typename U>
+    ble_error_t init(U* obj, void (T::*m)(InitializationCompleteCallbackContext*)) {
+      mbed::Callback<void(InitializationCompleteCallbackContext*)> cb(obj, m);
+      post([this, cb]() {
+        InitializationCompleteCallbackContext ctx = { *this, BLE_ERROR_NONE };
+        _initialized = true;
+        cb(&ctx);
+      });
+      return BLE_ERROR_NONE;
+    }
+
+    bool hasInitialized() const { return _initialized; }
+
+    void processEvents() {
+      while(!_pending.empty()) {
+        std::function<void()> ev = _pending.front();
+        _pending.pop_front();
+        ev();
+      }
+    }
+
+    ble::Gap& gap() { return _gap; }
+    GattServer& gattServer() { return _gatt; }
+    GattClient& gattClient() { return _gatt_client; }
+    ble::SecurityManager& securityManager() { return _sm; }
+
+    ble_error_t addService(GattService& service) {
+      return _gatt.addService(service);
+    }
+
+    /** Queue a stack event; it is delivered by processEvents() */
+    void post(std::function<void()> ev) {
+      _pending.push_back(ev);
+      if(_events_cb) {
+        OnEventsToProcessCallbackContext ctx = { *this };
+        _events_cb(&ctx);
+      } else {
+        processEvents();
+      }
+    }
+
+  private:
+    BLE() : _gatt(*this), _initialized(false) { }
+
+    ble::Gap _gap;
+    GattServer _gatt;
+    GattClient _gatt_client;
+    ble::SecurityManager _sm;
+    OnEventsToProcessCallback_t _events_cb;
+    std::deque<std::function<void()> > _pending;
+    bool _initialized;
+};
+
+typedef BLE BLEDevice;
+
+namespace mbed_host {
+
+  /** Notification that went over the air */
+  struct Notification {
+    uint64_t t_us;
+    GattAttribute::Handle_t handle;
+    std::vector<uint8_t> data;
+  };
+
+  /** Simulated link to a central.
+   *
+   * Notifications written while connected take one of notify_buffers stack
+   * buffers. At every connection event up to packets_per_event of them are
+   * transmitted and the corresponding onDataSent is raised, as long as they
+   * fit the event: each costs its airtime (link layer fragments at the PHY's
+   * bit rate, each acknowledged by an empty packet from the central, 150 us
+   * apart), and an event lasts at most event_length_us (0: up to the next
+   * one). Notifications longer than the ATT MTU allows are refused.
+   *
+   * Links start at an ATT MTU of 23, the 1M PHY and 27 byte link layer
+   * payloads. negotiateAttMtu() settles on the smaller of att_mtu and
+   * central_att_mtu; setPhy() switches to 2M when both sides support it, at
+   * an instant like parameter updates. requestDataLength() (DmConnSetDataLen
+   * in dm_api.h) raises the payload, up to 251 bytes, at the next connection
+   * event when both controllers support data length extension. subscribe() plays the central enabling
+   * notifications of a characteristic.
+   *
+   * Connection parameter updates requested by the peripheral take effect at
+   * an instant UPDATE_INSTANT_EVENTS connection events after the next one, as
+   * the link layer procedure does. The central grants the requested slave
+   * latency and timeout, and the requested minimum interval unless it is
+   * below central_min_interval_us, in which case it grants that instead (as
+   * some hosts do). Connection events without data are not simulated: with
+   * slave latency L the peripheral is taken to wake every L + 1 of them, which
+   * radioEvents() accounts for.
+   *
+   * Advertising: while the Gap advertises, every advertising event (interval
+   * plus a 0-10 ms pseudo-random advDelay, or every 3.75 ms for at most
+   * 1.28 s for high duty cycle directed advertising) is checked against the
+   * central. After scan() the central scans for scan_window_us every
+   * scan_interval_us and connects on the first event it hears that it is
+   * allowed to connect to: directed to its address, or filtered by a
+   * whitelist that holds it. A central with central_private (the default,
+   * as macOS, iOS, Windows and Android hosts) connects from a resolvable
+   * private address, which only matches its identity address in the
+   * whitelist or as the directed advertising target when the peripheral
+   * enabled privacy on a controller with ll_privacy. On connection a central without a bond pairs
+   * (pairingResult) and one with a bond only re-encrypts the link
+   * (linkEncryptionResult).
+   */
+  class FakeLink {
+    public:
+      static const unsigned UPDATE_INSTANT_EVENTS = 6;
+
+      FakeLink() :
+        conn_interval_us(30000),
+        notify_buffers(3),
+        packets_per_event(3),
+        central_min_interval_us(7500),
+        slave_latency(0),
+        scan_interval_us(1280000),
+        scan_window_us(11250),
+        central_address(centralBytes()),
+        event_length_us(0),
+        att_mtu(247),
+        central_att_mtu(247),
+        le_2m_phy(true),
+        central_2m_phy(true),
+        data_length_extension(true),
+        central_data_length_extension(true),
+        ll_privacy(true),
+        central_private(true),
+        _connected(false),
+        _att_mtu(23),
+        _phy_2m(false),
+        _ll_payload(27),
+        _phy_pending(false),
+        _handle(1),
+        _ce_scheduled(false),
+        _update_pending(false),
+        _anchor_us(0),
+        _radio_events(0),
+        _ble(NULL),
+        _scanning(false),
+        _scan_start_us(0),
+        _adv_active(false),
+        _adv_seq(0),
+        _adv_end_us(0),
+        _adv_events(0),
+        _adv_rand(1),
+        _pairings(0) { }
+
+      uint64_t conn_interval_us;
+      unsigned notify_buffers;
+      unsigned packets_per_event;
+      uint64_t central_min_interval_us;
+      uint16_t slave_latency;
+      uint64_t scan_interval_us;
+      uint64_t scan_window_us;
+      ble::address_t central_address;
+      uint64_t event_length_us;
+      uint16_t att_mtu;                 // largest the peripheral's stack takes
+      uint16_t central_att_mtu;
+      bool le_2m_phy;                   // controller features, peripheral
+      bool central_2m_phy;              // and central
+      bool data_length_extension;
+      bool central_data_length_extension;
+      bool ll_privacy;                  // controller resolves private addresses
+      bool central_private;             // central uses resolvable private addresses
+
+      bool connected() const { return _connected; }
+      ble::connection_handle_t handle() const { return _handle; }
+      const std::vector<Notification>& log() const { return _log; }
+      unsigned inFlight() const { return (unsigned)_queue.size(); }
+      /* link state: ATT MTU, PHY and link layer payload in use */
+      uint16_t attMtu() const { return _att_mtu; }
+      bool phy2m() const { return _phy_2m; }
+      uint16_t llPayload() const { return _ll_payload; }
+
+      /** Connect the central at the current virtual time, whether the
+       * peripheral advertises or not */
+      void connect(BLE& ble) {
+        _ble = &ble;
+        _scanning = false;
+        stopAdvertising(ble);
+        ble.post([this, &ble]() {
+          _connected = true;
+          _att_mtu = 23;
+          _phy_2m = false;
+          _ll_payload = 27;
+          _anchor_us = sim().now_us();
+          ble::Gap::EventHandler* h = ble.gap().getEventHandler();
+          ble::ConnectionCompleteEvent ev(BLE_ERROR_NONE, _handle,
+                                          ble::conn_interval_t((uint16_t)(conn_interval_us / 1250)),
+                                          slave_latency, ble::supervision_timeout_t(400),
+                                          ble::peer_address_type_t::PUBLIC,
+                                          central_address);
+          if(h) h->onConnectionComplete(ev);
+        });
+        secure(ble);
+      }
+
+      /** Start scanning: the central connects once it hears the peripheral */
+      void scan(BLE& ble) {
+        _ble = &ble;
+        _scanning = true;
+        _scan_start_us = sim().now_us();
+      }
+
+      bool scanning() const { return _scanning; }
+      /* advertising events played, pairings done */
+      uint64_t advertisingEvents() const { return _adv_events; }
+      unsigned pairings() const { return _pairings; }
+
+      void startAdvertising(BLE& ble, const ble::adv_duration_t& duration) {
+        _ble = &ble;
+        Sim& s = sim();
+        _adv_active = true;
+        _adv_seq++;
+        uint64_t now = s.now_us();
+        _adv_end_us = duration.value() ? now + duration.valueInUs() : UINT64_MAX;
+        if(directed(ble) && _adv_end_us > now + HIGH_DUTY_MAX_US)
+          _adv_end_us = now + HIGH_DUTY_MAX_US;
+        ble.gap().setAdvertisingActive(true);
+        scheduleAdvertisingEvent(ble, now);
+      }
+
+      void stopAdvertising(BLE& ble) {
+        _adv_active = false;
+        _adv_seq++;
+        ble.gap().setAdvertisingActive(false);
+      }
+
+      void disconnect(BLE& ble, uint8_t reason = 0x13) {
+        ble.post([this, &ble, reason]() {
+          closeSegment();
+          _connected = false;
+          _update_pending = false;
+          _phy_pending = false;
+          _queue.clear();
+          ble::Gap::EventHandler* h = ble.gap().getEventHandler();
+          ble::DisconnectionCompleteEvent ev(_handle, reason);
+          if(h) h->onDisconnectionComplete(ev);
+        });
+      }
+
+      ble_error_t notify(BLE& ble, GattAttribute::Handle_t handle,
+                         const uint8_t* value, uint16_t size) {
+        if(!_connected) return BLE_ERROR_NONE;
+        if(size > _att_mtu - 3) return BLE_ERROR_INVALID_PARAM;
+        if(_queue.size() >= notify_buffers) return BLE_STACK_BUSY;
+        Notification n;
+        n.t_us = 0;
+        n.handle = handle;
+        n.data.assign(value, value + size);
+        _queue.push_back(n);
+        scheduleConnectionEvent(ble);
+        return BLE_ERROR_NONE;
+      }
+
+      ble_error_t requestParameters(ble::connection_handle_t handle,
+                                    ble::conn_interval_t min_interval,
+                                    ble::conn_interval_t max_interval,
+                                    ble::slave_latency_t latency,
+                                    ble::supervision_timeout_t timeout) {
+        if(!_connected || handle != _handle || !_ble) return BLE_ERROR_INVALID_STATE;
+        if(min_interval.value() < 6 || max_interval.value() < min_interval.value())
+          return BLE_ERROR_INVALID_PARAM;
+        if(_update_pending) return BLE_STACK_BUSY;
+
+        uint64_t granted_us = min_interval.valueInUs();
+        if(granted_us < central_min_interval_us) granted_us = central_min_interval_us;
+        ble::conn_interval_t interval((uint16_t)(granted_us / 1250));
+        Sim& s = sim();
+        uint64_t instant = nextEventTime(s.now_us()) +
+                           UPDATE_INSTANT_EVENTS * conn_interval_us;
+        _update_pending = true;
+        BLE& ble = *_ble;
+        s.schedule(NULL, instant, 0, [this, &ble, interval, latency, timeout]() {
+          if(!_update_pending) return;
+          _update_pending = false;
+          closeSegment();
+          conn_interval_us = interval.valueInUs();
+          slave_latency = latency;
+          ble::Gap::Handle_t h = _handle;
+          ble.post([&ble, h, interval, latency, timeout]() {
+            ble::Gap::EventHandler* eh = ble.gap().getEventHandler();
+            ble::ConnectionParametersUpdateCompleteEvent ev(BLE_ERROR_NONE, h,
+                                                            interval, latency, timeout);
+            if(eh) eh->onConnectionParametersUpdateComplete(ev);
+          });
+        });
+        return BLE_ERROR_NONE;
+      }
+
+      bool supports(ble::controller_supported_features_t feature) const {
+        switch(feature.value()) {
+          case ble::controller_supported_features_t::LE_2M_PHY: return le_2m_phy;
+          case ble::controller_supported_features_t::LE_DATA_PACKET_LENGTH_EXTENSION:
+            return data_length_extension;
+          case ble::controller_supported_features_t::LL_PRIVACY: return ll_privacy;
+          default: return false;
+        }
+      }
+
+      ble_error_t exchangeMtu(ble::connection_handle_t handle) {
+        if(!_connected || handle != _handle || !_ble) return BLE_ERROR_INVALID_STATE;
+        BLE& ble = *_ble;
+        uint16_t mtu = att_mtu < central_att_mtu ? att_mtu : central_att_mtu;
+        sim().schedule(NULL, nextEventTime(sim().now_us()), 0, [this, &ble, mtu]() {
+          if(!_connected) return;
+          _att_mtu = mtu;
+          ble::connection_handle_t h = _handle;
+          ble.post([&ble, h, mtu]() {
+            GattServer::EventHandler* eh = ble.gattServer().getEventHandler();
+            if(eh) eh->onAttMtuChange(h, mtu);
+          });
+        });
+        return BLE_ERROR_NONE;
+      }
+
+      void requestDataLength(ble::connection_handle_t handle, uint16_t tx_octets) {
+        if(!_connected || handle != _handle || !_ble) return;
+        if(!data_length_extension || !central_data_length_extension) return;
+        extendDataLength(*_ble, tx_octets < 27 ? 27 : tx_octets > 251 ? 251 : tx_octets);
+      }
+
+      ble_error_t requestPhy(ble::connection_handle_t handle, const ble::phy_set_t* tx,
+                             const ble::phy_set_t* rx) {
+        if(!_connected || handle != _handle || !_ble) return BLE_ERROR_INVALID_STATE;
+        if(_phy_pending) return BLE_STACK_BUSY;
+        bool want_2m = le_2m_phy && central_2m_phy && (!tx || tx->get_2m()) &&
+                       (!rx || rx->get_2m());
+        Sim& s = sim();
+        uint64_t instant = nextEventTime(s.now_us()) + UPDATE_INSTANT_EVENTS * conn_interval_us;
+        _phy_pending = true;
+        BLE& ble = *_ble;
+        s.schedule(NULL, instant, 0, [this, &ble, want_2m]() {
+          if(!_phy_pending) return;
+          _phy_pending = false;
+          _phy_2m = want_2m;
+          ble::connection_handle_t h = _handle;
+          ble::phy_t phy = want_2m ? ble::phy_t::LE_2M : ble::phy_t::LE_1M;
+          ble.post([&ble, h, phy]() {
+            ble::Gap::EventHandler* eh = ble.gap().getEventHandler();
+            if(eh) eh->onPhyUpdateComplete(BLE_ERROR_NONE, h, phy, phy);
+          });
+        });
+        return BLE_ERROR_NONE;
+      }
+
+      /** The central enables (or disables) notifications of a characteristic */
+      void subscribe(BLE& ble, GattAttribute::Handle_t handle, bool enable = true) {
+        ble::connection_handle_t h = _handle;
+        ble.post([&ble, h, handle, enable]() {
+          GattServer::EventHandler* eh = ble.gattServer().getEventHandler();
+          GattUpdatesChangedCallbackParams p = { h, (GattAttribute::Handle_t)(handle + 1),
+                                                 handle };
+          if(!eh) return;
+          if(enable) eh->onUpdatesEnabled(p);
+          else eh->onUpdatesDisabled(p);
+        });
+      }
+
+      /* time a notification of size bytes takes on air, acknowledgements
+       * included */
+      uint64_t airtimeUs(size_t size) const {
+        const uint64_t IFS_US = 150;
+        uint64_t byte_us = _phy_2m ? 4 : 8;
+        uint64_t overhead = (_phy_2m ? 2 : 1) + 4 + 2 + 3;  // preamble, AA, header, CRC
+        size_t l2cap = size + 3 + 4;                          // ATT and L2CAP headers
+        uint64_t fragments = (l2cap + _ll_payload - 1) / _ll_payload;
+        return (l2cap + fragments * overhead) * byte_us +
+               fragments * (2 * IFS_US + overhead * byte_us);
+      }
+
+      /* connection events the peripheral woke up for while connected */
+      double radioEvents() const {
+        return _radio_events + (_connected ? segmentEvents() : 0.0);
+      }
+
+    private:
+      static const uint64_t HIGH_DUTY_MAX_US = 1280000;
+      static const uint64_t HIGH_DUTY_INTERVAL_US = 3750;
+
+      static const uint8_t (&centralBytes())[6] {
+        static const uint8_t a[6] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0xc0 };
+        return a;
+      }
+
+      static bool directed(BLE& ble) {
+        return ble.gap().advertisingParameters().getType().value() ==
+               ble::advertising_type_t::CONNECTABLE_DIRECTED;
+      }
+
+      void scheduleAdvertisingEvent(BLE& ble, uint64_t t) {
+        uint32_t seq = _adv_seq;
+        sim().schedule(NULL, t < _adv_end_us ? t : _adv_end_us, 0,
+                       [this, &ble, seq]() { advertisingEvent(ble, seq); });
+      }
+
+      void advertisingEvent(BLE& ble, uint32_t seq) {
+        if(seq != _adv_seq || !_adv_active) return;
+        Sim& s = sim();
+        uint64_t now = s.now_us();
+        if(now >= _adv_end_us) {
+          stopAdvertising(ble);
+          ble.post([&ble]() {
+            ble::Gap::EventHandler* h = ble.gap().getEventHandler();
+            ble::AdvertisingEndEvent ev(ble::LEGACY_ADVERTISING_HANDLE, 0, 0, false);
+            if(h) h->onAdvertisingEnd(ev);
+          });
+          return;
+        }
+        _adv_events++;
+        if(heard(ble, now)) {
+          connect(ble);
+          ble.post([this, &ble]() {
+            ble::Gap::EventHandler* h = ble.gap().getEventHandler();
+            ble::AdvertisingEndEvent ev(ble::LEGACY_ADVERTISING_HANDLE, _handle, 0, true);
+            if(h) h->onAdvertisingEnd(ev);
+          });
+          return;
+        }
+        const ble::AdvertisingParameters& p = ble.gap().advertisingParameters();
+        uint64_t next = directed(ble) ? HIGH_DUTY_INTERVAL_US :
+                        p.getMinPrimaryInterval().value() * 625ull + advDelayUs();
+        scheduleAdvertisingEvent(ble, now + next);
+      }
+
+      /* does the central hear this advertising event and may it connect */
+      bool heard(BLE& ble, uint64_t now) const {
+        if(!_scanning || _connected) return false;
+        if((now - _scan_start_us) % scan_interval_us >= scan_window_us) return false;
+        const ble::AdvertisingParameters& p = ble.gap().advertisingParameters();
+        bool resolved = !central_private || (ll_privacy && ble.gap().privacyEnabled());
+        if(directed(ble)) return resolved && p.getPeerAddress() == central_address;
+        ble::advertising_filter_policy_t::type f = p.getFilter().value();
+        if(f == ble::advertising_filter_policy_t::FILTER_CONNECTION_REQUEST ||
+           f == ble::advertising_filter_policy_t::FILTER_SCAN_AND_CONNECTION_REQUESTS)
+          return resolved && ble.gap().inWhitelist(central_address);
+        return true;
+      }
+
+      uint64_t advDelayUs() {
+        _adv_rand = _adv_rand * 1103515245u + 12345u;
+        return (_adv_rand >> 16) % 10001;
+      }
+
+      /* pair a new central, re-encrypt with a bonded one */
+      void secure(BLE& ble) {
+        ble::SecurityManager& sm = ble.securityManager();
+        if(!sm.bondingEnabled()) return;
+        bool bonded = sm.isBonded(central_address);
+        if(!bonded) {
+          sm.addBond(central_address);
+          _pairings++;
+        }
+        ble::connection_handle_t h = _handle;
+        ble.post([&ble, h, bonded]() {
+          ble::SecurityManager::EventHandler* eh = ble.securityManager().getEventHandler();
+          if(!eh) return;
+          if(bonded) eh->linkEncryptionResult(h, ble::link_encryption_t::ENCRYPTED);
+          else eh->pairingResult(h, ble::SecurityManager::SEC_STATUS_SUCCESS);
+        });
+      }
+
+      /* both sides send up to octets byte payloads from the next event on */
+      void extendDataLength(BLE& ble, uint16_t octets) {
+        sim().schedule(NULL, nextEventTime(sim().now_us()), 0, [this, &ble, octets]() {
+          if(!_connected) return;
+          _ll_payload = octets;
+          ble::connection_handle_t h = _handle;
+          ble.post([&ble, h, octets]() {
+            ble::Gap::EventHandler* eh = ble.gap().getEventHandler();
+            if(eh) eh->onDataLengthChange(h, octets, octets);
+          });
+        });
+      }
+
+      /* time of the first connection event after now */
+      uint64_t nextEventTime(uint64_t now) const {
+        return _anchor_us + ((now - _anchor_us) / conn_interval_us + 1) * conn_interval_us;
+      }
+
+      /* events attended since the parameters last changed */
+      double segmentEvents() const {
+        return (double)(sim().now_us() - _anchor_us) /
+               (conn_interval_us * (1 + (uint64_t)slave_latency));
+      }
+
+      void closeSegment() {
+        if(!_connected) return;
+        _radio_events += segmentEvents();
+        _anchor_us = sim().now_us();
+      }
+
+      void scheduleConnectionEvent(BLE& ble) {
+        if(_ce_scheduled) return;
+        Sim& s = sim();
+        uint64_t next = nextEventTime(s.now_us());
+        _ce_scheduled = true;
+        s.schedule(NULL, next, 0, [this, &ble]() { connectionEvent(ble); });
+      }
+
+      void connectionEvent(BLE& ble) {
+        _ce_scheduled = false;
+        if(!_connected) return;
+        unsigned sent = 0;
+        uint64_t budget = event_length_us && event_length_us < conn_interval_us ?
+                          event_length_us : conn_interval_us;
+        uint64_t airtime = 0;
+        while(!_queue.empty() && sent < packets_per_event) {
+          uint64_t t = airtimeUs(_queue.front().data.size());
+          if(sent && airtime + t > budget) break;
+          airtime += t;
+          Notification n = _queue.front();
+          _queue.pop_front();
+          n.t_us = sim().now_us();
+          _log.push_back(n);
+          sent++;
+        }
+        if(sent) ble.post([&ble, sent]() { ble.gattServer().dataSent(sent); });
+        if(!_queue.empty()) scheduleConnectionEvent(ble);
+      }
+
+      bool _connected;
+      uint16_t _att_mtu;
+      bool _phy_2m;
+      uint16_t _ll_payload;
+      bool _phy_pending;
+      ble::connection_handle_t _handle;
+      bool _ce_scheduled;
+      bool _update_pending;
+      uint64_t _anchor_us;      // a connection event at the current parameters
+      double _radio_events;
+      BLE* _ble;
+      bool _scanning;
+      uint64_t _scan_start_us;
+      bool _adv_active;
+      uint32_t _adv_seq;
+      uint64_t _adv_end_us;
+      uint64_t _adv_events;
+      uint32_t _adv_rand;
+      unsigned _pairings;
+      std::deque<Notification> _queue;
+      std::vector<Notification> _log;
+  };
+
+  inline FakeLink& link() {
+    static FakeLink l;
+    return l;
+  }
+
+} /** mbed_host namespace end **/
+
+ble_error_t ble::Gap::startAdvertising(advertising_handle_t handle,
+                                       adv_duration_t maxDuration,
+                                       uint8_t maxEvents) {
+  mbed_host::link().startAdvertising(BLE::Instance(), maxDuration);
+  return BLE_ERROR_NONE;
+}
+
+ble_error_t ble::Gap::stopAdvertising(advertising_handle_t handle) {
+  mbed_host::link().stopAdvertising(BLE::Instance());
+  return BLE_ERROR_NONE;
+}
+
+ble_error_t ble::SecurityManager::generateWhitelistFromBondTable(whitelist_t* whitelist) const {
+  whitelist->size = 0;
+  for(size_t i = 0; i < _bonds.size() && whitelist->size < whitelist->capacity; i++)
+    whitelist->addresses[whitelist->size++] = _bonds[i];
+  EventHandler* h = _handler;
+  BLE::Instance().post([h, whitelist]() {
+    if(h) h->whitelistFromBondTable(whitelist);
+  });
+  return BLE_ERROR_NONE;
+}
+
+ble_error_t ble::Gap::updateConnectionParameters(
+    connection_handle_t connectionHandle,
+    conn_interval_t minConnectionInterval,
+    conn_interval_t maxConnectionInterval,
+    slave_latency_t slaveLatency,
+    supervision_timeout_t supervisionTimeout,
+    conn_event_length_t minConnectionEventLength,
+    conn_event_length_t maxConnectionEventLength) {
+  return mbed_host::link().requestParameters(connectionHandle, minConnectionInterval,
+                                             maxConnectionInterval, slaveLatency,
+                                             supervisionTimeout);
+}
+
+bool ble::Gap::isFeatureSupported(controller_supported_features_t feature) {
+  return mbed_host::link().supports(feature);
+}
+
+ble_error_t ble::Gap::setPhy(connection_handle_t connection, const phy_set_t* txPhys,
+                             const phy_set_t* rxPhys, coded_symbol_per_bit_t codedSymbol) {
+  return mbed_host::link().requestPhy(connection, txPhys, rxPhys);
+}
+
+ble_error_t GattClient::negotiateAttMtu(ble::connection_handle_t connection) {
+  return mbed_host::link().exchangeMtu(connection);
+}
+
+ble_error_t GattServer::write(GattAttribute::Handle_t handle, const uint8_t* value,
+                              uint16_t size, bool localOnly) {
+  if(localOnly) return BLE_ERROR_NONE;
+  return mbed_host::link().notify(_ble, handle, value, size);
+}
+
+#endif /* _MBED_HOST_STUB_BLE_H_ */
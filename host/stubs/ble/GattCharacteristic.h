@@ -0,0 +1,5 @@
+/* Host stand-in: see ble/BLE.h */
+#ifndef _MBED_HOST_STUB_BLE_GATTCHARACTERISTIC_H_
+#define _MBED_HOST_STUB_BLE_GATTCHARACTERISTIC_H_
+#include "BLE.h"
+#endif
@@ -0,0 +1,15 @@
+/* Host stand-in for ble/services/BatteryService.h */
+#ifndef _MBED_HOST_STUB_BATTERY_SERVICE_H_
+#define _MBED_HOST_STUB_BATTERY_SERVICE_H_
+
+#include "../BLE.h"
+
+class BatteryService {
+  public:
+    BatteryService(BLE& ble, uint8_t level = 100) : _level(level) { }
+    void updateBatteryLevel(uint8_t level) { _level = level; }
+  private:
+    uint8_t _level;
+};
+
+#endif
@@ -0,0 +1,18 @@
+/* Host stand-in for ble/services/DeviceInformationService.h */
+#ifndef _MBED_HOST_STUB_DEVICE_INFORMATION_SERVICE_H_
+#define _MBED_HOST_STUB_DEVICE_INFORMATION_SERVICE_H_
+
+#include "../BLE.h"
+
+class DeviceInformationService {
+  public:
+    DeviceInformationService(BLE& ble,
+                             const char* manufacturersName = NULL,
+                             const char* modelNumber = NULL,
+                             const char* serialNumber = NULL,
+                             const char* hardwareRevision = NULL,
+                             const char* firmwareRevision = NULL,
+                             const char* softwareRevision = NULL) { }
+};
+
+#endif
@@ -0,0 +1,21 @@
+/* Host stand-in for the part of the Cordio device manager API (dm_api.h)
+ * that Myokbd calls below mbed's BLE API: the data length request, forwarded
+ * to the simulated central (see FakeLink in ble/BLE.h). Cordio connection
+ * ids start at 1 */
+#ifndef _MBED_HOST_STUB_DM_API_H_
+#define _MBED_HOST_STUB_DM_API_H_
+
+#include <stdint.h>
+#include "ble/BLE.h"
+
+typedef uint8_t dmConnId_t;
+
+inline dmConnId_t DmConnIdByHandle(uint16_t handle) {
+  return (dmConnId_t)(handle + 1);
+}
+
+inline void DmConnSetDataLen(dmConnId_t connId, uint16_t txOctets, uint16_t txTime) {
+  mbed_host::link().requestDataLength((ble::connection_handle_t)(connId - 1), txOctets);
+}
+
+#endif
@@ -0,0 +1,19 @@
+/* Host stand-in for the mbed HAL analogin API, see mbed.h */
+#ifndef _MBED_HOST_STUB_ANALOGIN_API_H_
+#define _MBED_HOST_STUB_ANALOGIN_API_H_
+
+#include "../mbed.h"
+
+typedef struct {
+  PinName pin;
+} analogin_t;
+
+inline void analogin_init(analogin_t* obj, PinName pin) { obj->pin = pin; }
+inline uint16_t analogin_read_u16(analogin_t* obj) {
+  return mbed_host::analogRead(obj->pin);
+}
+inline float analogin_read(analogin_t* obj) {
+  return analogin_read_u16(obj) / 65535.0f;
+}
+
+#endif
@@ -0,0 +1,464 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Minimal host stand-in for the parts of mbed OS used by Myokbd.
+ *
+ * Only the API surface exercised by the sketch is provided. Everything that
+ * involves time runs on the virtual clock in mbed_host/Sim.h; analog inputs
+ * read from sources registered with mbed_host::attachAnalog().
+ */
+#ifndef _MBED_HOST_STUB_MBED_H_
+#define _MBED_HOST_STUB_MBED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include "mbed_host/Sim.h"
+
+#define MBED_ASSERT(expr) assert(expr)
+#define EVENTS_EVENT_SIZE 64
+
+/* ---- pins ---- */
+typedef int PinName;
+#define NC   (-1)
+#define LED1 13
+#define P1_9 41
+
+/* ---- critical sections ---- */
+// Interrupt masking is modelled with a global lock so that host-side
+// concurrency benchmarks pay a comparable serialisation cost.
+inline std::recursive_mutex& mbed_host_critical_lock() {
+  static std::recursive_mutex m;
+  return m;
+}
+inline void core_util_critical_section_enter() { mbed_host_critical_lock().lock(); }
+inline void core_util_critical_section_exit() { mbed_host_critical_lock().unlock(); }
+
+namespace mbed_host {
+
+  /** Source of analog samples attached to a pin */
+  class AnalogSource {
+    public:
+      virtual ~AnalogSource() { }
+      virtual uint16_t read_u16() = 0;
+  };
+
+  inline std::map<PinName, AnalogSource*>& analogSources() {
+    static std::map<PinName, AnalogSource*> s;
+    return s;
+  }
+
+  inline void attachAnalog(PinName pin, AnalogSource* src) {
+    analogSources()[pin] = src;
+  }
+
+  inline uint16_t analogRead(PinName pin) {
+    auto it = analogSources().find(pin);
+    return it == analogSources().end() ? 0 : it->second->read_u16();
+  }
+
+} /** mbed_host namespace end **/
+
+namespace mbed {
+
+  /* ---- NonCopyable: as in mbed, so that copies the target rejects fail here too ---- */
+  template<typename T>
+  class NonCopyable {
+    protected:
+      NonCopyable() { }
+      ~NonCopyable() { }
+    private:
+      NonCopyable(const NonCopyable&) = delete;
+      NonCopyable& operator=(const NonCopyable&) = delete;
+  };
+
+  /* ---- Callback ---- */
+  template<typename F> class Callback;
+
+  template<typename R, typename... Args>
+  class Callback<R(Args...)> {
+    public:
+      Callback() { }
+      Callback(R (*f)(Args...)) : _f(f) { }
+      template<typename T, typename U>
+      Callback(U* obj, R (T::*m)(Args...)) :
+        _f([obj, m](Args... a) -> R { return (obj->*m)(a...); }) { }
+      template<typename F>
+      Callback(F f) : _f(f) { }
+
+      R operator()(Args... a) const { return _f(a...); }
+      R call(Args... a) const { return _f(a...); }
+      explicit operator bool() const { return (bool)_f; }
+
+    private:
+      std::function<R(Args...)> _f;
+  };
+
+  template<typename T, typename U, typename R, typename... Args>
+  Callback<R(Args...)> callback(U* obj, R (T::*m)(Args...)) {
+    return Callback<R(Args...)>(obj, m);
+  }
+
+  template<typename R, typename... Args>
+  Callback<R(Args...)> callback(R (*f)(Args...)) {
+    return Callback<R(Args...)>(f);
+  }
+
+  /* ---- Span ---- */
+  template<typename T>
+  class Span {
+    public:
+      Span() : _data(NULL), _size(0) { }
+      Span(T* data, size_t size) : _data(data), _size(size) { }
+      template<typename U>
+      Span(const Span<U>& o) : _data(o.data()), _size(o.size()) { }
+      T* data() const { return _data; }
+      size_t size() const { return _size; }
+      T& operator[](size_t i) const { return _data[i]; }
+    private:
+      T* _data;
+      size_t _size;
+  };
+
+  template<typename T>
+  Span<T> make_Span(T* data, size_t size) { return Span<T>(data, size); }
+  template<typename T>
+  Span<const T> make_const_Span(const T* data, size_t size) {
+    return Span<const T>(data, size);
+  }
+
+  /* ---- digital and analog io ---- */
+  class DigitalOut {
+    public:
+      DigitalOut(PinName pin, int value = 0) : _pin(pin), _value(value) { }
+      void write(int value) { _value = value; }
+      int read() const { return _value; }
+      DigitalOut& operator=(int value) { _value = value; return *this; }
+      operator int() const { return _value; }
+    private:
+      PinName _pin;
+      int _value;
+  };
+
+  class AnalogIn {
+    public:
+      AnalogIn(PinName pin) : _pin(pin) { }
+      uint16_t read_u16() { return mbed_host::analogRead(_pin); }
+      float read() { return read_u16() / 65535.0f; }
+      operator float() { return read(); }
+    private:
+      PinName _pin;
+  };
+
+  /* ---- timers ---- */
+  class Timer {
+    public:
+      Timer() : _running(false), _start_us(0), _acc_us(0) { }
+      void start() {
+        if(_running) return;
+        _start_us = mbed_host::sim().now_us();
+        _running = true;
+      }
+      void stop() {
+        if(!_running) return;
+        _acc_us += mbed_host::sim().now_us() - _start_us;
+        _running = false;
+      }
+      void reset() {
+        _acc_us = 0;
+        _start_us = mbed_host::sim().now_us();
+      }
+      uint64_t read_high_resolution_us() const {
+        return _acc_us + (_running ? mbed_host::sim().now_us() - _start_us : 0);
+      }
+      int read_us() const { return (int)read_high_resolution_us(); }
+      int read_ms() const { return (int)(read_high_resolution_us() / 1000); }
+      float read() const { return read_high_resolution_us() / 1000000.0f; }
+    private:
+      bool _running;
+      uint64_t _start_us;
+      uint64_t _acc_us;
+  };
+
+  class LowPowerTimer : public Timer { };
+
+  /** Ticker callbacks run in (simulated) interrupt context */
+  class Ticker {
+    public:
+      Ticker() : _id(0) { }
+      ~Ticker() { detach(); }
+
+      void attach_us(Callback<void()> cb, uint64_t us) {
+        detach();
+        uint64_t t = mbed_host::sim().now_us();
+        _id = mbed_host::sim().schedule(NULL, t + us, us, [cb]() { cb(); });
+      }
+      template<typename T, typename U>
+      void attach_us(U* obj, void (T::*m)(), uint64_t us) {
+        attach_us(Callback<void()>(obj, m), us);
+      }
+      void attach(Callback<void()> cb, float s) {
+        attach_us(cb, (uint64_t)(s * 1000000.0f));
+      }
+      void detach() {
+        if(_id) mbed_host::sim().cancel(_id);
+        _id = 0;
+      }
+    private:
+      int _id;
+  };
+
+  class LowPowerTicker : public Ticker { };
+
+  /* ---- CircularBuffer ---- */
+  template<typename T, uint32_t BufferSize, typename CounterType = uint32_t>
+  class CircularBuffer {
+    public:
+      CircularBuffer() : _head(0), _tail(0), _full(false) { }
+
+      void push(const T& data) {
+        core_util_critical_section_enter();
+        if(_full) _tail = (_tail + 1) % BufferSize;
+        _pool[_head] = data;
+        _head = (_head + 1) % BufferSize;
+        _full = (_head == _tail);
+        core_util_critical_section_exit();
+      }
+
+      bool pop(T& data) {
+        bool ok = false;
+        core_util_critical_section_enter();
+        if(!(_head == _tail && !_full)) {
+          data = _pool[_tail];
+          _tail = (_tail + 1) % BufferSize;
+          _full = false;
+          ok = true;
+        }
+        core_util_critical_section_exit();
+        return ok;
+      }
+
+      bool empty() const {
+        core_util_critical_section_enter();
+        bool e = (_head == _tail && !_full);
+        core_util_critical_section_exit();
+        return e;
+      }
+
+      bool full() const {
+        core_util_critical_section_enter();
+        bool f = _full;
+        core_util_critical_section_exit();
+        return f;
+      }
+
+      void reset() {
+        core_util_critical_section_enter();
+        _head = _tail = 0;
+        _full = false;
+        core_util_critical_section_exit();
+      }
+
+      CounterType size() const {
+        core_util_critical_section_enter();
+        CounterType n = _full ? BufferSize :
+          (_head >= _tail ? _head - _tail : BufferSize + _head - _tail);
+        core_util_critical_section_exit();
+        return n;
+      }
+
+    private:
+      T _pool[BufferSize];
+      CounterType _head;
+      CounterType _tail;
+      bool _full;
+  };
+
+  /* ---- Stream ---- */
+  class Stream {
+    public:
+      Stream(const char* name = NULL) { }
+      virtual ~Stream() { }
+
+      int putc(int c) { return _putc(c); }
+      int puts(const char* s) {
+        while(*s) _putc(*s++);
+        return 0;
+      }
+      int printf(const char* format, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf, sizeof(buf), format, args);
+        va_end(args);
+        for(int i = 0; i < n && i < (int)sizeof(buf) - 1; i++) _putc(buf[i]);
+        return n;
+      }
+
+    protected:
+      virtual int _putc(int c) = 0;
+      virtual int _getc() = 0;
+  };
+
+} /** mbed namespace end **/
+
+namespace events {
+
+  /** EventQueue stand-in: every queue schedules on the shared virtual clock,
+   * and dispatch_forever() serves all queues until the simulation is stopped.
+   *
+   * A queue put in background mode is no longer served by the simulation
+   * loop: like on the device, it reports its next deadline through the update
+   * callback and only runs events when dispatch() is called.
+   */
+  class EventQueue : private mbed::NonCopyable<EventQueue> {
+    public:
+      EventQueue(unsigned size = 32 * EVENTS_EVENT_SIZE) : _background(false) { }
+
+      template<typename F>
+      int call(F f) { return post(0, 0, f); }
+      template<typename T, typename U, typename R>
+      int call(U* obj, R (T::*m)()) {
+        return post(0, 0, [obj, m]() { (obj->*m)(); });
+      }
+
+      template<typename F>
+      int call_in(int ms, F f) { return post(ms, 0, f); }
+      template<typename T, typename U, typename R>
+      int call_in(int ms, U* obj, R (T::*m)()) {
+        return post(ms, 0, [obj, m]() { (obj->*m)(); });
+      }
+
+      template<typename F>
+      int call_every(int ms, F f) { return post(ms, ms, f); }
+      template<typename T, typename U, typename R>
+      int call_every(int ms, U* obj, R (T::*m)()) {
+        return post(ms, ms, [obj, m]() { (obj->*m)(); });
+      }
+
+      bool cancel(int id) {
+        mbed_host::sim().cancel(id);
+        return true;
+      }
+
+      void dispatch_forever() { mbed_host::sim().run(); }
+      void break_dispatch() { mbed_host::sim().requestStop(); }
+
+      /** Run the events that are due; only ms == 0 (non-blocking) and
+       * ms < 0 (dispatch_forever) are supported on the host.
+       */
+      void dispatch(int ms = -1) {
+        if(ms < 0) {
+          dispatch_forever();
+          return;
+        }
+        mbed_host::sim().runDue(this);
+        update();
+      }
+
+      void background(mbed::Callback<void(int)> update) {
+        _update = update;
+        _background = true;
+        mbed_host::sim().setManual(this);
+        this->update();
+      }
+
+    private:
+      template<typename F>
+      int post(int delay_ms, int period_ms, F f) {
+        mbed_host::Sim& s = mbed_host::sim();
+        int id = s.schedule(this, s.now_us() + (uint64_t)delay_ms * 1000,
+                            (uint64_t)period_ms * 1000, f);
+        update();
+        return id;
+      }
+
+      /* report the time to the next event, in ms (-1 if none) */
+      void update() {
+        if(!_background || !_update) return;
+        mbed_host::Sim& s = mbed_host::sim();
+        uint64_t next = s.nextDeadline(this);
+        if(next == UINT64_MAX) {
+          _update(-1);
+        } else {
+          uint64_t now = s.now_us();
+          _update(next <= now ? 0 : (int)((next - now + 999) / 1000));
+        }
+      }
+
+      bool _background;
+      mbed::Callback<void(int)> _update;
+  };
+
+} /** events namespace end **/
+
+#define osWaitForever 0xFFFFFFFFu
+
+namespace rtos {
+
+  /** Threads are not created on the host: the EventQueues they would
+   * dispatch are already served by the simulation loop.
+   */
+  class Thread {
+    public:
+      Thread(int priority = 0, uint32_t stack_size = 0) { }
+      int start(mbed::Callback<void()> task) { return 0; }
+      int join() { return 0; }
+  };
+
+  namespace Kernel {
+    inline uint64_t get_ms_count() { return mbed_host::sim().now_us() / 1000; }
+  }
+
+  /** Waiting on flags lets virtual time pass: interrupt context and
+   * non-background queues keep running until a flag is set or the timeout
+   * expires (which is when the device would be asleep).
+   */
+  class EventFlags {
+    public:
+      EventFlags() : _flags(0) { }
+
+      uint32_t set(uint32_t flags) {
+        core_util_critical_section_enter();
+        _flags |= flags;
+        uint32_t f = _flags;
+        core_util_critical_section_exit();
+        return f;
+      }
+
+      uint32_t get() const { return _flags; }
+
+      uint32_t wait_any(uint32_t flags, uint32_t millisec = osWaitForever,
+                        bool clear = true) {
+        mbed_host::Sim& s = mbed_host::sim();
+        uint64_t until = millisec == osWaitForever ? UINT64_MAX :
+                         s.now_us() + (uint64_t)millisec * 1000;
+        while(!(_flags & flags) && !s.stopRequested() && s.step(until)) { }
+        if(!(_flags & flags) && until != UINT64_MAX && !s.stopRequested())
+          s.advance(until - s.now_us());
+        core_util_critical_section_enter();
+        uint32_t r = _flags & flags;
+        if(clear) _flags &= ~r;
+        core_util_critical_section_exit();
+        return r;
+      }
+
+    private:
+      volatile uint32_t _flags;
+  };
+
+} /** rtos namespace end **/
+
+#endif /* _MBED_HOST_STUB_MBED_H_ */
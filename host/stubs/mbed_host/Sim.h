@@ -0,0 +1,193 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Host-side simulation core for the mbed stand-in layer.
+ *
+ * All time on the host is virtual: timers, tickers and EventQueues schedule
+ * work on a single discrete-event loop ordered by (deadline, insertion order),
+ * so replaying the same input always produces the same output regardless of
+ * how fast the host machine is.
+ *
+ * Events are tagged with an owner: an EventQueue, or nullptr for interrupt
+ * context (Ticker callbacks). The loop serves every owner cooperatively,
+ * which stands in for the threads that dispatch queues on the device.
+ * Owners marked manual (EventQueues put in background mode) are skipped by
+ * the loop; their events only run through runDue(), when the code under
+ * test dispatches them.
+ */
+#ifndef _MBED_HOST_SIM_H_
+#define _MBED_HOST_SIM_H_
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <set>
+#include <utility>
+
+namespace mbed_host {
+
+  class Sim {
+    public:
+      typedef std::function<void()> Fn;
+
+      Sim() : _now_us(0), _seq(0), _stop(false), _running(NULL),
+              _isr_events(0), _thread_events(0) { }
+
+      uint64_t now_us() const { return _now_us; }
+      uint32_t now_ms() const { return (uint32_t)(_now_us / 1000); }
+
+      /** Schedule fn at absolute time at_us; a non-zero period makes the
+       * event periodic. Returns an id usable with cancel().
+       */
+      int schedule(const void* owner, uint64_t at_us, uint64_t period_us, Fn fn) {
+        int id = ++_seq;
+        if(at_us < _now_us) at_us = _now_us;
+        Key k(at_us, id);
+        _events[k] = Event{owner, period_us, fn};
+        _ids[id] = k;
+        return id;
+      }
+
+      void cancel(int id) {
+        auto it = _ids.find(id);
+        if(it == _ids.end()) return;
+        _events.erase(it->second);
+        _ids.erase(it);
+      }
+
+      /** Run the next due event (advancing virtual time to its deadline).
+       * Events owned by the currently executing owner are skipped so that a
+       * blocking call made from inside a queue callback cannot re-enter that
+       * queue. If only_owner is not null, only events of that owner or of
+       * interrupt context are considered.
+       *
+       * @return false if nothing eligible is scheduled before limit_us
+       */
+      bool step(uint64_t limit_us = UINT64_MAX, const void* only_owner = NULL) {
+        auto it = _events.begin();
+        for(; it != _events.end(); ++it) {
+          const void* o = it->second.owner;
+          if(o != NULL && _running != NULL && o == _running) continue;
+          if(o != NULL && _manual.count(o)) continue;
+          if(only_owner != NULL && o != NULL && o != only_owner) continue;
+          break;
+        }
+        if(it == _events.end() || it->first.first > limit_us) return false;
+
+        _now_us = it->first.first;
+        fire(it);
+        return true;
+      }
+
+      /** Exclude the events of owner from step(); see runDue() */
+      void setManual(const void* owner) { _manual.insert(owner); }
+
+      /** Run the events of owner that are due, without advancing time.
+       * @return the number of events run
+       */
+      unsigned runDue(const void* owner) {
+        unsigned n = 0;
+        for(;;) {
+          auto it = _events.begin();
+          while(it != _events.end() && it->first.first <= _now_us &&
+                it->second.owner != owner) ++it;
+          if(it == _events.end() || it->first.first > _now_us) return n;
+          fire(it);
+          n++;
+        }
+      }
+
+      /** Deadline of the earliest event of owner, UINT64_MAX if none */
+      uint64_t nextDeadline(const void* owner) const {
+        for(auto it = _events.begin(); it != _events.end(); ++it)
+          if(it->second.owner == owner) return it->first.first;
+        return UINT64_MAX;
+      }
+
+    private:
+      typedef std::pair<uint64_t, int> Key;
+      struct Event {
+        const void* owner;
+        uint64_t period_us;
+        Fn fn;
+      };
+
+      void fire(std::map<Key, Event>::iterator it) {
+        Key k = it->first;
+        Event ev = it->second;
+        _events.erase(it);
+        if(ev.period_us) {
+          Key next(k.first + ev.period_us, k.second);
+          _events[next] = ev;
+          _ids[k.second] = next;
+        } else {
+          _ids.erase(k.second);
+        }
+
+        const void* prev = _running;
+        if(ev.owner) {
+          _running = ev.owner;
+          _thread_events++;
+        } else {
+          _isr_events++;
+        }
+        ev.fn();
+        _running = prev;
+      }
+
+    public:
+
+      /** Run until requestStop() or until nothing is left to run */
+      void run() {
+        while(!_stop && step()) { }
+      }
+
+      /** Let dt_us of virtual time pass, serving other contexts meanwhile */
+      void advance(uint64_t dt_us) {
+        uint64_t until = _now_us + dt_us;
+        while(!_stop && step(until)) { }
+        if(_now_us < until) _now_us = until;
+      }
+
+      void requestStop() { _stop = true; }
+      bool stopRequested() const { return _stop; }
+
+      /* number of callbacks executed in interrupt and thread context */
+      uint64_t isrEvents() const { return _isr_events; }
+      uint64_t threadEvents() const { return _thread_events; }
+
+      void reset() {
+        _events.clear();
+        _ids.clear();
+        _now_us = 0;
+        _stop = false;
+        _running = NULL;
+        _manual.clear();
+        _isr_events = _thread_events = 0;
+      }
+
+    private:
+      uint64_t _now_us;
+      int _seq;
+      bool _stop;
+      const void* _running;
+      uint64_t _isr_events;
+      uint64_t _thread_events;
+      std::map<Key, Event> _events;
+      std::map<int, Key> _ids;
+      std::set<const void*> _manual;
+  };
+
+  inline Sim& sim() {
+    static Sim s;
+    return s;
+  }
+
+} /** mbed_host namespace end **/
+
+#endif /* _MBED_HOST_SIM_H_ */
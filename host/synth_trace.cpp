@@ -0,0 +1,103 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Generates deterministic, labelled synthetic EMG envelope traces in the
+ * format read by Trace.h, for exercising the replay tools when no recording
+ * is at hand.
+ *
+ * The signal imitates the MyoWare envelope output: a noisy baseline with
+ * smooth contractions of random strength. Contractions are either short
+ * squeezes (labelled PREV) or long holds (labelled NEXT). -m adds mains hum
+ * (50 Hz) of that amplitude, as picked up by unshielded electrode leads.
+ *
+ * usage: synth_trace [-r rate_hz] [-s seconds] [-S seed] [-n noise] [-m mains]
+ *                    > trace.txt
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <random>
+
+#include "Trace.h"
+
+using namespace myokbd::host;
+
+int main(int argc, char** argv) {
+  uint32_t rate_hz = 40;
+  double seconds = 120;
+  unsigned seed = 1;
+  double noise = 300;        // baseline noise std dev, read_u16 units
+  double mains = 0;          // 50 Hz hum amplitude
+  int opt;
+  while((opt = getopt(argc, argv, "r:s:S:n:m:")) != -1) {
+    switch(opt) {
+      case 'r': rate_hz = (uint32_t)atoi(optarg); break;
+      case 's': seconds = atof(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 'n': noise = atof(optarg); break;
+      case 'm': mains = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-r rate_hz] [-s seconds] [-S seed] [-n noise] [-m mains]\n",
+                argv[0]);
+        return 2;
+    }
+  }
+
+  std::mt19937 rng(seed);
+  std::normal_distribution<double> gauss(0.0, 1.0);
+  std::uniform_real_distribution<double> uni(0.0, 1.0);
+
+  const double baseline = 6000;
+  size_t n = (size_t)(seconds * rate_hz);
+  double dt = 1.0 / rate_hz;
+
+  printf("# synthetic EMG envelope, seed=%u\n", seed);
+  printf("# rate_hz=%u\n", rate_hz);
+
+  // first gesture after the detector had a chance to settle
+  double next_onset = 6.0 + 2.0 * uni(rng);
+  double onset = -1, hold = 0, amp = 0;
+  uint8_t label = LABEL_REST;
+  double drift_phase = 0;
+
+  for(size_t i = 0; i < n; i++) {
+    double t = i * dt;
+    if(onset < 0 && t >= next_onset) {
+      onset = t;
+      bool is_long = uni(rng) < 0.5;
+      hold = is_long ? 0.70 + 0.5 * uni(rng) : 0.20 + 0.2 * uni(rng);
+      label = is_long ? LABEL_NEXT : LABEL_PREV;
+      amp = 9000 + 12000 * uni(rng);
+    }
+
+    double env = 0;
+    uint8_t l = LABEL_REST;
+    if(onset >= 0) {
+      double u = t - onset;
+      // 30 ms rise, hold, 60 ms decay; the label covers rise and hold
+      if(u < 0.03) env = amp * u / 0.03;
+      else if(u < hold) env = amp;
+      else if(u < hold + 0.06) env = amp * (1 - (u - hold) / 0.06);
+      else {
+        onset = -1;
+        next_onset = t + 1.5 + 3.0 * uni(rng);
+      }
+      if(onset >= 0 && u < hold) l = label;
+      env *= 1.0 + 0.08 * gauss(rng);
+    }
+
+    drift_phase += dt * 0.05;
+    double v = baseline + 400 * sin(2 * M_PI * drift_phase) + env +
+               noise * gauss(rng) + mains * sin(2 * M_PI * 50 * t);
+    if(v < 0) v = 0;
+    if(v > 65535) v = 65535;
+    printf("%u,%u\n", (unsigned)v, (unsigned)l);
+  }
+  return 0;
+}
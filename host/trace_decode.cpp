@@ -0,0 +1,256 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Event trace decoder (EventTrace.h).
+ *
+ * Reads trace dumps, as captured from the sketch's serial port after sending
+ * 'T' (or written by replay -T); anything between frames is skipped, and
+ * records seen in several dumps are kept once. Prints:
+ *  - the timeline of events, samples included with -s (-q: none);
+ *  - for each gesture, the time spent in each stage: the contraction
+ *    (onset flip to release flip, when released), last flip to gesture
+ *    decision, decision to enqueue, enqueue to report write and write to
+ *    the stack reporting it sent;
+ *  - the median and max of each stage.
+ *
+ * usage: trace_decode [-q] [-s] dump.bin ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "EventTrace.h"
+
+using namespace myokbd;
+
+namespace {
+
+  struct Event {
+    uint32_t seq;
+    uint64_t t_us;    // unwrapped
+    TraceRecord r;
+  };
+
+  const char* EventNames[] = {
+    "SAMPLE", "FLIP", "GESTURE", "ENQUEUE", "DROPPED", "WRITE", "SENT",
+    "CONNECT", "DISCONNECT", "RATE"
+  };
+  const char* GestureNames[] = {
+    "short", "double", "triple", "long", "repeat"
+  };
+
+  const char* eventName(uint8_t e) {
+    return e < (uint8_t)TraceEvent::N_EVENTS ? EventNames[e] : "?";
+  }
+
+  bool is(const Event& e, TraceEvent t) { return e.r.event == (uint8_t)t; }
+
+  /* frames from one dump file into recs, keyed by sequence number */
+  bool load(const char* path, std::map<uint32_t, TraceRecord>& recs, unsigned& frames) {
+    FILE* f = fopen(path, "rb");
+    if(!f) return false;
+    std::vector<uint8_t> buf;
+    uint8_t chunk[4096];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), f)) > 0) buf.insert(buf.end(), chunk, chunk + n);
+    fclose(f);
+
+    size_t i = 0;
+    while(i + sizeof(TraceFrameHeader) <= buf.size()) {
+      if(memcmp(&buf[i], "MKTR", 4)) {
+        i++;
+        continue;
+      }
+      TraceFrameHeader h;
+      memcpy(&h, &buf[i], sizeof(h));
+      size_t len = (size_t)h.count * h.record_size;
+      if(h.version != TRACE_VERSION || h.record_size != sizeof(TraceRecord) ||
+         i + sizeof(h) + len > buf.size()) {
+        i++;
+        continue;
+      }
+      for(uint16_t k = 0; k < h.count; k++) {
+        TraceRecord r;
+        memcpy(&r, &buf[i + sizeof(h) + k * sizeof(r)], sizeof(r));
+        recs[h.first_seq + k] = r;
+      }
+      frames++;
+      i += sizeof(h) + len;
+    }
+    return true;
+  }
+
+  /* in sequence order (which is time order), with the 32-bit micros()
+   * unwrapped; a gap in sequence numbers is reported */
+  std::vector<Event> timeline(const std::map<uint32_t, TraceRecord>& recs, unsigned& gaps) {
+    std::vector<Event> ev;
+    uint64_t t = 0;
+    gaps = 0;
+    for(std::map<uint32_t, TraceRecord>::const_iterator it = recs.begin();
+        it != recs.end(); ++it) {
+      if(!ev.empty()) {
+        if(it->first != ev.back().seq + 1) gaps++;
+        t += (uint32_t)(it->second.t_us - ev.back().r.t_us);
+      } else {
+        t = it->second.t_us;
+      }
+      Event e = { it->first, t, it->second };
+      ev.push_back(e);
+    }
+    return ev;
+  }
+
+  void printEvent(const Event& e, uint64_t t0) {
+    printf("  %10.3f ms  %-10s", (e.t_us - t0) / 1000.0, eventName(e.r.event));
+    switch((TraceEvent)e.r.event) {
+      case TraceEvent::SAMPLE: printf(" ch %u  %u", e.r.ch, e.r.value); break;
+      case TraceEvent::FLIP: printf(" ch %u  %s", e.r.ch, e.r.value ? "PEAK" : "rest"); break;
+      case TraceEvent::GESTURE:
+        printf(" ch %u  %s", e.r.ch, e.r.value < 5 ? GestureNames[e.r.value] : "?");
+        break;
+      case TraceEvent::ENQUEUE:
+      case TraceEvent::DROPPED: printf(" usage 0x%02x", e.r.value); break;
+      case TraceEvent::WRITE: printf(" %s", e.r.value ? "refused" : "ok"); break;
+      case TraceEvent::SENT: printf(" %u", e.r.value); break;
+      case TraceEvent::CONNECT: printf(" interval %.2f ms", e.r.value * 1.25); break;
+      case TraceEvent::DISCONNECT: printf(" reason 0x%02x", e.r.value); break;
+      case TraceEvent::RATE: printf(" hold %u", e.r.value); break;
+      default: break;
+    }
+    printf("\n");
+  }
+
+  enum Stage { CONTRACTION, DECISION, ENQUEUE, WRITE, SENT, N_STAGES };
+  const char* StageNames[] = {
+    "contraction", "flip -> gesture", "gesture -> enqueue", "enqueue -> write",
+    "write -> sent"
+  };
+
+  /* index of the first event of type t in (from, to), or to */
+  size_t next(const std::vector<Event>& ev, size_t from, size_t to, TraceEvent t,
+              bool ok_write = false) {
+    for(size_t i = from + 1; i < to; i++)
+      if(is(ev[i], t) && (!ok_write || ev[i].r.value == 0)) return i;
+    return to;
+  }
+
+  void stage(std::vector<double>* st, Stage s, const Event& a, const Event& b) {
+    double ms = (b.t_us - a.t_us) / 1000.0;
+    st[s].push_back(ms);
+    printf("  %s %.2f", StageNames[s], ms);
+  }
+
+  void gestures(const std::vector<Event>& ev) {
+    std::vector<double> st[N_STAGES];
+    printf("gestures:\n");
+    size_t n = 0;
+    for(size_t g = 0; g < ev.size(); g++) {
+      if(!is(ev[g], TraceEvent::GESTURE)) continue;
+      n++;
+      uint8_t ch = ev[g].r.ch;
+      printf("  %10.3f ms  ch %u %-7s", (ev[g].t_us - ev[0].t_us) / 1000.0, ch,
+             ev[g].r.value < 5 ? GestureNames[ev[g].r.value] : "?");
+
+      // the channel's latest flip, and the onset it belongs to
+      size_t flip = g, onset = g;
+      for(size_t i = g; i-- > 0;) {
+        if(!is(ev[i], TraceEvent::FLIP) || ev[i].r.ch != ch) continue;
+        if(flip == g) flip = i;
+        if(ev[i].r.value) {
+          onset = i;
+          break;
+        }
+      }
+      if(onset < g && flip != onset) stage(st, CONTRACTION, ev[onset], ev[flip]);
+      if(flip < g) stage(st, DECISION, ev[flip], ev[g]);
+
+      size_t end = next(ev, g, ev.size(), TraceEvent::GESTURE);
+      size_t enq = next(ev, g, end, TraceEvent::ENQUEUE);
+      if(enq == end) {
+        printf("  (no command)\n");
+        continue;
+      }
+      stage(st, ENQUEUE, ev[g], ev[enq]);
+      size_t wr = next(ev, enq, ev.size(), TraceEvent::WRITE, true);
+      if(wr < ev.size()) {
+        stage(st, WRITE, ev[enq], ev[wr]);
+        size_t sent = next(ev, wr, ev.size(), TraceEvent::SENT);
+        if(sent < ev.size()) stage(st, SENT, ev[wr], ev[sent]);
+      }
+      printf(" ms\n");
+    }
+    if(!n) {
+      printf("  none\n");
+      return;
+    }
+    printf("stages (ms):\n");
+    for(int s = 0; s < N_STAGES; s++) {
+      std::vector<double>& v = st[s];
+      if(v.empty()) continue;
+      std::sort(v.begin(), v.end());
+      printf("  %-20s %4zu  median %8.2f  max %8.2f\n", StageNames[s], v.size(),
+             v[v.size() / 2], v.back());
+    }
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-q] [-s] dump.bin ...\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  bool quiet = false, samples = false;
+  int opt;
+  while((opt = getopt(argc, argv, "qs")) != -1) {
+    switch(opt) {
+      case 'q': quiet = true; break;
+      case 's': samples = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind >= argc) usage(argv[0]);
+
+  std::map<uint32_t, TraceRecord> recs;
+  unsigned frames = 0;
+  for(int i = optind; i < argc; i++) {
+    if(!load(argv[i], recs, frames)) {
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      return 1;
+    }
+  }
+  unsigned gaps;
+  std::vector<Event> ev = timeline(recs, gaps);
+  if(ev.empty()) {
+    fprintf(stderr, "no trace records found\n");
+    return 1;
+  }
+
+  unsigned counts[(size_t)TraceEvent::N_EVENTS] = { 0 };
+  for(size_t i = 0; i < ev.size(); i++)
+    if(ev[i].r.event < (uint8_t)TraceEvent::N_EVENTS) counts[ev[i].r.event]++;
+  printf("%zu records in %u frame(s), seq %u-%u (%u gap(s)), %.3f s\n", ev.size(), frames,
+         ev.front().seq, ev.back().seq, gaps, (ev.back().t_us - ev.front().t_us) / 1e6);
+  printf("events:");
+  for(size_t e = 0; e < (size_t)TraceEvent::N_EVENTS; e++)
+    if(counts[e]) printf(" %u %s", counts[e], EventNames[e]);
+  printf("\n");
+
+  if(!quiet) {
+    printf("timeline:\n");
+    for(size_t i = 0; i < ev.size(); i++)
+      if(samples || !is(ev[i], TraceEvent::SAMPLE)) printEvent(ev[i], ev[0].t_us);
+  }
+  gestures(ev);
+  return 0;
+}
@@ -0,0 +1,124 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Converts between the text traces of Trace.h and the binary trace files of
+ * TraceFile.h.
+ *
+ * Packing takes one text trace per channel, all at the same rate; the labels
+ * come from the first one and the file is cut to the shortest. -b stores
+ * only the top adc_bits of every sample (12 for what the nRF52 ADC really
+ * resolves), -c sets the frames per chunk.
+ *
+ * -x unpacks channel -C of a binary file back to text on stdout; any tool
+ * reading traces takes the binary file as well (channel 0).
+ *
+ * usage: trace_pack [-b adc_bits] [-c chunk_frames] -o out.mktf ch0.txt [ch1.txt ...]
+ *        trace_pack -x [-C channel] in.mktf > trace.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Trace.h"
+
+using namespace myokbd::host;
+
+static int unpack(const char* path, uint8_t channel) {
+  TraceFileReader r;
+  if(!r.open(path)) {
+    fprintf(stderr, "cannot read trace file %s\n", path);
+    return 1;
+  }
+  if(channel >= r.channels()) {
+    fprintf(stderr, "%s has %u channels\n", path, r.channels());
+    return 1;
+  }
+  printf("# rate_hz=%u\n", r.rateHz());
+  printf("# channel %u of %s (%u bit)\n", channel, path, r.adcBits());
+  std::vector<uint16_t> samples;
+  std::vector<uint8_t> labels;
+  for(uint32_t k = 0; k < r.chunks(); k++) {
+    uint32_t n = r.chunkFrames(k);
+    samples.resize(n);
+    labels.resize(n);
+    if(!r.decode(k, channel, &samples[0]) || !r.decodeLabels(k, &labels[0])) {
+      fprintf(stderr, "%s: chunk %u is corrupt\n", path, k);
+      return 1;
+    }
+    for(uint32_t i = 0; i < n; i++) {
+      if(r.labelled()) printf("%u,%u\n", samples[i], labels[i]);
+      else printf("%u\n", samples[i]);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  const char* out = NULL;
+  unsigned adc_bits = 16;
+  uint32_t chunk_frames = 4096;
+  bool extract = false;
+  unsigned channel = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "o:b:c:xC:")) != -1) {
+    switch(opt) {
+      case 'o': out = optarg; break;
+      case 'b': adc_bits = (unsigned)atoi(optarg); break;
+      case 'c': chunk_frames = (uint32_t)atoi(optarg); break;
+      case 'x': extract = true; break;
+      case 'C': channel = (unsigned)atoi(optarg); break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+  int n_ch = argc - optind;
+  if(extract ? n_ch != 1 : (!out || n_ch < 1 || n_ch > TRACE_FILE_MAX_CH)) {
+    fprintf(stderr, "usage: %s [-b adc_bits] [-c chunk_frames] -o out.mktf ch0.txt [ch1.txt ...]\n"
+                    "       %s -x [-C channel] in.mktf\n", argv[0], argv[0]);
+    return 2;
+  }
+  if(extract) return unpack(argv[optind], (uint8_t)channel);
+
+  std::vector<Trace> ch(n_ch);
+  size_t frames = 0;
+  for(int c = 0; c < n_ch; c++) {
+    const char* path = argv[optind + c];
+    if(!loadTrace(path, ch[c])) {
+      fprintf(stderr, "cannot read trace %s\n", path);
+      return 1;
+    }
+    if(ch[c].rate_hz != ch[0].rate_hz) {
+      fprintf(stderr, "%s is at %u Hz, %s at %u Hz\n", path, ch[c].rate_hz,
+              argv[optind], ch[0].rate_hz);
+      return 1;
+    }
+    if(!c || ch[c].size() < frames) frames = ch[c].size();
+  }
+
+  TraceWriter w;
+  if(!w.open(out, ch[0].rate_hz, (uint8_t)n_ch, ch[0].labelled(), (uint8_t)adc_bits,
+             chunk_frames)) {
+    fprintf(stderr, "cannot write %s\n", out);
+    return 1;
+  }
+  uint16_t frame[TRACE_FILE_MAX_CH];
+  for(size_t i = 0; i < frames; i++) {
+    for(int c = 0; c < n_ch; c++) frame[c] = ch[c].samples[i];
+    w.add(frame, ch[0].labelled() ? ch[0].labels[i] : 0);
+  }
+  if(!w.close()) {
+    fprintf(stderr, "error writing %s\n", out);
+    return 1;
+  }
+  printf("%s: %zu frames x %d channels at %u Hz, %llu bytes (%.2f bytes/sample)\n",
+         out, frames, n_ch, ch[0].rate_hz, (unsigned long long)w.bytes(),
+         frames ? (double)w.bytes() / (frames * n_ch) : 0.0);
+  return 0;
+}
@@ -0,0 +1,507 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Detector and gesture parameter search over a corpus of labelled traces.
+ *
+ * Every configuration runs the sketch's per-channel signal path offline, as
+ * PresentationController does at the full rate: EmgFrontEnd, then the
+ * configured detector (EMG_DECISION, EMG_DEBOUNCE) with the given threshold,
+ * influence and lag window, then the gesture engine with the given long
+ * squeeze and minimum squeeze times, gestures becoming commands through
+ * DefaultCommandMap. Idle-rate sampling, threshold calibration and the BLE
+ * link are left out: latencies are from the labelled onset to the sample
+ * the command is issued at (replay adds the link on top).
+ *
+ * Commands are matched to labelled contractions as in replay: a contraction
+ * gets the first command issued between its onset and the next onset; a
+ * command of the wrong kind is wrong, an unmatched one spurious. The first
+ * window of the largest lag searched is not scored in any trace, so that all
+ * configurations are scored over the same contractions. Configurations are
+ * ranked by F1 (precision and recall of correct commands), then by mean
+ * latency.
+ *
+ * Ranges are lo:hi[:step]. By default the full grid is searched; -R n draws
+ * n configurations at random from the ranges instead. Each (detector
+ * configuration, trace) pair is a task for a work-stealing pool of -j threads
+ * (all hardware threads by default); the gesture settings of a grid share
+ * one detector run. -s repeats the search at 1, 2, 4... threads and reports
+ * the speedup.
+ *
+ * The best configuration is written to -o as config.h defines (tuned_config.h
+ * by default), to copy into config.h; -k sets how many are listed.
+ *
+ * usage: tune [-t threshold] [-i influence] [-l log2_lag] [-n long_ms]
+ *             [-p min_tap_ms] [-R n] [-S seed] [-j threads] [-s] [-k top]
+ *             [-o header] trace.txt ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "config.h"
+#include "PresentationController.h"
+
+#include "Trace.h"
+#include "WorkStealingPool.h"
+
+using namespace myokbd;
+using namespace myokbd::host;
+using namespace ldry::signal;
+
+namespace {
+
+  const uint8_t MIN_LOG2_LAG = 6;
+  const uint8_t MAX_LOG2_LAG = 12;
+  const uint8_t NO_COMMAND = 0xff;
+  const uint8_t OTHER_COMMAND = 0xfe;
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct Range {
+    double lo, hi, step;
+
+    /* lo:hi[:step]; without a step, hi is ignored unless searched at random */
+    bool parse(const char* s) {
+      step = 0;
+      int n = sscanf(s, "%lf:%lf:%lf", &lo, &hi, &step);
+      if(n == 1) hi = lo;
+      return n >= 1 && hi >= lo && step >= 0;
+    }
+
+    unsigned count() const {
+      return step > 0 ? (unsigned)((hi - lo) / step + 1e-9) + 1 : 1;
+    }
+    double at(unsigned k) const { return lo + k * step; }
+
+    double draw(std::mt19937& rng) const {
+      return std::uniform_real_distribution<double>(lo, hi)(rng);
+    }
+  };
+
+  struct DetectorParams {
+    float threshold;
+    float influence;
+    uint8_t log2_lag;
+  };
+
+  struct GestureParams {
+    uint16_t long_ms;
+    uint16_t min_tap_ms;
+  };
+
+  /* one detector run, and the gesture settings scored on its output */
+  struct Candidate {
+    Candidate() : first(0) { }
+    DetectorParams det;
+    std::vector<GestureParams> gestures;
+    size_t first;       // index of its first configuration
+  };
+
+  struct Config {
+    DetectorParams det;
+    GestureParams gesture;
+    bool baseline;      // the values in config.h
+  };
+
+  struct Score {
+    unsigned contractions = 0, correct = 0, wrong = 0, missed = 0, spurious = 0;
+    std::vector<float> latency_ms;
+
+    void merge(const Score& s) {
+      contractions += s.contractions;
+      correct += s.correct;
+      wrong += s.wrong;
+      missed += s.missed;
+      spurious += s.spurious;
+      latency_ms.insert(latency_ms.end(), s.latency_ms.begin(), s.latency_ms.end());
+    }
+
+    double precision() const {
+      unsigned n = correct + wrong + spurious;
+      return n ? (double)correct / n : 0;
+    }
+    double recall() const { return contractions ? (double)correct / contractions : 0; }
+    double meanLatency() const {
+      double sum = 0;
+      for(size_t i = 0; i < latency_ms.size(); i++) sum += latency_ms[i];
+      return latency_ms.empty() ? 0 : sum / latency_ms.size();
+    }
+    double f1() const {
+      double p = precision(), r = recall();
+      return p + r > 0 ? 2 * p * r / (p + r) : 0;
+    }
+    /* q-quantile; latency_ms must be sorted */
+    double latency(double q) const {
+      if(latency_ms.empty()) return 0;
+      return latency_ms[std::min(latency_ms.size() - 1, (size_t)(q * latency_ms.size()))];
+    }
+  };
+
+  struct Corpus {
+    std::vector<Trace> traces;
+    std::vector<std::vector<uint16_t> > filtered;
+    size_t skip;              // samples not scored at the start of each trace
+    uint8_t labels[N_GESTURES];
+    bool multi;               // double/triple squeezes are bound
+  };
+
+  struct Command {
+    size_t sample;
+    uint8_t label;
+  };
+
+  /* commands of channel 0 of DefaultCommandMap, as the Labels they answer */
+  void bindLabels(Corpus& c) {
+    for(size_t g = 0; g < N_GESTURES; g++) c.labels[g] = NO_COMMAND;
+    c.multi = false;
+    for(size_t i = 0; i < DefaultCommandMapSize; i++) {
+      const CommandBinding& b = DefaultCommandMap[i];
+      if(b.channel != 0) continue;
+      uint8_t label = OTHER_COMMAND;
+      if(b.command == &PresentationRemote::previousSlide) label = LABEL_PREV;
+      else if(b.command == &PresentationRemote::nextSlide) label = LABEL_NEXT;
+      c.labels[(size_t)b.gesture] = label;
+      if(b.gesture == Gesture::DOUBLE_SQUEEZE || b.gesture == Gesture::TRIPLE_SQUEEZE)
+        c.multi = true;
+    }
+  }
+
+  void score(const Trace& t, const std::vector<Segment>& segs, size_t skip,
+             const std::vector<Command>& cmds, Score& s) {
+    std::vector<bool> matched(cmds.size(), false);
+    size_t ci = 0;
+    for(size_t si = 0; si < segs.size(); si++) {
+      if(segs[si].onset < skip) continue;
+      size_t t0 = segs[si].onset;
+      size_t t1 = si + 1 < segs.size() ? segs[si + 1].onset : (size_t)-1;
+      s.contractions++;
+      while(ci < cmds.size() && cmds[ci].sample < t0) ci++;
+      if(ci < cmds.size() && cmds[ci].sample < t1) {
+        matched[ci] = true;
+        if(cmds[ci].label == segs[si].label) s.correct++;
+        else s.wrong++;
+        s.latency_ms.push_back((float)((cmds[ci].sample - t0) * 1000.0 / t.rate_hz));
+        ci++;
+      } else {
+        s.missed++;
+      }
+    }
+    for(size_t i = 0; i < cmds.size(); i++)
+      if(!matched[i] && cmds[i].sample >= skip) s.spurious++;
+  }
+
+  /* one detector over trace k, scored for every gesture setting of c */
+  template <uint16_t LOG_2LAG>
+  void evaluate(const Corpus& corpus, size_t k, const Candidate& c, Score* out) {
+    typedef MultiPeakDetection<1, LOG_2LAG, EMG_DECISION, EMG_DEBOUNCE> Detector;
+    const Trace& t = corpus.traces[k];
+    const std::vector<uint16_t>& x = corpus.filtered[k];
+    Detector det(c.det.threshold, c.det.influence, EMG_WAKE_THRESHOLD);
+    std::vector<GestureEngine<1> > engines;
+    engines.reserve(c.gestures.size());
+    for(size_t g = 0; g < c.gestures.size(); g++) {
+      GestureTiming timing;
+      timing.min_tap_ms = c.gestures[g].min_tap_ms;
+      timing.long_ms = c.gestures[g].long_ms;
+      timing.multi_gap_ms = GESTURE_MULTI_GAP_MS;
+      timing.repeat_delay_ms = GESTURE_REPEAT_DELAY_MS;
+      timing.repeat_interval_ms = 1000 / GESTURE_REPEAT_RATE_HZ;
+      engines.emplace_back(timing);
+      if(!corpus.multi) engines.back().setMultiGap(0, 0);
+    }
+    std::vector<std::vector<Command> > cmds(c.gestures.size());
+
+    for(size_t i = 0; i < x.size(); i++) {
+      PeakSignal sig;
+      det.addFrame(&x[i], &sig);
+      if(sig == PeakSignal::MORE_DATA_NEEDED) continue;
+      bool contracted = sig == PeakSignal::PEAK;
+      int now_ms = (int)((uint64_t)(i + 1) * 1000 / t.rate_hz);
+      for(size_t g = 0; g < engines.size(); g++) {
+        Gesture ge = engines[g].step(0, contracted, now_ms);
+        if(ge == Gesture::NONE || corpus.labels[(size_t)ge] == NO_COMMAND) continue;
+        Command cmd = { i, corpus.labels[(size_t)ge] };
+        cmds[g].push_back(cmd);
+      }
+    }
+
+    std::vector<Segment> segs = segments(t);
+    for(size_t g = 0; g < c.gestures.size(); g++) score(t, segs, corpus.skip, cmds[g], out[g]);
+  }
+
+  void evaluate(const Corpus& corpus, size_t k, const Candidate& c, Score* out) {
+    switch(c.det.log2_lag) {
+      case 6: evaluate<6>(corpus, k, c, out); break;
+      case 7: evaluate<7>(corpus, k, c, out); break;
+      case 8: evaluate<8>(corpus, k, c, out); break;
+      case 9: evaluate<9>(corpus, k, c, out); break;
+      case 10: evaluate<10>(corpus, k, c, out); break;
+      case 11: evaluate<11>(corpus, k, c, out); break;
+      case 12: evaluate<12>(corpus, k, c, out); break;
+    }
+  }
+
+  /* the scores of every configuration, merged over the corpus */
+  std::vector<Score> search(const Corpus& corpus, const std::vector<Candidate>& cands,
+                            size_t n_configs, WorkStealingPool& pool) {
+    size_t n_traces = corpus.traces.size();
+    // per (configuration, trace), so that tasks never share an entry
+    std::vector<Score> partial(n_configs * n_traces);
+    pool.run(cands.size() * n_traces, [&](size_t task) {
+      const Candidate& c = cands[task / n_traces];
+      size_t k = task % n_traces;
+      std::vector<Score> out(c.gestures.size());
+      evaluate(corpus, k, c, &out[0]);
+      for(size_t g = 0; g < out.size(); g++)
+        partial[(c.first + g) * n_traces + k] = std::move(out[g]);
+    });
+    std::vector<Score> scores(n_configs);
+    for(size_t i = 0; i < n_configs; i++) {
+      for(size_t k = 0; k < n_traces; k++) scores[i].merge(partial[i * n_traces + k]);
+      std::sort(scores[i].latency_ms.begin(), scores[i].latency_ms.end());
+    }
+    return scores;
+  }
+
+  bool better(const Score& a, const Score& b) {
+    double fa = a.f1(), fb = b.f1();
+    if(fa != fb) return fa > fb;
+    return a.meanLatency() < b.meanLatency();
+  }
+
+  void printConfig(const char* rank, const Config& c, const Score& s) {
+    printf("%6s  %6.2f  %5.2f  %4u  %5u  %5u   %5.3f  %5.3f  %5.3f  %6.1f  %6.1f  %6.1f  "
+           "%u/%u/%u/%u\n",
+           rank, c.det.threshold, c.det.influence, 1u << c.det.log2_lag, c.gesture.long_ms,
+           c.gesture.min_tap_ms, s.precision(), s.recall(), s.f1(), s.meanLatency(),
+           s.latency(0.5), s.latency(0.95), s.correct, s.wrong, s.missed, s.spurious);
+  }
+
+  bool writeHeader(const char* path, const Config& c, const Score& s, size_t rank_of,
+                   const Corpus& corpus, double seconds) {
+    FILE* f = fopen(path, "w");
+    if(!f) return false;
+    fprintf(f,
+      "/* Generated by host/tune: the best of %zu configurations over %zu trace(s),\n"
+      " * %.1f h, %u contractions scored.\n"
+      " *   precision %.3f, recall %.3f (%u correct, %u wrong, %u missed, %u spurious)\n"
+      " *   onset -> command mean %.1f ms, median %.1f ms, p95 %.1f ms (at the\n"
+      " *   detector; the link adds up to a connection interval)\n"
+      " * Replace these defines in config.h. EMG_THRESHOLD is only used until a\n"
+      " * threshold is calibrated, unless EMG_AUTO_THRESHOLD_SAMPLES is 0.\n"
+      " */\n"
+      "#ifndef _MYOKBD_TUNED_CONFIG_H_\n"
+      "#define _MYOKBD_TUNED_CONFIG_H_\n\n"
+      "#define EMG_THRESHOLD %.2ff\n"
+      "#define EMG_INFLUENCE %.2ff\n"
+      "#define EMG_LOG2_LAG %u\n"
+      "#define GESTURE_MIN_TAP_MS %u\n"
+      "#define GESTURE_LONG_MS %u\n\n"
+      "#endif\n",
+      rank_of, corpus.traces.size(), seconds / 3600, s.contractions,
+      s.precision(), s.recall(), s.correct, s.wrong, s.missed, s.spurious,
+      s.meanLatency(), s.latency(0.5), s.latency(0.95),
+      c.det.threshold, c.det.influence, c.det.log2_lag, c.gesture.min_tap_ms,
+      c.gesture.long_ms);
+    return fclose(f) == 0;
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-t threshold] [-i influence] [-l log2_lag] [-n long_ms]\n"
+                    "       [-p min_tap_ms] [-R n] [-S seed] [-j threads] [-s] [-k top]\n"
+                    "       [-o header] trace.txt ...\n"
+                    "ranges are lo:hi[:step]\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  Range threshold = { 2, 5, 0.5 };
+  Range influence = { 0, 0.2, 0.1 };
+  Range lag = { 8, 11, 1 };
+  Range long_ms = { 400, 700, 100 };
+  Range min_tap_ms = { 75, 175, 50 };
+  unsigned random = 0;
+  unsigned seed = 1;
+  unsigned threads = 0;
+  bool scaling = false;
+  unsigned top = 10;
+  const char* out = "tuned_config.h";
+  int opt;
+  while((opt = getopt(argc, argv, "t:i:l:n:p:R:S:j:sk:o:")) != -1) {
+    bool ok = true;
+    switch(opt) {
+      case 't': ok = threshold.parse(optarg); break;
+      case 'i': ok = influence.parse(optarg); break;
+      case 'l': ok = lag.parse(optarg); break;
+      case 'n': ok = long_ms.parse(optarg); break;
+      case 'p': ok = min_tap_ms.parse(optarg); break;
+      case 'R': random = (unsigned)atoi(optarg); break;
+      case 'S': seed = (unsigned)atoi(optarg); break;
+      case 'j': threads = (unsigned)atoi(optarg); break;
+      case 's': scaling = true; break;
+      case 'k': top = (unsigned)atoi(optarg); break;
+      case 'o': out = optarg; break;
+      default: usage(argv[0]);
+    }
+    if(!ok) usage(argv[0]);
+  }
+  if(optind >= argc) usage(argv[0]);
+  if(lag.lo < MIN_LOG2_LAG || lag.hi > MAX_LOG2_LAG) {
+    fprintf(stderr, "log2_lag must be within [%u, %u]\n", MIN_LOG2_LAG, MAX_LOG2_LAG);
+    return 2;
+  }
+  if(lag.step > 0 && lag.step < 1) lag.step = 1;
+
+  Corpus corpus;
+  bindLabels(corpus);
+  double seconds = 0;
+  size_t samples = 0;
+  for(int i = optind; i < argc; i++) {
+    Trace t;
+    if(!loadTrace(argv[i], t) || !t.labelled()) {
+      fprintf(stderr, "cannot read labelled trace %s\n", argv[i]);
+      return 1;
+    }
+    if(t.rate_hz != EMG_SAMPLE_RATE_HZ)
+      printf("note: %s is at %u Hz, the filter front end is designed for %u Hz\n",
+             argv[i], t.rate_hz, EMG_SAMPLE_RATE_HZ);
+    EmgFrontEnd fe;
+    std::vector<uint16_t> x(t.size());
+    for(size_t k = 0; k < t.size(); k++) {
+      int32_t v = t.samples[k];
+      if(k) fe.step(v);
+      else v = fe.prime(v);
+      x[k] = (uint16_t)(v < 0 ? 0 : v > 0xffff ? 0xffff : v);
+    }
+    seconds += (double)t.size() / t.rate_hz;
+    samples += t.size();
+    corpus.traces.push_back(std::move(t));
+    corpus.filtered.push_back(std::move(x));
+  }
+
+  // candidates: the grid (or random draws), then config.h as it is
+  std::vector<Candidate> cands;
+  std::vector<Config> configs;
+  std::mt19937 rng(seed);
+  if(random) {
+    for(unsigned r = 0; r < random; r++) {
+      Candidate c;
+      c.det.threshold = (float)threshold.draw(rng);
+      c.det.influence = (float)influence.draw(rng);
+      c.det.log2_lag = (uint8_t)(lag.lo + rng() % (unsigned)(lag.hi - lag.lo + 1));
+      GestureParams g = { (uint16_t)long_ms.draw(rng), (uint16_t)min_tap_ms.draw(rng) };
+      c.gestures.push_back(g);
+      cands.push_back(c);
+    }
+  } else {
+    std::vector<GestureParams> grid;
+    for(unsigned a = 0; a < long_ms.count(); a++)
+      for(unsigned b = 0; b < min_tap_ms.count(); b++) {
+        GestureParams g = { (uint16_t)long_ms.at(a), (uint16_t)min_tap_ms.at(b) };
+        grid.push_back(g);
+      }
+    for(unsigned a = 0; a < threshold.count(); a++)
+      for(unsigned b = 0; b < influence.count(); b++)
+        for(unsigned l = 0; l < lag.count(); l++) {
+          Candidate c;
+          c.det.threshold = (float)threshold.at(a);
+          c.det.influence = (float)influence.at(b);
+          c.det.log2_lag = (uint8_t)lag.at(l);
+          c.gestures = grid;
+          cands.push_back(c);
+        }
+  }
+  Candidate base;
+  base.det.threshold = EMG_THRESHOLD;
+  base.det.influence = EMG_INFLUENCE;
+  base.det.log2_lag = EMG_LOG2_LAG;
+  GestureParams base_g = { GESTURE_LONG_MS, GESTURE_MIN_TAP_MS };
+  base.gestures.push_back(base_g);
+  cands.push_back(base);
+
+  uint8_t max_lag = 0;
+  for(size_t i = 0; i < cands.size(); i++) {
+    cands[i].first = configs.size();
+    max_lag = std::max(max_lag, cands[i].det.log2_lag);
+    for(size_t g = 0; g < cands[i].gestures.size(); g++) {
+      Config c = { cands[i].det, cands[i].gestures[g], i + 1 == cands.size() };
+      configs.push_back(c);
+    }
+  }
+  corpus.skip = (size_t)1 << max_lag;
+
+  size_t n_tasks = cands.size() * corpus.traces.size();
+  printf("%zu trace(s), %.1f h; %zu configurations (%zu detector runs per trace), "
+         "first %zu samples of each trace not scored\n", corpus.traces.size(),
+         seconds / 3600, configs.size(), cands.size(), corpus.skip);
+
+  std::vector<unsigned> runs;
+  unsigned max_threads = threads ? threads : WorkStealingPool::hardwareThreads();
+  if(scaling)
+    for(unsigned j = 1; j < max_threads; j *= 2) runs.push_back(j);
+  runs.push_back(max_threads);
+
+  std::vector<Score> scores;
+  double t1_s = 0;
+  for(size_t r = 0; r < runs.size(); r++) {
+    WorkStealingPool pool(runs[r]);
+    Clock::time_point t0 = Clock::now();
+    scores = search(corpus, cands, configs.size(), pool);
+    double wall_s = std::chrono::duration<double>(Clock::now() - t0).count();
+    if(r == 0) t1_s = wall_s * runs[0];
+    size_t stolen = 0, most = 0, least = (size_t)-1;
+    for(size_t w = 0; w < pool.stats().size(); w++) {
+      stolen += pool.stats()[w].stolen;
+      most = std::max(most, pool.stats()[w].tasks);
+      least = std::min(least, pool.stats()[w].tasks);
+    }
+    printf("%3u thread(s): %7.2f s, %6.1f M detector samples/s", runs[r], wall_s,
+           wall_s > 0 ? samples * cands.size() / wall_s / 1e6 : 0.0);
+    if(scaling) printf(", speedup %5.2f (%3.0f%% of linear)", t1_s / wall_s,
+                       100.0 * t1_s / wall_s / runs[r]);
+    printf("; %zu tasks, %zu stolen, %zu-%zu per thread\n", n_tasks, stolen, least, most);
+  }
+
+  std::vector<size_t> order;
+  for(size_t i = 0; i < configs.size(); i++) order.push_back(i);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return better(scores[a], scores[b]);
+  });
+
+  printf("\n  rank  thresh  infl   lag  long   tap    prec  recall   F1      mean  "
+         "median     p95  correct/wrong/missed/spurious\n");
+  size_t base_rank = 0;
+  for(size_t r = 0; r < order.size(); r++) {
+    const Config& c = configs[order[r]];
+    if(c.baseline) base_rank = r + 1;
+    if(r < top) {
+      char rank[24];
+      snprintf(rank, sizeof(rank), "%zu", r + 1);
+      printConfig(rank, c, scores[order[r]]);
+    }
+  }
+  char rank[24];
+  snprintf(rank, sizeof(rank), "(%zu)", base_rank);
+  printf("config.h:\n");
+  printConfig(rank, configs.back(), scores.back());
+
+  const Config& best = configs[order[0]];
+  if(!writeHeader(out, best, scores[order[0]], configs.size(), corpus, seconds)) {
+    fprintf(stderr, "cannot write %s\n", out);
+    return 1;
+  }
+  printf("\nbest configuration written to %s\n", out);
+  return 0;
+}
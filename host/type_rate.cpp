@@ -0,0 +1,132 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Text typing throughput of KeyboardService.
+ *
+ * Types a text through KeyboardService (as KeyboardService::printf would,
+ * waiting whenever the key buffer is full) over the simulated BLE link,
+ * decodes the input reports seen by the central back into characters and
+ * reports characters per second of virtual time, reports per character and
+ * whether the central received the exact text.
+ *
+ * usage: type_rate [-c conn_interval_ms] [-b notify_buffers]
+ *                  [-p packets_per_event] [-n repeat] [text]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "KeyboardService.h"
+
+#include "HidLog.h"
+
+using namespace myokbd::host;
+
+namespace {
+
+  events::EventQueue ble_queue(32 * EVENTS_EVENT_SIZE);
+
+  void scheduleBleEvents(BLE::OnEventsToProcessCallbackContext* context) {
+    ble_queue.call(mbed::Callback<void()>(&context->ble, &BLE::processEvents));
+  }
+
+  struct Peripheral : public ble::Gap::EventHandler {
+    Peripheral(BLEDevice& ble) : _ble(ble), kbd(NULL) { }
+
+    void onInitComplete(BLEDevice::InitializationCompleteCallbackContext* params) {
+      kbd = new btsvc::KeyboardService<KBD_BUF_SIZE>(_ble, ble_queue);
+    }
+
+    void onConnectionComplete(const ble::ConnectionCompleteEvent& event) override {
+      kbd->connect(event);
+    }
+
+    BLEDevice& _ble;
+    btsvc::KeyboardService<KBD_BUF_SIZE>* kbd;
+  };
+
+  /* character typed by a (usage, modifier) press, or 0 if none maps to it */
+  char pressToChar(const KeyPress& p) {
+    for(int c = 0; c < KEYMAP_SIZE; c++)
+      if(keymap[c].usage == p.usage && keymap[c].modifier == p.modifier)
+        return (char)c;
+    return 0;
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-c conn_interval_ms] [-b notify_buffers] "
+                    "[-p packets_per_event] [-n repeat] [text]\n", prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  uint32_t conn_interval_ms = 30;
+  unsigned repeat = 20;
+  int opt;
+  while((opt = getopt(argc, argv, "c:b:p:n:")) != -1) {
+    switch(opt) {
+      case 'c': conn_interval_ms = (uint32_t)atoi(optarg); break;
+      case 'b': mbed_host::link().notify_buffers = (unsigned)atoi(optarg); break;
+      case 'p': mbed_host::link().packets_per_event = (unsigned)atoi(optarg); break;
+      case 'n': repeat = (unsigned)atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  std::string unit = optind < argc ? argv[optind] :
+    "The quick brown fox jumps over the lazy dog: https://example.org/slides?id=42\n";
+  std::string text;
+  for(unsigned i = 0; i < repeat; i++) text += unit;
+
+  mbed_host::Sim& sim = mbed_host::sim();
+  mbed_host::link().conn_interval_us = conn_interval_ms * 1000;
+
+  BLEDevice& ble = BLEDevice::Instance();
+  Peripheral p(ble);
+  ble.onEventsToProcess(scheduleBleEvents);
+  ble.gap().setEventHandler(&p);
+  ble.init(&p, &Peripheral::onInitComplete);
+  mbed_host::link().connect(ble);
+  while(sim.step()) { }
+
+  // type, letting the link drain the key buffer whenever it is full
+  uint64_t t0 = sim.now_us();
+  for(size_t i = 0; i < text.size(); i++) {
+    while(p.kbd->_putc((unsigned char)text[i]) == ENOMEM)
+      if(!sim.step()) break;
+  }
+  while(sim.step()) { }
+
+  const std::vector<mbed_host::Notification>& log = mbed_host::link().log();
+  std::vector<KeyPress> presses = keyPresses(log, inputReportHandle(log));
+  std::string received;
+  for(size_t i = 0; i < presses.size(); i++) received += pressToChar(presses[i]);
+  uint64_t t1 = log.empty() ? t0 : log.back().t_us;
+
+  double s = (t1 - t0) / 1e6;
+  printf("typed %zu characters in %.3f s virtual (%u ms connection interval, "
+         "%u buffers, %u packets/event)\n", text.size(), s, conn_interval_ms,
+         mbed_host::link().notify_buffers, mbed_host::link().packets_per_event);
+  printf("%.1f characters/s, %zu reports, %.2f reports/character\n",
+         s > 0 ? text.size() / s : 0.0, log.size(),
+         text.empty() ? 0.0 : (double)log.size() / text.size());
+  printf("received text %s\n", received == text ? "matches" : "DIFFERS");
+  if(received != text) {
+    size_t i = 0;
+    while(i < received.size() && i < text.size() && received[i] == text[i]) i++;
+    printf("  first difference at character %zu of %zu (%zu received)\n",
+           i, text.size(), received.size());
+    return 1;
+  }
+  return 0;
+}
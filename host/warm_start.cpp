@@ -0,0 +1,200 @@
+/* ---------
+ * Copyright 2020 Lucian Carata <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the Myokbd open-source project: github.com/lc525/myokbd
+ * Licensed under the terms of Apache license 2.0, see the LICENSE file at the
+ * root of the project for details.
+ * ---------
+ *
+ * Warm start benchmark.
+ *
+ * Saves the detector window to a CalibrationStore on a HeapBlockDevice (the
+ * first time the arm rests for EMG_IDLE_AFTER_MS after the window is full,
+ * as PresentationController does), then boots the detector again at several
+ * points of the same labelled trace, every -s seconds:
+ *
+ *  - cold: the settling delay (1 s) and a full window to fill, as without a
+ *    saved calibration;
+ *  - warm: restored from the store.
+ *
+ * For each, reports the time from power-on to the first classified sample
+ * and how many of the contractions starting within -w seconds of the boot
+ * were detected. A detector that has run since the start of the trace is the
+ * reference. With -o, the signal after each boot is offset by that many ADC
+ * counts (electrodes moved since the save), which a warm start should notice
+ * and fall back to a cold one.
+ *
+ * usage: warm_start [-s boot_every_s] [-w window_s] [-o offset] trace.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include "config.h"
+#include "MultiPeakDetection.h"
+#include "CalibrationStore.h"
+#include "BlockDevice.h"
+
+#include "Trace.h"
+
+using namespace ldry::signal;
+using namespace myokbd;
+using namespace myokbd::host;
+
+namespace {
+
+  typedef MultiPeakDetection<1, EMG_LOG2_LAG> Detector;
+
+  const uint32_t SettleMs = 1000;
+  const uint32_t Key = 1;
+
+  struct Boot {
+    unsigned n = 0;
+    unsigned detected = 0, contractions = 0, spurious = 0;
+    unsigned fallbacks = 0;
+    uint64_t startup_ms = 0, kept_ms = 0;
+
+    void print(const char* what) const {
+      if(!n) return;
+      printf("%s: usable after %.0f ms on average; %u of %u contractions detected, "
+             "%u spurious", what, (double)startup_ms / n, detected, contractions, spurious);
+      if(fallbacks)
+        printf("; %u fell back to a cold start (%.0f ms on average otherwise)",
+               fallbacks, n > fallbacks ? (double)kept_ms / (n - fallbacks) : 0.0);
+      printf("\n");
+    }
+  };
+
+  /* run det from sample `from` (skipping `skip` samples, the settling delay)
+   * to `to`; out[i - from] is the stable signal, MORE_DATA_NEEDED when the
+   * detector is not running or not ready */
+  void run(Detector& det, const Trace& t, size_t from, size_t skip, size_t to,
+           int offset, std::vector<PeakSignal>& out) {
+    out.assign(to - from, PeakSignal::MORE_DATA_NEEDED);
+    for(size_t i = from + skip; i < to; i++) {
+      int v = (int)t.samples[i] + offset;
+      uint16_t x = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+      det.addFrame(&x, &out[i - from]);
+    }
+  }
+
+  /* contractions starting in [from, to) and how many of them the signal
+   * shows as a peak before they end; spurious counts peaks starting outside
+   * any contraction */
+  void score(const Trace& t, const std::vector<Segment>& segs,
+             const std::vector<PeakSignal>& sig, size_t from, size_t to, Boot& b) {
+    for(size_t s = 0; s < segs.size(); s++) {
+      if(segs[s].onset < from || segs[s].onset >= to) continue;
+      b.contractions++;
+      for(size_t i = segs[s].onset; i < segs[s].offset && i < to; i++)
+        if(sig[i - from] == PeakSignal::PEAK) { b.detected++; break; }
+    }
+    for(size_t i = from + 1; i < to; i++)
+      if(sig[i - from] == PeakSignal::PEAK && sig[i - from - 1] != PeakSignal::PEAK &&
+         t.labels[i] == LABEL_REST && t.labels[i - 1] == LABEL_REST)
+        b.spurious++;
+  }
+
+  void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-s boot_every_s] [-w window_s] [-o offset] trace.txt\n",
+            prog);
+    exit(2);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  double boot_every_s = 7;
+  double window_s = 5;
+  int offset = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "s:w:o:")) != -1) {
+    switch(opt) {
+      case 's': boot_every_s = atof(optarg); break;
+      case 'w': window_s = atof(optarg); break;
+      case 'o': offset = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind >= argc) usage(argv[0]);
+
+  Trace trace;
+  if(!loadTrace(argv[optind], trace) || !trace.labelled()) {
+    fprintf(stderr, "cannot read labelled trace %s\n", argv[optind]);
+    return 1;
+  }
+  const uint32_t rate = trace.rate_hz;
+  const size_t lag = 1u << EMG_LOG2_LAG;
+  const size_t settle = (size_t)SettleMs * rate / 1000;
+  const size_t rest = (size_t)EMG_IDLE_AFTER_MS * rate / 1000;
+  const size_t window = (size_t)(window_s * rate);
+  std::vector<Segment> segs = segments(trace);
+
+  // first boot: save once the window is full and the arm has rested
+  mbed::HeapBlockDevice bd(MYOKBD_CALIB_SIZE, 1, 4, 4096);
+  CalibrationStore store(bd);
+  store.init();
+  Detector first(3, 0, EMG_WAKE_THRESHOLD);
+  Detector::Snapshot snap;
+  size_t quiet = 0, saved_at = 0;
+  for(size_t i = 0; i < trace.size() && !saved_at; i++) {
+    PeakSignal sig;
+    first.addFrame(&trace.samples[i], &sig);
+    quiet = trace.labels[i] == LABEL_REST ? quiet + 1 : 0;
+    if(first.ready() && quiet >= rest && first.save(snap) &&
+       store.save(Key, &snap, sizeof(snap)))
+      saved_at = i + 1;
+  }
+  if(!saved_at) {
+    fprintf(stderr, "the trace has no rest long enough to save a calibration\n");
+    return 1;
+  }
+
+  std::vector<PeakSignal> ref_sig;
+  Detector ref(3, 0, EMG_WAKE_THRESHOLD);
+  run(ref, trace, 0, 0, trace.size(), 0, ref_sig);
+
+  Boot cold, warm, reference;
+  size_t step = (size_t)(boot_every_s * rate);
+  std::vector<PeakSignal> sig;
+  for(size_t boot = saved_at + step; boot + window <= trace.size(); boot += step) {
+    size_t end = boot + window;
+
+    Detector c(3, 0, EMG_WAKE_THRESHOLD);
+    run(c, trace, boot, settle, end, offset, sig);
+    cold.n++;
+    cold.startup_ms += (uint64_t)(settle + lag + 1) * 1000 / rate;
+    score(trace, segs, sig, boot, end, cold);
+
+    CalibrationStore boot_store(bd);     // as after a reset
+    Detector w(3, 0, EMG_WAKE_THRESHOLD);
+    boot_store.init();
+    if(boot_store.load(Key, &snap, sizeof(snap))) w.restore(snap);
+    run(w, trace, boot, 0, end, offset, sig);
+    size_t first_ok = 0;
+    while(first_ok < sig.size() && sig[first_ok] == PeakSignal::MORE_DATA_NEEDED) first_ok++;
+    uint64_t ms = (uint64_t)(first_ok + 1) * 1000 / rate;
+    warm.n++;
+    warm.startup_ms += ms;
+    if(w.restored()) warm.kept_ms += ms;
+    else warm.fallbacks++;
+    score(trace, segs, sig, boot, end, warm);
+
+    std::vector<PeakSignal> ref_part(ref_sig.begin() + boot, ref_sig.begin() + end);
+    reference.n++;
+    score(trace, segs, ref_part, boot, end, reference);
+  }
+
+  printf("trace: %s (%zu samples @ %u Hz), lag %zu samples, calibration saved at %.1f s "
+         "(%zu bytes)\n", argv[optind], trace.size(), rate, lag,
+         (double)saved_at / rate, sizeof(snap));
+  printf("%u boots, every %.1f s; contractions counted within %.1f s of each boot%s\n",
+         cold.n, boot_every_s, window_s, offset ? "" : ", signal unchanged");
+  if(offset) printf("signal offset by %d after each boot\n", offset);
+  cold.print("cold");
+  warm.print("warm");
+  printf("reference (running since the start): %u of %u contractions detected, "
+         "%u spurious\n", reference.detected, reference.contractions, reference.spurious);
+  return 0;
+}